@@ -30,6 +30,29 @@
  * ]|
  * FIXME Describe what the pipeline does.
  * </refsect2>
+ *
+ * Instead of FLV on the always sink pad, H.264 and AAC can be fed to the
+ * "video" and "audio" request pads directly, without flvmux.  The sink
+ * builds the RTMP messages itself, including the sequence headers from
+ * codec_data.  Byte-stream H.264 is accepted as well and converted to
+ * the length-prefixed format, with the sequence header built from the
+ * SPS and PPS found in the stream.
+ * |[
+ * gst-launch -v videotestsrc ! x264enc ! h264parse ! rtmp2sink name=s
+ *     location=rtmp://server.example.com/live/myStream
+ *     audiotestsrc ! faac ! aacparse ! s.audio
+ * ]|
+ *
+ * If #GstRtmp2Sink:bitrate-feedback is enabled, the sink periodically
+ * compares the rate at which it queues data with the rate at which the
+ * connection drains it.  The result is posted as an element message and
+ * sent upstream as a custom event, both named "GstRtmpBitrateFeedback",
+ * with the fields "queued-bytes" (guint64), "queue-delay" (GstClockTime),
+ * "input-bitrate", "output-bitrate" and "recommended-bitrate" (guint64,
+ * in bits per second) and "congested" (gboolean).  Applications can map
+ * the recommended bitrate onto the encoder, e.g. x264enc's bitrate
+ * property.  The recommendation never goes below
+ * #GstRtmp2Sink:min-bitrate.
  */
 
 #ifdef HAVE_CONFIG_H
@@ -56,6 +79,11 @@ static void gst_rtmp2_sink_finalize (GObject * object);
 static void gst_rtmp2_sink_uri_handler_init (gpointer g_iface,
     gpointer iface_data);
 
+/* GstElement virtual functions */
+static GstPad *gst_rtmp2_sink_request_new_pad (GstElement * element,
+    GstPadTemplate * templ, const gchar * name, const GstCaps * caps);
+static void gst_rtmp2_sink_release_pad (GstElement * element, GstPad * pad);
+
 /* GstBaseSink virtual functions */
 static void gst_rtmp2_sink_get_times (GstBaseSink * sink, GstBuffer * buffer,
     GstClockTime * start, GstClockTime * end);
@@ -81,28 +109,51 @@ static gboolean gst_rtmp2_sink_uri_set_uri (GstURIHandler * handler,
 static gchar *gst_rtmp2_sink_get_uri (GstRtmp2Sink * sink);
 static gboolean gst_rtmp2_sink_set_uri (GstRtmp2Sink * sink, const char *uri);
 static void gst_rtmp2_sink_task (gpointer user_data);
+static void create_command_templates (void);
 static void connect_done (GObject * source, GAsyncResult * result,
     gpointer user_data);
-static void send_connect (GstRtmp2Sink * rtmp2sink);
+static void send_connect (GstRtmp2Sink * rtmp2sink, gboolean pipelined);
 static void cmd_connect_done (GstRtmpConnection * connection,
     GstRtmpChunk * chunk, const char *command_name, int transaction_id,
     GstAmfNode * command_object, GstAmfNode * optional_args,
     gpointer user_data);
-static void send_create_stream (GstRtmp2Sink * rtmp2sink);
+static void send_create_stream (GstRtmp2Sink * rtmp2sink, gboolean pipelined);
 static void create_stream_done (GstRtmpConnection * connection,
     GstRtmpChunk * chunk, const char *command_name, int transaction_id,
     GstAmfNode * command_object, GstAmfNode * optional_args,
     gpointer user_data);
-static void send_publish (GstRtmp2Sink * rtmp2sink);
+static void send_publish (GstRtmp2Sink * rtmp2sink, int transaction_id,
+    GstRtmpCommandCallback callback);
 static void publish_done (GstRtmpConnection * connection,
     GstRtmpChunk * chunk, const char *command_name, int transaction_id,
     GstAmfNode * command_object, GstAmfNode * optional_args,
     gpointer user_data);
+static void publish_started (GstRtmp2Sink * rtmp2sink);
+static void send_pipelined (GstRtmp2Sink * rtmp2sink);
+static void pipelined_create_stream (guint32 stream_id, int transaction_id,
+    gpointer user_data);
+static void pipelined_publish (guint32 stream_id, int transaction_id,
+    gpointer user_data);
+static void handle_pipelined_reply (GstRtmp2Sink * rtmp2sink,
+    GstRtmpChunk * chunk);
 static void got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
     gpointer user_data);
 static void send_secure_token_response (GstRtmp2Sink * rtmp2sink,
     const char *challenge);
+static void gst_rtmp2_sink_update_feedback (GstRtmp2Sink * rtmp2sink,
+    GstPad * pad, gsize bytes);
+static GstFlowReturn gst_rtmp2_sink_es_chain (GstPad * pad, GstObject * parent,
+    GstBuffer * buffer);
+static gboolean gst_rtmp2_sink_es_event (GstPad * pad, GstObject * parent,
+    GstEvent * event);
 
+/* keeps a buffer mapped for as long as its data is referenced */
+typedef struct _GstRtmp2SinkMappedBuffer GstRtmp2SinkMappedBuffer;
+struct _GstRtmp2SinkMappedBuffer
+{
+  GstBuffer *buffer;
+  GstMapInfo map;
+};
 
 enum
 {
@@ -113,7 +164,21 @@ enum
   PROP_PORT,
   PROP_APPLICATION,
   PROP_STREAM,
-  PROP_SECURE_TOKEN
+  PROP_SECURE_TOKEN,
+  PROP_BITRATE_FEEDBACK,
+  PROP_FEEDBACK_INTERVAL,
+  PROP_TARGET_QUEUE_DELAY,
+  PROP_MIN_BITRATE,
+  PROP_PACING,
+  PROP_PACING_RATE,
+  PROP_PACING_BURST,
+  PROP_MAX_OUTPUT_LATENCY,
+  PROP_DATA_CHUNK_STREAM,
+  PROP_AUDIO_CHUNK_STREAM,
+  PROP_VIDEO_CHUNK_STREAM,
+  PROP_CHUNK_SIZE,
+  PROP_PIPELINED_CONNECT,
+  PROP_POOL_SIZE
 };
 
 #define DEFAULT_LOCATION "rtmp://localhost/live/myStream"
@@ -125,6 +190,22 @@ enum
 //#define DEFAULT_SECURE_TOKEN ""
 /* FIXME for testing only */
 #define DEFAULT_SECURE_TOKEN "4305c027c2758beb"
+#define DEFAULT_BITRATE_FEEDBACK FALSE
+#define DEFAULT_FEEDBACK_INTERVAL 1000
+#define DEFAULT_TARGET_QUEUE_DELAY 500
+#define DEFAULT_MIN_BITRATE 100000
+#define DEFAULT_PACING FALSE
+#define DEFAULT_PACING_RATE 0
+#define DEFAULT_PACING_BURST 0
+#define DEFAULT_MAX_OUTPUT_LATENCY 0
+#define DEFAULT_DATA_CHUNK_STREAM 4
+#define DEFAULT_AUDIO_CHUNK_STREAM 5
+#define DEFAULT_VIDEO_CHUNK_STREAM 6
+#define DEFAULT_CHUNK_SIZE 128
+#define DEFAULT_PIPELINED_CONNECT FALSE
+#define DEFAULT_POOL_SIZE 0
+
+static const char *const publish_codes[] = { "NetStream.Publish.Start", NULL };
 
 /* pad templates */
 
@@ -135,6 +216,24 @@ GST_STATIC_PAD_TEMPLATE ("sink",
     GST_STATIC_CAPS ("video/x-flv")
     );
 
+static GstStaticPadTemplate gst_rtmp2_sink_video_template =
+GST_STATIC_PAD_TEMPLATE ("video",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("video/x-h264, stream-format=(string)avc, "
+        "alignment=(string)au; "
+        "video/x-h264, stream-format=(string)byte-stream, "
+        "alignment=(string)au")
+    );
+
+static GstStaticPadTemplate gst_rtmp2_sink_audio_template =
+GST_STATIC_PAD_TEMPLATE ("audio",
+    GST_PAD_SINK,
+    GST_PAD_REQUEST,
+    GST_STATIC_CAPS ("audio/mpeg, mpegversion=(int)4, "
+        "stream-format=(string)raw")
+    );
+
 
 /* class initialization */
 
@@ -152,21 +251,31 @@ G_DEFINE_TYPE_WITH_CODE (GstRtmp2Sink, gst_rtmp2_sink, GST_TYPE_BASE_SINK,
      static void gst_rtmp2_sink_class_init (GstRtmp2SinkClass * klass)
 {
   GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+  GstElementClass *element_class = GST_ELEMENT_CLASS (klass);
   GstBaseSinkClass *base_sink_class = GST_BASE_SINK_CLASS (klass);
 
   /* Setting up pads and setting metadata should be moved to
      base_class_init if you intend to subclass this class. */
   gst_element_class_add_pad_template (GST_ELEMENT_CLASS (klass),
       gst_static_pad_template_get (&gst_rtmp2_sink_sink_template));
+  gst_element_class_add_pad_template (GST_ELEMENT_CLASS (klass),
+      gst_static_pad_template_get (&gst_rtmp2_sink_video_template));
+  gst_element_class_add_pad_template (GST_ELEMENT_CLASS (klass),
+      gst_static_pad_template_get (&gst_rtmp2_sink_audio_template));
 
   gst_element_class_set_static_metadata (GST_ELEMENT_CLASS (klass),
       "RTMP sink element", "Sink", "Sink element for publishing RTMP streams",
       "David Schleef <ds@schleef.org>");
 
+  create_command_templates ();
+
   gobject_class->set_property = gst_rtmp2_sink_set_property;
   gobject_class->get_property = gst_rtmp2_sink_get_property;
   gobject_class->dispose = gst_rtmp2_sink_dispose;
   gobject_class->finalize = gst_rtmp2_sink_finalize;
+  element_class->request_new_pad =
+      GST_DEBUG_FUNCPTR (gst_rtmp2_sink_request_new_pad);
+  element_class->release_pad = GST_DEBUG_FUNCPTR (gst_rtmp2_sink_release_pad);
   base_sink_class->get_times = GST_DEBUG_FUNCPTR (gst_rtmp2_sink_get_times);
   base_sink_class->start = GST_DEBUG_FUNCPTR (gst_rtmp2_sink_start);
   base_sink_class->stop = GST_DEBUG_FUNCPTR (gst_rtmp2_sink_stop);
@@ -203,6 +312,81 @@ G_DEFINE_TYPE_WITH_CODE (GstRtmp2Sink, gst_rtmp2_sink, GST_TYPE_BASE_SINK,
       g_param_spec_string ("secure-token", "Secure token",
           "Secure token used for authentication",
           DEFAULT_SECURE_TOKEN, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_BITRATE_FEEDBACK,
+      g_param_spec_boolean ("bitrate-feedback", "Bitrate feedback",
+          "Post messages and send upstream events with a recommended "
+          "encoder bitrate", DEFAULT_BITRATE_FEEDBACK,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_FEEDBACK_INTERVAL,
+      g_param_spec_int ("feedback-interval", "Feedback interval",
+          "Interval between bitrate feedback reports, in milliseconds",
+          100, 60000, DEFAULT_FEEDBACK_INTERVAL,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TARGET_QUEUE_DELAY,
+      g_param_spec_int ("target-queue-delay", "Target queue delay",
+          "Output queue delay above which the connection is considered "
+          "congested, in milliseconds", 0, 60000, DEFAULT_TARGET_QUEUE_DELAY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MIN_BITRATE,
+      g_param_spec_uint64 ("min-bitrate", "Minimum bitrate",
+          "Lowest bitrate that bitrate feedback recommends, in bits/s",
+          1, G_MAXUINT64, DEFAULT_MIN_BITRATE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PACING,
+      g_param_spec_boolean ("pacing", "Pacing",
+          "Spread output over time instead of sending bursts",
+          DEFAULT_PACING, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PACING_RATE,
+      g_param_spec_uint64 ("pacing-rate", "Pacing rate",
+          "Pacing rate in bits per second (0 = twice the input rate)",
+          0, G_MAXUINT64, DEFAULT_PACING_RATE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PACING_BURST,
+      g_param_spec_uint ("pacing-burst", "Pacing burst",
+          "Maximum burst size in bytes (0 = 50 ms at the pacing rate)",
+          0, G_MAXUINT, DEFAULT_PACING_BURST,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MAX_OUTPUT_LATENCY,
+      g_param_spec_uint ("max-output-latency", "Maximum output latency",
+          "Abort partially sent video frames that are this many milliseconds "
+          "older than the newest queued media, and skip to the next "
+          "keyframe (0 = never)", 0, G_MAXUINT, DEFAULT_MAX_OUTPUT_LATENCY,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_DATA_CHUNK_STREAM,
+      g_param_spec_uint ("data-chunk-stream", "Data chunk stream",
+          "Chunk stream ID used for data messages (4-63, 2 and 3 carry "
+          "control messages and commands)", 4, 63,
+          DEFAULT_DATA_CHUNK_STREAM,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_AUDIO_CHUNK_STREAM,
+      g_param_spec_uint ("audio-chunk-stream", "Audio chunk stream",
+          "Chunk stream ID used for audio messages (4-63, 2 and 3 carry "
+          "control messages and commands)", 4, 63,
+          DEFAULT_AUDIO_CHUNK_STREAM,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_VIDEO_CHUNK_STREAM,
+      g_param_spec_uint ("video-chunk-stream", "Video chunk stream",
+          "Chunk stream ID used for video messages (4-63, 2 and 3 carry "
+          "control messages and commands)", 4, 63,
+          DEFAULT_VIDEO_CHUNK_STREAM,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_CHUNK_SIZE,
+      g_param_spec_uint ("chunk-size", "Chunk size",
+          "Maximum size of outgoing chunks (128 = don't change)", 128,
+          0x7fffffff, DEFAULT_CHUNK_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_PIPELINED_CONNECT,
+      g_param_spec_boolean ("pipelined-connect", "Pipelined connect",
+          "Send connect, createStream and publish without waiting for "
+          "the replies, falling back to one at a time if the server "
+          "rejects them.  Not done with a secure-token",
+          DEFAULT_PIPELINED_CONNECT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_POOL_SIZE,
+      g_param_spec_uint ("pool-size", "Pool size",
+          "Number of handshaken connections to keep ready for this server, "
+          "shared by all elements in the process (0 = no pool)", 0, 64,
+          DEFAULT_POOL_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
 }
 
@@ -212,12 +396,30 @@ gst_rtmp2_sink_init (GstRtmp2Sink * rtmp2sink)
   rtmp2sink->timeout = DEFAULT_TIMEOUT;
   gst_rtmp2_sink_set_uri (rtmp2sink, DEFAULT_LOCATION);
   rtmp2sink->secure_token = g_strdup (DEFAULT_SECURE_TOKEN);
+  rtmp2sink->bitrate_feedback = DEFAULT_BITRATE_FEEDBACK;
+  rtmp2sink->feedback_interval = DEFAULT_FEEDBACK_INTERVAL;
+  rtmp2sink->target_queue_delay = DEFAULT_TARGET_QUEUE_DELAY;
+  rtmp2sink->min_bitrate = DEFAULT_MIN_BITRATE;
+  rtmp2sink->pacing = DEFAULT_PACING;
+  rtmp2sink->pacing_rate = DEFAULT_PACING_RATE;
+  rtmp2sink->pacing_burst = DEFAULT_PACING_BURST;
+  rtmp2sink->max_output_latency = DEFAULT_MAX_OUTPUT_LATENCY;
+  rtmp2sink->data_chunk_stream = DEFAULT_DATA_CHUNK_STREAM;
+  rtmp2sink->audio_chunk_stream = DEFAULT_AUDIO_CHUNK_STREAM;
+  rtmp2sink->video_chunk_stream = DEFAULT_VIDEO_CHUNK_STREAM;
+  rtmp2sink->chunk_size = DEFAULT_CHUNK_SIZE;
+  rtmp2sink->pipelined_connect = DEFAULT_PIPELINED_CONNECT;
+  rtmp2sink->pool_size = DEFAULT_POOL_SIZE;
+  gst_rtmp_h264_access_unit_init (&rtmp2sink->video_au);
 
   g_mutex_init (&rtmp2sink->lock);
   g_cond_init (&rtmp2sink->cond);
   rtmp2sink->task = gst_task_new (gst_rtmp2_sink_task, rtmp2sink, NULL);
   g_rec_mutex_init (&rtmp2sink->task_lock);
   gst_task_set_lock (rtmp2sink->task, &rtmp2sink->task_lock);
+  /* createStream and publish are transactions 4 and 5 */
+  gst_rtmp_startup_init (&rtmp2sink->startup, "publish", 4, 5, publish_codes,
+      pipelined_create_stream, pipelined_publish, rtmp2sink);
   rtmp2sink->client = gst_rtmp_client_new ();
   rtmp2sink->connection = gst_rtmp_client_get_connection (rtmp2sink->client);
 
@@ -255,6 +457,48 @@ gst_rtmp2_sink_set_property (GObject * object, guint property_id,
       g_free (rtmp2sink->secure_token);
       rtmp2sink->secure_token = g_value_dup_string (value);
       break;
+    case PROP_BITRATE_FEEDBACK:
+      rtmp2sink->bitrate_feedback = g_value_get_boolean (value);
+      break;
+    case PROP_FEEDBACK_INTERVAL:
+      rtmp2sink->feedback_interval = g_value_get_int (value);
+      break;
+    case PROP_TARGET_QUEUE_DELAY:
+      rtmp2sink->target_queue_delay = g_value_get_int (value);
+      break;
+    case PROP_MIN_BITRATE:
+      rtmp2sink->min_bitrate = g_value_get_uint64 (value);
+      break;
+    case PROP_PACING:
+      rtmp2sink->pacing = g_value_get_boolean (value);
+      break;
+    case PROP_PACING_RATE:
+      rtmp2sink->pacing_rate = g_value_get_uint64 (value);
+      break;
+    case PROP_PACING_BURST:
+      rtmp2sink->pacing_burst = g_value_get_uint (value);
+      break;
+    case PROP_MAX_OUTPUT_LATENCY:
+      rtmp2sink->max_output_latency = g_value_get_uint (value);
+      break;
+    case PROP_DATA_CHUNK_STREAM:
+      rtmp2sink->data_chunk_stream = g_value_get_uint (value);
+      break;
+    case PROP_AUDIO_CHUNK_STREAM:
+      rtmp2sink->audio_chunk_stream = g_value_get_uint (value);
+      break;
+    case PROP_VIDEO_CHUNK_STREAM:
+      rtmp2sink->video_chunk_stream = g_value_get_uint (value);
+      break;
+    case PROP_CHUNK_SIZE:
+      rtmp2sink->chunk_size = g_value_get_uint (value);
+      break;
+    case PROP_PIPELINED_CONNECT:
+      rtmp2sink->pipelined_connect = g_value_get_boolean (value);
+      break;
+    case PROP_POOL_SIZE:
+      rtmp2sink->pool_size = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -288,6 +532,48 @@ gst_rtmp2_sink_get_property (GObject * object, guint property_id,
     case PROP_SECURE_TOKEN:
       g_value_set_string (value, rtmp2sink->secure_token);
       break;
+    case PROP_BITRATE_FEEDBACK:
+      g_value_set_boolean (value, rtmp2sink->bitrate_feedback);
+      break;
+    case PROP_FEEDBACK_INTERVAL:
+      g_value_set_int (value, rtmp2sink->feedback_interval);
+      break;
+    case PROP_TARGET_QUEUE_DELAY:
+      g_value_set_int (value, rtmp2sink->target_queue_delay);
+      break;
+    case PROP_MIN_BITRATE:
+      g_value_set_uint64 (value, rtmp2sink->min_bitrate);
+      break;
+    case PROP_PACING:
+      g_value_set_boolean (value, rtmp2sink->pacing);
+      break;
+    case PROP_PACING_RATE:
+      g_value_set_uint64 (value, rtmp2sink->pacing_rate);
+      break;
+    case PROP_PACING_BURST:
+      g_value_set_uint (value, rtmp2sink->pacing_burst);
+      break;
+    case PROP_MAX_OUTPUT_LATENCY:
+      g_value_set_uint (value, rtmp2sink->max_output_latency);
+      break;
+    case PROP_DATA_CHUNK_STREAM:
+      g_value_set_uint (value, rtmp2sink->data_chunk_stream);
+      break;
+    case PROP_AUDIO_CHUNK_STREAM:
+      g_value_set_uint (value, rtmp2sink->audio_chunk_stream);
+      break;
+    case PROP_VIDEO_CHUNK_STREAM:
+      g_value_set_uint (value, rtmp2sink->video_chunk_stream);
+      break;
+    case PROP_CHUNK_SIZE:
+      g_value_set_uint (value, rtmp2sink->chunk_size);
+      break;
+    case PROP_PIPELINED_CONNECT:
+      g_value_set_boolean (value, rtmp2sink->pipelined_connect);
+      break;
+    case PROP_POOL_SIZE:
+      g_value_set_uint (value, rtmp2sink->pool_size);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -319,15 +605,88 @@ gst_rtmp2_sink_finalize (GObject * object)
   g_free (rtmp2sink->application);
   g_free (rtmp2sink->stream);
   g_free (rtmp2sink->secure_token);
+  gst_buffer_replace (&rtmp2sink->video_codec_data, NULL);
+  gst_buffer_replace (&rtmp2sink->audio_codec_data, NULL);
+  gst_rtmp_h264_access_unit_clear (&rtmp2sink->video_au);
+  if (rtmp2sink->video_sps)
+    g_bytes_unref (rtmp2sink->video_sps);
+  if (rtmp2sink->video_pps)
+    g_bytes_unref (rtmp2sink->video_pps);
   g_object_unref (rtmp2sink->task);
   g_rec_mutex_clear (&rtmp2sink->task_lock);
   g_object_unref (rtmp2sink->client);
+  gst_rtmp_startup_clear (&rtmp2sink->startup);
   g_mutex_clear (&rtmp2sink->lock);
   g_cond_clear (&rtmp2sink->cond);
 
   G_OBJECT_CLASS (gst_rtmp2_sink_parent_class)->finalize (object);
 }
 
+static GstPad *
+gst_rtmp2_sink_request_new_pad (GstElement * element, GstPadTemplate * templ,
+    const gchar * name, const GstCaps * caps)
+{
+  GstRtmp2Sink *rtmp2sink = GST_RTMP2_SINK (element);
+  GstElementClass *klass = GST_ELEMENT_GET_CLASS (element);
+  GstSegment *segment;
+  GstPad **padp;
+  GstPad *pad;
+
+  if (templ == gst_element_class_get_pad_template (klass, "video")) {
+    padp = &rtmp2sink->video_pad;
+    segment = &rtmp2sink->video_segment;
+  } else if (templ == gst_element_class_get_pad_template (klass, "audio")) {
+    padp = &rtmp2sink->audio_pad;
+    segment = &rtmp2sink->audio_segment;
+  } else {
+    return NULL;
+  }
+
+  pad = gst_pad_new_from_template (templ,
+      GST_PAD_TEMPLATE_NAME_TEMPLATE (templ));
+
+  GST_OBJECT_LOCK (rtmp2sink);
+  if (*padp) {
+    GST_OBJECT_UNLOCK (rtmp2sink);
+    GST_WARNING_OBJECT (rtmp2sink, "already have a %s pad",
+        GST_PAD_TEMPLATE_NAME_TEMPLATE (templ));
+    gst_object_unref (pad);
+    return NULL;
+  }
+  *padp = pad;
+  GST_OBJECT_UNLOCK (rtmp2sink);
+
+  gst_segment_init (segment, GST_FORMAT_TIME);
+  gst_pad_set_chain_function (pad, GST_DEBUG_FUNCPTR (gst_rtmp2_sink_es_chain));
+  gst_pad_set_event_function (pad, GST_DEBUG_FUNCPTR (gst_rtmp2_sink_es_event));
+
+  /* nothing will ever preroll on the always sink pad */
+  gst_base_sink_set_async_enabled (GST_BASE_SINK (rtmp2sink), FALSE);
+
+  if (GST_STATE (rtmp2sink) > GST_STATE_READY)
+    gst_pad_set_active (pad, TRUE);
+  gst_element_add_pad (element, pad);
+
+  return pad;
+}
+
+static void
+gst_rtmp2_sink_release_pad (GstElement * element, GstPad * pad)
+{
+  GstRtmp2Sink *rtmp2sink = GST_RTMP2_SINK (element);
+
+  GST_OBJECT_LOCK (rtmp2sink);
+  if (pad == rtmp2sink->video_pad) {
+    rtmp2sink->video_pad = NULL;
+  } else if (pad == rtmp2sink->audio_pad) {
+    rtmp2sink->audio_pad = NULL;
+  }
+  GST_OBJECT_UNLOCK (rtmp2sink);
+
+  gst_pad_set_active (pad, FALSE);
+  gst_element_remove_pad (element, pad);
+}
+
 static void
 gst_rtmp2_sink_uri_handler_init (gpointer g_iface, gpointer iface_data)
 {
@@ -358,6 +717,18 @@ gst_rtmp2_sink_start (GstBaseSink * sink)
 
   GST_DEBUG_OBJECT (rtmp2sink, "start");
 
+  rtmp2sink->feedback_last_time = 0;
+  rtmp2sink->reset = FALSE;
+  rtmp2sink->video_eos = FALSE;
+  rtmp2sink->audio_eos = FALSE;
+  rtmp2sink->stream_id = 1;
+  gst_rtmp_startup_reset (&rtmp2sink->startup);
+
+  gst_rtmp_connection_set_pacing (rtmp2sink->connection, rtmp2sink->pacing,
+      rtmp2sink->pacing_rate / 8, rtmp2sink->pacing_burst);
+  gst_rtmp_connection_set_max_output_latency (rtmp2sink->connection,
+      rtmp2sink->max_output_latency);
+
   gst_task_start (rtmp2sink->task);
 
   return TRUE;
@@ -407,6 +778,9 @@ gst_rtmp2_sink_unlock_stop (GstBaseSink * sink)
 
   GST_DEBUG_OBJECT (rtmp2sink, "unlock_stop");
 
+  g_mutex_lock (&rtmp2sink->lock);
+  rtmp2sink->reset = FALSE;
+  g_mutex_unlock (&rtmp2sink->lock);
 
   return TRUE;
 }
@@ -430,7 +804,8 @@ gst_rtmp2_sink_event (GstBaseSink * sink, GstEvent * event)
 
   GST_DEBUG_OBJECT (rtmp2sink, "event");
 
-  return TRUE;
+  return GST_BASE_SINK_CLASS (gst_rtmp2_sink_parent_class)->event (sink,
+      event);
 }
 
 static GstFlowReturn
@@ -447,46 +822,91 @@ gst_rtmp2_sink_preroll (GstBaseSink * sink, GstBuffer * buffer)
   return GST_FLOW_OK;
 }
 
+/* Waits until the stream is published.  Returns FALSE when flushing. */
+static gboolean
+gst_rtmp2_sink_wait_connected (GstRtmp2Sink * rtmp2sink)
+{
+  gboolean ret;
+
+  g_mutex_lock (&rtmp2sink->lock);
+  while (!rtmp2sink->is_connected && !rtmp2sink->reset) {
+    g_cond_wait (&rtmp2sink->cond, &rtmp2sink->lock);
+  }
+  ret = !rtmp2sink->reset;
+  g_mutex_unlock (&rtmp2sink->lock);
+
+  return ret;
+}
+
+static void
+gst_rtmp2_sink_mapped_buffer_free (gpointer user_data)
+{
+  GstRtmp2SinkMappedBuffer *mapped = user_data;
+
+  gst_buffer_unmap (mapped->buffer, &mapped->map);
+  gst_buffer_unref (mapped->buffer);
+  g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+}
+
 static GstFlowReturn
 gst_rtmp2_sink_render (GstBaseSink * sink, GstBuffer * buffer)
 {
   GstRtmp2Sink *rtmp2sink = GST_RTMP2_SINK (sink);
+  GstRtmp2SinkMappedBuffer *mapped;
   GstRtmpChunk *chunk;
   GBytes *bytes;
   gsize size;
-  guint8 *data;
+  const guint8 *data;
+  gsize message_length;
 
   GST_DEBUG_OBJECT (rtmp2sink, "render");
 
-  size = gst_buffer_get_size (buffer);
-  gst_buffer_extract_dup (buffer, 0, size, (gpointer *) & data, &size);
+  mapped = g_slice_new (GstRtmp2SinkMappedBuffer);
+  if (!gst_buffer_map (buffer, &mapped->map, GST_MAP_READ)) {
+    g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+    return GST_FLOW_ERROR;
+  }
+  mapped->buffer = gst_buffer_ref (buffer);
+  data = mapped->map.data;
+  size = mapped->map.size;
+
+  /* the payload is sent straight from the buffer, which stays mapped
+   * until the connection has written it */
+  bytes = g_bytes_new_with_free_func (data, size,
+      gst_rtmp2_sink_mapped_buffer_free, mapped);
 
   if (size >= 4) {
     if (data[0] == 'F' && data[1] == 'L' && data[2] == 'V') {
       /* drop the header, we don't need it */
-      g_free (data);
+      g_bytes_unref (bytes);
       return GST_FLOW_OK;
     }
   }
 
   if (size < 15) {
-    g_free (data);
+    g_bytes_unref (bytes);
     return GST_FLOW_ERROR;
   }
 
 
   chunk = gst_rtmp_chunk_new ();
   chunk->message_type_id = data[0];
-  chunk->chunk_stream_id = 4;
-  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_DATA ||
-      chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_AUDIO ||
-      chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+  /* separate chunk streams, so that audio can be interleaved with
+   * large video frames */
+  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_AUDIO) {
+    chunk->chunk_stream_id = rtmp2sink->audio_chunk_stream;
+  } else if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+    chunk->chunk_stream_id = rtmp2sink->video_chunk_stream;
+  } else if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_DATA) {
+    chunk->chunk_stream_id = rtmp2sink->data_chunk_stream;
   } else {
     GST_ERROR ("unknown message_type_id %d", chunk->message_type_id);
+    chunk->chunk_stream_id = rtmp2sink->data_chunk_stream;
   }
   chunk->message_length = GST_READ_UINT24_BE (data + 1);
-  chunk->timestamp = GST_READ_UINT24_BE (data + 4);
-  chunk->stream_id = 1;         /* FIXME use actual stream id */
+  /* the upper 8 bits follow the lower 24 */
+  chunk->timestamp = GST_READ_UINT24_BE (data + 4) | (data[7] << 24);
+  chunk->stream_id = rtmp2sink->stream_id;
 
   if (chunk->message_length != size - 15) {
     GST_ERROR ("message length was %" G_GSIZE_FORMAT " expected %"
@@ -498,22 +918,50 @@ gst_rtmp2_sink_render (GstBaseSink * sink, GstBuffer * buffer)
       0x02, 0x00, 0x0d, 0x40, 0x73, 0x65, 0x74, 0x44,
       0x61, 0x74, 0x61, 0x46, 0x72, 0x61, 0x6d, 0x65
     };
-    guint8 *newdata;
     /* FIXME HACK, attach a setDataFrame header.  This should be done
      * using a command. */
+    gst_rtmp_chunk_set_payload_prefix (chunk,
+        g_bytes_new_static (header, sizeof (header)));
+    chunk->message_length += sizeof (header);
+  }
 
-    newdata = g_malloc (size - 15 + sizeof (header));
-    memcpy (newdata, header, sizeof (header));
-    memcpy (newdata + sizeof (header), data + 11, size - 15);
-    g_free (data);
+  chunk->payload = g_bytes_new_from_bytes (bytes, 11, size - 15);
+  g_bytes_unref (bytes);
 
-    chunk->message_length += sizeof (header);
-    chunk->payload = g_bytes_new_take (newdata, chunk->message_length);
+  if (rtmp2sink->dump) {
+    gst_rtmp_dump_chunk (chunk, TRUE, TRUE, TRUE);
+  }
+
+  message_length = chunk->message_length;
+  gst_rtmp_connection_queue_chunk (rtmp2sink->connection, chunk);
+
+  if (rtmp2sink->bitrate_feedback) {
+    gst_rtmp2_sink_update_feedback (rtmp2sink, GST_BASE_SINK_PAD (rtmp2sink),
+        message_length);
+  }
+
+  return GST_FLOW_OK;
+}
+
+static gsize
+gst_rtmp2_sink_queue_es_message (GstRtmp2Sink * rtmp2sink, int type,
+    guint32 timestamp, GBytes * prefix, GBytes * payload)
+{
+  GstRtmpChunk *chunk;
+
+  chunk = gst_rtmp_chunk_new ();
+  chunk->message_type_id = type;
+  if (type == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+    chunk->chunk_stream_id = rtmp2sink->video_chunk_stream;
   } else {
-    bytes = g_bytes_new_take (data, size);
-    chunk->payload = g_bytes_new_from_bytes (bytes, 11, size - 15);
-    g_bytes_unref (bytes);
+    chunk->chunk_stream_id = rtmp2sink->audio_chunk_stream;
   }
+  chunk->timestamp = timestamp;
+  chunk->stream_id = rtmp2sink->stream_id;
+  chunk->message_length = g_bytes_get_size (prefix) +
+      g_bytes_get_size (payload);
+  gst_rtmp_chunk_set_payload_prefix (chunk, prefix);
+  chunk->payload = payload;
 
   if (rtmp2sink->dump) {
     gst_rtmp_dump_chunk (chunk, TRUE, TRUE, TRUE);
@@ -521,9 +969,415 @@ gst_rtmp2_sink_render (GstBaseSink * sink, GstBuffer * buffer)
 
   gst_rtmp_connection_queue_chunk (rtmp2sink->connection, chunk);
 
+  return g_bytes_get_size (prefix) + g_bytes_get_size (payload);
+}
+
+/* Converts a byte-stream access unit to AVCC.  This happens in the
+ * buffer's own memory when every start code is 4 bytes long.  New SPS
+ * and PPS update the sequence header.  Takes ownership of @buffer;
+ * returns NULL if the buffer is to be dropped. */
+static GBytes *
+gst_rtmp2_sink_convert_annexb (GstRtmp2Sink * rtmp2sink, GstBuffer * buffer,
+    gboolean * keyframe)
+{
+  GstRtmpH264AccessUnit *au = &rtmp2sink->video_au;
+  GstRtmp2SinkMappedBuffer *mapped;
+  gboolean changed = FALSE;
+  guint8 *data;
+
+  mapped = g_slice_new (GstRtmp2SinkMappedBuffer);
+  if (!gst_buffer_map (buffer, &mapped->map, GST_MAP_READ)) {
+    g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+    gst_buffer_unref (buffer);
+    return NULL;
+  }
+
+  if (!gst_rtmp_h264_scan (au, mapped->map.data, mapped->map.size)) {
+    GST_WARNING_OBJECT (rtmp2sink, "no start code in byte-stream buffer");
+    gst_buffer_unmap (buffer, &mapped->map);
+    g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+    gst_buffer_unref (buffer);
+    return NULL;
+  }
+
+  *keyframe = au->idr;
+
+  if (au->sps && (!rtmp2sink->video_sps ||
+          !g_bytes_equal (au->sps, rtmp2sink->video_sps))) {
+    if (rtmp2sink->video_sps)
+      g_bytes_unref (rtmp2sink->video_sps);
+    rtmp2sink->video_sps = g_bytes_ref (au->sps);
+    changed = TRUE;
+  }
+  if (au->pps && (!rtmp2sink->video_pps ||
+          !g_bytes_equal (au->pps, rtmp2sink->video_pps))) {
+    if (rtmp2sink->video_pps)
+      g_bytes_unref (rtmp2sink->video_pps);
+    rtmp2sink->video_pps = g_bytes_ref (au->pps);
+    changed = TRUE;
+  }
+  if (changed && rtmp2sink->video_sps && rtmp2sink->video_pps) {
+    GBytes *config;
+
+    config = gst_rtmp_h264_make_avc_config (rtmp2sink->video_sps,
+        rtmp2sink->video_pps);
+    if (config) {
+      GstBuffer *codec_data = gst_buffer_new_wrapped (g_bytes_unref_to_data
+          (config, NULL), g_bytes_get_size (config));
+
+      gst_buffer_replace (&rtmp2sink->video_codec_data, codec_data);
+      gst_buffer_unref (codec_data);
+      rtmp2sink->video_header_pending = TRUE;
+    }
+  }
+
+  if (!rtmp2sink->video_codec_data) {
+    GST_DEBUG_OBJECT (rtmp2sink, "dropping video until SPS and PPS are seen");
+    gst_buffer_unmap (buffer, &mapped->map);
+    g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+    gst_buffer_unref (buffer);
+    return NULL;
+  }
+
+  if (au->in_place && gst_buffer_is_writable (buffer)) {
+    /* remapping may copy if the memory is shared, offsets stay valid */
+    gst_buffer_unmap (buffer, &mapped->map);
+    if (gst_buffer_map (buffer, &mapped->map, GST_MAP_READWRITE)) {
+      gsize size;
+
+      size = gst_rtmp_h264_to_avcc (au, mapped->map.data, mapped->map.data);
+      mapped->buffer = buffer;
+      return g_bytes_new_with_free_func (mapped->map.data, size,
+          gst_rtmp2_sink_mapped_buffer_free, mapped);
+    }
+    if (!gst_buffer_map (buffer, &mapped->map, GST_MAP_READ)) {
+      g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+      gst_buffer_unref (buffer);
+      return NULL;
+    }
+  }
+
+  data = g_malloc (au->avcc_size);
+  gst_rtmp_h264_to_avcc (au, mapped->map.data, data);
+  gst_buffer_unmap (buffer, &mapped->map);
+  g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+  gst_buffer_unref (buffer);
+
+  return g_bytes_new_take (data, au->avcc_size);
+}
+
+/* Builds FLV-style video and audio message payloads straight from H.264
+ * and AAC buffers: a few bytes of tag header as prefix, followed by the
+ * mapped buffer. */
+static GstFlowReturn
+gst_rtmp2_sink_es_chain (GstPad * pad, GstObject * parent, GstBuffer * buffer)
+{
+  GstRtmp2Sink *rtmp2sink = GST_RTMP2_SINK (parent);
+  GstRtmp2SinkMappedBuffer *mapped;
+  GstSegment *segment;
+  GstBuffer *codec_data;
+  gboolean *header_pending;
+  gboolean is_video;
+  GstClockTime dts;
+  GstClockTime pts;
+  guint32 timestamp;
+  gint32 cts;
+  guint8 *header;
+  gsize header_size;
+  GBytes *bytes;
+  gsize message_length;
+  gboolean keyframe;
+  int type;
+
+  if (!gst_rtmp2_sink_wait_connected (rtmp2sink)) {
+    gst_buffer_unref (buffer);
+    return GST_FLOW_FLUSHING;
+  }
+
+  is_video = (pad == rtmp2sink->video_pad);
+  if (is_video) {
+    type = GST_RTMP_MESSAGE_TYPE_VIDEO;
+    segment = &rtmp2sink->video_segment;
+    codec_data = rtmp2sink->video_codec_data;
+    header_pending = &rtmp2sink->video_header_pending;
+  } else {
+    type = GST_RTMP_MESSAGE_TYPE_AUDIO;
+    segment = &rtmp2sink->audio_segment;
+    codec_data = rtmp2sink->audio_codec_data;
+    header_pending = &rtmp2sink->audio_header_pending;
+  }
+
+  pts = GST_BUFFER_PTS (buffer);
+  dts = GST_BUFFER_DTS_IS_VALID (buffer) ? GST_BUFFER_DTS (buffer) : pts;
+  if (!GST_CLOCK_TIME_IS_VALID (dts)) {
+    GST_ELEMENT_ERROR (rtmp2sink, STREAM, FORMAT, (NULL),
+        ("buffer without timestamp on %s pad", GST_PAD_NAME (pad)));
+    gst_buffer_unref (buffer);
+    return GST_FLOW_ERROR;
+  }
+  dts = gst_segment_to_running_time (segment, GST_FORMAT_TIME, dts);
+  if (!GST_CLOCK_TIME_IS_VALID (dts)) {
+    GST_DEBUG_OBJECT (pad, "dropping buffer outside of segment");
+    gst_buffer_unref (buffer);
+    return GST_FLOW_OK;
+  }
+  /* RTMP timestamps are 32-bit milliseconds */
+  timestamp = dts / GST_MSECOND;
+
+  cts = 0;
+  if (is_video && GST_CLOCK_TIME_IS_VALID (pts)) {
+    pts = gst_segment_to_running_time (segment, GST_FORMAT_TIME, pts);
+    if (GST_CLOCK_TIME_IS_VALID (pts))
+      cts = ((gint64) pts - (gint64) dts) / GST_MSECOND;
+  }
+
+  keyframe = !GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  if (is_video && rtmp2sink->video_annexb) {
+    bytes = gst_rtmp2_sink_convert_annexb (rtmp2sink, buffer, &keyframe);
+    if (!bytes) {
+      return GST_FLOW_OK;
+    }
+    codec_data = rtmp2sink->video_codec_data;
+  } else {
+    mapped = g_slice_new (GstRtmp2SinkMappedBuffer);
+    if (!gst_buffer_map (buffer, &mapped->map, GST_MAP_READ)) {
+      g_slice_free (GstRtmp2SinkMappedBuffer, mapped);
+      gst_buffer_unref (buffer);
+      return GST_FLOW_ERROR;
+    }
+    /* takes over our ref */
+    mapped->buffer = buffer;
+    bytes = g_bytes_new_with_free_func (mapped->map.data, mapped->map.size,
+        gst_rtmp2_sink_mapped_buffer_free, mapped);
+  }
+
+  if (*header_pending) {
+    guint8 *data;
+    gsize size;
+
+    header = g_malloc (5);
+    if (is_video) {
+      header[0] = 0x17;
+      header[1] = 0;            /* AVC sequence header */
+      GST_WRITE_UINT24_BE (header + 2, 0);
+      header_size = 5;
+    } else {
+      header[0] = 0xaf;
+      header[1] = 0;            /* AAC sequence header */
+      header_size = 2;
+    }
+    gst_buffer_extract_dup (codec_data, 0, gst_buffer_get_size (codec_data),
+        (gpointer *) & data, &size);
+    gst_rtmp2_sink_queue_es_message (rtmp2sink, type, timestamp,
+        g_bytes_new_take (header, header_size), g_bytes_new_take (data, size));
+    *header_pending = FALSE;
+  }
+
+  header = g_malloc (5);
+  if (is_video) {
+    header[0] = keyframe ? 0x17 : 0x27;
+    header[1] = 1;              /* AVC NALU */
+    GST_WRITE_UINT24_BE (header + 2, cts & 0xffffff);
+    header_size = 5;
+  } else {
+    header[0] = 0xaf;
+    header[1] = 1;              /* AAC raw */
+    header_size = 2;
+  }
+
+  message_length = gst_rtmp2_sink_queue_es_message (rtmp2sink, type,
+      timestamp, g_bytes_new_take (header, header_size), bytes);
+
+  if (rtmp2sink->bitrate_feedback) {
+    gst_rtmp2_sink_update_feedback (rtmp2sink,
+        rtmp2sink->video_pad ? rtmp2sink->video_pad : pad, message_length);
+  }
+
   return GST_FLOW_OK;
 }
 
+static gboolean
+gst_rtmp2_sink_es_event (GstPad * pad, GstObject * parent, GstEvent * event)
+{
+  GstRtmp2Sink *rtmp2sink = GST_RTMP2_SINK (parent);
+  gboolean is_video = (pad == rtmp2sink->video_pad);
+  gboolean ret = TRUE;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_CAPS:{
+      GstCaps *caps;
+      GstStructure *s;
+      const GValue *value;
+
+      gst_event_parse_caps (event, &caps);
+      s = gst_caps_get_structure (caps, 0);
+      value = gst_structure_get_value (s, "codec_data");
+      if (is_video) {
+        rtmp2sink->video_annexb = g_strcmp0 (gst_structure_get_string (s,
+                "stream-format"), "byte-stream") == 0;
+      }
+      if (is_video && rtmp2sink->video_annexb) {
+        /* the sequence header comes from the in-band SPS and PPS */
+      } else if (!value) {
+        GST_ELEMENT_ERROR (rtmp2sink, STREAM, FORMAT, (NULL),
+            ("no codec_data in caps on %s pad", GST_PAD_NAME (pad)));
+        ret = FALSE;
+      } else if (is_video) {
+        gst_buffer_replace (&rtmp2sink->video_codec_data,
+            gst_value_get_buffer (value));
+        rtmp2sink->video_header_pending = TRUE;
+      } else {
+        gst_buffer_replace (&rtmp2sink->audio_codec_data,
+            gst_value_get_buffer (value));
+        rtmp2sink->audio_header_pending = TRUE;
+      }
+      break;
+    }
+    case GST_EVENT_SEGMENT:
+      gst_event_copy_segment (event, is_video ? &rtmp2sink->video_segment :
+          &rtmp2sink->audio_segment);
+      break;
+    case GST_EVENT_FLUSH_START:
+      /* wake up a chain function waiting for the stream to be published,
+       * like the base class does on the sink pad */
+      gst_rtmp2_sink_unlock (GST_BASE_SINK (rtmp2sink));
+      break;
+    case GST_EVENT_FLUSH_STOP:
+      gst_rtmp2_sink_unlock_stop (GST_BASE_SINK (rtmp2sink));
+      gst_segment_init (is_video ? &rtmp2sink->video_segment :
+          &rtmp2sink->audio_segment, GST_FORMAT_TIME);
+      GST_OBJECT_LOCK (rtmp2sink);
+      if (is_video) {
+        rtmp2sink->video_eos = FALSE;
+      } else {
+        rtmp2sink->audio_eos = FALSE;
+      }
+      GST_OBJECT_UNLOCK (rtmp2sink);
+      break;
+    case GST_EVENT_EOS:{
+      gboolean all_eos;
+
+      GST_OBJECT_LOCK (rtmp2sink);
+      if (is_video) {
+        rtmp2sink->video_eos = TRUE;
+      } else {
+        rtmp2sink->audio_eos = TRUE;
+      }
+      all_eos = (!rtmp2sink->video_pad || rtmp2sink->video_eos) &&
+          (!rtmp2sink->audio_pad || rtmp2sink->audio_eos);
+      GST_OBJECT_UNLOCK (rtmp2sink);
+
+      /* let the base class post EOS once all streams are done */
+      if (all_eos) {
+        GST_DEBUG_OBJECT (rtmp2sink, "all request pads are EOS");
+        gst_pad_send_event (GST_BASE_SINK_PAD (rtmp2sink),
+            gst_event_new_eos ());
+      }
+      break;
+    }
+    default:
+      break;
+  }
+
+  gst_event_unref (event);
+  return ret;
+}
+
+/* Compare what we queued during the last interval with what the
+ * connection managed to drain, and recommend a bitrate that keeps the
+ * output queue short. */
+static void
+gst_rtmp2_sink_update_feedback (GstRtmp2Sink * rtmp2sink, GstPad * pad,
+    gsize bytes)
+{
+  GstStructure *s;
+  gint64 now;
+  gint64 elapsed;
+  gsize queued;
+  gint64 drained;
+  guint64 input_bitrate;
+  guint64 output_bitrate;
+  guint64 recommended_bitrate;
+  GstClockTime queue_delay;
+  gboolean congested;
+
+  now = g_get_monotonic_time ();
+  queued = gst_rtmp_connection_get_queued_bytes (rtmp2sink->connection);
+
+  /* the request pads render from their own streaming threads */
+  GST_OBJECT_LOCK (rtmp2sink);
+
+  if (rtmp2sink->feedback_last_time == 0) {
+    rtmp2sink->feedback_last_time = now;
+    rtmp2sink->feedback_bytes_in = 0;
+    rtmp2sink->feedback_last_queued = queued;
+    GST_OBJECT_UNLOCK (rtmp2sink);
+    return;
+  }
+
+  rtmp2sink->feedback_bytes_in += bytes;
+  elapsed = now - rtmp2sink->feedback_last_time;
+  if (elapsed < (gint64) rtmp2sink->feedback_interval * 1000) {
+    GST_OBJECT_UNLOCK (rtmp2sink);
+    return;
+  }
+
+  drained = (gint64) rtmp2sink->feedback_bytes_in -
+      ((gint64) queued - (gint64) rtmp2sink->feedback_last_queued);
+  drained = MAX (drained, 0);
+
+  input_bitrate = gst_util_uint64_scale (rtmp2sink->feedback_bytes_in * 8,
+      G_USEC_PER_SEC, elapsed);
+  output_bitrate = gst_util_uint64_scale (drained * 8, G_USEC_PER_SEC,
+      elapsed);
+
+  if (queued == 0) {
+    queue_delay = 0;
+  } else if (output_bitrate == 0) {
+    queue_delay = GST_CLOCK_TIME_NONE;
+  } else {
+    queue_delay = gst_util_uint64_scale (queued * 8, GST_SECOND,
+        output_bitrate);
+  }
+
+  congested = queued > 0 && (queue_delay == GST_CLOCK_TIME_NONE ||
+      queue_delay > rtmp2sink->target_queue_delay * GST_MSECOND);
+
+  if (congested) {
+    /* leave some headroom so the backlog can drain */
+    recommended_bitrate = output_bitrate * 85 / 100;
+  } else {
+    /* let the encoder probe upwards slowly */
+    recommended_bitrate = MAX (input_bitrate, output_bitrate) * 110 / 100;
+  }
+  /* a recommendation of 0 would stop the encoder altogether */
+  recommended_bitrate = MAX (recommended_bitrate, rtmp2sink->min_bitrate);
+
+  rtmp2sink->feedback_last_time = now;
+  rtmp2sink->feedback_bytes_in = 0;
+  rtmp2sink->feedback_last_queued = queued;
+  GST_OBJECT_UNLOCK (rtmp2sink);
+
+  GST_DEBUG_OBJECT (rtmp2sink, "queued %" G_GSIZE_FORMAT " bytes, delay %"
+      GST_TIME_FORMAT ", in %" G_GUINT64_FORMAT " bps, out %"
+      G_GUINT64_FORMAT " bps, recommended %" G_GUINT64_FORMAT " bps",
+      queued, GST_TIME_ARGS (queue_delay), input_bitrate, output_bitrate,
+      recommended_bitrate);
+
+  s = gst_structure_new ("GstRtmpBitrateFeedback",
+      "queued-bytes", G_TYPE_UINT64, (guint64) queued,
+      "queue-delay", G_TYPE_UINT64, queue_delay,
+      "input-bitrate", G_TYPE_UINT64, input_bitrate,
+      "output-bitrate", G_TYPE_UINT64, output_bitrate,
+      "recommended-bitrate", G_TYPE_UINT64, recommended_bitrate,
+      "congested", G_TYPE_BOOLEAN, congested, NULL);
+
+  gst_element_post_message (GST_ELEMENT (rtmp2sink),
+      gst_message_new_element (GST_OBJECT (rtmp2sink),
+          gst_structure_copy (s)));
+  gst_pad_push_event (pad, gst_event_new_custom (GST_EVENT_CUSTOM_UPSTREAM, s));
+}
+
 
 /* URL handler */
 
@@ -635,8 +1489,11 @@ gst_rtmp2_sink_task (gpointer user_data)
 
   GST_DEBUG ("gst_rtmp2_sink_task starting");
 
+  rtmp2sink->start_time = g_get_monotonic_time ();
   gst_rtmp_client_set_server_address (rtmp2sink->client,
       rtmp2sink->server_address);
+  gst_rtmp_client_set_server_port (rtmp2sink->client, rtmp2sink->port);
+  gst_rtmp_client_set_pool_size (rtmp2sink->client, rtmp2sink->pool_size);
   gst_rtmp_client_connect_async (rtmp2sink->client, NULL, connect_done,
       rtmp2sink);
 
@@ -672,32 +1529,61 @@ connect_done (GObject * source, GAsyncResult * result, gpointer user_data)
     return;
   }
 
-  g_signal_connect (rtmp2sink->connection, "got-chunk", G_CALLBACK (got_chunk),
-      rtmp2sink);
+  rtmp2sink->connected_time = g_get_monotonic_time ();
+  gst_rtmp_connection_add_message_handler (rtmp2sink->connection,
+      GST_RTMP_MESSAGE_MASK_ALL, got_chunk, rtmp2sink, NULL);
 
-  send_connect (rtmp2sink);
+  /* the secureToken response has to reach the server before createStream
+   * and publish, so it can't be pipelined */
+  if (rtmp2sink->pipelined_connect && (rtmp2sink->secure_token == NULL ||
+          !rtmp2sink->secure_token[0])) {
+    send_pipelined (rtmp2sink);
+  } else {
+    send_connect (rtmp2sink, FALSE);
+  }
 }
 
+/* Like the shared templates in rtmpconnection.c, the slots are the
+ * strings left NULL, and the template lives as long as the process. */
+static GstAmfTemplate *publish_template;
+
 static void
-send_connect (GstRtmp2Sink * rtmp2sink)
+create_command_templates (void)
 {
-  GstAmfNode *node;
+  GstAmfNode *args[3];
+
+  /* stream, application */
+  args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+  args[1] = gst_amf_node_new (GST_AMF_TYPE_STRING);
+  args[2] = gst_amf_node_new (GST_AMF_TYPE_STRING);
+  publish_template = gst_amf_template_new ("publish", 3, args);
+
+  gst_amf_node_free (args[0]);
+  gst_amf_node_free (args[1]);
+  gst_amf_node_free (args[2]);
+}
+
+/* In pipelined mode no callbacks are registered, the replies are
+ * picked up by handle_pipelined_reply() */
+static void
+send_connect (GstRtmp2Sink * rtmp2sink, gboolean pipelined)
+{
+  const char *strings[2];
   gchar *uri;
 
-  node = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
-  gst_amf_object_set_string (node, "app", rtmp2sink->application);
-  gst_amf_object_set_string (node, "type", "nonprivate");
   uri = gst_rtmp2_sink_get_uri (rtmp2sink);
-  gst_amf_object_set_string (node, "tcUrl", uri);
+  strings[0] = rtmp2sink->application;
+  strings[1] = uri;
+  if (rtmp2sink->chunk_size != 128) {
+    /* fewer chunk headers to write */
+    gst_rtmp_connection_set_chunk_size (rtmp2sink->connection,
+        rtmp2sink->chunk_size);
+  }
+  gst_rtmp_connection_send_template (rtmp2sink->connection, 3, 0,
+      gst_rtmp_connection_get_command_template
+      (GST_RTMP_COMMAND_TEMPLATE_CONNECT), 1, strings,
+      pipelined ? NULL : cmd_connect_done, rtmp2sink);
   g_free (uri);
-  // "fpad": False,
-  // "capabilities": 15,
-  // "audioCodecs": 3191,
-  // "videoCodecs": 252,
-  // "videoFunction": 1,
-  gst_rtmp_connection_send_command (rtmp2sink->connection, 3, "connect", 1,
-      node, NULL, cmd_connect_done, rtmp2sink);
-  gst_amf_node_free (node);
 }
 
 static void
@@ -711,7 +1597,7 @@ cmd_connect_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
   ret = FALSE;
   if (optional_args) {
     const GstAmfNode *n;
-    n = gst_amf_node_get_object (optional_args, "code");
+    n = gst_amf_node_get_object_by_key (optional_args, GST_AMF_KEY_CODE);
     if (n) {
       const char *s;
       s = gst_amf_node_get_string (n);
@@ -726,7 +1612,8 @@ cmd_connect_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
 
     GST_DEBUG ("success");
 
-    n = gst_amf_node_get_object (optional_args, "secureToken");
+    n = gst_amf_node_get_object_by_key (optional_args,
+        GST_AMF_KEY_SECURE_TOKEN);
     if (n) {
       const gchar *challenge;
       challenge = gst_amf_node_get_string (n);
@@ -734,38 +1621,27 @@ cmd_connect_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
       send_secure_token_response (rtmp2sink, challenge);
     }
 
-    send_create_stream (rtmp2sink);
+    send_create_stream (rtmp2sink, FALSE);
   } else {
     GST_ERROR ("connect error");
   }
 }
 
 static void
-send_create_stream (GstRtmp2Sink * rtmp2sink)
+send_create_stream (GstRtmp2Sink * rtmp2sink, gboolean pipelined)
 {
-  GstAmfNode *node;
-  GstAmfNode *node2;
-
-  node = gst_amf_node_new (GST_AMF_TYPE_NULL);
-  node2 = gst_amf_node_new (GST_AMF_TYPE_STRING);
-  gst_amf_node_set_string (node2, rtmp2sink->stream);
-  gst_rtmp_connection_send_command (rtmp2sink->connection, 3, "releaseStream",
-      2, node, node2, NULL, NULL);
-  gst_amf_node_free (node);
-  gst_amf_node_free (node2);
-
-  node = gst_amf_node_new (GST_AMF_TYPE_NULL);
-  node2 = gst_amf_node_new (GST_AMF_TYPE_STRING);
-  gst_amf_node_set_string (node2, rtmp2sink->stream);
-  gst_rtmp_connection_send_command (rtmp2sink->connection, 3, "FCPublish", 3,
-      node, node2, NULL, NULL);
-  gst_amf_node_free (node);
-  gst_amf_node_free (node2);
-
-  node = gst_amf_node_new (GST_AMF_TYPE_NULL);
-  gst_rtmp_connection_send_command (rtmp2sink->connection, 3, "createStream", 4,
-      node, NULL, create_stream_done, rtmp2sink);
-  gst_amf_node_free (node);
+  const char *strings[] = { rtmp2sink->stream };
+
+  gst_rtmp_connection_send_template (rtmp2sink->connection, 3, 0,
+      gst_rtmp_connection_get_command_template
+      (GST_RTMP_COMMAND_TEMPLATE_RELEASE_STREAM), 2, strings, NULL, NULL);
+  gst_rtmp_connection_send_template (rtmp2sink->connection, 3, 0,
+      gst_rtmp_connection_get_command_template
+      (GST_RTMP_COMMAND_TEMPLATE_FC_PUBLISH), 3, strings, NULL, NULL);
+  gst_rtmp_connection_send_template (rtmp2sink->connection, 3, 0,
+      gst_rtmp_connection_get_command_template
+      (GST_RTMP_COMMAND_TEMPLATE_CREATE_STREAM), 4, NULL,
+      pipelined ? NULL : create_stream_done, rtmp2sink);
 }
 
 static void
@@ -785,29 +1661,22 @@ create_stream_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
 
   if (ret) {
     GST_DEBUG ("createStream success, stream_id=%d", stream_id);
-    send_publish (rtmp2sink);
+    rtmp2sink->stream_id = stream_id;
+    send_publish (rtmp2sink, 5, publish_done);
   } else {
     GST_ERROR ("createStream failed");
   }
 }
 
 static void
-send_publish (GstRtmp2Sink * rtmp2sink)
+send_publish (GstRtmp2Sink * rtmp2sink, int transaction_id,
+    GstRtmpCommandCallback callback)
 {
-  GstAmfNode *node;
-  GstAmfNode *node2;
-  GstAmfNode *node3;
+  const char *strings[] = { rtmp2sink->stream, rtmp2sink->application };
 
-  node = gst_amf_node_new (GST_AMF_TYPE_NULL);
-  node2 = gst_amf_node_new (GST_AMF_TYPE_STRING);
-  gst_amf_node_set_string (node2, rtmp2sink->stream);
-  node3 = gst_amf_node_new (GST_AMF_TYPE_STRING);
-  gst_amf_node_set_string (node3, rtmp2sink->application);
-  gst_rtmp_connection_send_command2 (rtmp2sink->connection, 4, 1, "publish", 5,
-      node, node2, node3, NULL, publish_done, rtmp2sink);
-  gst_amf_node_free (node);
-  gst_amf_node_free (node2);
-  gst_amf_node_free (node3);
+  gst_rtmp_connection_send_template (rtmp2sink->connection, 4,
+      rtmp2sink->stream_id, publish_template, transaction_id, strings,
+      callback, rtmp2sink);
 }
 
 static void
@@ -827,16 +1696,102 @@ publish_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
 
   if (ret) {
     GST_DEBUG ("publish success, stream_id=%d", stream_id);
-
-    g_mutex_lock (&rtmp2sink->lock);
-    rtmp2sink->is_connected = TRUE;
-    g_cond_signal (&rtmp2sink->cond);
-    g_mutex_unlock (&rtmp2sink->lock);
+    publish_started (rtmp2sink);
   } else {
     GST_ERROR ("publish failed");
   }
 }
 
+static void
+publish_started (GstRtmp2Sink * rtmp2sink)
+{
+  GstClockTime connect_time;
+  GstClockTime publish_time;
+
+  connect_time = (rtmp2sink->connected_time - rtmp2sink->start_time) *
+      GST_USECOND;
+  publish_time = (g_get_monotonic_time () - rtmp2sink->start_time) *
+      GST_USECOND;
+  GST_INFO_OBJECT (rtmp2sink, "publishing %" GST_TIME_FORMAT " after start, "
+      "connected after %" GST_TIME_FORMAT " (pipelined %d, fallback %d)",
+      GST_TIME_ARGS (publish_time), GST_TIME_ARGS (connect_time),
+      rtmp2sink->pipelined_connect, rtmp2sink->startup.fallback);
+  gst_element_post_message (GST_ELEMENT (rtmp2sink),
+      gst_message_new_element (GST_OBJECT (rtmp2sink),
+          gst_structure_new ("GstRtmp2SinkPublished",
+              "time-to-publish", G_TYPE_UINT64, publish_time,
+              "connect-time", G_TYPE_UINT64, connect_time,
+              "pipelined", G_TYPE_BOOLEAN, rtmp2sink->pipelined_connect,
+              "fallback", G_TYPE_BOOLEAN, rtmp2sink->startup.fallback,
+              NULL)));
+
+  g_mutex_lock (&rtmp2sink->lock);
+  rtmp2sink->is_connected = TRUE;
+  g_cond_signal (&rtmp2sink->cond);
+  g_mutex_unlock (&rtmp2sink->lock);
+}
+
+/* Sends connect, releaseStream, FCPublish, createStream and publish
+ * without waiting, so they leave in one write and publishing starts
+ * after one round trip instead of three.  The replies are checked by
+ * rtmp2sink->startup, which falls back to one command at a time. */
+static void
+send_pipelined (GstRtmp2Sink * rtmp2sink)
+{
+  GST_DEBUG_OBJECT (rtmp2sink, "sending pipelined startup commands");
+
+  gst_rtmp_startup_begin (&rtmp2sink->startup);
+  rtmp2sink->stream_id = rtmp2sink->startup.stream_id;
+  send_connect (rtmp2sink, TRUE);
+  send_create_stream (rtmp2sink, TRUE);
+  send_publish (rtmp2sink, 5, NULL);
+}
+
+static void
+pipelined_create_stream (guint32 stream_id, int transaction_id,
+    gpointer user_data)
+{
+  GstRtmp2Sink *rtmp2sink = GST_RTMP2_SINK (user_data);
+
+  gst_rtmp_connection_send_template (rtmp2sink->connection, 3, 0,
+      gst_rtmp_connection_get_command_template
+      (GST_RTMP_COMMAND_TEMPLATE_CREATE_STREAM), transaction_id, NULL, NULL,
+      NULL);
+}
+
+static void
+pipelined_publish (guint32 stream_id, int transaction_id, gpointer user_data)
+{
+  GstRtmp2Sink *rtmp2sink = GST_RTMP2_SINK (user_data);
+
+  rtmp2sink->stream_id = stream_id;
+  send_publish (rtmp2sink, transaction_id, NULL);
+}
+
+static void
+handle_pipelined_reply (GstRtmp2Sink * rtmp2sink, GstRtmpChunk * chunk)
+{
+  char *error;
+
+  switch (gst_rtmp_startup_handle_reply (&rtmp2sink->startup, chunk, &error)) {
+    case GST_RTMP_STARTUP_PENDING:
+      break;
+    case GST_RTMP_STARTUP_STARTED:
+      rtmp2sink->stream_id = rtmp2sink->startup.stream_id;
+      publish_started (rtmp2sink);
+      break;
+    case GST_RTMP_STARTUP_CONNECT_FAILED:
+      GST_ELEMENT_ERROR (rtmp2sink, RESOURCE, OPEN_WRITE,
+          ("Server rejected connect"), ("%s", error));
+      break;
+    case GST_RTMP_STARTUP_FAILED:
+      GST_ELEMENT_ERROR (rtmp2sink, RESOURCE, OPEN_WRITE,
+          ("Could not publish stream"), ("%s", error));
+      break;
+  }
+  g_free (error);
+}
+
 static void
 got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
     gpointer user_data)
@@ -846,6 +1801,11 @@ got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
   if (rtmp2sink->dump) {
     gst_rtmp_dump_chunk (chunk, FALSE, TRUE, TRUE);
   }
+
+  if (rtmp2sink->startup.active &&
+      chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_COMMAND) {
+    handle_pipelined_reply (rtmp2sink, chunk);
+  }
 }
 
 static void
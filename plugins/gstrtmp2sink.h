@@ -23,6 +23,8 @@
 #include <gst/base/gstbasesink.h>
 #include <rtmp/rtmpclient.h>
 #include <rtmp/rtmputils.h>
+#include <rtmp/rtmph264.h>
+#include <rtmp/rtmpstartup.h>
 
 G_BEGIN_DECLS
 
@@ -47,6 +49,20 @@ struct _GstRtmp2Sink
   char *application;
   char *stream;
   char *secure_token;
+  gboolean bitrate_feedback;
+  int feedback_interval;
+  int target_queue_delay;
+  guint64 min_bitrate;
+  gboolean pacing;
+  guint64 pacing_rate;
+  guint pacing_burst;
+  guint max_output_latency;
+  guint data_chunk_stream;
+  guint audio_chunk_stream;
+  guint video_chunk_stream;
+  guint chunk_size;
+  gboolean pipelined_connect;
+  guint pool_size;
 
   /* stuff */
   GMutex lock;
@@ -60,6 +76,35 @@ struct _GstRtmp2Sink
   GstRtmpConnection *connection;
   gboolean is_connected;
   gboolean dump;
+  guint32 stream_id;
+
+  /* pipelined startup, replies are checked in got_chunk */
+  GstRtmpStartup startup;
+  /* monotonic times, for time-to-publish */
+  gint64 start_time;
+  gint64 connected_time;
+
+  /* elementary stream input on request pads */
+  GstPad *video_pad;
+  GstPad *audio_pad;
+  GstSegment video_segment;
+  GstSegment audio_segment;
+  GstBuffer *video_codec_data;
+  GstBuffer *audio_codec_data;
+  gboolean video_header_pending;
+  gboolean audio_header_pending;
+  gboolean video_eos;
+  gboolean audio_eos;
+  /* byte-stream H.264 is converted to AVCC */
+  gboolean video_annexb;
+  GstRtmpH264AccessUnit video_au;
+  GBytes *video_sps;
+  GBytes *video_pps;
+
+  /* bitrate feedback */
+  gint64 feedback_last_time;
+  guint64 feedback_bytes_in;
+  gsize feedback_last_queued;
 
 };
 
@@ -28,6 +28,43 @@
  * ]|
  * FIXME Describe what the pipeline does.
  * </refsect2>
+ *
+ * rtmp2src is a live source.  RTMP timestamps are mapped to the running
+ * time at which messages arrive, following the drift between the
+ * sender's clock and the pipeline clock.  The reported latency is
+ * #GstRtmp2Src:target-latency, or more if messages are measured to be
+ * pushed later than that after their timestamp.
+ *
+ * The FLV header, onMetaData and the sequence header tags are marked as
+ * headers and also put in the streamheader field of the caps, like
+ * flvmux does, so consumers joining later can start right away.
+ *
+ * Messages wait in a queue until the streaming thread pushes them.  The
+ * queue can be limited with #GstRtmp2Src:max-queue-bytes and
+ * #GstRtmp2Src:max-queue-time, in which case the oldest media is dropped.
+ * With #GstRtmp2Src:catch-up, a backlog longer than
+ * #GstRtmp2Src:catch-up-threshold is cut back to the newest keyframe, or
+ * to the newest audio frame in streams without video.
+ * Sequence headers and metadata are never dropped.  Each time something
+ * is dropped, an element message named "GstRtmp2SrcQueueDrop" is posted
+ * with the fields "reason" (string, "overflow" or "catch-up"),
+ * "messages" (uint) and "bytes" (guint64).
+ *
+ * For recording, where nothing should be dropped, set
+ * #GstRtmp2Src:high-watermark instead.  Reading from the socket stops when
+ * that many bytes are queued and resumes once the queue is down to
+ * #GstRtmp2Src:low-watermark, by default half the high watermark, letting
+ * TCP slow the server down.
+ *
+ * With #GstRtmp2Src:elementary-streams set, the FLV always pad stays
+ * unused.  Instead, H.264 and AAC are pushed on "video" and "audio"
+ * sometimes pads that appear once the respective sequence header has
+ * arrived, so no flvdemux is needed.
+ * |[
+ * gst-launch -v rtmp2src elementary-streams=true name=s
+ *     s.video ! queue ! avdec_h264 ! autovideosink
+ *     s.audio ! queue ! faad ! autoaudiosink
+ * ]|
  */
 
 #ifdef HAVE_CONFIG_H
@@ -44,6 +81,19 @@
 GST_DEBUG_CATEGORY_STATIC (gst_rtmp2_src_debug_category);
 #define GST_CAT_DEFAULT gst_rtmp2_src_debug_category
 
+#if GST_CHECK_VERSION(1,14,0)
+#define HAVE_SUBMIT_BUFFER_LIST 1
+#endif
+
+typedef struct
+{
+  GstRtmpChunk *chunk;
+  /* clock time when the message arrived, or NONE */
+  GstClockTime arrival;
+  /* running time, set when popped */
+  GstClockTime timestamp;
+} GstRtmp2SrcQueueItem;
+
 /* prototypes */
 
 /* GObject virtual functions */
@@ -84,26 +134,75 @@ static gboolean gst_rtmp2_src_uri_set_uri (GstURIHandler * handler,
 
 /* Internal API */
 static void gst_rtmp2_src_task (gpointer user_data);
+static void create_command_templates (void);
 static void got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
     gpointer user_data);
+static void connection_closed (GstRtmpConnection * connection,
+    gpointer user_data);
 static void connect_done (GObject * source, GAsyncResult * result,
     gpointer user_data);
-static void send_connect (GstRtmp2Src * src);
+static void send_connect (GstRtmp2Src * src, gboolean pipelined);
 static void cmd_connect_done (GstRtmpConnection * connection,
     GstRtmpChunk * chunk, const char *command_name, int transaction_id,
     GstAmfNode * command_object, GstAmfNode * optional_args,
     gpointer user_data);
-static void send_create_stream (GstRtmp2Src * src);
+static void send_create_stream (GstRtmp2Src * src, int transaction_id,
+    GstRtmpCommandCallback callback);
 static void create_stream_done (GstRtmpConnection * connection,
     GstRtmpChunk * chunk, const char *command_name, int transaction_id,
     GstAmfNode * command_object, GstAmfNode * optional_args,
     gpointer user_data);
-static void send_play (GstRtmp2Src * src);
+static void send_play (GstRtmp2Src * src, int transaction_id,
+    GstRtmpCommandCallback callback);
 static void play_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
     const char *command_name, int transaction_id, GstAmfNode * command_object,
     GstAmfNode * optional_args, gpointer user_data);
 static void send_secure_token_response (GstRtmp2Src * rtmp2src,
     const char *challenge);
+static void send_pipelined (GstRtmp2Src * rtmp2src);
+static void pipelined_create_stream (guint32 stream_id, int transaction_id,
+    gpointer user_data);
+static void pipelined_play (guint32 stream_id, int transaction_id,
+    gpointer user_data);
+static void handle_pipelined_reply (GstRtmp2Src * rtmp2src,
+    GstRtmpChunk * chunk);
+static GstFlowReturn gst_rtmp2_src_pop_batch (GstRtmp2Src * rtmp2src,
+    GQueue * batch, guint max);
+static void gst_rtmp2_src_free_item (GstRtmp2SrcQueueItem * item);
+static GstBuffer *gst_rtmp2_src_make_flv_tag (GstRtmp2Src * rtmp2src,
+    GstRtmpChunk * chunk, GstClockTime timestamp);
+static void gst_rtmp2_src_set_header (GstRtmp2Src * rtmp2src,
+    GstBuffer ** header, GstBuffer * buffer);
+static void gst_rtmp2_src_clear_headers (GstRtmp2Src * rtmp2src);
+static GstClockTime gst_rtmp2_src_map_timestamp (GstRtmp2Src * rtmp2src,
+    guint32 timestamp, GstClockTime arrival);
+static void gst_rtmp2_src_flush_queue (GstRtmp2Src * rtmp2src);
+static void gst_rtmp2_src_limit_queue (GstRtmp2Src * rtmp2src,
+    const char **reason, guint * messages, guint64 * bytes);
+static gboolean chunk_is_droppable (GstRtmpChunk * chunk);
+static gboolean chunk_is_keyframe (GstRtmpChunk * chunk);
+static gboolean chunk_is_header (GstRtmpChunk * chunk);
+static void drop_link (GstRtmp2Src * rtmp2src, GList * link,
+    guint * messages, guint64 * bytes);
+static guint32 queue_duration_from (GstRtmp2Src * rtmp2src, GList * link);
+static gboolean gst_rtmp2_src_query_latency (GstRtmp2Src * rtmp2src,
+    GstQuery * query);
+static gboolean gst_rtmp2_src_es_query (GstPad * pad, GstObject * parent,
+    GstQuery * query);
+static GstFlowReturn gst_rtmp2_src_create_es (GstRtmp2Src * rtmp2src);
+static GstFlowReturn gst_rtmp2_src_handle_es (GstRtmp2Src * rtmp2src,
+    GstRtmpChunk * chunk, GstClockTime dts, GstBufferList ** lists);
+static GstFlowReturn gst_rtmp2_src_push_es_list (GstRtmp2Src * rtmp2src,
+    gboolean is_video, GstBufferList ** lists);
+static void gst_rtmp2_src_set_codec_data (GstRtmp2Src * rtmp2src,
+    gboolean is_video, const guint8 * data, gsize size);
+static void gst_rtmp2_src_remove_es_pads (GstRtmp2Src * rtmp2src);
+static void gst_rtmp2_src_handle_es_metadata (GstRtmp2Src * rtmp2src,
+    GstRtmpChunk * chunk);
+static void gst_rtmp2_src_check_no_more_pads (GstRtmp2Src * rtmp2src,
+    GstRtmpChunk * chunk, GstClockTime timestamp);
+static GstPadProbeReturn gst_rtmp2_src_forward_es_event (GstPad * pad,
+    GstPadProbeInfo * info, gpointer user_data);
 
 static gchar *gst_rtmp2_src_get_uri (GstRtmp2Src * src);
 static gboolean gst_rtmp2_src_set_uri (GstRtmp2Src * src, const char *uri);
@@ -117,7 +216,18 @@ enum
   PROP_PORT,
   PROP_APPLICATION,
   PROP_STREAM,
-  PROP_SECURE_TOKEN
+  PROP_SECURE_TOKEN,
+  PROP_ELEMENTARY_STREAMS,
+  PROP_TARGET_LATENCY,
+  PROP_MAX_QUEUE_BYTES,
+  PROP_MAX_QUEUE_TIME,
+  PROP_CATCH_UP,
+  PROP_CATCH_UP_THRESHOLD,
+  PROP_HIGH_WATERMARK,
+  PROP_LOW_WATERMARK,
+  PROP_MAX_BATCH,
+  PROP_FAST_START,
+  PROP_POOL_SIZE
 };
 
 #define DEFAULT_LOCATION "rtmp://localhost/live/myStream"
@@ -127,6 +237,28 @@ enum
 #define DEFAULT_APPLICATION "live"
 #define DEFAULT_STREAM "myStream"
 #define DEFAULT_SECURE_TOKEN ""
+#define DEFAULT_ELEMENTARY_STREAMS FALSE
+#define DEFAULT_TARGET_LATENCY 200
+#define DEFAULT_MAX_QUEUE_BYTES 0
+#define DEFAULT_MAX_QUEUE_TIME 0
+#define DEFAULT_CATCH_UP FALSE
+#define DEFAULT_CATCH_UP_THRESHOLD 1000
+#define DEFAULT_HIGH_WATERMARK 0
+#define DEFAULT_LOW_WATERMARK 0
+#define DEFAULT_MAX_BATCH 64
+#define DEFAULT_FAST_START FALSE
+#define DEFAULT_POOL_SIZE 0
+
+static const char *const play_codes[] = {
+  "NetStream.Play.Start", "NetStream.Play.Reset", NULL
+};
+
+/* timestamp jumps larger than this restart the clock mapping */
+#define MAX_SKEW (GST_SECOND)
+
+/* without onMetaData, give up waiting for the other elementary stream
+ * after this much media */
+#define NO_MORE_PADS_THRESHOLD (6 * GST_SECOND)
 
 /* pad templates */
 
@@ -137,6 +269,22 @@ GST_STATIC_PAD_TEMPLATE ("src",
     GST_STATIC_CAPS ("video/x-flv")
     );
 
+static GstStaticPadTemplate gst_rtmp2_src_video_template =
+GST_STATIC_PAD_TEMPLATE ("video",
+    GST_PAD_SRC,
+    GST_PAD_SOMETIMES,
+    GST_STATIC_CAPS ("video/x-h264, stream-format=(string)avc, "
+        "alignment=(string)au")
+    );
+
+static GstStaticPadTemplate gst_rtmp2_src_audio_template =
+GST_STATIC_PAD_TEMPLATE ("audio",
+    GST_PAD_SRC,
+    GST_PAD_SOMETIMES,
+    GST_STATIC_CAPS ("audio/mpeg, mpegversion=(int)4, "
+        "stream-format=(string)raw, framed=(boolean)true")
+    );
+
 
 /* class initialization */
 
@@ -160,11 +308,17 @@ G_DEFINE_TYPE_WITH_CODE (GstRtmp2Src, gst_rtmp2_src, GST_TYPE_PUSH_SRC,
      base_class_init if you intend to subclass this class. */
   gst_element_class_add_pad_template (GST_ELEMENT_CLASS (klass),
       gst_static_pad_template_get (&gst_rtmp2_src_src_template));
+  gst_element_class_add_pad_template (GST_ELEMENT_CLASS (klass),
+      gst_static_pad_template_get (&gst_rtmp2_src_video_template));
+  gst_element_class_add_pad_template (GST_ELEMENT_CLASS (klass),
+      gst_static_pad_template_get (&gst_rtmp2_src_audio_template));
 
   gst_element_class_set_static_metadata (GST_ELEMENT_CLASS (klass),
       "RTMP source element", "Source", "Source element for RTMP streams",
       "David Schleef <ds@schleef.org>");
 
+  create_command_templates ();
+
   gobject_class->set_property = gst_rtmp2_src_set_property;
   gobject_class->get_property = gst_rtmp2_src_get_property;
   gobject_class->dispose = gst_rtmp2_src_dispose;
@@ -179,8 +333,7 @@ G_DEFINE_TYPE_WITH_CODE (GstRtmp2Src, gst_rtmp2_src, GST_TYPE_PUSH_SRC,
   base_src_class->do_seek = GST_DEBUG_FUNCPTR (gst_rtmp2_src_do_seek);
   base_src_class->unlock = GST_DEBUG_FUNCPTR (gst_rtmp2_src_unlock);
   base_src_class->unlock_stop = GST_DEBUG_FUNCPTR (gst_rtmp2_src_unlock_stop);
-  if (0)
-    base_src_class->query = GST_DEBUG_FUNCPTR (gst_rtmp2_src_query);
+  base_src_class->query = GST_DEBUG_FUNCPTR (gst_rtmp2_src_query);
   base_src_class->event = GST_DEBUG_FUNCPTR (gst_rtmp2_src_event);
   base_src_class->create = GST_DEBUG_FUNCPTR (gst_rtmp2_src_create);
   base_src_class->alloc = GST_DEBUG_FUNCPTR (gst_rtmp2_src_alloc);
@@ -209,6 +362,61 @@ G_DEFINE_TYPE_WITH_CODE (GstRtmp2Src, gst_rtmp2_src, GST_TYPE_PUSH_SRC,
       g_param_spec_string ("secure-token", "Secure token",
           "Secure token used for authentication",
           DEFAULT_SECURE_TOKEN, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_ELEMENTARY_STREAMS,
+      g_param_spec_boolean ("elementary-streams", "Elementary streams",
+          "Output H.264 and AAC on sometimes pads instead of FLV",
+          DEFAULT_ELEMENTARY_STREAMS,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_TARGET_LATENCY,
+      g_param_spec_uint ("target-latency", "Target latency",
+          "Minimum latency to report, in ms", 0, G_MAXUINT,
+          DEFAULT_TARGET_LATENCY, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MAX_QUEUE_BYTES,
+      g_param_spec_uint ("max-queue-bytes", "Max queue bytes",
+          "Drop the oldest media when more bytes are queued (0 = unlimited)",
+          0, G_MAXUINT, DEFAULT_MAX_QUEUE_BYTES,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MAX_QUEUE_TIME,
+      g_param_spec_uint ("max-queue-time", "Max queue time",
+          "Drop the oldest media when more is queued, in ms (0 = unlimited)",
+          0, G_MAXUINT, DEFAULT_MAX_QUEUE_TIME,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_CATCH_UP,
+      g_param_spec_boolean ("catch-up", "Catch up",
+          "Skip to the newest keyframe when falling behind",
+          DEFAULT_CATCH_UP, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_CATCH_UP_THRESHOLD,
+      g_param_spec_uint ("catch-up-threshold", "Catch up threshold",
+          "Queued duration that triggers catching up, in ms",
+          0, G_MAXUINT, DEFAULT_CATCH_UP_THRESHOLD,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_HIGH_WATERMARK,
+      g_param_spec_uint ("high-watermark", "High watermark",
+          "Stop reading from the server when this many bytes are queued "
+          "(0 = never)", 0, G_MAXUINT, DEFAULT_HIGH_WATERMARK,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_LOW_WATERMARK,
+      g_param_spec_uint ("low-watermark", "Low watermark",
+          "Resume reading when no more than this many bytes are queued "
+          "(0 = half the high watermark)",
+          0, G_MAXUINT, DEFAULT_LOW_WATERMARK,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_MAX_BATCH,
+      g_param_spec_uint ("max-batch", "Max batch",
+          "Maximum number of queued messages pushed as one buffer list",
+          1, G_MAXUINT, DEFAULT_MAX_BATCH,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_FAST_START,
+      g_param_spec_boolean ("fast-start", "Fast start",
+          "Send connect, createStream and play without waiting for the "
+          "replies, assuming stream id 1.  Not done with a secure-token",
+          DEFAULT_FAST_START,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_POOL_SIZE,
+      g_param_spec_uint ("pool-size", "Pool size",
+          "Number of handshaken connections to keep ready for this server, "
+          "shared by all elements in the process (0 = no pool)", 0, 64,
+          DEFAULT_POOL_SIZE, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
 }
 
@@ -218,16 +426,38 @@ gst_rtmp2_src_init (GstRtmp2Src * rtmp2src)
   g_mutex_init (&rtmp2src->lock);
   g_cond_init (&rtmp2src->cond);
   rtmp2src->queue = g_queue_new ();
+  g_queue_init (&rtmp2src->batch);
+
+  gst_base_src_set_live (GST_BASE_SRC (rtmp2src), TRUE);
+  gst_base_src_set_format (GST_BASE_SRC (rtmp2src), GST_FORMAT_TIME);
 
-  //gst_base_src_set_live (GST_BASE_SRC(rtmp2src), TRUE);
+  /* the base class only ever pushes events on the always pad */
+  rtmp2src->flow_combiner = gst_flow_combiner_new ();
+  gst_pad_add_probe (GST_BASE_SRC_PAD (rtmp2src),
+      GST_PAD_PROBE_TYPE_EVENT_DOWNSTREAM | GST_PAD_PROBE_TYPE_EVENT_FLUSH,
+      gst_rtmp2_src_forward_es_event, rtmp2src, NULL);
 
   rtmp2src->timeout = DEFAULT_TIMEOUT;
   gst_rtmp2_src_set_uri (rtmp2src, DEFAULT_LOCATION);
   rtmp2src->secure_token = g_strdup (DEFAULT_SECURE_TOKEN);
+  rtmp2src->elementary_streams = DEFAULT_ELEMENTARY_STREAMS;
+  rtmp2src->target_latency = DEFAULT_TARGET_LATENCY;
+  rtmp2src->max_queue_bytes = DEFAULT_MAX_QUEUE_BYTES;
+  rtmp2src->max_queue_time = DEFAULT_MAX_QUEUE_TIME;
+  rtmp2src->catch_up = DEFAULT_CATCH_UP;
+  rtmp2src->catch_up_threshold = DEFAULT_CATCH_UP_THRESHOLD;
+  rtmp2src->high_watermark = DEFAULT_HIGH_WATERMARK;
+  rtmp2src->low_watermark = DEFAULT_LOW_WATERMARK;
+  rtmp2src->max_batch = DEFAULT_MAX_BATCH;
+  rtmp2src->fast_start = DEFAULT_FAST_START;
+  rtmp2src->pool_size = DEFAULT_POOL_SIZE;
 
   rtmp2src->task = gst_task_new (gst_rtmp2_src_task, rtmp2src, NULL);
   g_rec_mutex_init (&rtmp2src->task_lock);
   gst_task_set_lock (rtmp2src->task, &rtmp2src->task_lock);
+  /* createStream and play are transactions 2 and 3 */
+  gst_rtmp_startup_init (&rtmp2src->startup, "play", 2, 3, play_codes,
+      pipelined_create_stream, pipelined_play, rtmp2src);
   rtmp2src->client = gst_rtmp_client_new ();
   g_object_set (rtmp2src->client, "timeout", rtmp2src->timeout, NULL);
 
@@ -275,6 +505,55 @@ gst_rtmp2_src_set_property (GObject * object, guint property_id,
       g_free (rtmp2src->secure_token);
       rtmp2src->secure_token = g_value_dup_string (value);
       break;
+    case PROP_ELEMENTARY_STREAMS:
+      rtmp2src->elementary_streams = g_value_get_boolean (value);
+      break;
+    case PROP_TARGET_LATENCY:
+      GST_OBJECT_LOCK (rtmp2src);
+      rtmp2src->target_latency = g_value_get_uint (value);
+      GST_OBJECT_UNLOCK (rtmp2src);
+      gst_element_post_message (GST_ELEMENT (rtmp2src),
+          gst_message_new_latency (GST_OBJECT (rtmp2src)));
+      break;
+    case PROP_MAX_QUEUE_BYTES:
+      g_mutex_lock (&rtmp2src->lock);
+      rtmp2src->max_queue_bytes = g_value_get_uint (value);
+      g_mutex_unlock (&rtmp2src->lock);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      g_mutex_lock (&rtmp2src->lock);
+      rtmp2src->max_queue_time = g_value_get_uint (value);
+      g_mutex_unlock (&rtmp2src->lock);
+      break;
+    case PROP_CATCH_UP:
+      g_mutex_lock (&rtmp2src->lock);
+      rtmp2src->catch_up = g_value_get_boolean (value);
+      g_mutex_unlock (&rtmp2src->lock);
+      break;
+    case PROP_CATCH_UP_THRESHOLD:
+      g_mutex_lock (&rtmp2src->lock);
+      rtmp2src->catch_up_threshold = g_value_get_uint (value);
+      g_mutex_unlock (&rtmp2src->lock);
+      break;
+    case PROP_HIGH_WATERMARK:
+      g_mutex_lock (&rtmp2src->lock);
+      rtmp2src->high_watermark = g_value_get_uint (value);
+      g_mutex_unlock (&rtmp2src->lock);
+      break;
+    case PROP_LOW_WATERMARK:
+      g_mutex_lock (&rtmp2src->lock);
+      rtmp2src->low_watermark = g_value_get_uint (value);
+      g_mutex_unlock (&rtmp2src->lock);
+      break;
+    case PROP_MAX_BATCH:
+      rtmp2src->max_batch = g_value_get_uint (value);
+      break;
+    case PROP_FAST_START:
+      rtmp2src->fast_start = g_value_get_boolean (value);
+      break;
+    case PROP_POOL_SIZE:
+      rtmp2src->pool_size = g_value_get_uint (value);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -308,6 +587,39 @@ gst_rtmp2_src_get_property (GObject * object, guint property_id,
     case PROP_SECURE_TOKEN:
       g_value_set_string (value, rtmp2src->secure_token);
       break;
+    case PROP_ELEMENTARY_STREAMS:
+      g_value_set_boolean (value, rtmp2src->elementary_streams);
+      break;
+    case PROP_TARGET_LATENCY:
+      g_value_set_uint (value, rtmp2src->target_latency);
+      break;
+    case PROP_MAX_QUEUE_BYTES:
+      g_value_set_uint (value, rtmp2src->max_queue_bytes);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      g_value_set_uint (value, rtmp2src->max_queue_time);
+      break;
+    case PROP_CATCH_UP:
+      g_value_set_boolean (value, rtmp2src->catch_up);
+      break;
+    case PROP_CATCH_UP_THRESHOLD:
+      g_value_set_uint (value, rtmp2src->catch_up_threshold);
+      break;
+    case PROP_HIGH_WATERMARK:
+      g_value_set_uint (value, rtmp2src->high_watermark);
+      break;
+    case PROP_LOW_WATERMARK:
+      g_value_set_uint (value, rtmp2src->low_watermark);
+      break;
+    case PROP_MAX_BATCH:
+      g_value_set_uint (value, rtmp2src->max_batch);
+      break;
+    case PROP_FAST_START:
+      g_value_set_boolean (value, rtmp2src->fast_start);
+      break;
+    case PROP_POOL_SIZE:
+      g_value_set_uint (value, rtmp2src->pool_size);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -330,6 +642,7 @@ void
 gst_rtmp2_src_finalize (GObject * object)
 {
   GstRtmp2Src *rtmp2src = GST_RTMP2_SRC (object);
+  GstRtmp2SrcQueueItem *item;
 
   GST_DEBUG_OBJECT (rtmp2src, "finalize");
 
@@ -342,9 +655,13 @@ gst_rtmp2_src_finalize (GObject * object)
   g_object_unref (rtmp2src->task);
   g_rec_mutex_clear (&rtmp2src->task_lock);
   g_object_unref (rtmp2src->client);
+  gst_flow_combiner_free (rtmp2src->flow_combiner);
+  gst_rtmp_startup_clear (&rtmp2src->startup);
   g_mutex_clear (&rtmp2src->lock);
   g_cond_clear (&rtmp2src->cond);
-  g_queue_free_full (rtmp2src->queue, g_object_unref);
+  g_queue_free_full (rtmp2src->queue, (GDestroyNotify) gst_rtmp2_src_free_item);
+  while ((item = g_queue_pop_head (&rtmp2src->batch)))
+    gst_rtmp2_src_free_item (item);
 
   G_OBJECT_CLASS (gst_rtmp2_src_parent_class)->finalize (object);
 }
@@ -358,6 +675,17 @@ gst_rtmp2_src_start (GstBaseSrc * src)
   GST_DEBUG_OBJECT (rtmp2src, "start");
 
   rtmp2src->sent_header = FALSE;
+  gst_rtmp2_src_clear_headers (rtmp2src);
+  gst_rtmp2_src_flush_queue (rtmp2src);
+  rtmp2src->have_mapping = FALSE;
+  rtmp2src->lateness = 0;
+  rtmp2src->reported_latency = 0;
+  rtmp2src->group_id = gst_util_group_id_next ();
+  rtmp2src->have_metadata = FALSE;
+  rtmp2src->first_es_timestamp = GST_CLOCK_TIME_NONE;
+  rtmp2src->signalled_no_more_pads = FALSE;
+  rtmp2src->stream_id = 1;
+  gst_rtmp_startup_reset (&rtmp2src->startup);
 
   gst_task_start (rtmp2src->task);
 
@@ -373,8 +701,11 @@ gst_rtmp2_src_task (gpointer user_data)
 
   GST_DEBUG ("gst_rtmp2_src_task starting");
 
+  rtmp2src->start_time = g_get_monotonic_time ();
   gst_rtmp_client_set_server_address (rtmp2src->client,
       rtmp2src->server_address);
+  gst_rtmp_client_set_server_port (rtmp2src->client, rtmp2src->port);
+  gst_rtmp_client_set_pool_size (rtmp2src->client, rtmp2src->pool_size);
   gst_rtmp_client_connect_async (rtmp2src->client, NULL, connect_done,
       rtmp2src);
 
@@ -411,10 +742,33 @@ connect_done (GObject * source, GAsyncResult * result, gpointer user_data)
   }
 
   rtmp2src->connection = gst_rtmp_client_get_connection (rtmp2src->client);
-  g_signal_connect (rtmp2src->connection, "got-chunk", G_CALLBACK (got_chunk),
-      rtmp2src);
+  gst_rtmp_connection_add_message_handler (rtmp2src->connection,
+      GST_RTMP_MESSAGE_MASK_ALL, got_chunk, rtmp2src, NULL);
+  g_signal_connect (rtmp2src->connection, "closed",
+      G_CALLBACK (connection_closed), rtmp2src);
+
+  /* the secureToken response has to reach the server before createStream
+   * and play, so it can't be pipelined */
+  if (rtmp2src->fast_start && (rtmp2src->secure_token == NULL ||
+          !rtmp2src->secure_token[0])) {
+    send_pipelined (rtmp2src);
+  } else {
+    send_connect (rtmp2src, FALSE);
+  }
+}
+
+/* The stream ends when the server goes away */
+static void
+connection_closed (GstRtmpConnection * connection, gpointer user_data)
+{
+  GstRtmp2Src *rtmp2src = GST_RTMP2_SRC (user_data);
 
-  send_connect (rtmp2src);
+  GST_DEBUG_OBJECT (rtmp2src, "connection closed");
+
+  g_mutex_lock (&rtmp2src->lock);
+  rtmp2src->eos = TRUE;
+  g_cond_signal (&rtmp2src->cond);
+  g_mutex_unlock (&rtmp2src->lock);
 }
 
 static void
@@ -427,38 +781,299 @@ got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
     gst_rtmp_dump_chunk (chunk, FALSE, TRUE, TRUE);
   }
 
+  if (rtmp2src->startup.active &&
+      chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_COMMAND) {
+    handle_pipelined_reply (rtmp2src, chunk);
+  }
+
   if (chunk->stream_id != 0 &&
       (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO ||
-          (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_DATA
-              && chunk->message_length > 100))) {
-    g_object_ref (chunk);
+          chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_AUDIO ||
+          (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_DATA &&
+              (chunk_is_header (chunk) ||
+                  (!rtmp2src->elementary_streams &&
+                      chunk->message_length > 100))))) {
+    GstRtmp2SrcQueueItem *item;
+    GstClock *clock;
+    const char *reason = NULL;
+    guint messages = 0;
+    guint64 bytes = 0;
+
+    item = g_slice_new (GstRtmp2SrcQueueItem);
+    item->chunk = g_object_ref (chunk);
+    item->arrival = GST_CLOCK_TIME_NONE;
+    clock = gst_element_get_clock (GST_ELEMENT (rtmp2src));
+    if (clock) {
+      item->arrival = gst_clock_get_time (clock);
+      gst_object_unref (clock);
+    }
+
     g_mutex_lock (&rtmp2src->lock);
-    g_queue_push_tail (rtmp2src->queue, chunk);
+    g_queue_push_tail (rtmp2src->queue, item);
+    rtmp2src->queue_bytes += chunk->message_length;
+    gst_rtmp2_src_limit_queue (rtmp2src, &reason, &messages, &bytes);
+    if (rtmp2src->high_watermark && !rtmp2src->input_paused &&
+        rtmp2src->queue_bytes >= rtmp2src->high_watermark) {
+      GST_DEBUG_OBJECT (rtmp2src, "queue above high watermark, pausing input");
+      rtmp2src->input_paused = TRUE;
+      gst_rtmp_connection_pause_input (connection);
+    }
     g_cond_signal (&rtmp2src->cond);
     g_mutex_unlock (&rtmp2src->lock);
+
+    if (messages > 0) {
+      GST_DEBUG_OBJECT (rtmp2src, "%s: dropped %u messages, %"
+          G_GUINT64_FORMAT " bytes", reason, messages, bytes);
+      gst_element_post_message (GST_ELEMENT (rtmp2src),
+          gst_message_new_element (GST_OBJECT (rtmp2src),
+              gst_structure_new ("GstRtmp2SrcQueueDrop",
+                  "reason", G_TYPE_STRING, reason,
+                  "messages", G_TYPE_UINT, messages,
+                  "bytes", G_TYPE_UINT64, bytes, NULL)));
+    }
   }
 }
 
+/* Media frames, as opposed to sequence headers and metadata */
+static gboolean
+chunk_is_droppable (GstRtmpChunk * chunk)
+{
+  const guint8 *data;
+  gsize size;
+
+  data = g_bytes_get_data (chunk->payload, &size);
+  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+    return !(size >= 2 && (data[0] & 0x0f) == 7 && data[1] != 1);
+  } else if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_AUDIO) {
+    return !(size >= 2 && (data[0] >> 4) == 10 && data[1] == 0);
+  }
+  return FALSE;
+}
+
+static gboolean
+chunk_is_keyframe (GstRtmpChunk * chunk)
+{
+  const guint8 *data;
+  gsize size;
+
+  if (chunk->message_type_id != GST_RTMP_MESSAGE_TYPE_VIDEO ||
+      !chunk_is_droppable (chunk))
+    return FALSE;
+
+  data = g_bytes_get_data (chunk->payload, &size);
+  return size >= 1 && (data[0] >> 4) == 1;
+}
+
+/* Sequence headers and metadata, which go into the streamheader */
+static gboolean
+chunk_is_header (GstRtmpChunk * chunk)
+{
+  const guint8 *data;
+  gsize size;
+
+  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_DATA) {
+    /* AMF0 string "onMetaData" */
+    data = g_bytes_get_data (chunk->payload, &size);
+    return size >= 13 && data[0] == GST_AMF_TYPE_STRING &&
+        GST_READ_UINT16_BE (data + 1) == 10 &&
+        memcmp (data + 3, "onMetaData", 10) == 0;
+  }
+
+  return !chunk_is_droppable (chunk);
+}
+
 static void
-send_connect (GstRtmp2Src * rtmp2src)
+drop_link (GstRtmp2Src * rtmp2src, GList * link, guint * messages,
+    guint64 * bytes)
+{
+  GstRtmp2SrcQueueItem *item = link->data;
+
+  if (link == rtmp2src->last_keyframe)
+    rtmp2src->last_keyframe = NULL;
+  *messages += 1;
+  *bytes += item->chunk->message_length;
+  rtmp2src->queue_bytes -= item->chunk->message_length;
+  gst_rtmp2_src_free_item (item);
+  g_queue_delete_link (rtmp2src->queue, link);
+}
+
+/* RTMP timestamp span from @link to the newest message, in ms */
+static guint32
+queue_duration_from (GstRtmp2Src * rtmp2src, GList * link)
+{
+  GstRtmp2SrcQueueItem *first = link->data;
+  GstRtmp2SrcQueueItem *last = g_queue_peek_tail (rtmp2src->queue);
+  gint32 duration;
+
+  duration = last->chunk->timestamp - first->chunk->timestamp;
+  return MAX (duration, 0);
+}
+
+/* The oldest queued media frame, skipping sequence headers and metadata,
+ * which keep their old timestamps */
+static GList *
+first_droppable (GstRtmp2Src * rtmp2src)
 {
-  GstAmfNode *node;
+  GList *link;
+
+  for (link = rtmp2src->queue->head; link; link = link->next) {
+    if (chunk_is_droppable (((GstRtmp2SrcQueueItem *) link->data)->chunk))
+      return link;
+  }
+  return NULL;
+}
+
+static guint
+low_watermark (GstRtmp2Src * rtmp2src)
+{
+  if (rtmp2src->low_watermark == 0)
+    return rtmp2src->high_watermark / 2;
+  return rtmp2src->low_watermark;
+}
+
+/* Drops everything queued, for start and stop */
+static void
+gst_rtmp2_src_flush_queue (GstRtmp2Src * rtmp2src)
+{
+  GstRtmp2SrcQueueItem *item;
+
+  g_mutex_lock (&rtmp2src->lock);
+  while ((item = g_queue_pop_head (rtmp2src->queue)))
+    gst_rtmp2_src_free_item (item);
+  while ((item = g_queue_pop_head (&rtmp2src->batch)))
+    gst_rtmp2_src_free_item (item);
+  rtmp2src->queue_bytes = 0;
+  rtmp2src->last_keyframe = NULL;
+  rtmp2src->have_video = FALSE;
+  rtmp2src->drop_video = FALSE;
+  rtmp2src->input_paused = FALSE;
+  rtmp2src->eos = FALSE;
+  g_mutex_unlock (&rtmp2src->lock);
+}
+
+/* Called with the lock held, after a message was queued */
+static void
+gst_rtmp2_src_limit_queue (GstRtmp2Src * rtmp2src, const char **reason,
+    guint * messages, guint64 * bytes)
+{
+  GQueue *queue = rtmp2src->queue;
+  GstRtmp2SrcQueueItem *newest = g_queue_peek_tail (queue);
+  GList *link;
+  GList *next;
+
+  /* a stream without video catches up to its newest audio frame */
+  if (newest->chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+    rtmp2src->have_video = TRUE;
+  }
+  if (chunk_is_keyframe (newest->chunk) || (!rtmp2src->have_video &&
+          chunk_is_droppable (newest->chunk))) {
+    rtmp2src->last_keyframe = queue->tail;
+  }
+
+  if (rtmp2src->drop_video &&
+      newest->chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO &&
+      chunk_is_droppable (newest->chunk)) {
+    if (chunk_is_keyframe (newest->chunk)) {
+      rtmp2src->drop_video = FALSE;
+    } else {
+      *reason = "overflow";
+      drop_link (rtmp2src, queue->tail, messages, bytes);
+      return;
+    }
+  }
+
+  if (rtmp2src->catch_up && rtmp2src->last_keyframe &&
+      (link = first_droppable (rtmp2src)) != rtmp2src->last_keyframe &&
+      queue_duration_from (rtmp2src, link) > rtmp2src->catch_up_threshold) {
+    GList *keyframe = rtmp2src->last_keyframe;
+
+    for (link = queue->head; link != keyframe; link = next) {
+      next = link->next;
+      if (chunk_is_droppable (((GstRtmp2SrcQueueItem *) link->data)->chunk)) {
+        *reason = "catch-up";
+        drop_link (rtmp2src, link, messages, bytes);
+      }
+    }
+    rtmp2src->drop_video = FALSE;
+  }
+
+  for (link = queue->head; link; link = next) {
+    GstRtmpChunk *chunk = ((GstRtmp2SrcQueueItem *) link->data)->chunk;
+
+    if (!((rtmp2src->max_queue_bytes &&
+                rtmp2src->queue_bytes > rtmp2src->max_queue_bytes) ||
+            (rtmp2src->max_queue_time &&
+                queue_duration_from (rtmp2src, link) >
+                rtmp2src->max_queue_time))) {
+      break;
+    }
+
+    next = link->next;
+    if (chunk_is_droppable (chunk)) {
+      if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+        rtmp2src->drop_video = TRUE;
+      }
+      *reason = "overflow";
+      drop_link (rtmp2src, link, messages, bytes);
+    }
+  }
+
+  /* the rest of the GOP can't be decoded either */
+  if (rtmp2src->drop_video) {
+    for (link = queue->head; link; link = next) {
+      GstRtmpChunk *chunk = ((GstRtmp2SrcQueueItem *) link->data)->chunk;
+
+      next = link->next;
+      if (chunk->message_type_id != GST_RTMP_MESSAGE_TYPE_VIDEO ||
+          !chunk_is_droppable (chunk)) {
+        continue;
+      }
+      if (chunk_is_keyframe (chunk)) {
+        rtmp2src->drop_video = FALSE;
+        break;
+      }
+      drop_link (rtmp2src, link, messages, bytes);
+    }
+  }
+}
+
+/* Like the shared templates in rtmpconnection.c, the slots are the
+ * strings left NULL, and the template lives as long as the process. */
+static GstAmfTemplate *play_template;
+
+static void
+create_command_templates (void)
+{
+  GstAmfNode *args[3];
+
+  /* stream */
+  args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+  args[1] = gst_amf_node_new (GST_AMF_TYPE_STRING);
+  args[2] = gst_amf_node_new (GST_AMF_TYPE_NUMBER);
+  gst_amf_node_set_number (args[2], 0);
+  play_template = gst_amf_template_new ("play", 3, args);
+
+  gst_amf_node_free (args[0]);
+  gst_amf_node_free (args[1]);
+  gst_amf_node_free (args[2]);
+}
+
+/* In fast start mode no callbacks are registered, the replies are
+ * picked up by handle_pipelined_reply() */
+static void
+send_connect (GstRtmp2Src * rtmp2src, gboolean pipelined)
+{
+  const char *strings[2];
   gchar *uri;
 
-  node = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
-  gst_amf_object_set_string (node, "app", rtmp2src->application);
-  gst_amf_object_set_string (node, "type", "nonprivate");
   uri = gst_rtmp2_src_get_uri (rtmp2src);
-  gst_amf_object_set_string (node, "tcUrl", uri);
+  strings[0] = rtmp2src->application;
+  strings[1] = uri;
+  gst_rtmp_connection_send_template (rtmp2src->connection, 3, 0,
+      gst_rtmp_connection_get_command_template
+      (GST_RTMP_COMMAND_TEMPLATE_CONNECT), 1, strings,
+      pipelined ? NULL : cmd_connect_done, rtmp2src);
   g_free (uri);
-  // "fpad": False,
-  // "capabilities": 15,
-  // "audioCodecs": 3191,
-  // "videoCodecs": 252,
-  // "videoFunction": 1,
-  gst_rtmp_connection_send_command (rtmp2src->connection, 3, "connect", 1, node,
-      NULL, cmd_connect_done, rtmp2src);
-  gst_amf_node_free (node);
 }
 
 static void
@@ -472,7 +1087,7 @@ cmd_connect_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
   ret = FALSE;
   if (optional_args) {
     const GstAmfNode *n;
-    n = gst_amf_node_get_object (optional_args, "code");
+    n = gst_amf_node_get_object_by_key (optional_args, GST_AMF_KEY_CODE);
     if (n) {
       const char *s;
       s = gst_amf_node_get_string (n);
@@ -487,7 +1102,8 @@ cmd_connect_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
 
     GST_DEBUG ("success");
 
-    n = gst_amf_node_get_object (optional_args, "secureToken");
+    n = gst_amf_node_get_object_by_key (optional_args,
+        GST_AMF_KEY_SECURE_TOKEN);
     if (n) {
       const gchar *challenge;
       challenge = gst_amf_node_get_string (n);
@@ -495,22 +1111,20 @@ cmd_connect_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
       send_secure_token_response (rtmp2src, challenge);
     }
 
-    send_create_stream (rtmp2src);
+    send_create_stream (rtmp2src, 2, create_stream_done);
   } else {
     GST_ERROR ("connect error");
   }
 }
 
 static void
-send_create_stream (GstRtmp2Src * rtmp2src)
+send_create_stream (GstRtmp2Src * rtmp2src, int transaction_id,
+    GstRtmpCommandCallback callback)
 {
-  GstAmfNode *node;
-
-  node = gst_amf_node_new (GST_AMF_TYPE_NULL);
-  gst_rtmp_connection_send_command (rtmp2src->connection, 3, "createStream", 2,
-      node, NULL, create_stream_done, rtmp2src);
-  gst_amf_node_free (node);
-
+  gst_rtmp_connection_send_template (rtmp2src->connection, 3, 0,
+      gst_rtmp_connection_get_command_template
+      (GST_RTMP_COMMAND_TEMPLATE_CREATE_STREAM), transaction_id, NULL,
+      callback, rtmp2src);
 }
 
 static void
@@ -530,30 +1144,22 @@ create_stream_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
 
   if (ret) {
     GST_DEBUG ("createStream success, stream_id=%d", stream_id);
-    send_play (rtmp2src);
+    rtmp2src->stream_id = stream_id;
+    send_play (rtmp2src, 3, play_done);
   } else {
     GST_ERROR ("createStream failed");
   }
 }
 
 static void
-send_play (GstRtmp2Src * rtmp2src)
+send_play (GstRtmp2Src * rtmp2src, int transaction_id,
+    GstRtmpCommandCallback callback)
 {
-  GstAmfNode *n1;
-  GstAmfNode *n2;
-  GstAmfNode *n3;
-
-  n1 = gst_amf_node_new (GST_AMF_TYPE_NULL);
-  n2 = gst_amf_node_new (GST_AMF_TYPE_STRING);
-  gst_amf_node_set_string (n2, rtmp2src->stream);
-  n3 = gst_amf_node_new (GST_AMF_TYPE_NUMBER);
-  gst_amf_node_set_number (n3, 0);
-  gst_rtmp_connection_send_command2 (rtmp2src->connection, 8, 1, "play", 3, n1,
-      n2, n3, NULL, play_done, rtmp2src);
-  gst_amf_node_free (n1);
-  gst_amf_node_free (n2);
-  gst_amf_node_free (n3);
+  const char *strings[] = { rtmp2src->stream };
 
+  gst_rtmp_connection_send_template (rtmp2src->connection, 8,
+      rtmp2src->stream_id, play_template, transaction_id, strings, callback,
+      rtmp2src);
 }
 
 static void
@@ -578,6 +1184,63 @@ play_done (GstRtmpConnection * connection, GstRtmpChunk * chunk,
   }
 }
 
+/* Sends connect, createStream and play back to back, so they leave in
+ * one write and media starts flowing after one round trip instead of
+ * three.  The replies are checked by rtmp2src->startup, which falls back
+ * to one command at a time. */
+static void
+send_pipelined (GstRtmp2Src * rtmp2src)
+{
+  GST_DEBUG_OBJECT (rtmp2src, "sending pipelined startup commands");
+
+  gst_rtmp_startup_begin (&rtmp2src->startup);
+  rtmp2src->stream_id = rtmp2src->startup.stream_id;
+  send_connect (rtmp2src, TRUE);
+  send_create_stream (rtmp2src, 2, NULL);
+  send_play (rtmp2src, 3, NULL);
+}
+
+static void
+pipelined_create_stream (guint32 stream_id, int transaction_id,
+    gpointer user_data)
+{
+  send_create_stream (GST_RTMP2_SRC (user_data), transaction_id, NULL);
+}
+
+static void
+pipelined_play (guint32 stream_id, int transaction_id, gpointer user_data)
+{
+  GstRtmp2Src *rtmp2src = GST_RTMP2_SRC (user_data);
+
+  rtmp2src->stream_id = stream_id;
+  send_play (rtmp2src, transaction_id, NULL);
+}
+
+static void
+handle_pipelined_reply (GstRtmp2Src * rtmp2src, GstRtmpChunk * chunk)
+{
+  char *error;
+
+  switch (gst_rtmp_startup_handle_reply (&rtmp2src->startup, chunk, &error)) {
+    case GST_RTMP_STARTUP_PENDING:
+      break;
+    case GST_RTMP_STARTUP_STARTED:
+      GST_INFO_OBJECT (rtmp2src, "playing %" G_GINT64_FORMAT " ms after "
+          "start (fallback %d)", (g_get_monotonic_time () -
+              rtmp2src->start_time) / 1000, rtmp2src->startup.fallback);
+      break;
+    case GST_RTMP_STARTUP_CONNECT_FAILED:
+      GST_ELEMENT_ERROR (rtmp2src, RESOURCE, OPEN_READ,
+          ("Server rejected connect"), ("%s", error));
+      break;
+    case GST_RTMP_STARTUP_FAILED:
+      GST_ELEMENT_ERROR (rtmp2src, RESOURCE, OPEN_READ,
+          ("Could not play stream"), ("%s", error));
+      break;
+  }
+  g_free (error);
+}
+
 static gboolean
 gst_rtmp2_src_stop (GstBaseSrc * src)
 {
@@ -585,6 +1248,10 @@ gst_rtmp2_src_stop (GstBaseSrc * src)
 
   GST_DEBUG_OBJECT (rtmp2src, "stop");
 
+  if (rtmp2src->connection) {
+    g_signal_handlers_disconnect_by_func (rtmp2src->connection,
+        connection_closed, rtmp2src);
+  }
   gst_rtmp_connection_close (rtmp2src->connection);
 
   gst_task_stop (rtmp2src->task);
@@ -592,6 +1259,14 @@ gst_rtmp2_src_stop (GstBaseSrc * src)
 
   gst_task_join (rtmp2src->task);
 
+  g_mutex_lock (&rtmp2src->lock);
+  rtmp2src->connection = NULL;
+  g_mutex_unlock (&rtmp2src->lock);
+  gst_rtmp2_src_flush_queue (rtmp2src);
+
+  gst_rtmp2_src_remove_es_pads (rtmp2src);
+  gst_rtmp2_src_clear_headers (rtmp2src);
+
   return TRUE;
 }
 
@@ -605,6 +1280,10 @@ gst_rtmp2_src_get_times (GstBaseSrc * src, GstBuffer * buffer,
 
   GST_DEBUG_OBJECT (rtmp2src, "get_times");
 
+  /* Buffers are timestamped with the running time they arrived at, or
+   * earlier, so there is never anything to wait for. */
+  *start = GST_CLOCK_TIME_NONE;
+  *end = GST_CLOCK_TIME_NONE;
 }
 
 /* get the total size of the resource in bytes */
@@ -678,6 +1357,10 @@ gst_rtmp2_src_unlock_stop (GstBaseSrc * src)
 
   GST_DEBUG_OBJECT (rtmp2src, "unlock_stop");
 
+  g_mutex_lock (&rtmp2src->lock);
+  rtmp2src->reset = FALSE;
+  g_mutex_unlock (&rtmp2src->lock);
+
   return TRUE;
 }
 
@@ -689,7 +1372,11 @@ gst_rtmp2_src_query (GstBaseSrc * src, GstQuery * query)
 
   GST_DEBUG_OBJECT (rtmp2src, "query");
 
-  return TRUE;
+  if (GST_QUERY_TYPE (query) == GST_QUERY_LATENCY) {
+    return gst_rtmp2_src_query_latency (rtmp2src, query);
+  }
+
+  return GST_BASE_SRC_CLASS (gst_rtmp2_src_parent_class)->query (src, query);
 }
 
 /* notify subclasses of an event */
@@ -700,7 +1387,7 @@ gst_rtmp2_src_event (GstBaseSrc * src, GstEvent * event)
 
   GST_DEBUG_OBJECT (rtmp2src, "event");
 
-  return TRUE;
+  return GST_BASE_SRC_CLASS (gst_rtmp2_src_parent_class)->event (src, event);
 }
 
 /* ask the subclass to create a buffer with offset and size, the default
@@ -710,13 +1397,17 @@ gst_rtmp2_src_create (GstBaseSrc * src, guint64 offset, guint size,
     GstBuffer ** buf)
 {
   GstRtmp2Src *rtmp2src = GST_RTMP2_SRC (src);
-  GstRtmpChunk *chunk;
-  const char *data;
-  guint8 *buf_data;
-  gsize payload_size;
+  GstRtmp2SrcQueueItem *item;
+  GQueue *batch = &rtmp2src->batch;
+  guint max_batch;
+  GstFlowReturn ret;
 
   GST_DEBUG_OBJECT (rtmp2src, "create");
 
+  if (rtmp2src->elementary_streams) {
+    return gst_rtmp2_src_create_es (rtmp2src);
+  }
+
   if (!rtmp2src->sent_header) {
     static const guint8 header[] = {
       0x46, 0x4c, 0x56, 0x01, 0x01, 0x00, 0x00, 0x00,
@@ -726,22 +1417,64 @@ gst_rtmp2_src_create (GstBaseSrc * src, guint64 offset, guint size,
 
     rtmp2src->sent_header = TRUE;
     data = g_memdup (header, sizeof (header));
-    data[4] = 0x1;              /* |4 with audio */
+    data[4] = 0x1 | 0x4;        /* video and audio */
     *buf = gst_buffer_new_wrapped (data, sizeof (header));
+    gst_rtmp2_src_set_header (rtmp2src, &rtmp2src->flv_header, *buf);
     return GST_FLOW_OK;
   }
 
-  g_mutex_lock (&rtmp2src->lock);
-  chunk = g_queue_pop_head (rtmp2src->queue);
-  while (!chunk) {
-    if (rtmp2src->reset) {
-      g_mutex_unlock (&rtmp2src->lock);
-      return GST_FLOW_FLUSHING;
+#ifdef HAVE_SUBMIT_BUFFER_LIST
+  max_batch = rtmp2src->max_batch;
+#else
+  max_batch = 1;
+#endif
+
+  if (g_queue_is_empty (batch)) {
+    ret = gst_rtmp2_src_pop_batch (rtmp2src, batch, max_batch);
+    if (ret != GST_FLOW_OK)
+      return ret;
+  }
+
+  if (batch->length == 1) {
+    item = g_queue_pop_head (batch);
+    *buf = gst_rtmp2_src_make_flv_tag (rtmp2src, item->chunk,
+        item->timestamp);
+    gst_rtmp2_src_free_item (item);
+    return GST_FLOW_OK;
+  }
+#ifdef HAVE_SUBMIT_BUFFER_LIST
+  {
+    GstBufferList *list;
+
+    list = gst_buffer_list_new_sized (batch->length);
+    while ((item = g_queue_peek_head (batch))) {
+      /* a header changes the caps right away, so the list so far has to
+       * go out first; the rest waits for the next call */
+      if (gst_buffer_list_length (list) > 0 && chunk_is_header (item->chunk))
+        break;
+      g_queue_pop_head (batch);
+      gst_buffer_list_add (list, gst_rtmp2_src_make_flv_tag (rtmp2src,
+              item->chunk, item->timestamp));
+      gst_rtmp2_src_free_item (item);
     }
-    g_cond_wait (&rtmp2src->cond, &rtmp2src->lock);
-    chunk = g_queue_pop_head (rtmp2src->queue);
+    GST_LOG_OBJECT (rtmp2src, "pushing %u messages as a list",
+        gst_buffer_list_length (list));
+    gst_base_src_submit_buffer_list (src, list);
+    *buf = NULL;
   }
-  g_mutex_unlock (&rtmp2src->lock);
+#endif
+
+  return GST_FLOW_OK;
+}
+
+static GstBuffer *
+gst_rtmp2_src_make_flv_tag (GstRtmp2Src * rtmp2src, GstRtmpChunk * chunk,
+    GstClockTime timestamp)
+{
+  const char *data;
+  guint8 *buf_data;
+  gsize payload_size;
+  GstBuffer *buffer;
 
   data = g_bytes_get_data (chunk->payload, &payload_size);
 
@@ -749,16 +1482,672 @@ gst_rtmp2_src_create (GstBaseSrc * src, guint64 offset, guint size,
   buf_data[0] = chunk->message_type_id;
   GST_WRITE_UINT24_BE (buf_data + 1, chunk->message_length);
   GST_WRITE_UINT24_BE (buf_data + 4, chunk->timestamp);
-  GST_WRITE_UINT24_BE (buf_data + 7, 0);
+  /* upper 8 bits of the timestamp, then the stream id */
+  buf_data[7] = chunk->timestamp >> 24;
+  GST_WRITE_UINT24_BE (buf_data + 8, 0);
   memcpy (buf_data + 11, data, payload_size);
   GST_WRITE_UINT32_BE (buf_data + payload_size + 11, payload_size + 11);
-  g_object_unref (chunk);
 
-  *buf = gst_buffer_new_wrapped (buf_data, payload_size + 11 + 4);
+  buffer = gst_buffer_new_wrapped (buf_data, payload_size + 11 + 4);
+  GST_BUFFER_PTS (buffer) = timestamp;
+  GST_BUFFER_DTS (buffer) = timestamp;
+
+  if (chunk_is_header (chunk)) {
+    if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_DATA) {
+      gst_rtmp2_src_set_header (rtmp2src, &rtmp2src->metadata_header, buffer);
+    } else if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+      gst_rtmp2_src_set_header (rtmp2src, &rtmp2src->video_header, buffer);
+    } else {
+      gst_rtmp2_src_set_header (rtmp2src, &rtmp2src->audio_header, buffer);
+    }
+  }
+
+  return buffer;
+}
+
+/* Marks @buffer as a header, remembers it in @header and updates the
+ * streamheader in the caps */
+static void
+gst_rtmp2_src_set_header (GstRtmp2Src * rtmp2src, GstBuffer ** header,
+    GstBuffer * buffer)
+{
+  GstBuffer *headers[4];
+  GValue array = G_VALUE_INIT;
+  GstCaps *caps;
+  int i;
+
+  GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_HEADER);
+  if (*header) {
+    gst_buffer_unref (*header);
+  }
+  /* shares the memory */
+  *header = gst_buffer_copy (buffer);
+
+  headers[0] = rtmp2src->flv_header;
+  headers[1] = rtmp2src->metadata_header;
+  headers[2] = rtmp2src->video_header;
+  headers[3] = rtmp2src->audio_header;
+
+  g_value_init (&array, GST_TYPE_ARRAY);
+  for (i = 0; i < 4; i++) {
+    GValue value = G_VALUE_INIT;
+
+    if (!headers[i])
+      continue;
+    g_value_init (&value, GST_TYPE_BUFFER);
+    gst_value_set_buffer (&value, headers[i]);
+    gst_value_array_append_value (&array, &value);
+    g_value_unset (&value);
+  }
+
+  caps = gst_caps_new_empty_simple ("video/x-flv");
+  gst_structure_set_value (gst_caps_get_structure (caps, 0), "streamheader",
+      &array);
+  g_value_unset (&array);
+
+  GST_DEBUG_OBJECT (rtmp2src, "new caps %" GST_PTR_FORMAT, caps);
+  gst_base_src_set_caps (GST_BASE_SRC (rtmp2src), caps);
+  gst_caps_unref (caps);
+}
+
+static void
+gst_rtmp2_src_clear_headers (GstRtmp2Src * rtmp2src)
+{
+  gst_buffer_replace (&rtmp2src->flv_header, NULL);
+  gst_buffer_replace (&rtmp2src->metadata_header, NULL);
+  gst_buffer_replace (&rtmp2src->video_header, NULL);
+  gst_buffer_replace (&rtmp2src->audio_header, NULL);
+}
+
+static void
+gst_rtmp2_src_free_item (GstRtmp2SrcQueueItem * item)
+{
+  g_object_unref (item->chunk);
+  g_slice_free (GstRtmp2SrcQueueItem, item);
+}
+
+/* Waits for messages and moves up to @max of them into @batch under one
+ * lock, with their timestamps mapped to running time.  Returns
+ * GST_FLOW_FLUSHING when unlocked, and GST_FLOW_EOS once the connection
+ * closed and everything it delivered was popped. */
+static GstFlowReturn
+gst_rtmp2_src_pop_batch (GstRtmp2Src * rtmp2src, GQueue * batch, guint max)
+{
+  GstRtmp2SrcQueueItem *item;
+  GList *link;
+
+  g_mutex_lock (&rtmp2src->lock);
+  while (g_queue_is_empty (rtmp2src->queue)) {
+    if (rtmp2src->reset) {
+      g_mutex_unlock (&rtmp2src->lock);
+      return GST_FLOW_FLUSHING;
+    }
+    if (rtmp2src->eos) {
+      g_mutex_unlock (&rtmp2src->lock);
+      GST_DEBUG_OBJECT (rtmp2src, "end of stream");
+      return GST_FLOW_EOS;
+    }
+    g_cond_wait (&rtmp2src->cond, &rtmp2src->lock);
+  }
+  while (batch->length < max && rtmp2src->queue->head) {
+    if (rtmp2src->queue->head == rtmp2src->last_keyframe)
+      rtmp2src->last_keyframe = NULL;
+    item = g_queue_pop_head (rtmp2src->queue);
+    rtmp2src->queue_bytes -= item->chunk->message_length;
+    g_queue_push_tail (batch, item);
+  }
+  if (rtmp2src->input_paused && rtmp2src->connection &&
+      rtmp2src->queue_bytes <= low_watermark (rtmp2src)) {
+    GST_DEBUG_OBJECT (rtmp2src, "queue below low watermark, resuming input");
+    rtmp2src->input_paused = FALSE;
+    gst_rtmp_connection_resume_input (rtmp2src->connection);
+  }
+  g_mutex_unlock (&rtmp2src->lock);
+
+  for (link = batch->head; link; link = link->next) {
+    item = link->data;
+    item->timestamp = gst_rtmp2_src_map_timestamp (rtmp2src,
+        item->chunk->timestamp, item->arrival);
+  }
+
+  return GST_FLOW_OK;
+}
+
+/* Maps a 32-bit millisecond RTMP timestamp onto running time.  The
+ * mapping is anchored at the first message.  Network delay only ever
+ * makes messages later than the sender's pacing, so the smallest recent
+ * offset between the two is taken as the clock offset: it is followed
+ * down at once and up slowly, which also tracks drift between the
+ * sender's clock and ours. */
+static GstClockTime
+gst_rtmp2_src_map_timestamp (GstRtmp2Src * rtmp2src, guint32 timestamp,
+    GstClockTime arrival)
+{
+  GstClockTime base_time;
+  GstClockTime running_time;
+  GstClockTime now;
+  GstClockTime pts;
+  GstClockTime latency;
+  GstClockTimeDiff delta;
+  GstClock *clock;
+  gboolean post_latency = FALSE;
+
+  now = GST_CLOCK_TIME_NONE;
+  clock = gst_element_get_clock (GST_ELEMENT (rtmp2src));
+  if (clock) {
+    now = gst_clock_get_time (clock);
+    gst_object_unref (clock);
+  }
+  if (!GST_CLOCK_TIME_IS_VALID (arrival)) {
+    arrival = now;
+  }
+
+  /* unwrap; only differences of ext_timestamp are used */
+  if (rtmp2src->have_mapping) {
+    rtmp2src->ext_timestamp += (gint32) (timestamp - rtmp2src->last_timestamp)
+        * GST_MSECOND;
+  } else {
+    rtmp2src->ext_timestamp = 0;
+  }
+  rtmp2src->last_timestamp = timestamp;
+
+  base_time = gst_element_get_base_time (GST_ELEMENT (rtmp2src));
+  if (GST_CLOCK_TIME_IS_VALID (arrival) && arrival >= base_time) {
+    running_time = arrival - base_time;
+  } else if (rtmp2src->have_mapping) {
+    /* no clock, go with the sender's pacing */
+    running_time = rtmp2src->map_running_time + rtmp2src->skew +
+        rtmp2src->ext_timestamp - rtmp2src->map_timestamp;
+  } else {
+    running_time = 0;
+  }
+
+  delta = GST_CLOCK_DIFF (rtmp2src->map_timestamp, rtmp2src->ext_timestamp);
+  delta = GST_CLOCK_DIFF (rtmp2src->map_running_time, running_time) - delta;
+  if (!rtmp2src->have_mapping || delta - rtmp2src->skew > MAX_SKEW ||
+      delta - rtmp2src->skew < -MAX_SKEW) {
+    if (rtmp2src->have_mapping) {
+      GST_DEBUG_OBJECT (rtmp2src, "timestamp jump, resyncing");
+    }
+    rtmp2src->have_mapping = TRUE;
+    rtmp2src->map_running_time = running_time;
+    rtmp2src->map_timestamp = rtmp2src->ext_timestamp;
+    rtmp2src->skew = 0;
+    delta = 0;
+  } else if (delta < rtmp2src->skew) {
+    rtmp2src->skew = delta;
+  } else {
+    rtmp2src->skew += (delta - rtmp2src->skew) / 256;
+  }
+
+  delta = GST_CLOCK_DIFF (rtmp2src->map_timestamp, rtmp2src->ext_timestamp) +
+      rtmp2src->skew;
+  if (delta < 0 && (GstClockTime) - delta > rtmp2src->map_running_time) {
+    pts = 0;
+  } else {
+    pts = rtmp2src->map_running_time + delta;
+  }
+
+  /* how late the buffer goes out; decays slowly */
+  GST_OBJECT_LOCK (rtmp2src);
+  if (GST_CLOCK_TIME_IS_VALID (now) && now >= base_time &&
+      now - base_time > pts) {
+    GstClockTime late = now - base_time - pts;
+
+    if (late > rtmp2src->lateness) {
+      rtmp2src->lateness = late;
+    } else {
+      rtmp2src->lateness -= (rtmp2src->lateness - late) / 64;
+    }
+  }
+  latency = MAX (rtmp2src->target_latency * GST_MSECOND, rtmp2src->lateness);
+  if (latency > rtmp2src->reported_latency + rtmp2src->reported_latency / 10) {
+    post_latency = TRUE;
+  }
+  GST_OBJECT_UNLOCK (rtmp2src);
+
+  if (post_latency) {
+    GST_DEBUG_OBJECT (rtmp2src, "latency grew to %" GST_TIME_FORMAT,
+        GST_TIME_ARGS (latency));
+    gst_element_post_message (GST_ELEMENT (rtmp2src),
+        gst_message_new_latency (GST_OBJECT (rtmp2src)));
+  }
+
+  return pts;
+}
+
+/* The minimum latency covers what is queued right now, as well as how
+ * late buffers have been going out; the maximum is what max-queue-time
+ * lets the queue grow to, or unbounded. */
+static gboolean
+gst_rtmp2_src_query_latency (GstRtmp2Src * rtmp2src, GstQuery * query)
+{
+  GstClockTime queued = 0;
+  GstClockTime max_latency = GST_CLOCK_TIME_NONE;
+  GstClockTime latency;
+  GList *link;
+
+  g_mutex_lock (&rtmp2src->lock);
+  link = first_droppable (rtmp2src);
+  if (link) {
+    queued = queue_duration_from (rtmp2src, link) * GST_MSECOND;
+  }
+  if (rtmp2src->max_queue_time) {
+    max_latency = rtmp2src->max_queue_time * GST_MSECOND;
+  }
+  g_mutex_unlock (&rtmp2src->lock);
+
+  GST_OBJECT_LOCK (rtmp2src);
+  latency = MAX (rtmp2src->target_latency * GST_MSECOND, rtmp2src->lateness);
+  latency = MAX (latency, queued);
+  rtmp2src->reported_latency = latency;
+  GST_OBJECT_UNLOCK (rtmp2src);
+
+  if (GST_CLOCK_TIME_IS_VALID (max_latency)) {
+    max_latency = MAX (max_latency, latency);
+  }
+
+  GST_DEBUG_OBJECT (rtmp2src, "latency %" GST_TIME_FORMAT " (%"
+      GST_TIME_FORMAT " queued), max %" GST_TIME_FORMAT,
+      GST_TIME_ARGS (latency), GST_TIME_ARGS (queued),
+      GST_TIME_ARGS (max_latency));
+
+  gst_query_set_latency (query, TRUE, latency, max_latency);
+
+  return TRUE;
+}
+
+static gboolean
+gst_rtmp2_src_es_query (GstPad * pad, GstObject * parent, GstQuery * query)
+{
+  if (GST_QUERY_TYPE (query) == GST_QUERY_LATENCY) {
+    return gst_rtmp2_src_query_latency (GST_RTMP2_SRC (parent), query);
+  }
+
+  return gst_pad_query_default (pad, parent, query);
+}
+
+/* In elementary stream mode the always pad never gets a buffer.  This
+ * keeps running in the streaming thread, pushing on the sometimes pads,
+ * until flushing, the end of the stream or until downstream returns an
+ * error.  The base class then pushes EOS on the always pad, which
+ * gst_rtmp2_src_forward_es_event() passes on. */
+static GstFlowReturn
+gst_rtmp2_src_create_es (GstRtmp2Src * rtmp2src)
+{
+  GstRtmp2SrcQueueItem *item;
+  GQueue batch = G_QUEUE_INIT;
+  GstBufferList *lists[2] = { NULL, NULL };
+  GstFlowReturn ret;
+
+  do {
+    ret = gst_rtmp2_src_pop_batch (rtmp2src, &batch, rtmp2src->max_batch);
+    if (ret != GST_FLOW_OK)
+      return ret;
+
+    while ((item = g_queue_pop_head (&batch))) {
+      if (ret == GST_FLOW_OK) {
+        ret = gst_rtmp2_src_handle_es (rtmp2src, item->chunk, item->timestamp,
+            lists);
+        gst_rtmp2_src_check_no_more_pads (rtmp2src, item->chunk,
+            item->timestamp);
+      }
+      gst_rtmp2_src_free_item (item);
+    }
+    if (ret == GST_FLOW_OK) {
+      ret = gst_rtmp2_src_push_es_list (rtmp2src, TRUE, lists);
+    }
+    if (ret == GST_FLOW_OK) {
+      ret = gst_rtmp2_src_push_es_list (rtmp2src, FALSE, lists);
+    }
+  } while (ret == GST_FLOW_OK);
+
+  if (lists[0])
+    gst_buffer_list_unref (lists[0]);
+  if (lists[1])
+    gst_buffer_list_unref (lists[1]);
+
+  return ret;
+}
+
+/* Turns one message into a buffer on the video (lists[0]) or audio
+ * (lists[1]) list.  Sequence headers flush that list first so the caps
+ * change lands between the right buffers.  onMetaData only tells which
+ * pads to expect. */
+static GstFlowReturn
+gst_rtmp2_src_handle_es (GstRtmp2Src * rtmp2src, GstRtmpChunk * chunk,
+    GstClockTime dts, GstBufferList ** lists)
+{
+  gboolean is_video = chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO;
+  GstBufferList **list = &lists[is_video ? 0 : 1];
+  const guint8 *data;
+  GstBuffer *buffer;
+  GstPad *pad;
+  gsize offset;
+  gsize size;
+  gint32 cts = 0;
+  GstFlowReturn ret;
+
+  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_DATA) {
+    gst_rtmp2_src_handle_es_metadata (rtmp2src, chunk);
+    return GST_FLOW_OK;
+  }
+
+  data = g_bytes_get_data (chunk->payload, &size);
+  if (is_video) {
+    if (size < 5 || (data[0] & 0x0f) != 7) {
+      GST_DEBUG_OBJECT (rtmp2src, "dropping non-H.264 video message");
+      return GST_FLOW_OK;
+    }
+    offset = 5;
+    if (data[1] == 0) {
+      ret = gst_rtmp2_src_push_es_list (rtmp2src, is_video, lists);
+      gst_rtmp2_src_set_codec_data (rtmp2src, TRUE, data + offset,
+          size - offset);
+      return ret;
+    } else if (data[1] != 1) {
+      /* end of sequence */
+      return GST_FLOW_OK;
+    }
+    /* composition time offset, signed */
+    cts = ((gint32) GST_READ_UINT24_BE (data + 2) ^ 0x800000) - 0x800000;
+    pad = rtmp2src->video_pad;
+  } else {
+    if (size < 2 || (data[0] >> 4) != 10) {
+      GST_DEBUG_OBJECT (rtmp2src, "dropping non-AAC audio message");
+      return GST_FLOW_OK;
+    }
+    offset = 2;
+    if (data[1] == 0) {
+      ret = gst_rtmp2_src_push_es_list (rtmp2src, is_video, lists);
+      gst_rtmp2_src_set_codec_data (rtmp2src, FALSE, data + offset,
+          size - offset);
+      return ret;
+    }
+    pad = rtmp2src->audio_pad;
+  }
+
+  if (!pad) {
+    GST_DEBUG_OBJECT (rtmp2src, "dropping %s before sequence header",
+        is_video ? "video" : "audio");
+    return GST_FLOW_OK;
+  }
+
+  buffer = gst_buffer_new_wrapped_full (GST_MEMORY_FLAG_READONLY,
+      (gpointer) data, size, offset, size - offset,
+      g_bytes_ref (chunk->payload), (GDestroyNotify) g_bytes_unref);
+  GST_BUFFER_DTS (buffer) = dts;
+  if (cts < 0 && (GstClockTime) - cts * GST_MSECOND > dts) {
+    GST_BUFFER_PTS (buffer) = 0;
+  } else {
+    GST_BUFFER_PTS (buffer) = dts + cts * GST_MSECOND;
+  }
+  if (is_video && (data[0] >> 4) != 1) {
+    GST_BUFFER_FLAG_SET (buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+  }
+
+  if (!*list) {
+    *list = gst_buffer_list_new ();
+  }
+  gst_buffer_list_add (*list, buffer);
 
   return GST_FLOW_OK;
 }
 
+static GstFlowReturn
+gst_rtmp2_src_push_es_list (GstRtmp2Src * rtmp2src, gboolean is_video,
+    GstBufferList ** lists)
+{
+  GstBufferList **list = &lists[is_video ? 0 : 1];
+  GstPad *pad = is_video ? rtmp2src->video_pad : rtmp2src->audio_pad;
+  GstFlowReturn ret;
+
+  if (!*list)
+    return GST_FLOW_OK;
+
+  ret = gst_pad_push_list (pad, *list);
+  *list = NULL;
+
+  /* only gives up on not-linked or EOS when all pads returned it */
+  return gst_flow_combiner_update_pad_flow (rtmp2src->flow_combiner, pad,
+      ret);
+}
+
+/* Sets caps from an AVC sequence header (AVCDecoderConfigurationRecord)
+ * or AAC sequence header (AudioSpecificConfig), adding the pad the first
+ * time. */
+static void
+gst_rtmp2_src_set_codec_data (GstRtmp2Src * rtmp2src, gboolean is_video,
+    const guint8 * data, gsize size)
+{
+  static const gint aac_rates[] = {
+    96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000,
+    11025, 8000, 7350
+  };
+  GstPad **padp;
+  GstPad *pad;
+  GstBuffer *codec_data;
+  GstCaps *caps;
+  GstEvent *event;
+  GstSegment segment;
+  gchar *stream_id;
+
+  if (size < 2) {
+    GST_WARNING_OBJECT (rtmp2src, "short sequence header");
+    return;
+  }
+
+  codec_data = gst_buffer_new_wrapped (g_memdup (data, size), size);
+  if (is_video) {
+    caps = gst_caps_new_simple ("video/x-h264",
+        "stream-format", G_TYPE_STRING, "avc",
+        "alignment", G_TYPE_STRING, "au",
+        "codec_data", GST_TYPE_BUFFER, codec_data, NULL);
+    padp = &rtmp2src->video_pad;
+  } else {
+    int rate_index = ((data[0] & 0x7) << 1) | (data[1] >> 7);
+    int channels = (data[1] >> 3) & 0xf;
+
+    caps = gst_caps_new_simple ("audio/mpeg",
+        "mpegversion", G_TYPE_INT, 4,
+        "stream-format", G_TYPE_STRING, "raw",
+        "framed", G_TYPE_BOOLEAN, TRUE,
+        "codec_data", GST_TYPE_BUFFER, codec_data, NULL);
+    if (rate_index < (int) G_N_ELEMENTS (aac_rates)) {
+      gst_caps_set_simple (caps, "rate", G_TYPE_INT, aac_rates[rate_index],
+          NULL);
+    }
+    if (channels >= 1 && channels <= 7) {
+      gst_caps_set_simple (caps, "channels", G_TYPE_INT,
+          channels == 7 ? 8 : channels, NULL);
+    }
+    padp = &rtmp2src->audio_pad;
+  }
+  gst_buffer_unref (codec_data);
+
+  GST_DEBUG_OBJECT (rtmp2src, "sequence header caps %" GST_PTR_FORMAT, caps);
+
+  pad = *padp;
+  if (pad) {
+    gst_pad_push_event (pad, gst_event_new_caps (caps));
+    gst_caps_unref (caps);
+    return;
+  }
+
+  if (is_video) {
+    pad = gst_pad_new_from_static_template (&gst_rtmp2_src_video_template,
+        "video");
+  } else {
+    pad = gst_pad_new_from_static_template (&gst_rtmp2_src_audio_template,
+        "audio");
+  }
+  gst_pad_use_fixed_caps (pad);
+  gst_pad_set_query_function (pad, GST_DEBUG_FUNCPTR (gst_rtmp2_src_es_query));
+  gst_pad_set_active (pad, TRUE);
+
+  /* sticky, so they are sent once the pad is linked */
+  stream_id = gst_pad_create_stream_id (pad, GST_ELEMENT (rtmp2src),
+      is_video ? "video" : "audio");
+  event = gst_event_new_stream_start (stream_id);
+  gst_event_set_group_id (event, rtmp2src->group_id);
+  gst_pad_push_event (pad, event);
+  g_free (stream_id);
+
+  gst_pad_push_event (pad, gst_event_new_caps (caps));
+  gst_caps_unref (caps);
+
+  gst_segment_init (&segment, GST_FORMAT_TIME);
+  gst_pad_push_event (pad, gst_event_new_segment (&segment));
+
+  GST_OBJECT_LOCK (rtmp2src);
+  *padp = pad;
+  GST_OBJECT_UNLOCK (rtmp2src);
+  gst_flow_combiner_add_pad (rtmp2src->flow_combiner, pad);
+  gst_element_add_pad (GST_ELEMENT (rtmp2src), pad);
+}
+
+/* Notes which of the streams we can output onMetaData announces */
+static void
+gst_rtmp2_src_handle_es_metadata (GstRtmp2Src * rtmp2src,
+    GstRtmpChunk * chunk)
+{
+  const guint8 *data;
+  gsize size;
+  gsize n_bytes;
+  GstAmfNode *name;
+  GstAmfNode *metadata;
+  const GstAmfNode *node;
+
+  data = g_bytes_get_data (chunk->payload, &size);
+  name = gst_amf_node_new_parse (data, size, &n_bytes);
+  if (!name)
+    return;
+  gst_amf_node_free (name);
+  metadata = gst_amf_node_new_parse (data + n_bytes, size - n_bytes, NULL);
+  if (!metadata)
+    return;
+
+  if (metadata->type == GST_AMF_TYPE_OBJECT ||
+      metadata->type == GST_AMF_TYPE_ECMA_ARRAY) {
+    node = gst_amf_node_get_object_by_key (metadata,
+        GST_AMF_KEY_VIDEOCODECID);
+    rtmp2src->expect_video = node && node->type == GST_AMF_TYPE_NUMBER &&
+        gst_amf_node_get_number (node) == 7;
+    node = gst_amf_node_get_object_by_key (metadata,
+        GST_AMF_KEY_AUDIOCODECID);
+    rtmp2src->expect_audio = node && node->type == GST_AMF_TYPE_NUMBER &&
+        gst_amf_node_get_number (node) == 10;
+    rtmp2src->have_metadata = TRUE;
+    GST_DEBUG_OBJECT (rtmp2src, "metadata announces%s%s",
+        rtmp2src->expect_video ? " H.264" : "",
+        rtmp2src->expect_audio ? " AAC" : "");
+  }
+  gst_amf_node_free (metadata);
+}
+
+/* Signals no-more-pads once every pad onMetaData announced was added.
+ * Without metadata that is when both pads exist, or when one of them
+ * went without the other for NO_MORE_PADS_THRESHOLD. */
+static void
+gst_rtmp2_src_check_no_more_pads (GstRtmp2Src * rtmp2src,
+    GstRtmpChunk * chunk, GstClockTime timestamp)
+{
+  gboolean done;
+
+  if (rtmp2src->signalled_no_more_pads)
+    return;
+
+  if (chunk->message_type_id != GST_RTMP_MESSAGE_TYPE_DATA &&
+      !GST_CLOCK_TIME_IS_VALID (rtmp2src->first_es_timestamp)) {
+    rtmp2src->first_es_timestamp = timestamp;
+  }
+
+  if (rtmp2src->have_metadata) {
+    done = (!rtmp2src->expect_video || rtmp2src->video_pad) &&
+        (!rtmp2src->expect_audio || rtmp2src->audio_pad);
+  } else {
+    done = (rtmp2src->video_pad && rtmp2src->audio_pad) ||
+        ((rtmp2src->video_pad || rtmp2src->audio_pad) &&
+        timestamp > rtmp2src->first_es_timestamp + NO_MORE_PADS_THRESHOLD);
+  }
+
+  if (done) {
+    GST_DEBUG_OBJECT (rtmp2src, "no more pads");
+    rtmp2src->signalled_no_more_pads = TRUE;
+    gst_element_no_more_pads (GST_ELEMENT (rtmp2src));
+  }
+}
+
+/* Passes EOS, flushes and segments the base class pushes on the always
+ * pad on to the elementary stream pads */
+static GstPadProbeReturn
+gst_rtmp2_src_forward_es_event (GstPad * pad, GstPadProbeInfo * info,
+    gpointer user_data)
+{
+  GstRtmp2Src *rtmp2src = GST_RTMP2_SRC (user_data);
+  GstEvent *event = GST_PAD_PROBE_INFO_EVENT (info);
+  GstSegment segment;
+  GstPad *pads[2];
+  int i;
+
+  switch (GST_EVENT_TYPE (event)) {
+    case GST_EVENT_EOS:
+    case GST_EVENT_FLUSH_START:
+    case GST_EVENT_FLUSH_STOP:
+    case GST_EVENT_SEGMENT:
+      break;
+    default:
+      return GST_PAD_PROBE_OK;
+  }
+
+  GST_OBJECT_LOCK (rtmp2src);
+  pads[0] = rtmp2src->video_pad ? gst_object_ref (rtmp2src->video_pad) : NULL;
+  pads[1] = rtmp2src->audio_pad ? gst_object_ref (rtmp2src->audio_pad) : NULL;
+  GST_OBJECT_UNLOCK (rtmp2src);
+
+  for (i = 0; i < 2; i++) {
+    if (!pads[i])
+      continue;
+    GST_DEBUG_OBJECT (pads[i], "forwarding %" GST_PTR_FORMAT, event);
+    gst_pad_push_event (pads[i], gst_event_ref (event));
+    /* a flush drops the segment, the next buffers need a new one */
+    if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP) {
+      gst_segment_init (&segment, GST_FORMAT_TIME);
+      gst_pad_push_event (pads[i], gst_event_new_segment (&segment));
+    }
+    gst_object_unref (pads[i]);
+  }
+
+  if (GST_EVENT_TYPE (event) == GST_EVENT_FLUSH_STOP) {
+    gst_flow_combiner_reset (rtmp2src->flow_combiner);
+  }
+
+  return GST_PAD_PROBE_OK;
+}
+
+static void
+gst_rtmp2_src_remove_es_pads (GstRtmp2Src * rtmp2src)
+{
+  GstPad *pads[2];
+  int i;
+
+  GST_OBJECT_LOCK (rtmp2src);
+  pads[0] = rtmp2src->video_pad;
+  pads[1] = rtmp2src->audio_pad;
+  rtmp2src->video_pad = NULL;
+  rtmp2src->audio_pad = NULL;
+  GST_OBJECT_UNLOCK (rtmp2src);
+
+  for (i = 0; i < 2; i++) {
+    if (!pads[i])
+      continue;
+    gst_flow_combiner_remove_pad (rtmp2src->flow_combiner, pads[i]);
+    gst_pad_set_active (pads[i], FALSE);
+    gst_element_remove_pad (GST_ELEMENT (rtmp2src), pads[i]);
+  }
+  gst_flow_combiner_reset (rtmp2src->flow_combiner);
+}
+
 /* ask the subclass to allocate an output buffer. The default implementation
  * will use the negotiated allocator. */
 static GstFlowReturn
@@ -21,8 +21,10 @@
 #define _GST_RTMP2_SRC_H_
 
 #include <gst/base/gstpushsrc.h>
+#include <gst/base/gstflowcombiner.h>
 #include <rtmp/rtmpclient.h>
 #include <rtmp/rtmputils.h>
+#include <rtmp/rtmpstartup.h>
 
 G_BEGIN_DECLS
 
@@ -47,13 +49,37 @@ struct _GstRtmp2Src
   char *application;
   char *stream;
   char *secure_token;
+  gboolean elementary_streams;
+  guint target_latency;
+  guint max_queue_bytes;
+  guint max_queue_time;
+  gboolean catch_up;
+  guint catch_up_threshold;
+  guint high_watermark;
+  guint low_watermark;
+  guint max_batch;
+  gboolean fast_start;
+  guint pool_size;
 
   /* stuff */
   gboolean sent_header;
   GMutex lock;
   GCond cond;
   GQueue *queue;
+  gsize queue_bytes;
+  /* popped, but held back for the next buffer list, streaming thread */
+  GQueue batch;
+  /* video was dropped, wait for a keyframe */
+  gboolean drop_video;
+  /* newest queued keyframe, or audio frame if there is no video, for
+   * catching up */
+  GList *last_keyframe;
+  gboolean have_video;
+  /* reading from the socket is paused until below low_watermark */
+  gboolean input_paused;
   gboolean reset;
+  /* the connection closed, end of stream once the queue is drained */
+  gboolean eos;
   GstTask *task;
   GRecMutex task_lock;
   GMainLoop *task_main_loop;
@@ -61,6 +87,43 @@ struct _GstRtmp2Src
   GstRtmpClient *client;
   GstRtmpConnection *connection;
   gboolean dump;
+  guint32 stream_id;
+
+  /* fast start, replies are checked in got_chunk */
+  GstRtmpStartup startup;
+  gint64 start_time;
+
+  /* FLV header, onMetaData and sequence header tags for streamheader */
+  GstBuffer *flv_header;
+  GstBuffer *metadata_header;
+  GstBuffer *video_header;
+  GstBuffer *audio_header;
+
+  /* elementary stream output on sometimes pads; the pads are set under
+   * the object lock */
+  GstPad *video_pad;
+  GstPad *audio_pad;
+  GstFlowCombiner *flow_combiner;
+  guint group_id;
+  /* which pads onMetaData announced, and the first media timestamp, for
+   * no-more-pads; streaming thread */
+  gboolean have_metadata;
+  gboolean expect_video;
+  gboolean expect_audio;
+  GstClockTime first_es_timestamp;
+  gboolean signalled_no_more_pads;
+
+  /* mapping of RTMP timestamps to running time */
+  gboolean have_mapping;
+  guint32 last_timestamp;
+  GstClockTime ext_timestamp;
+  GstClockTime map_running_time;
+  GstClockTime map_timestamp;
+  GstClockTimeDiff skew;
+  /* how late buffers are pushed compared to their timestamp, and the
+   * latency last reported; protected by the object lock */
+  GstClockTime lateness;
+  GstClockTime reported_latency;
 };
 
 struct _GstRtmp2SrcClass
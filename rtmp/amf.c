@@ -26,6 +26,11 @@
 
 #include "amf.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define AMF_SSE2 1
+#include <emmintrin.h>
+#endif
+
 typedef struct _AmfObjectField AmfObjectField;
 struct _AmfObjectField
 {
@@ -33,6 +38,26 @@ struct _AmfObjectField
   GstAmfNode *value;
 };
 
+/* Open-addressed table of the fields of a large object, so lookups
+ * don't scan.  Holds the first field of each name, like the scan finds,
+ * and is at most half full. */
+typedef struct _AmfIndexEntry AmfIndexEntry;
+struct _AmfIndexEntry
+{
+  guint hash;
+  AmfObjectField *field;
+};
+
+struct _GstAmfIndex
+{
+  guint mask;
+  guint n_entries;
+  AmfIndexEntry entries[1];
+};
+
+/* objects with fewer fields are scanned */
+#define AMF_INDEX_THRESHOLD 16
+
 typedef struct _AmfParser AmfParser;
 struct _AmfParser
 {
@@ -42,21 +67,60 @@ struct _AmfParser
   gboolean error;
 };
 
+/* Values are bump-allocated from one block.  If a message doesn't fit,
+ * the rest goes into extra blocks and the main block is grown to the
+ * total on the next reset, so a reused arena settles on one allocation. */
+struct _GstAmfArena
+{
+  GBytes *bytes;
+  guint8 *block;
+  gsize block_size;
+  gsize block_used;
+  GSList *extra_blocks;
+  gsize extra_size;
+  /* members of the objects being parsed, innermost last */
+  GArray *scratch;
+};
+
+#define ARENA_BLOCK_SIZE 2048
+#define AMF_MAX_DEPTH 64
+
+struct _GstAmfTemplate
+{
+  /* the command without the slot strings */
+  guint8 *data;
+  gsize size;
+  gsize transaction_id_offset;
+  /* where each slot string goes in @data */
+  gsize *slots;
+  guint n_slots;
+};
+
 typedef struct _AmfSerializer AmfSerializer;
 struct _AmfSerializer
 {
   guint8 *data;
   gsize size;
-  int offset;
+  gsize offset;
   gboolean error;
+  /* offsets of template slots, or NULL if there can't be any */
+  GArray *slots;
 };
 
+static gboolean _utf8_validate (const guint8 * s, gsize len);
+static gsize _utf8_substitute (const guint8 * s, gsize len, guint8 * out);
+static void _index_insert (GstAmfIndex * index, guint hash,
+    AmfObjectField * field);
+static gboolean _reader_skip (GstAmfReader * reader, int depth,
+    gboolean utf8);
 static char *_parse_utf8_string (AmfParser * parser);
 static void _parse_object (AmfParser * parser, GstAmfNode * node);
 static GstAmfNode *_parse_value (AmfParser * parser);
 static void amf_object_field_free (AmfObjectField * field);
-static void _serialize_object (AmfSerializer * serializer, GstAmfNode * node);
-static void _serialize_value (AmfSerializer * serializer, GstAmfNode * node);
+static gboolean _arena_parse_value (AmfParser * parser, GstAmfArena * arena,
+    GstAmfValue * value, int depth);
+static void _serialize_value (AmfSerializer * serializer,
+    const GstAmfNode * node);
 
 
 GstAmfNode *
@@ -67,7 +131,8 @@ gst_amf_node_new (GstAmfType type)
   node = g_malloc0 (sizeof (GstAmfNode));
   node->type = type;
   if (node->type == GST_AMF_TYPE_OBJECT ||
-      node->type == GST_AMF_TYPE_ECMA_ARRAY) {
+      node->type == GST_AMF_TYPE_ECMA_ARRAY ||
+      node->type == GST_AMF_TYPE_STRICT_ARRAY) {
     node->array_val = g_ptr_array_new ();
   }
 
@@ -80,9 +145,11 @@ gst_amf_node_free (GstAmfNode * node)
   if (node->type == GST_AMF_TYPE_STRING) {
     g_free (node->string_val);
   } else if (node->type == GST_AMF_TYPE_OBJECT ||
-      node->type == GST_AMF_TYPE_ECMA_ARRAY) {
+      node->type == GST_AMF_TYPE_ECMA_ARRAY ||
+      node->type == GST_AMF_TYPE_STRICT_ARRAY) {
     g_ptr_array_foreach (node->array_val, (GFunc) amf_object_field_free, NULL);
     g_ptr_array_free (node->array_val, TRUE);
+    g_free (node->index);
   }
 
   g_free (node);
@@ -106,6 +173,7 @@ _parse_u16 (AmfParser * parser)
   return x;
 }
 
+#if 0
 static int
 _parse_u24 (AmfParser * parser)
 {
@@ -114,6 +182,7 @@ _parse_u24 (AmfParser * parser)
   parser->offset += 3;
   return x;
 }
+#endif
 
 static int
 _parse_u32 (AmfParser * parser)
@@ -148,6 +217,8 @@ _parse_number (AmfParser * parser)
   return d;
 }
 
+/* The decoding functions above and below don't check bounds, they are
+ * only run on data that _reader_skip() has accepted */
 static char *
 _parse_utf8_string (AmfParser * parser)
 {
@@ -155,17 +226,36 @@ _parse_utf8_string (AmfParser * parser)
   char *s;
 
   size = _parse_u16 (parser);
-  if (parser->offset + size > parser->size) {
-    GST_ERROR ("string too long");
-    parser->error = TRUE;
-    return NULL;
-  }
   s = g_strndup ((gchar *) (parser->data + parser->offset), size);
   parser->offset += size;
 
   return s;
 }
 
+/* String values are not required to be UTF-8, servers put whatever
+ * their configuration has in e.g. a description, so invalid bytes are
+ * replaced rather than failing the whole message */
+static char *
+_parse_string_value (AmfParser * parser, gsize length_size)
+{
+  const guint8 *data;
+  gsize size;
+  char *s;
+
+  size = length_size == 2 ? _parse_u16 (parser) :
+      (guint32) _parse_u32 (parser);
+  data = parser->data + parser->offset;
+  parser->offset += size;
+
+  if (_utf8_validate (data, size))
+    return g_strndup ((const gchar *) data, size);
+
+  GST_DEBUG ("replacing invalid UTF-8 in AMF string");
+  s = g_malloc (3 * size + 1);
+  s[_utf8_substitute (data, size, (guint8 *) s)] = 0;
+  return s;
+}
+
 static void
 _parse_object (AmfParser * parser, GstAmfNode * node)
 {
@@ -187,29 +277,21 @@ _parse_object (AmfParser * parser, GstAmfNode * node)
 static void
 _parse_ecma_array (AmfParser * parser, GstAmfNode * node)
 {
-  int n_elements;
-  int i;
-
-  n_elements = _parse_u32 (parser);
-
-  /* FIXME This is weird.  The one time I've seen this, the encoded value
-   * was 0, but the number of elements was 1. */
-  if (n_elements != 0) {
-    GST_ERROR ("unimplemented, n_elements != 0");
-  }
+  /* The count is only a hint, encoders have been seen writing 0 for a
+   * single element.  The members end like those of an object. */
+  _parse_u32 (parser);
+  _parse_object (parser, node);
+}
 
-  if (n_elements == 0)
-    n_elements++;
+static void
+_parse_strict_array (AmfParser * parser, GstAmfNode * node)
+{
+  guint32 n_elements;
 
-  for (i = 0; i < n_elements; i++) {
-    char *s;
-    GstAmfNode *child_node;
-    s = _parse_utf8_string (parser);
-    child_node = _parse_value (parser);
-    gst_amf_object_append_take (node, s, child_node);
-    g_free (s);
+  n_elements = _parse_u32 (parser);
+  while (n_elements-- > 0) {
+    gst_amf_object_append_take (node, "", _parse_value (parser));
   }
-  _parse_u24 (parser);
 }
 
 static GstAmfNode *
@@ -231,7 +313,7 @@ _parse_value (AmfParser * parser)
       gst_amf_node_set_boolean (node, _parse_u8 (parser));
       break;
     case GST_AMF_TYPE_STRING:
-      gst_amf_node_set_string_take (node, _parse_utf8_string (parser));
+      gst_amf_node_set_string_take (node, _parse_string_value (parser, 2));
       break;
     case GST_AMF_TYPE_OBJECT:
       _parse_object (parser, node);
@@ -241,11 +323,28 @@ _parse_value (AmfParser * parser)
       break;
     case GST_AMF_TYPE_NULL:
       break;
+    case GST_AMF_TYPE_UNDEFINED:
+      break;
+    case GST_AMF_TYPE_REFERENCE:
+      node->int_val = _parse_u16 (parser);
+      break;
     case GST_AMF_TYPE_ECMA_ARRAY:
       _parse_ecma_array (parser, node);
       break;
     case GST_AMF_TYPE_OBJECT_END:
       break;
+    case GST_AMF_TYPE_STRICT_ARRAY:
+      _parse_strict_array (parser, node);
+      break;
+    case GST_AMF_TYPE_DATE:
+      /* milliseconds since the epoch, then an unused time zone */
+      node->double_val = _parse_number (parser);
+      _parse_u16 (parser);
+      break;
+    case GST_AMF_TYPE_LONG_STRING:
+      node->type = GST_AMF_TYPE_STRING;
+      gst_amf_node_set_string_take (node, _parse_string_value (parser, 4));
+      break;
     default:
       GST_ERROR ("unimplemented AMF type %d", type);
       break;
@@ -254,21 +353,738 @@ _parse_value (AmfParser * parser)
   return node;
 }
 
+/* Returns NULL if the value is truncated, nested too deeply, of an
+ * unsupported type or has a field name that isn't UTF-8.  Invalid UTF-8
+ * in string values is replaced with U+FFFD.  *@n_bytes is set to @size
+ * on failure, since nothing after it can be trusted either. */
 GstAmfNode *
 gst_amf_node_new_parse (const guint8 * data, gsize size, gsize * n_bytes)
 {
   AmfParser _p = { 0 }, *parser = &_p;
+  GstAmfReader reader;
   GstAmfNode *node;
 
+  /* check the extent and field names of the whole value in one pass, so
+   * decoding doesn't need to */
+  gst_amf_reader_init (&reader, data, size);
+  if (!_reader_skip (&reader, 0, TRUE)) {
+    GST_WARNING ("invalid AMF value");
+    if (n_bytes)
+      *n_bytes = size;
+    return NULL;
+  }
+
   parser->data = data;
-  parser->size = size;
+  parser->size = reader.offset;
   node = _parse_value (parser);
+  g_warn_if_fail (parser->offset == (int) reader.offset);
 
   if (n_bytes)
-    *n_bytes = parser->offset;
+    *n_bytes = reader.offset;
   return node;
 }
 
+void
+gst_amf_reader_init (GstAmfReader * reader, const guint8 * data, gsize size)
+{
+  reader->data = data;
+  reader->size = size;
+  reader->offset = 0;
+  reader->error = FALSE;
+}
+
+gboolean
+gst_amf_reader_at_end (const GstAmfReader * reader)
+{
+  return reader->error || reader->offset >= reader->size;
+}
+
+/* Returns the GstAmfType of the next value, or -1 at the end */
+int
+gst_amf_reader_peek_type (const GstAmfReader * reader)
+{
+  if (gst_amf_reader_at_end (reader))
+    return -1;
+  return reader->data[reader->offset];
+}
+
+static gboolean
+_reader_check (GstAmfReader * reader, gsize size)
+{
+  if (reader->size - reader->offset < size) {
+    GST_WARNING ("AMF data truncated");
+    reader->error = TRUE;
+  }
+  return !reader->error;
+}
+
+static double
+_reader_number (const guint8 * data)
+{
+  double d;
+  guint8 *d_ptr = (guint8 *) & d;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    d_ptr[i] = data[7 - i];
+  }
+  return d;
+}
+
+gboolean
+gst_amf_reader_read_number (GstAmfReader * reader, double *value)
+{
+  if (gst_amf_reader_peek_type (reader) != GST_AMF_TYPE_NUMBER ||
+      !_reader_check (reader, 9))
+    return FALSE;
+
+  *value = _reader_number (reader->data + reader->offset + 1);
+  reader->offset += 9;
+  return TRUE;
+}
+
+gboolean
+gst_amf_reader_read_boolean (GstAmfReader * reader, gboolean * value)
+{
+  if (gst_amf_reader_peek_type (reader) != GST_AMF_TYPE_BOOLEAN ||
+      !_reader_check (reader, 2))
+    return FALSE;
+
+  *value = reader->data[reader->offset + 1] != 0;
+  reader->offset += 2;
+  return TRUE;
+}
+
+/* Length of the UTF-8 sequence at @s, or 0 if it isn't valid.  Strict:
+ * no overlong forms, surrogates or code points above U+10FFFF.  NUL is
+ * allowed. */
+static int
+_utf8_char_length (const guint8 * s, const guint8 * end)
+{
+  guint8 c = *s, lo, hi;
+  int n, i;
+
+  if (c < 0x80) {
+    return 1;
+  } else if (c >= 0xc2 && c <= 0xdf) {
+    n = 1;
+    lo = 0x80;
+    hi = 0xbf;
+  } else if (c >= 0xe0 && c <= 0xef) {
+    n = 2;
+    lo = c == 0xe0 ? 0xa0 : 0x80;
+    hi = c == 0xed ? 0x9f : 0xbf;
+  } else if (c >= 0xf0 && c <= 0xf4) {
+    n = 3;
+    lo = c == 0xf0 ? 0x90 : 0x80;
+    hi = c == 0xf4 ? 0x8f : 0xbf;
+  } else {
+    return 0;
+  }
+
+  if (end - s <= n || s[1] < lo || s[1] > hi)
+    return 0;
+  for (i = 2; i <= n; i++) {
+    if ((s[i] & 0xc0) != 0x80)
+      return 0;
+  }
+  return n + 1;
+}
+
+/* ASCII, which most strings are entirely, is skipped 16 (or 8) bytes at
+ * a time */
+static gboolean
+_utf8_validate (const guint8 * s, gsize len)
+{
+  const guint8 *end = s + len;
+  int n;
+
+  while (s < end) {
+#ifdef AMF_SSE2
+    while (end - s >= 16 &&
+        _mm_movemask_epi8 (_mm_loadu_si128 ((const __m128i *) s)) == 0)
+      s += 16;
+#else
+    while (end - s >= 8 && (GST_READ_UINT64_LE (s) &
+            G_GUINT64_CONSTANT (0x8080808080808080)) == 0)
+      s += 8;
+#endif
+    if (s == end)
+      break;
+
+    n = _utf8_char_length (s, end);
+    if (n == 0)
+      return FALSE;
+    s += n;
+  }
+
+  return TRUE;
+}
+
+/* Copies @len bytes from @s to @out, which must have room for 3 * @len,
+ * replacing every byte that doesn't start a valid sequence with U+FFFD.
+ * Returns the length written. */
+static gsize
+_utf8_substitute (const guint8 * s, gsize len, guint8 * out)
+{
+  const guint8 *end = s + len;
+  guint8 *start = out;
+  int n;
+
+  while (s < end) {
+    n = _utf8_char_length (s, end);
+    if (n == 0) {
+      *out++ = 0xef;
+      *out++ = 0xbf;
+      *out++ = 0xbd;
+      s++;
+    } else {
+      memcpy (out, s, n);
+      out += n;
+      s += n;
+    }
+  }
+
+  return out - start;
+}
+
+/* Reads a length-prefixed string without a type marker */
+static gboolean
+_reader_string (GstAmfReader * reader, gsize length_size, const char **s,
+    gsize * length, gboolean utf8)
+{
+  gsize n;
+
+  if (!_reader_check (reader, length_size))
+    return FALSE;
+  n = length_size == 2 ?
+      GST_READ_UINT16_BE (reader->data + reader->offset) :
+      GST_READ_UINT32_BE (reader->data + reader->offset);
+  /* not length_size + n, which can wrap around with a 32-bit gsize */
+  if (n > reader->size - reader->offset - length_size) {
+    GST_WARNING ("AMF data truncated");
+    reader->error = TRUE;
+    return FALSE;
+  }
+  if (utf8 && !_utf8_validate (reader->data + reader->offset + length_size,
+          n)) {
+    GST_WARNING ("AMF field name is not UTF-8");
+    reader->error = TRUE;
+    return FALSE;
+  }
+
+  *s = (const char *) reader->data + reader->offset + length_size;
+  *length = n;
+  reader->offset += length_size + n;
+  return TRUE;
+}
+
+/* @s points into the data and is not NUL-terminated.  Long strings are
+ * read too. */
+gboolean
+gst_amf_reader_read_string (GstAmfReader * reader, const char **s,
+    gsize * length)
+{
+  int type = gst_amf_reader_peek_type (reader);
+  gsize start = reader->offset;
+
+  if (type != GST_AMF_TYPE_STRING && type != GST_AMF_TYPE_LONG_STRING)
+    return FALSE;
+
+  reader->offset++;
+  if (!_reader_string (reader, type == GST_AMF_TYPE_STRING ? 2 : 4, s,
+          length, FALSE)) {
+    reader->offset = start;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Moves into an object or ECMA array, whose members are then read with
+ * gst_amf_reader_next_field() and one read or skip for each value */
+gboolean
+gst_amf_reader_enter_object (GstAmfReader * reader)
+{
+  int type = gst_amf_reader_peek_type (reader);
+
+  if (type == GST_AMF_TYPE_OBJECT) {
+    reader->offset++;
+  } else if (type == GST_AMF_TYPE_ECMA_ARRAY && _reader_check (reader, 5)) {
+    /* the count is only a hint */
+    reader->offset += 5;
+  } else {
+    return FALSE;
+  }
+  return TRUE;
+}
+
+static gboolean
+_reader_next_field (GstAmfReader * reader, const char **name,
+    gsize * length, gboolean utf8)
+{
+  if (!_reader_string (reader, 2, name, length, utf8) ||
+      !_reader_check (reader, 1))
+    return FALSE;
+
+  if (*length == 0 &&
+      reader->data[reader->offset] == GST_AMF_TYPE_OBJECT_END) {
+    reader->offset++;
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Returns FALSE after the last member, having consumed the end marker */
+gboolean
+gst_amf_reader_next_field (GstAmfReader * reader, const char **name,
+    gsize * length)
+{
+  return _reader_next_field (reader, name, length, FALSE);
+}
+
+static gboolean
+_reader_skip (GstAmfReader * reader, int depth, gboolean utf8)
+{
+  const char *s;
+  gsize length;
+  guint32 count;
+
+  if (depth > AMF_MAX_DEPTH) {
+    GST_WARNING ("AMF data nested too deeply");
+    reader->error = TRUE;
+    return FALSE;
+  }
+  if (!_reader_check (reader, 1))
+    return FALSE;
+
+  switch (reader->data[reader->offset++]) {
+    case GST_AMF_TYPE_NUMBER:
+      if (!_reader_check (reader, 8))
+        return FALSE;
+      reader->offset += 8;
+      break;
+    case GST_AMF_TYPE_BOOLEAN:
+      if (!_reader_check (reader, 1))
+        return FALSE;
+      reader->offset += 1;
+      break;
+    case GST_AMF_TYPE_STRING:
+      return _reader_string (reader, 2, &s, &length, FALSE);
+    case GST_AMF_TYPE_LONG_STRING:
+      return _reader_string (reader, 4, &s, &length, FALSE);
+    case GST_AMF_TYPE_ECMA_ARRAY:
+      if (!_reader_check (reader, 4))
+        return FALSE;
+      reader->offset += 4;
+      /* fall through */
+    case GST_AMF_TYPE_OBJECT:
+      while (_reader_next_field (reader, &s, &length, utf8)) {
+        if (!_reader_skip (reader, depth + 1, utf8))
+          return FALSE;
+      }
+      return !reader->error;
+    case GST_AMF_TYPE_STRICT_ARRAY:
+      if (!_reader_check (reader, 4))
+        return FALSE;
+      count = GST_READ_UINT32_BE (reader->data + reader->offset);
+      reader->offset += 4;
+      /* every value takes at least a byte */
+      if (!_reader_check (reader, count))
+        return FALSE;
+      while (count-- > 0) {
+        if (!_reader_skip (reader, depth + 1, utf8))
+          return FALSE;
+      }
+      break;
+    case GST_AMF_TYPE_DATE:
+      if (!_reader_check (reader, 10))
+        return FALSE;
+      reader->offset += 10;
+      break;
+    case GST_AMF_TYPE_REFERENCE:
+      if (!_reader_check (reader, 2))
+        return FALSE;
+      reader->offset += 2;
+      break;
+    case GST_AMF_TYPE_NULL:
+    case GST_AMF_TYPE_UNDEFINED:
+      break;
+    default:
+      GST_WARNING ("unsupported AMF type %d",
+          reader->data[reader->offset - 1]);
+      reader->error = TRUE;
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Skips the next value, checking that it is complete */
+gboolean
+gst_amf_reader_skip (GstAmfReader * reader)
+{
+  return _reader_skip (reader, 0, FALSE);
+}
+
+/* Like gst_amf_reader_skip(), and also checks that field names are
+ * UTF-8.  String values may be anything, see gst_amf_node_new_parse(). */
+gboolean
+gst_amf_reader_validate (GstAmfReader * reader)
+{
+  return _reader_skip (reader, 0, TRUE);
+}
+
+/* Decodes the next value into a GstAmfNode tree, or returns NULL */
+GstAmfNode *
+gst_amf_reader_read_node (GstAmfReader * reader)
+{
+  GstAmfNode *node;
+  gsize n_bytes;
+
+  if (gst_amf_reader_at_end (reader))
+    return NULL;
+
+  node = gst_amf_node_new_parse (reader->data + reader->offset,
+      reader->size - reader->offset, &n_bytes);
+  reader->offset += n_bytes;
+  if (!node)
+    reader->error = TRUE;
+
+  return node;
+}
+
+GstAmfArena *
+gst_amf_arena_new (void)
+{
+  GstAmfArena *arena;
+
+  arena = g_new0 (GstAmfArena, 1);
+  arena->block_size = ARENA_BLOCK_SIZE;
+  arena->block = g_malloc (arena->block_size);
+  arena->scratch = g_array_new (FALSE, FALSE, sizeof (GstAmfField));
+
+  return arena;
+}
+
+void
+gst_amf_arena_free (GstAmfArena * arena)
+{
+  gst_amf_arena_reset (arena);
+  g_array_free (arena->scratch, TRUE);
+  g_free (arena->block);
+  g_free (arena);
+}
+
+/* Releases everything returned by the last parse */
+void
+gst_amf_arena_reset (GstAmfArena * arena)
+{
+  if (arena->bytes) {
+    g_bytes_unref (arena->bytes);
+    arena->bytes = NULL;
+  }
+  if (arena->extra_blocks) {
+    g_slist_free_full (arena->extra_blocks, g_free);
+    arena->extra_blocks = NULL;
+    arena->block_size = arena->block_used + arena->extra_size;
+    g_free (arena->block);
+    arena->block = g_malloc (arena->block_size);
+    arena->extra_size = 0;
+  }
+  arena->block_used = 0;
+  g_array_set_size (arena->scratch, 0);
+}
+
+static gpointer
+_arena_alloc (GstAmfArena * arena, gsize size)
+{
+  gpointer ptr;
+
+  arena->block_used = (arena->block_used + 7) & ~(gsize) 7;
+  if (arena->block_used + size <= arena->block_size) {
+    ptr = arena->block + arena->block_used;
+    arena->block_used += size;
+    return ptr;
+  }
+
+  ptr = g_malloc (size);
+  arena->extra_blocks = g_slist_prepend (arena->extra_blocks, ptr);
+  arena->extra_size += (size + 7) & ~(gsize) 7;
+  return ptr;
+}
+
+static gboolean
+_arena_check (AmfParser * parser, gsize size)
+{
+  if (parser->size - parser->offset < size) {
+    GST_WARNING ("AMF data truncated");
+    parser->error = TRUE;
+  }
+  return !parser->error;
+}
+
+/* Field names must be UTF-8.  For string values, pass @arena: invalid
+ * bytes are then replaced with U+FFFD in a copy in the arena. */
+static gboolean
+_arena_parse_string (AmfParser * parser, GstAmfArena * arena,
+    gsize length_size, const char **string, guint32 * length)
+{
+  const guint8 *data;
+  guint8 *copy;
+
+  if (!_arena_check (parser, length_size))
+    return FALSE;
+  *length = length_size == 2 ? _parse_u16 (parser) :
+      (guint32) _parse_u32 (parser);
+  if (!_arena_check (parser, *length))
+    return FALSE;
+  data = parser->data + parser->offset;
+  parser->offset += *length;
+
+  if (_utf8_validate (data, *length)) {
+    *string = (const char *) data;
+    return TRUE;
+  }
+  if (!arena || *length > G_MAXUINT32 / 3) {
+    GST_WARNING ("AMF field name is not UTF-8");
+    parser->error = TRUE;
+    return FALSE;
+  }
+
+  GST_DEBUG ("replacing invalid UTF-8 in AMF string");
+  copy = _arena_alloc (arena, 3 * (gsize) * length);
+  *length = _utf8_substitute (data, *length, copy);
+  *string = (const char *) copy;
+  return TRUE;
+}
+
+/* Parses members up to the object end marker, or @count unnamed ones for
+ * strict arrays, onto the scratch stack and then moves them into the
+ * arena in one piece. */
+static gboolean
+_arena_parse_members (AmfParser * parser, GstAmfArena * arena,
+    GstAmfValue * value, gboolean named, guint32 count, int depth)
+{
+  guint base = arena->scratch->len;
+  guint n;
+  GstAmfField *fields;
+
+  while (named || count-- > 0) {
+    GstAmfField field = { NULL, 0 };
+
+    if (named) {
+      guint32 name_length;
+
+      if (!_arena_parse_string (parser, NULL, 2, &field.name,
+              &name_length))
+        return FALSE;
+      field.name_length = name_length;
+      if (!_arena_check (parser, 1))
+        return FALSE;
+      if (name_length == 0 &&
+          parser->data[parser->offset] == GST_AMF_TYPE_OBJECT_END) {
+        parser->offset++;
+        break;
+      }
+    }
+    if (!_arena_parse_value (parser, arena, &field.value, depth + 1))
+      return FALSE;
+    g_array_append_val (arena->scratch, field);
+  }
+
+  n = arena->scratch->len - base;
+  fields = _arena_alloc (arena, n * sizeof (GstAmfField));
+  memcpy (fields, &g_array_index (arena->scratch, GstAmfField, base),
+      n * sizeof (GstAmfField));
+  g_array_set_size (arena->scratch, base);
+
+  value->length = n;
+  value->v.fields = fields;
+  return TRUE;
+}
+
+static gboolean
+_arena_parse_value (AmfParser * parser, GstAmfArena * arena,
+    GstAmfValue * value, int depth)
+{
+  guint32 count;
+
+  if (depth > AMF_MAX_DEPTH) {
+    GST_WARNING ("AMF data nested too deeply");
+    parser->error = TRUE;
+    return FALSE;
+  }
+  if (!_arena_check (parser, 1))
+    return FALSE;
+
+  memset (value, 0, sizeof (*value));
+  value->type = _parse_u8 (parser);
+
+  switch (value->type) {
+    case GST_AMF_TYPE_NUMBER:
+      if (!_arena_check (parser, 8))
+        return FALSE;
+      value->v.number = _parse_number (parser);
+      break;
+    case GST_AMF_TYPE_BOOLEAN:
+      if (!_arena_check (parser, 1))
+        return FALSE;
+      value->v.boolean = _parse_u8 (parser) != 0;
+      break;
+    case GST_AMF_TYPE_STRING:
+      return _arena_parse_string (parser, arena, 2, &value->v.string,
+          &value->length);
+    case GST_AMF_TYPE_LONG_STRING:
+      value->type = GST_AMF_TYPE_STRING;
+      return _arena_parse_string (parser, arena, 4, &value->v.string,
+          &value->length);
+    case GST_AMF_TYPE_OBJECT:
+      return _arena_parse_members (parser, arena, value, TRUE, 0, depth);
+    case GST_AMF_TYPE_ECMA_ARRAY:
+      /* the count is only a hint */
+      if (!_arena_check (parser, 4))
+        return FALSE;
+      _parse_u32 (parser);
+      return _arena_parse_members (parser, arena, value, TRUE, 0, depth);
+    case GST_AMF_TYPE_STRICT_ARRAY:
+      if (!_arena_check (parser, 4))
+        return FALSE;
+      count = _parse_u32 (parser);
+      /* every value takes at least a byte */
+      if (!_arena_check (parser, count))
+        return FALSE;
+      return _arena_parse_members (parser, arena, value, FALSE, count, depth);
+    case GST_AMF_TYPE_DATE:
+      /* milliseconds since the epoch, then an unused time zone */
+      if (!_arena_check (parser, 10))
+        return FALSE;
+      value->v.number = _parse_number (parser);
+      parser->offset += 2;
+      break;
+    case GST_AMF_TYPE_REFERENCE:
+      if (!_arena_check (parser, 2))
+        return FALSE;
+      value->v.number = _parse_u16 (parser);
+      break;
+    case GST_AMF_TYPE_NULL:
+    case GST_AMF_TYPE_UNDEFINED:
+      break;
+    default:
+      GST_WARNING ("unsupported AMF type %d", value->type);
+      parser->error = TRUE;
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+/* Parses all values in @bytes into a strict array allocated from @arena,
+ * replacing the previous contents of the arena.  Strings in the result
+ * point into @bytes, which the arena keeps a reference to until the next
+ * reset, or into the arena where invalid UTF-8 in a string value had to
+ * be replaced.  Returns NULL if the data is malformed. */
+const GstAmfValue *
+gst_amf_arena_parse (GstAmfArena * arena, GBytes * bytes)
+{
+  AmfParser _p = { 0 }, *parser = &_p;
+  GstAmfValue *top;
+  guint base;
+  guint n;
+  GstAmfField *fields;
+
+  gst_amf_arena_reset (arena);
+  arena->bytes = g_bytes_ref (bytes);
+
+  parser->data = g_bytes_get_data (bytes, &parser->size);
+
+  base = arena->scratch->len;
+  while (parser->offset < (int) parser->size) {
+    GstAmfField field = { NULL, 0 };
+
+    if (!_arena_parse_value (parser, arena, &field.value, 0)) {
+      gst_amf_arena_reset (arena);
+      return NULL;
+    }
+    g_array_append_val (arena->scratch, field);
+  }
+
+  n = arena->scratch->len - base;
+  fields = _arena_alloc (arena, n * sizeof (GstAmfField));
+  memcpy (fields, &g_array_index (arena->scratch, GstAmfField, base),
+      n * sizeof (GstAmfField));
+  g_array_set_size (arena->scratch, base);
+
+  top = _arena_alloc (arena, sizeof (GstAmfValue));
+  top->type = GST_AMF_TYPE_STRICT_ARRAY;
+  top->length = n;
+  top->v.fields = fields;
+
+  return top;
+}
+
+/* The accessors accept NULL and values of the wrong type, so lookups can
+ * be chained without checking every step. */
+static gboolean
+_value_has_fields (const GstAmfValue * value)
+{
+  return value && (value->type == GST_AMF_TYPE_OBJECT ||
+      value->type == GST_AMF_TYPE_ECMA_ARRAY ||
+      value->type == GST_AMF_TYPE_STRICT_ARRAY);
+}
+
+const GstAmfValue *
+gst_amf_value_get_index (const GstAmfValue * value, guint index)
+{
+  if (!_value_has_fields (value) || index >= value->length)
+    return NULL;
+  return &value->v.fields[index].value;
+}
+
+const GstAmfValue *
+gst_amf_value_get_field (const GstAmfValue * value, const char *name)
+{
+  gsize name_length = strlen (name);
+  guint i;
+
+  if (!_value_has_fields (value))
+    return NULL;
+
+  for (i = 0; i < value->length; i++) {
+    const GstAmfField *field = &value->v.fields[i];
+
+    if (field->name_length == name_length &&
+        memcmp (field->name, name, name_length) == 0) {
+      return &field->value;
+    }
+  }
+  return NULL;
+}
+
+double
+gst_amf_value_get_number (const GstAmfValue * value)
+{
+  if (!value || value->type != GST_AMF_TYPE_NUMBER)
+    return 0;
+  return value->v.number;
+}
+
+gboolean
+gst_amf_value_string_equal (const GstAmfValue * value, const char *s)
+{
+  if (!value || value->type != GST_AMF_TYPE_STRING)
+    return FALSE;
+  return strlen (s) == value->length &&
+      memcmp (value->v.string, s, value->length) == 0;
+}
+
+char *
+gst_amf_value_dup_string (const GstAmfValue * value)
+{
+  if (!value || value->type != GST_AMF_TYPE_STRING)
+    return NULL;
+  return g_strndup (value->v.string, value->length);
+}
+
 void
 gst_amf_node_set_boolean (GstAmfNode * node, gboolean val)
 {
@@ -312,12 +1128,23 @@ gst_amf_object_append_take (GstAmfNode * node, const char *s,
   AmfObjectField *field;
 
   g_return_if_fail (node->type == GST_AMF_TYPE_OBJECT ||
-      node->type == GST_AMF_TYPE_ECMA_ARRAY);
+      node->type == GST_AMF_TYPE_ECMA_ARRAY ||
+      node->type == GST_AMF_TYPE_STRICT_ARRAY);
 
   field = g_malloc0 (sizeof (AmfObjectField));
   field->name = g_strdup (s);
   field->value = child_node;
   g_ptr_array_add (node->array_val, field);
+
+  if (node->index) {
+    if (node->index->n_entries < (node->index->mask + 1) / 2) {
+      _index_insert (node->index, g_str_hash (field->name), field);
+    } else {
+      /* full, rebuilt bigger on the next lookup */
+      g_free (node->index);
+      node->index = NULL;
+    }
+  }
 }
 
 static void
@@ -384,12 +1211,31 @@ _gst_amf_node_dump (GstAmfNode * node, int indent)
       }
       g_print ("%*.*s}", indent, indent, "");
       break;
+    case GST_AMF_TYPE_STRICT_ARRAY:
+      g_print ("[\n");
+      for (i = 0; i < (int) node->array_val->len; i++) {
+        AmfObjectField *field = g_ptr_array_index (node->array_val, i);
+        g_print ("%*.*s  ", indent, indent, "");
+        _gst_amf_node_dump (field->value, indent + 2);
+        g_print (",\n");
+      }
+      g_print ("%*.*s]", indent, indent, "");
+      break;
     case GST_AMF_TYPE_MOVIECLIP:
       g_print ("MOVIE_CLIP");
       break;
     case GST_AMF_TYPE_NULL:
       g_print ("Null");
       break;
+    case GST_AMF_TYPE_UNDEFINED:
+      g_print ("Undefined");
+      break;
+    case GST_AMF_TYPE_REFERENCE:
+      g_print ("Reference %d", node->int_val);
+      break;
+    case GST_AMF_TYPE_DATE:
+      g_print ("Date %.0f", node->double_val);
+      break;
     case GST_AMF_TYPE_OBJECT_END:
       break;
     default:
@@ -405,6 +1251,86 @@ gst_amf_node_dump (GstAmfNode * node)
   g_print ("\n");
 }
 
+static gsize
+_string_size (const char *s)
+{
+  gsize length = strlen (s);
+
+  return (length > G_MAXUINT16 ? 4 : 2) + length;
+}
+
+/* Adds the serialized size of @node to @size.  With @slots, strings
+ * without a value are template slots and take no space. */
+static gboolean
+_value_size (const GstAmfNode * node, gboolean slots, gsize * size)
+{
+  guint i;
+
+  switch (node->type) {
+    case GST_AMF_TYPE_NUMBER:
+      *size += 9;
+      return TRUE;
+    case GST_AMF_TYPE_BOOLEAN:
+      *size += 2;
+      return TRUE;
+    case GST_AMF_TYPE_STRING:
+      if (!node->string_val)
+        return slots;
+      *size += 1 + _string_size (node->string_val);
+      return TRUE;
+    case GST_AMF_TYPE_NULL:
+    case GST_AMF_TYPE_UNDEFINED:
+      *size += 1;
+      return TRUE;
+    case GST_AMF_TYPE_REFERENCE:
+      *size += 3;
+      return TRUE;
+    case GST_AMF_TYPE_DATE:
+      *size += 11;
+      return TRUE;
+    case GST_AMF_TYPE_OBJECT:
+    case GST_AMF_TYPE_ECMA_ARRAY:
+      /* type, ECMA count, fields, empty name and end marker */
+      *size += node->type == GST_AMF_TYPE_ECMA_ARRAY ? 5 : 1;
+      for (i = 0; i < node->array_val->len; i++) {
+        AmfObjectField *field = g_ptr_array_index (node->array_val, i);
+        gsize name_length = strlen (field->name);
+
+        if (name_length > G_MAXUINT16) {
+          GST_ERROR ("AMF field name too long");
+          return FALSE;
+        }
+        *size += 2 + name_length;
+        if (!_value_size (field->value, slots, size))
+          return FALSE;
+      }
+      *size += 3;
+      return TRUE;
+    case GST_AMF_TYPE_STRICT_ARRAY:
+      *size += 5;
+      for (i = 0; i < node->array_val->len; i++) {
+        AmfObjectField *field = g_ptr_array_index (node->array_val, i);
+
+        if (!_value_size (field->value, slots, size))
+          return FALSE;
+      }
+      return TRUE;
+    default:
+      GST_ERROR ("unimplemented AMF type %d", node->type);
+      return FALSE;
+  }
+}
+
+/* Returns the number of bytes gst_amf_node_serialize() writes for @node,
+ * or 0 if it contains something that can't be serialized. */
+gsize
+gst_amf_node_get_serialized_size (const GstAmfNode * node)
+{
+  gsize size = 0;
+
+  return _value_size (node, FALSE, &size) ? size : 0;
+}
+
 static gboolean
 _serialize_check (AmfSerializer * serializer, gsize value)
 {
@@ -444,7 +1370,7 @@ _serialize_u24 (AmfSerializer * serializer, int value)
 #endif
 
 static void
-_serialize_u32 (AmfSerializer * serializer, int value)
+_serialize_u32 (AmfSerializer * serializer, guint32 value)
 {
   if (_serialize_check (serializer, 4)) {
     GST_WRITE_UINT32_BE (serializer->data + serializer->offset, value);
@@ -469,7 +1395,7 @@ _serialize_number (AmfSerializer * serializer, double value)
 static void
 _serialize_utf8_string (AmfSerializer * serializer, const char *s)
 {
-  int size;
+  gsize size;
 
   size = strlen (s);
   if (_serialize_check (serializer, 2 + size)) {
@@ -480,11 +1406,37 @@ _serialize_utf8_string (AmfSerializer * serializer, const char *s)
 }
 
 static void
-_serialize_object (AmfSerializer * serializer, GstAmfNode * node)
+_serialize_long_string (AmfSerializer * serializer, const char *s,
+    gsize size)
 {
-  int i;
+  if (_serialize_check (serializer, 4 + size)) {
+    GST_WRITE_UINT32_BE (serializer->data + serializer->offset, size);
+    memcpy (serializer->data + serializer->offset + 4, s, size);
+    serializer->offset += 4 + size;
+  }
+}
+
+/* type and string, long if it has to be */
+static void
+_serialize_string_value (AmfSerializer * serializer, const char *s)
+{
+  gsize length = strlen (s);
+
+  if (length > G_MAXUINT16) {
+    _serialize_u8 (serializer, GST_AMF_TYPE_LONG_STRING);
+    _serialize_long_string (serializer, s, length);
+  } else {
+    _serialize_u8 (serializer, GST_AMF_TYPE_STRING);
+    _serialize_utf8_string (serializer, s);
+  }
+}
+
+static void
+_serialize_object (AmfSerializer * serializer, const GstAmfNode * node)
+{
+  guint i;
 
-  for (i = 0; i < (int) node->array_val->len; i++) {
+  for (i = 0; i < node->array_val->len; i++) {
     AmfObjectField *field = g_ptr_array_index (node->array_val, i);
     _serialize_utf8_string (serializer, field->name);
     _serialize_value (serializer, field->value);
@@ -494,47 +1446,70 @@ _serialize_object (AmfSerializer * serializer, GstAmfNode * node)
 }
 
 static void
-_serialize_ecma_array (AmfSerializer * serializer, GstAmfNode * node)
+_serialize_ecma_array (AmfSerializer * serializer, const GstAmfNode * node)
 {
-  int i;
+  _serialize_u32 (serializer, node->array_val->len);
+  _serialize_object (serializer, node);
+}
+
+static void
+_serialize_strict_array (AmfSerializer * serializer, const GstAmfNode * node)
+{
+  guint i;
 
-  _serialize_u32 (serializer, 0);
-  for (i = 0; i < (int) node->array_val->len; i++) {
+  _serialize_u32 (serializer, node->array_val->len);
+  for (i = 0; i < node->array_val->len; i++) {
     AmfObjectField *field = g_ptr_array_index (node->array_val, i);
-    _serialize_utf8_string (serializer, field->name);
     _serialize_value (serializer, field->value);
   }
-  _serialize_u16 (serializer, 0);
-  _serialize_u8 (serializer, GST_AMF_TYPE_OBJECT_END);
 }
 
 static void
-_serialize_value (AmfSerializer * serializer, GstAmfNode * node)
+_serialize_value (AmfSerializer * serializer, const GstAmfNode * node)
 {
-  _serialize_u8 (serializer, node->type);
   switch (node->type) {
     case GST_AMF_TYPE_NUMBER:
+      _serialize_u8 (serializer, node->type);
       _serialize_number (serializer, node->double_val);
       break;
     case GST_AMF_TYPE_BOOLEAN:
+      _serialize_u8 (serializer, node->type);
       _serialize_u8 (serializer, ! !node->int_val);
       break;
     case GST_AMF_TYPE_STRING:
-      _serialize_utf8_string (serializer, node->string_val);
+      if (node->string_val) {
+        _serialize_string_value (serializer, node->string_val);
+      } else if (serializer->slots) {
+        g_array_append_val (serializer->slots, serializer->offset);
+      } else {
+        GST_ERROR ("AMF string without a value");
+        serializer->error = TRUE;
+      }
       break;
     case GST_AMF_TYPE_OBJECT:
+      _serialize_u8 (serializer, node->type);
       _serialize_object (serializer, node);
       break;
-    case GST_AMF_TYPE_MOVIECLIP:
-      GST_ERROR ("unimplemented AMF type: movie clip");
-      serializer->error = TRUE;
-      break;
     case GST_AMF_TYPE_NULL:
+    case GST_AMF_TYPE_UNDEFINED:
+      _serialize_u8 (serializer, node->type);
+      break;
+    case GST_AMF_TYPE_REFERENCE:
+      _serialize_u8 (serializer, node->type);
+      _serialize_u16 (serializer, node->int_val);
       break;
     case GST_AMF_TYPE_ECMA_ARRAY:
+      _serialize_u8 (serializer, node->type);
       _serialize_ecma_array (serializer, node);
       break;
-    case GST_AMF_TYPE_OBJECT_END:
+    case GST_AMF_TYPE_STRICT_ARRAY:
+      _serialize_u8 (serializer, node->type);
+      _serialize_strict_array (serializer, node);
+      break;
+    case GST_AMF_TYPE_DATE:
+      _serialize_u8 (serializer, node->type);
+      _serialize_number (serializer, node->double_val);
+      _serialize_u16 (serializer, 0);
       break;
     default:
       GST_ERROR ("unimplemented AMF type %d", node->type);
@@ -543,29 +1518,116 @@ _serialize_value (AmfSerializer * serializer, GstAmfNode * node)
   }
 }
 
-GBytes *
-gst_amf_serialize_command (const char *command_name, int transaction_id,
-    GstAmfNode * command_object, GstAmfNode * optional_args)
+/* Writes @node to @data and returns the number of bytes written, or 0 if
+ * it doesn't fit into @size bytes or can't be serialized. */
+gsize
+gst_amf_node_serialize (const GstAmfNode * node, guint8 * data, gsize size)
 {
   AmfSerializer _s = { 0 }, *serializer = &_s;
 
-  serializer->size = 4096;
-  serializer->data = g_malloc (serializer->size);
+  serializer->data = data;
+  serializer->size = size;
+  _serialize_value (serializer, node);
+
+  return serializer->error ? 0 : serializer->offset;
+}
+
+static gboolean
+_command_size (const char *command_name, guint n_args, GstAmfNode ** args,
+    gboolean slots, gsize * size)
+{
+  guint i;
+
+  *size = strlen (command_name);
+  if (*size > G_MAXUINT16) {
+    GST_ERROR ("command name too long");
+    return FALSE;
+  }
+  *size += 3 + 9;
+  for (i = 0; i < n_args; i++) {
+    if (args[i] && !_value_size (args[i], slots, size))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+_serialize_command (AmfSerializer * serializer, const char *command_name,
+    int transaction_id, guint n_args, GstAmfNode ** args)
+{
+  guint i;
 
   _serialize_u8 (serializer, GST_AMF_TYPE_STRING);
   _serialize_utf8_string (serializer, command_name);
   _serialize_u8 (serializer, GST_AMF_TYPE_NUMBER);
   _serialize_number (serializer, transaction_id);
-  _serialize_value (serializer, command_object);
-  if (optional_args)
-    _serialize_value (serializer, optional_args);
+  for (i = 0; i < n_args; i++) {
+    if (args[i])
+      _serialize_value (serializer, args[i]);
+  }
+}
+
+/* Returns the size of a command message with @n_args arguments, or 0 if
+ * one of them can't be serialized.  NULL arguments are skipped. */
+gsize
+gst_amf_command_get_serialized_size (const char *command_name, guint n_args,
+    GstAmfNode ** args)
+{
+  gsize size;
+
+  return _command_size (command_name, n_args, args, FALSE, &size) ? size : 0;
+}
+
+/* Writes a command message to @data, which may be any memory the caller
+ * owns, sized with gst_amf_command_get_serialized_size().  Returns the
+ * number of bytes written, or 0 if it doesn't fit. */
+gsize
+gst_amf_serialize_command_into (guint8 * data, gsize size,
+    const char *command_name, int transaction_id, guint n_args,
+    GstAmfNode ** args)
+{
+  AmfSerializer _s = { 0 }, *serializer = &_s;
+
+  serializer->data = data;
+  serializer->size = size;
+  _serialize_command (serializer, command_name, transaction_id, n_args, args);
+
+  return serializer->error ? 0 : serializer->offset;
+}
+
+GBytes *
+gst_amf_serialize_commandv (const char *command_name, int transaction_id,
+    guint n_args, GstAmfNode ** args)
+{
+  guint8 *data;
+  gsize size;
+
+  size = gst_amf_command_get_serialized_size (command_name, n_args, args);
+  if (size == 0) {
+    GST_ERROR ("failed to serialize");
+    return NULL;
+  }
 
-  if (serializer->error) {
+  data = g_malloc (size);
+  if (gst_amf_serialize_command_into (data, size, command_name,
+          transaction_id, n_args, args) != size) {
     GST_ERROR ("failed to serialize");
-    g_free (serializer->data);
+    g_free (data);
     return NULL;
   }
-  return g_bytes_new_take (serializer->data, serializer->offset);
+
+  return g_bytes_new_take (data, size);
+}
+
+GBytes *
+gst_amf_serialize_command (const char *command_name, int transaction_id,
+    GstAmfNode * command_object, GstAmfNode * optional_args)
+{
+  GstAmfNode *args[] = { command_object, optional_args };
+
+  return gst_amf_serialize_commandv (command_name, transaction_id,
+      G_N_ELEMENTS (args), args);
 }
 
 GBytes *
@@ -573,29 +1635,120 @@ gst_amf_serialize_command2 (const char *command_name, int transaction_id,
     GstAmfNode * command_object, GstAmfNode * optional_args, GstAmfNode * n3,
     GstAmfNode * n4)
 {
-  AmfSerializer _s = { 0 }, *serializer = &_s;
+  GstAmfNode *args[] = { command_object, optional_args, n3, n4 };
 
-  serializer->size = 4096;
-  serializer->data = g_malloc (serializer->size);
+  return gst_amf_serialize_commandv (command_name, transaction_id,
+      G_N_ELEMENTS (args), args);
+}
 
-  _serialize_u8 (serializer, GST_AMF_TYPE_STRING);
-  _serialize_utf8_string (serializer, command_name);
-  _serialize_u8 (serializer, GST_AMF_TYPE_NUMBER);
-  _serialize_number (serializer, transaction_id);
-  _serialize_value (serializer, command_object);
-  if (optional_args)
-    _serialize_value (serializer, optional_args);
-  if (n3)
-    _serialize_value (serializer, n3);
-  if (n4)
-    _serialize_value (serializer, n4);
-
-  if (serializer->error) {
+/* Serializes a command once, leaving out the strings that change between
+ * uses.  Every string node without a value, as made by
+ * gst_amf_node_new() or gst_amf_object_set_string() with NULL, is a
+ * slot that gst_amf_template_fill() fills in, in serialization order.
+ * Returns NULL if the arguments can't be serialized. */
+GstAmfTemplate *
+gst_amf_template_new (const char *command_name, guint n_args,
+    GstAmfNode ** args)
+{
+  AmfSerializer _s = { 0 }, *serializer = &_s;
+  GstAmfTemplate *tmpl;
+  gsize size;
+
+  if (!_command_size (command_name, n_args, args, TRUE, &size)) {
     GST_ERROR ("failed to serialize");
-    g_free (serializer->data);
     return NULL;
   }
-  return g_bytes_new_take (serializer->data, serializer->offset);
+
+  tmpl = g_new0 (GstAmfTemplate, 1);
+  tmpl->data = g_malloc (size);
+  tmpl->size = size;
+  /* the transaction id follows the command name */
+  tmpl->transaction_id_offset = 3 + strlen (command_name) + 1;
+
+  serializer->data = tmpl->data;
+  serializer->size = size;
+  serializer->slots = g_array_new (FALSE, FALSE, sizeof (gsize));
+  _serialize_command (serializer, command_name, 0, n_args, args);
+  g_warn_if_fail (!serializer->error && serializer->offset == size);
+
+  tmpl->n_slots = serializer->slots->len;
+  tmpl->slots = (gsize *) g_array_free (serializer->slots, FALSE);
+
+  return tmpl;
+}
+
+void
+gst_amf_template_free (GstAmfTemplate * tmpl)
+{
+  g_free (tmpl->data);
+  g_free (tmpl->slots);
+  g_free (tmpl);
+}
+
+guint
+gst_amf_template_get_n_slots (const GstAmfTemplate * tmpl)
+{
+  return tmpl->n_slots;
+}
+
+/* Returns the message size with @strings, one per slot, filled in */
+gsize
+gst_amf_template_get_size (const GstAmfTemplate * tmpl,
+    const char *const *strings)
+{
+  gsize size = tmpl->size;
+  guint i;
+
+  for (i = 0; i < tmpl->n_slots; i++) {
+    size += 1 + _string_size (strings[i]);
+  }
+
+  return size;
+}
+
+/* Writes the command with @transaction_id and @strings to @data.  Returns
+ * the number of bytes written, or 0 if it doesn't fit into @size. */
+gsize
+gst_amf_template_fill_into (const GstAmfTemplate * tmpl, guint8 * data,
+    gsize size, int transaction_id, const char *const *strings)
+{
+  AmfSerializer _s = { 0 }, *serializer = &_s;
+  gsize offset = 0;
+  guint i;
+
+  if (gst_amf_template_get_size (tmpl, strings) > size)
+    return 0;
+
+  serializer->data = data;
+  serializer->size = size;
+  for (i = 0; i <= tmpl->n_slots; i++) {
+    gsize end = i < tmpl->n_slots ? tmpl->slots[i] : tmpl->size;
+
+    memcpy (data + serializer->offset, tmpl->data + offset, end - offset);
+    serializer->offset += end - offset;
+    offset = end;
+    if (i < tmpl->n_slots)
+      _serialize_string_value (serializer, strings[i]);
+  }
+  size = serializer->offset;
+  serializer->offset = tmpl->transaction_id_offset;
+  _serialize_number (serializer, transaction_id);
+
+  return size;
+}
+
+GBytes *
+gst_amf_template_fill (const GstAmfTemplate * tmpl, int transaction_id,
+    const char *const *strings)
+{
+  guint8 *data;
+  gsize size;
+
+  size = gst_amf_template_get_size (tmpl, strings);
+  data = g_malloc (size);
+  gst_amf_template_fill_into (tmpl, data, size, transaction_id, strings);
+
+  return g_bytes_new_take (data, size);
 }
 
 gboolean
@@ -616,11 +1769,81 @@ gst_amf_node_get_number (const GstAmfNode * node)
   return node->double_val;
 }
 
-const GstAmfNode *
-gst_amf_node_get_object (const GstAmfNode * node, const char *field_name)
+static const char *const well_known_keys[GST_AMF_N_KEYS] = {
+  "code", "secureToken", "videocodecid", "audiocodecid"
+};
+
+static guint well_known_key_hashes[GST_AMF_N_KEYS];
+
+/* Adds @field unless there already is a field with its name */
+static void
+_index_insert (GstAmfIndex * index, guint hash, AmfObjectField * field)
 {
-  int i;
-  for (i = 0; i < (int) node->array_val->len; i++) {
+  guint i;
+
+  for (i = hash & index->mask; index->entries[i].field;
+      i = (i + 1) & index->mask) {
+    if (index->entries[i].hash == hash &&
+        strcmp (index->entries[i].field->name, field->name) == 0)
+      return;
+  }
+  index->entries[i].hash = hash;
+  index->entries[i].field = field;
+  index->n_entries++;
+}
+
+static GstAmfIndex *
+_index_new (GPtrArray * fields)
+{
+  GstAmfIndex *index;
+  guint size = 8;
+  guint i;
+
+  while (size < fields->len * 4)
+    size <<= 1;
+  index = g_malloc0 (sizeof (GstAmfIndex) + (size - 1) *
+      sizeof (AmfIndexEntry));
+  index->mask = size - 1;
+
+  for (i = 0; i < fields->len; i++) {
+    AmfObjectField *field = g_ptr_array_index (fields, i);
+
+    _index_insert (index, g_str_hash (field->name), field);
+  }
+
+  return index;
+}
+
+static GstAmfIndex *
+_get_index (const GstAmfNode * node)
+{
+  if (!node->index && node->array_val->len >= AMF_INDEX_THRESHOLD) {
+    /* the index is a cache, building it doesn't change the node */
+    ((GstAmfNode *) node)->index = _index_new (node->array_val);
+  }
+  return node->index;
+}
+
+static const GstAmfNode *
+_index_lookup (const GstAmfIndex * index, const char *field_name, guint hash)
+{
+  guint i;
+
+  for (i = hash & index->mask; index->entries[i].field;
+      i = (i + 1) & index->mask) {
+    if (index->entries[i].hash == hash &&
+        strcmp (index->entries[i].field->name, field_name) == 0)
+      return index->entries[i].field->value;
+  }
+  return NULL;
+}
+
+static const GstAmfNode *
+_scan_fields (const GstAmfNode * node, const char *field_name)
+{
+  guint i;
+
+  for (i = 0; i < node->array_val->len; i++) {
     AmfObjectField *field = g_ptr_array_index (node->array_val, i);
     if (strcmp (field->name, field_name) == 0) {
       return field->value;
@@ -629,6 +1852,51 @@ gst_amf_node_get_object (const GstAmfNode * node, const char *field_name)
   return NULL;
 }
 
+/* Objects with many fields get a hash index on the first lookup */
+const GstAmfNode *
+gst_amf_node_get_object (const GstAmfNode * node, const char *field_name)
+{
+  GstAmfIndex *index = _get_index (node);
+
+  if (index)
+    return _index_lookup (index, field_name, g_str_hash (field_name));
+  return _scan_fields (node, field_name);
+}
+
+/* Like gst_amf_node_get_object() for a well-known field name, whose hash
+ * is only computed once */
+const GstAmfNode *
+gst_amf_node_get_object_by_key (const GstAmfNode * node, GstAmfKey key)
+{
+  static gsize initialized = 0;
+  GstAmfIndex *index;
+
+  g_return_val_if_fail (key < GST_AMF_N_KEYS, NULL);
+
+  if (g_once_init_enter (&initialized)) {
+    int i;
+
+    for (i = 0; i < GST_AMF_N_KEYS; i++) {
+      well_known_key_hashes[i] = g_str_hash (well_known_keys[i]);
+    }
+    g_once_init_leave (&initialized, 1);
+  }
+
+  index = _get_index (node);
+  if (index)
+    return _index_lookup (index, well_known_keys[key],
+        well_known_key_hashes[key]);
+  return _scan_fields (node, well_known_keys[key]);
+}
+
+const char *
+gst_amf_key_get_name (GstAmfKey key)
+{
+  g_return_val_if_fail (key < GST_AMF_N_KEYS, NULL);
+
+  return well_known_keys[key];
+}
+
 int
 gst_amf_node_get_object_length (const GstAmfNode * node)
 {
@@ -46,15 +46,31 @@ typedef enum {
 } GstAmfType;
 
 
+typedef struct _GstAmfIndex GstAmfIndex;
+
 struct _GstAmfNode {
   GstAmfType type;
   int int_val;
   double double_val;
   char *string_val;
   GPtrArray *array_val;
+
+  /* private */
+  GstAmfIndex *index;
 };
 typedef struct _GstAmfNode GstAmfNode;
 
+/* Field names that get looked up often, see
+ * gst_amf_node_get_object_by_key(): onStatus and connect replies, and
+ * onMetaData */
+typedef enum {
+  GST_AMF_KEY_CODE,
+  GST_AMF_KEY_SECURE_TOKEN,
+  GST_AMF_KEY_VIDEOCODECID,
+  GST_AMF_KEY_AUDIOCODECID,
+  GST_AMF_N_KEYS
+} GstAmfKey;
+
 GstAmfNode * gst_amf_node_new (GstAmfType type);
 void gst_amf_node_free (GstAmfNode *node);
 void gst_amf_node_dump (GstAmfNode *node);
@@ -74,7 +90,13 @@ void gst_amf_object_append_take (GstAmfNode *node, const char *s,
 gboolean gst_amf_node_get_boolean (const GstAmfNode *node);
 const char *gst_amf_node_get_string (const GstAmfNode *node);
 double gst_amf_node_get_number (const GstAmfNode *node);
+/* Objects with many fields, like onMetaData, get a hash index on the
+ * first lookup, which is stored in the node.  So lookups are not
+ * thread-safe, even on a const node. */
 const GstAmfNode *gst_amf_node_get_object (const GstAmfNode *node, const char *field_name);
+const GstAmfNode *gst_amf_node_get_object_by_key (const GstAmfNode *node,
+    GstAmfKey key);
+const char *gst_amf_key_get_name (GstAmfKey key);
 int gst_amf_node_get_object_length (const GstAmfNode *node);
 const GstAmfNode *gst_amf_node_get_object_by_index (const GstAmfNode *node, int i);
 
@@ -83,6 +105,105 @@ void gst_amf_object_set_number (GstAmfNode *node, const char *field_name,
 void gst_amf_object_set_string (GstAmfNode *node, const char *field_name,
     const char *s);
 
+/* lazy reading */
+
+/* Cursor over AMF0 values that decodes only what is asked for.  The read
+ * functions return FALSE without moving if the next value has another
+ * type, and set @error if the data is truncated or malformed. */
+typedef struct _GstAmfReader GstAmfReader;
+struct _GstAmfReader {
+  const guint8 *data;
+  gsize size;
+  gsize offset;
+  gboolean error;
+};
+
+void gst_amf_reader_init (GstAmfReader *reader, const guint8 *data,
+    gsize size);
+gboolean gst_amf_reader_at_end (const GstAmfReader *reader);
+int gst_amf_reader_peek_type (const GstAmfReader *reader);
+gboolean gst_amf_reader_read_number (GstAmfReader *reader, double *value);
+gboolean gst_amf_reader_read_boolean (GstAmfReader *reader,
+    gboolean *value);
+gboolean gst_amf_reader_read_string (GstAmfReader *reader, const char **s,
+    gsize *length);
+gboolean gst_amf_reader_enter_object (GstAmfReader *reader);
+gboolean gst_amf_reader_next_field (GstAmfReader *reader, const char **name,
+    gsize *length);
+gboolean gst_amf_reader_skip (GstAmfReader *reader);
+gboolean gst_amf_reader_validate (GstAmfReader *reader);
+GstAmfNode * gst_amf_reader_read_node (GstAmfReader *reader);
+
+/* arena parsing */
+
+typedef struct _GstAmfArena GstAmfArena;
+typedef struct _GstAmfValue GstAmfValue;
+typedef struct _GstAmfField GstAmfField;
+
+/* Compact parse tree allocated from a GstAmfArena.  Strings point into the
+ * parsed bytes, or into the arena where invalid UTF-8 in a value had to
+ * be replaced, and are not NUL-terminated.  Objects, ECMA arrays and
+ * strict arrays keep their members in @fields; strict array members have
+ * no name. */
+struct _GstAmfValue {
+  guint8 type;
+  /* string length or number of fields */
+  guint32 length;
+  union {
+    double number;
+    gboolean boolean;
+    const char *string;
+    const GstAmfField *fields;
+  } v;
+};
+
+struct _GstAmfField {
+  const char *name;
+  guint16 name_length;
+  GstAmfValue value;
+};
+
+GstAmfArena * gst_amf_arena_new (void);
+void gst_amf_arena_free (GstAmfArena *arena);
+void gst_amf_arena_reset (GstAmfArena *arena);
+const GstAmfValue * gst_amf_arena_parse (GstAmfArena *arena, GBytes *bytes);
+
+const GstAmfValue * gst_amf_value_get_index (const GstAmfValue *value,
+    guint index);
+const GstAmfValue * gst_amf_value_get_field (const GstAmfValue *value,
+    const char *name);
+double gst_amf_value_get_number (const GstAmfValue *value);
+gboolean gst_amf_value_string_equal (const GstAmfValue *value,
+    const char *s);
+char * gst_amf_value_dup_string (const GstAmfValue *value);
+
+/* serialization */
+
+gsize gst_amf_node_get_serialized_size (const GstAmfNode *node);
+gsize gst_amf_node_serialize (const GstAmfNode *node, guint8 *data,
+    gsize size);
+gsize gst_amf_command_get_serialized_size (const char *command_name,
+    guint n_args, GstAmfNode **args);
+gsize gst_amf_serialize_command_into (guint8 *data, gsize size,
+    const char *command_name, int transaction_id, guint n_args,
+    GstAmfNode **args);
+GBytes * gst_amf_serialize_commandv (const char *command_name,
+    int transaction_id, guint n_args, GstAmfNode **args);
+/* command templates */
+
+typedef struct _GstAmfTemplate GstAmfTemplate;
+
+GstAmfTemplate * gst_amf_template_new (const char *command_name,
+    guint n_args, GstAmfNode **args);
+void gst_amf_template_free (GstAmfTemplate *tmpl);
+guint gst_amf_template_get_n_slots (const GstAmfTemplate *tmpl);
+gsize gst_amf_template_get_size (const GstAmfTemplate *tmpl,
+    const char *const *strings);
+gsize gst_amf_template_fill_into (const GstAmfTemplate *tmpl, guint8 *data,
+    gsize size, int transaction_id, const char *const *strings);
+GBytes * gst_amf_template_fill (const GstAmfTemplate *tmpl,
+    int transaction_id, const char *const *strings);
+
 GBytes * gst_amf_serialize_command (const char *command_name,
     int transaction_id, GstAmfNode *command_object, GstAmfNode *optional_args);
 GBytes * gst_amf_serialize_command2 (const char *command_name,
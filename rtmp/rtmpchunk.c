@@ -121,6 +121,9 @@ gst_rtmp_chunk_finalize (GObject * object)
   if (rtmpchunk->payload) {
     g_bytes_unref (rtmpchunk->payload);
   }
+  if (rtmpchunk->payload_prefix) {
+    g_bytes_unref (rtmpchunk->payload_prefix);
+  }
 
   G_OBJECT_CLASS (gst_rtmp_chunk_parent_class)->finalize (object);
 }
@@ -186,33 +189,54 @@ gst_rtmp_chunk_parse_header2 (GstRtmpChunkHeader * header, GBytes * bytes,
     /* SRSLY:  "Message stream ID is stored in little-endian format." */
     header->stream_id = GST_READ_UINT32_LE (data + offset + 7);
     offset += 11;
-    if (header->timestamp == 0xffffff) {
-      GST_ERROR ("untested long timestamp");
+    header->extended_timestamp = (header->timestamp == 0xffffff);
+    if (header->extended_timestamp) {
+      if (offset + 4 > size)
+        goto short_header;
       header->timestamp = GST_READ_UINT32_BE (data + offset);
       offset += 4;
     }
   } else {
+    guint32 delta = 0;
+
     header->timestamp = previous_header->timestamp;
     header->message_length = previous_header->message_length;
     header->message_type_id = previous_header->message_type_id;
     header->stream_id = previous_header->stream_id;
 
     if (header->format == 1) {
-      header->timestamp += GST_READ_UINT24_BE (data + offset);
+      delta = GST_READ_UINT24_BE (data + offset);
       header->message_length = GST_READ_UINT24_BE (data + offset + 3);
       header->message_type_id = data[offset + 6];
       offset += 7;
+      header->extended_timestamp = (delta == 0xffffff);
     } else if (header->format == 2) {
-      header->timestamp += GST_READ_UINT24_BE (data + offset);
+      delta = GST_READ_UINT24_BE (data + offset);
       offset += 3;
+      header->extended_timestamp = (delta == 0xffffff);
     } else {
-      /* ok */
+      /* continuation chunks repeat the extended timestamp of the header
+       * they continue */
+      header->extended_timestamp = previous_header->extended_timestamp;
+    }
+
+    if (header->extended_timestamp) {
+      if (offset + 4 > size)
+        goto short_header;
+      if (header->format != 3)
+        delta = GST_READ_UINT32_BE (data + offset);
+      offset += 4;
     }
+    header->timestamp += delta;
   }
 
   header->header_size = offset;
 
   return (header->header_size <= size);
+
+short_header:
+  header->header_size = offset + 4;
+  return FALSE;
 }
 
 GBytes *
@@ -234,7 +258,7 @@ gst_rtmp_chunk_serialize (GstRtmpChunk * chunk,
   }
 
   g_assert (chunk->chunk_stream_id < 64);
-  data = g_malloc (chunksize + 12 + (chunksize / max_chunk_size));
+  data = g_malloc (chunksize + 16 + 5 * (chunksize / max_chunk_size));
 
   /* FIXME this is incomplete and inefficient */
   header_fmt = 0;
@@ -248,13 +272,16 @@ gst_rtmp_chunk_serialize (GstRtmpChunk * chunk,
   g_assert (chunk->chunk_stream_id < 64);
   data[0] = (header_fmt << 6) | (chunk->chunk_stream_id);
   if (header_fmt == 0) {
-    g_assert (chunk->timestamp < 0xffffff);
-    GST_WRITE_UINT24_BE (data + 1, chunk->timestamp);
+    GST_WRITE_UINT24_BE (data + 1, MIN (chunk->timestamp, 0xffffff));
     GST_WRITE_UINT24_BE (data + 4, chunk->message_length);
     data[7] = chunk->message_type_id;
     /* SRSLY:  "Message stream ID is stored in little-endian format." */
     GST_WRITE_UINT32_LE (data + 8, chunk->stream_id);
     offset = 12;
+    if (chunk->timestamp >= 0xffffff) {
+      GST_WRITE_UINT32_BE (data + offset, chunk->timestamp);
+      offset += 4;
+    }
   } else {
     GST_WRITE_UINT24_BE (data + 1, chunk->timestamp);
     GST_WRITE_UINT24_BE (data + 4, chunk->message_length);
@@ -265,6 +292,10 @@ gst_rtmp_chunk_serialize (GstRtmpChunk * chunk,
     if (i != 0) {
       data[offset] = 0xc0 | chunk->chunk_stream_id;
       offset++;
+      if (chunk->timestamp >= 0xffffff) {
+        GST_WRITE_UINT32_BE (data + offset, chunk->timestamp);
+        offset += 4;
+      }
     }
     memcpy (data + offset, chunkdata + i, MIN (chunksize - i, max_chunk_size));
     offset += MIN (chunksize - i, max_chunk_size);
@@ -275,6 +306,145 @@ gst_rtmp_chunk_serialize (GstRtmpChunk * chunk,
   return g_bytes_new_take (data, offset);
 }
 
+static gsize
+gst_rtmp_chunk_get_payload_size (GstRtmpChunk * chunk)
+{
+  gsize size;
+
+  size = chunk->payload ? g_bytes_get_size (chunk->payload) : 0;
+  if (chunk->payload_prefix)
+    size += g_bytes_get_size (chunk->payload_prefix);
+
+  return size;
+}
+
+/* Appends the header of the next chunk of @chunk, starting at
+ * @entry->offset, to @array.  Returns the number of payload bytes that
+ * follow the header, starting at *@payload_offset, and advances
+ * @entry->offset past them.  Messages on different chunk streams may be
+ * interleaved by calling this alternately with their entries.  The first
+ * chunk of a message uses a type 1 or 2 header if the previous message on
+ * the chunk stream allows it.  When the message is complete,
+ * @entry->offset is reset to 0. */
+gsize
+gst_rtmp_chunk_serialize_next_header (GstRtmpChunk * chunk,
+    GstRtmpChunkCacheEntry * entry, gsize max_chunk_size, GByteArray * array,
+    gsize * payload_offset)
+{
+  GstRtmpChunkHeader *previous_header = &entry->previous_header;
+  guint8 header[16];
+  gsize chunksize;
+  gsize len;
+
+  chunksize = gst_rtmp_chunk_get_payload_size (chunk);
+  if (chunk->message_length != chunksize) {
+    GST_ERROR ("message_length wrong (%" G_GSIZE_FORMAT " should be %"
+        G_GSIZE_FORMAT ")", chunk->message_length, chunksize);
+  }
+
+  g_assert (chunk->chunk_stream_id < 64);
+  g_assert (entry->offset <= chunksize);
+
+  if (entry->offset == 0) {
+    guint32 delta = chunk->timestamp - previous_header->timestamp;
+    int header_fmt = 0;
+
+    /* header_size is only set once a header has been sent */
+    if (previous_header->header_size > 0 &&
+        previous_header->stream_id == chunk->stream_id &&
+        chunk->timestamp >= previous_header->timestamp && delta < 0xffffff) {
+      if (previous_header->message_length == chunk->message_length &&
+          previous_header->message_type_id == chunk->message_type_id) {
+        header_fmt = 2;
+      } else {
+        header_fmt = 1;
+      }
+    }
+
+    header[0] = (header_fmt << 6) | chunk->chunk_stream_id;
+    if (header_fmt == 0) {
+      /* timestamps that don't fit in 24 bits follow the header, and are
+       * repeated after every continuation header of the message */
+      GST_WRITE_UINT24_BE (header + 1, MIN (chunk->timestamp, 0xffffff));
+      GST_WRITE_UINT24_BE (header + 4, chunk->message_length);
+      header[7] = chunk->message_type_id;
+      /* SRSLY:  "Message stream ID is stored in little-endian format." */
+      GST_WRITE_UINT32_LE (header + 8, chunk->stream_id);
+      if (chunk->timestamp >= 0xffffff) {
+        GST_WRITE_UINT32_BE (header + 12, chunk->timestamp);
+        g_byte_array_append (array, header, 16);
+      } else {
+        g_byte_array_append (array, header, 12);
+      }
+    } else if (header_fmt == 1) {
+      GST_WRITE_UINT24_BE (header + 1, delta);
+      GST_WRITE_UINT24_BE (header + 4, chunk->message_length);
+      header[7] = chunk->message_type_id;
+      g_byte_array_append (array, header, 8);
+    } else {
+      GST_WRITE_UINT24_BE (header + 1, delta);
+      g_byte_array_append (array, header, 4);
+    }
+
+    /* the peer tracks headers as they arrive, whether or not the
+     * message is completed */
+    gst_rtmp_chunk_cache_update (entry, chunk);
+    previous_header->header_size = 1;
+    previous_header->extended_timestamp = (header_fmt == 0 &&
+        chunk->timestamp >= 0xffffff);
+  } else {
+    header[0] = 0xc0 | chunk->chunk_stream_id;
+    if (previous_header->extended_timestamp) {
+      GST_WRITE_UINT32_BE (header + 1, chunk->timestamp);
+      g_byte_array_append (array, header, 5);
+    } else {
+      g_byte_array_append (array, header, 1);
+    }
+  }
+
+  *payload_offset = entry->offset;
+  len = MIN (chunksize - entry->offset, max_chunk_size);
+  entry->offset += len;
+
+  if (entry->offset == chunksize) {
+    entry->offset = 0;
+  }
+
+  return len;
+}
+
+/* Like gst_rtmp_chunk_serialize_next_header(), but also copies the
+ * payload of the chunk into @array. */
+void
+gst_rtmp_chunk_serialize_next (GstRtmpChunk * chunk,
+    GstRtmpChunkCacheEntry * entry, gsize max_chunk_size, GByteArray * array)
+{
+  const guint8 *data;
+  gsize offset;
+  gsize len;
+  gsize size;
+
+  len = gst_rtmp_chunk_serialize_next_header (chunk, entry, max_chunk_size,
+      array, &offset);
+
+  if (chunk->payload_prefix && len > 0) {
+    data = g_bytes_get_data (chunk->payload_prefix, &size);
+    if (offset < size) {
+      gsize n = MIN (len, size - offset);
+      g_byte_array_append (array, data + offset, n);
+      len -= n;
+      offset = 0;
+    } else {
+      offset -= size;
+    }
+  }
+
+  if (len > 0) {
+    data = g_bytes_get_data (chunk->payload, NULL);
+    g_byte_array_append (array, data + offset, len);
+  }
+}
+
 void
 gst_rtmp_chunk_set_chunk_stream_id (GstRtmpChunk * chunk,
     guint32 chunk_stream_id)
@@ -297,6 +467,17 @@ gst_rtmp_chunk_set_payload (GstRtmpChunk * chunk, GBytes * payload)
   chunk->payload = payload;
 }
 
+/* @prefix is sent in front of the payload, without copying either.
+ * message_length must cover both. */
+void
+gst_rtmp_chunk_set_payload_prefix (GstRtmpChunk * chunk, GBytes * prefix)
+{
+  if (chunk->payload_prefix) {
+    g_bytes_unref (chunk->payload_prefix);
+  }
+  chunk->payload_prefix = prefix;
+}
+
 guint32
 gst_rtmp_chunk_get_chunk_stream_id (GstRtmpChunk * chunk)
 {
@@ -356,53 +537,81 @@ gst_rtmp_chunk_cache_update (GstRtmpChunkCacheEntry * entry,
   entry->previous_header.stream_id = chunk->stream_id;
 }
 
+/* Discards a partially reassembled message, as requested by an ABORT
+ * message from the peer. */
+void
+gst_rtmp_chunk_cache_abort (GstRtmpChunkCache * cache, guint32 chunk_stream_id)
+{
+  GstRtmpChunkCacheEntry *entry;
+  int i;
+
+  for (i = 0; i < (int) cache->len; i++) {
+    entry = &g_array_index (cache, GstRtmpChunkCacheEntry, i);
+    if (entry->previous_header.chunk_stream_id != chunk_stream_id)
+      continue;
+
+    if (entry->chunk) {
+      GST_DEBUG ("aborting message on chunk stream %d after %" G_GSIZE_FORMAT
+          " of %" G_GSIZE_FORMAT " bytes", chunk_stream_id, entry->offset,
+          entry->chunk->message_length);
+      g_object_unref (entry->chunk);
+      entry->chunk = NULL;
+    }
+    g_free (entry->payload);
+    entry->payload = NULL;
+    entry->offset = 0;
+    return;
+  }
+}
+
+/* Returns FALSE if the message doesn't start with a command name and a
+ * transaction id, or if a value is malformed.  Whatever could be parsed
+ * is returned either way; @command_object may be NULL. */
 gboolean
 gst_rtmp_chunk_parse_message (GstRtmpChunk * chunk, char **command_name,
     double *transaction_id, GstAmfNode ** command_object,
     GstAmfNode ** optional_args)
 {
-  gsize n_parsed;
+  GstAmfReader reader;
   const guint8 *data;
   gsize size;
-  int offset;
-  GstAmfNode *n1, *n2, *n3, *n4;
+  const char *name = NULL;
+  gsize name_length = 0;
+  double id = 0;
+  GstAmfNode *n3 = NULL;
+  GstAmfNode *n4 = NULL;
+  gboolean ret;
 
-  offset = 0;
   data = g_bytes_get_data (chunk->payload, &size);
-  n1 = gst_amf_node_new_parse (data + offset, size - offset, &n_parsed);
-  offset += n_parsed;
-  n2 = gst_amf_node_new_parse (data + offset, size - offset, &n_parsed);
-  offset += n_parsed;
-  n3 = gst_amf_node_new_parse (data + offset, size - offset, &n_parsed);
-  offset += n_parsed;
-  if (offset < (int) size) {
-    n4 = gst_amf_node_new_parse (data + offset, size - offset, &n_parsed);
-  } else {
-    n4 = NULL;
+  gst_amf_reader_init (&reader, data, size);
+  ret = gst_amf_reader_read_string (&reader, &name, &name_length) &&
+      gst_amf_reader_read_number (&reader, &id);
+  if (ret) {
+    n3 = gst_amf_reader_read_node (&reader);
+    if (!gst_amf_reader_at_end (&reader)) {
+      n4 = gst_amf_reader_read_node (&reader);
+    }
+    ret = !reader.error;
   }
 
   if (command_name) {
-    *command_name = g_strdup (gst_amf_node_get_string (n1));
+    *command_name = name ? g_strndup (name, name_length) : NULL;
   }
-  gst_amf_node_free (n1);
-
   if (transaction_id) {
-    *transaction_id = gst_amf_node_get_number (n2);
+    *transaction_id = id;
   }
-  gst_amf_node_free (n2);
 
   if (command_object) {
     *command_object = n3;
-  } else {
+  } else if (n3) {
     gst_amf_node_free (n3);
   }
 
   if (optional_args) {
     *optional_args = n4;
-  } else {
-    if (n4)
-      gst_amf_node_free (n4);
+  } else if (n4) {
+    gst_amf_node_free (n4);
   }
 
-  return TRUE;
+  return ret;
 }
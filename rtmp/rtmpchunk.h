@@ -45,6 +45,7 @@ struct _GstRtmpChunkHeader {
   gsize message_length;
   int message_type_id;
   guint32 stream_id;
+  gboolean extended_timestamp;
 };
 
 struct _GstRtmpChunkCacheEntry {
@@ -65,6 +66,8 @@ struct _GstRtmpChunk
   guint32 stream_id;
 
   GBytes *payload;
+  /* output only: sent in front of payload, counted in message_length */
+  GBytes *payload_prefix;
 };
 
 struct _GstRtmpChunkClass
@@ -113,6 +116,12 @@ typedef enum {
   GST_RTMP_USER_CONTROL_PING_RESPONSE = 7,
 } GstRtmpUserControl;
 
+typedef enum {
+  GST_RTMP_PEER_BANDWIDTH_HARD = 0,
+  GST_RTMP_PEER_BANDWIDTH_SOFT = 1,
+  GST_RTMP_PEER_BANDWIDTH_DYNAMIC = 2,
+} GstRtmpPeerBandwidthLimitType;
+
 GType gst_rtmp_chunk_get_type (void);
 
 GstRtmpChunk *gst_rtmp_chunk_new (void);
@@ -122,10 +131,16 @@ GstRtmpChunk * gst_rtmp_chunk_new_parse (GBytes *bytes, gsize *chunk_size,
     GstRtmpChunkCache *cache);
 GBytes * gst_rtmp_chunk_serialize (GstRtmpChunk *chunk,
     GstRtmpChunkHeader *previous_header, gsize max_chunk_size);
+gsize gst_rtmp_chunk_serialize_next_header (GstRtmpChunk *chunk,
+    GstRtmpChunkCacheEntry *entry, gsize max_chunk_size, GByteArray *array,
+    gsize *payload_offset);
+void gst_rtmp_chunk_serialize_next (GstRtmpChunk *chunk,
+    GstRtmpChunkCacheEntry *entry, gsize max_chunk_size, GByteArray *array);
 
 void gst_rtmp_chunk_set_chunk_stream_id (GstRtmpChunk *chunk, guint32 chunk_stream_id);
 void gst_rtmp_chunk_set_timestamp (GstRtmpChunk *chunk, guint32 timestamp);
 void gst_rtmp_chunk_set_payload (GstRtmpChunk *chunk, GBytes *payload);
+void gst_rtmp_chunk_set_payload_prefix (GstRtmpChunk *chunk, GBytes *prefix);
 
 guint32 gst_rtmp_chunk_get_chunk_stream_id (GstRtmpChunk *chunk);
 guint32 gst_rtmp_chunk_get_timestamp (GstRtmpChunk *chunk);
@@ -148,6 +163,8 @@ GstRtmpChunkCacheEntry * gst_rtmp_chunk_cache_get (
     GstRtmpChunkCache *cache, guint32 chunk_stream_id);
 void gst_rtmp_chunk_cache_update (GstRtmpChunkCacheEntry * entry,
     GstRtmpChunk * chunk);
+void gst_rtmp_chunk_cache_abort (GstRtmpChunkCache *cache,
+    guint32 chunk_stream_id);
 
 G_END_DECLS
 
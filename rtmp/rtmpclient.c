@@ -41,6 +41,37 @@ static void gst_rtmp_client_finalize (GObject * object);
 static void
 gst_rtmp_client_connect_done (GObject * source, GAsyncResult * result,
     gpointer user_data);
+static gboolean gst_rtmp_client_pool_connected (gpointer user_data);
+
+typedef struct _PoolEndpoint PoolEndpoint;
+typedef struct _PoolConnection PoolConnection;
+
+static void pool_start (void);
+static void pool_stop (void);
+static char *pool_key (GstRtmpClient * client);
+static PoolEndpoint *pool_attach (GstRtmpClient * client);
+static void pool_detach (GstRtmpClient * client);
+static void pool_update_size (PoolEndpoint * endpoint);
+static void pool_endpoint_maybe_free (PoolEndpoint * endpoint);
+static GSocketConnection *pool_take (GstRtmpClient * client);
+static GSocketConnectable *pool_get_address (GstRtmpClient * client);
+static gboolean pool_refill (gpointer user_data);
+static gboolean pool_maintain (gpointer user_data);
+static void pool_top_up (PoolEndpoint * endpoint);
+static void pool_connect_address (PoolEndpoint * endpoint);
+static void pool_connect (PoolConnection * pc);
+static void pool_resolve_done (GObject * source, GAsyncResult * result,
+    gpointer user_data);
+static void pool_connect_done (GObject * source, GAsyncResult * result,
+    gpointer user_data);
+static void pool_handshake_step (PoolConnection * pc);
+static void pool_write_done (GObject * source, GAsyncResult * result,
+    gpointer user_data);
+static void pool_read_done (GObject * source, GAsyncResult * result,
+    gpointer user_data);
+static void pool_handshake_failed (PoolConnection * pc, GError * error);
+static gboolean pool_connection_is_usable (PoolConnection * pc, gint64 now);
+static void pool_connection_free (PoolConnection * pc);
 #if 0
 static void
 gst_rtmp_client_handshake_done (GObject * source, GAsyncResult * result,
@@ -52,12 +83,91 @@ enum
   PROP_0,
   PROP_SERVER_ADDRESS,
   PROP_SERVER_PORT,
-  PROP_TIMEOUT
+  PROP_TIMEOUT,
+  PROP_POOL_SIZE,
+  PROP_POOL_HITS,
+  PROP_POOL_MISSES
 };
 
 #define DEFAULT_SERVER_ADDRESS ""
 #define DEFAULT_SERVER_PORT 1935
 #define DEFAULT_TIMEOUT 5
+#define DEFAULT_POOL_SIZE 0
+
+/* servers drop connections that don't send connect after a while */
+#define POOL_MAX_IDLE_TIME (30 * G_USEC_PER_SEC)
+#define POOL_DNS_TTL (60 * G_USEC_PER_SEC)
+#define POOL_MAINTENANCE_INTERVAL 5
+#define HANDSHAKE_SIZE (1 + 1536 + 1536)
+
+/* connection pool
+ *
+ * Connections are made and handshaken ahead of time, per server address
+ * and port, on a thread of their own.  DNS results are cached for
+ * POOL_DNS_TTL, and the addresses are tried in turn, starting with the
+ * one that worked last.  Idle connections have TCP keepalive on and are
+ * replaced after POOL_MAX_IDLE_TIME, or as soon as the server sends
+ * anything or closes them.
+ *
+ * A client with a pool-size attaches to the endpoint for its server when
+ * it connects, and the endpoint keeps as many connections as the largest
+ * pool-size attached.  When the last client detaches, by going back to
+ * pool-size 0 or being finalized, the endpoint drops its idle
+ * connections and is freed once the ones being made are done.  The
+ * thread exits when no endpoints are left. */
+
+typedef enum
+{
+  POOL_WRITE_C0C1,
+  POOL_READ_S0S1S2,
+  POOL_WRITE_C2
+} PoolState;
+
+struct _PoolEndpoint
+{
+  char *key;
+  char *host;
+  int port;
+  /* attached clients, not referenced */
+  GList *clients;
+  /* largest pool-size of the clients */
+  guint size;
+  /* connections being made, and those waiting for DNS */
+  guint pending;
+  guint waiting;
+  GQueue idle;
+  GList *addresses;
+  gint64 addresses_time;
+  /* the address to try first, and whether connecting to it worked */
+  guint address_index;
+  gboolean address_ok;
+  gboolean resolving;
+  guint hits;
+  guint misses;
+};
+
+struct _PoolConnection
+{
+  PoolEndpoint *endpoint;
+  GSocketConnection *connection;
+  PoolState state;
+  guint8 *data;
+  gsize offset;
+  gint64 ready_time;
+  /* while connecting: the address, and how many have been tried */
+  guint address_index;
+  guint tries;
+};
+
+/* protects everything in the endpoints, and the thread state */
+static GMutex pool_lock;
+/* the endpoints with clients attached, by pool_key() */
+static GHashTable *pool_endpoints;
+/* including those that are waiting for connects to finish */
+static guint pool_n_endpoints;
+static GMainContext *pool_context;
+static GMainLoop *pool_main_loop;
+static GSource *pool_maintain_source;
 
 /* pad templates */
 
@@ -91,6 +201,19 @@ gst_rtmp_client_class_init (GstRtmpClientClass * klass)
       g_param_spec_int ("timeout", "Socket timeout",
           "Socket timeout, in seconds", 0, 1000, DEFAULT_TIMEOUT,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_POOL_SIZE,
+      g_param_spec_uint ("pool-size", "Pool size",
+          "Number of handshaken connections to keep ready for this server "
+          "(0 = no pool)", 0, 64, DEFAULT_POOL_SIZE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_POOL_HITS,
+      g_param_spec_uint ("pool-hits", "Pool hits",
+          "Connects to this server that used a pooled connection", 0,
+          G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+  g_object_class_install_property (gobject_class, PROP_POOL_MISSES,
+      g_param_spec_uint ("pool-misses", "Pool misses",
+          "Connects to this server that found the pool empty", 0,
+          G_MAXUINT, 0, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
 
 }
 
@@ -99,6 +222,7 @@ gst_rtmp_client_init (GstRtmpClient * rtmpclient)
 {
   rtmpclient->server_address = g_strdup (DEFAULT_SERVER_ADDRESS);
   rtmpclient->server_port = DEFAULT_SERVER_PORT;
+  rtmpclient->pool_size = DEFAULT_POOL_SIZE;
 
   rtmpclient->connection = gst_rtmp_connection_new ();
 }
@@ -122,6 +246,9 @@ gst_rtmp_client_set_property (GObject * object, guint property_id,
     case PROP_TIMEOUT:
       rtmpclient->timeout = g_value_get_int (value);
       break;
+    case PROP_POOL_SIZE:
+      gst_rtmp_client_set_pool_size (rtmpclient, g_value_get_uint (value));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -146,6 +273,23 @@ gst_rtmp_client_get_property (GObject * object, guint property_id,
     case PROP_TIMEOUT:
       g_value_set_int (value, rtmpclient->timeout);
       break;
+    case PROP_POOL_SIZE:
+      g_value_set_uint (value, rtmpclient->pool_size);
+      break;
+    case PROP_POOL_HITS:{
+      guint hits;
+
+      gst_rtmp_client_get_pool_stats (rtmpclient, &hits, NULL);
+      g_value_set_uint (value, hits);
+      break;
+    }
+    case PROP_POOL_MISSES:{
+      guint misses;
+
+      gst_rtmp_client_get_pool_stats (rtmpclient, NULL, &misses);
+      g_value_set_uint (value, misses);
+      break;
+    }
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
       break;
@@ -172,6 +316,10 @@ gst_rtmp_client_finalize (GObject * object)
   GST_DEBUG_OBJECT (rtmpclient, "finalize");
 
   /* clean up object here */
+  g_mutex_lock (&pool_lock);
+  pool_detach (rtmpclient);
+  g_mutex_unlock (&pool_lock);
+
   g_free (rtmpclient->server_address);
   g_free (rtmpclient->stream);
   g_clear_object (&rtmpclient->connection);
@@ -233,7 +381,26 @@ gst_rtmp_client_connect_async (GstRtmpClient * client,
   client->cancellable = cancellable;
   client->async = async;
 
-  addr = g_network_address_new (client->server_address, client->server_port);
+  if (client->pool_size > 0) {
+    client->socket_connection = pool_take (client);
+    if (client->socket_connection) {
+      GMainContext *context;
+      GSource *source;
+
+      GST_DEBUG ("using pooled connection");
+      context = g_main_context_ref_thread_default ();
+      source = g_idle_source_new ();
+      g_source_set_callback (source, gst_rtmp_client_pool_connected, client,
+          NULL);
+      g_source_attach (source, context);
+      g_source_unref (source);
+      g_main_context_unref (context);
+      return;
+    }
+    addr = pool_get_address (client);
+  } else {
+    addr = g_network_address_new (client->server_address, client->server_port);
+  }
   socket_client = g_socket_client_new ();
   g_socket_client_set_timeout (socket_client, client->timeout);
 
@@ -319,8 +486,619 @@ gst_rtmp_client_connect_finish (GstRtmpClient * client,
   return ret;
 }
 
+static gboolean
+gst_rtmp_client_pool_connected (gpointer user_data)
+{
+  GstRtmpClient *client = GST_RTMP_CLIENT (user_data);
+
+  gst_rtmp_connection_set_socket_connection (client->connection,
+      client->socket_connection);
+  gst_rtmp_connection_start_handshaked (client->connection);
+
+  g_simple_async_result_complete (client->async);
+  g_object_unref (client->async);
+  client->async = NULL;
+
+  return G_SOURCE_REMOVE;
+}
+
 GstRtmpConnection *
 gst_rtmp_client_get_connection (GstRtmpClient * client)
 {
   return client->connection;
 }
+
+/* Keeps @size connections to the client's server handshaken and ready,
+ * shared with every other client using the same server address and
+ * port.  Takes effect with the next connect; 0 leaves the pool at once. */
+void
+gst_rtmp_client_set_pool_size (GstRtmpClient * client, guint size)
+{
+  g_mutex_lock (&pool_lock);
+  client->pool_size = size;
+  if (client->pool_endpoint) {
+    if (size == 0) {
+      pool_detach (client);
+    } else {
+      pool_update_size (client->pool_endpoint);
+    }
+  }
+  g_mutex_unlock (&pool_lock);
+}
+
+/* Connects to the client's server that found a pooled connection and
+ * that didn't, counted over all clients for as long as some client has
+ * been using the pool.  Doesn't start the pool. */
+void
+gst_rtmp_client_get_pool_stats (GstRtmpClient * client, guint * hits,
+    guint * misses)
+{
+  PoolEndpoint *endpoint = NULL;
+  char *key;
+
+  g_mutex_lock (&pool_lock);
+  if (pool_endpoints) {
+    key = pool_key (client);
+    endpoint = g_hash_table_lookup (pool_endpoints, key);
+    g_free (key);
+  }
+  if (hits)
+    *hits = endpoint ? endpoint->hits : 0;
+  if (misses)
+    *misses = endpoint ? endpoint->misses : 0;
+  g_mutex_unlock (&pool_lock);
+}
+
+static gpointer
+pool_thread_func (gpointer user_data)
+{
+  GMainLoop *main_loop = user_data;
+
+  g_main_context_push_thread_default (pool_context);
+  g_main_loop_run (main_loop);
+  g_main_context_pop_thread_default (pool_context);
+  g_main_loop_unref (main_loop);
+
+  return NULL;
+}
+
+/* Starts the pool thread if it isn't running.  Called with the pool lock
+ * held. */
+static void
+pool_start (void)
+{
+  if (!pool_endpoints) {
+    pool_endpoints = g_hash_table_new (g_str_hash, g_str_equal);
+    pool_context = g_main_context_new ();
+  }
+  if (pool_main_loop)
+    return;
+
+  GST_DEBUG ("starting pool thread");
+  pool_main_loop = g_main_loop_new (pool_context, FALSE);
+
+  pool_maintain_source =
+      g_timeout_source_new_seconds (POOL_MAINTENANCE_INTERVAL);
+  g_source_set_callback (pool_maintain_source, pool_maintain, NULL, NULL);
+  g_source_attach (pool_maintain_source, pool_context);
+
+  g_thread_unref (g_thread_new ("rtmp-pool", pool_thread_func,
+          g_main_loop_ref (pool_main_loop)));
+}
+
+/* Called with the pool lock held, once the last endpoint is gone */
+static void
+pool_stop (void)
+{
+  GST_DEBUG ("stopping pool thread");
+
+  g_source_destroy (pool_maintain_source);
+  g_source_unref (pool_maintain_source);
+  pool_maintain_source = NULL;
+
+  /* the thread exits on its own; a new one may already be waiting for
+   * the context by then */
+  g_main_loop_quit (pool_main_loop);
+  g_main_loop_unref (pool_main_loop);
+  pool_main_loop = NULL;
+}
+
+static char *
+pool_key (GstRtmpClient * client)
+{
+  return g_strdup_printf ("%s:%d", client->server_address,
+      client->server_port);
+}
+
+/* Attaches @client to the endpoint for its server, leaving the one it
+ * was attached to if the server changed.  Called with the pool lock
+ * held. */
+static PoolEndpoint *
+pool_attach (GstRtmpClient * client)
+{
+  PoolEndpoint *endpoint = client->pool_endpoint;
+  char *key;
+
+  key = pool_key (client);
+  if (endpoint && strcmp (endpoint->key, key) != 0) {
+    pool_detach (client);
+    endpoint = NULL;
+  }
+
+  if (!endpoint) {
+    pool_start ();
+    endpoint = g_hash_table_lookup (pool_endpoints, key);
+    if (!endpoint) {
+      endpoint = g_new0 (PoolEndpoint, 1);
+      endpoint->key = g_strdup (key);
+      endpoint->host = g_strdup (client->server_address);
+      endpoint->port = client->server_port;
+      g_queue_init (&endpoint->idle);
+      g_hash_table_insert (pool_endpoints, endpoint->key, endpoint);
+      pool_n_endpoints++;
+    }
+    endpoint->clients = g_list_prepend (endpoint->clients, client);
+    client->pool_endpoint = endpoint;
+  }
+  g_free (key);
+
+  pool_update_size (endpoint);
+
+  return endpoint;
+}
+
+/* Called with the pool lock held */
+static void
+pool_detach (GstRtmpClient * client)
+{
+  PoolEndpoint *endpoint = client->pool_endpoint;
+  PoolConnection *pc;
+
+  if (!endpoint)
+    return;
+
+  client->pool_endpoint = NULL;
+  endpoint->clients = g_list_remove (endpoint->clients, client);
+  if (endpoint->clients) {
+    pool_update_size (endpoint);
+    return;
+  }
+
+  GST_DEBUG ("no more clients for %s:%d", endpoint->host, endpoint->port);
+  g_hash_table_remove (pool_endpoints, endpoint->key);
+  endpoint->size = 0;
+  while ((pc = g_queue_pop_head (&endpoint->idle))) {
+    pool_connection_free (pc);
+  }
+  pool_endpoint_maybe_free (endpoint);
+}
+
+/* Called with the pool lock held.  A smaller size takes effect with the
+ * next top-up. */
+static void
+pool_update_size (PoolEndpoint * endpoint)
+{
+  GList *l;
+
+  endpoint->size = 0;
+  for (l = endpoint->clients; l; l = l->next) {
+    GstRtmpClient *client = l->data;
+
+    endpoint->size = MAX (endpoint->size, client->pool_size);
+  }
+}
+
+/* Frees @endpoint if it has been detached and nothing refers to it
+ * anymore.  Called with the pool lock held. */
+static void
+pool_endpoint_maybe_free (PoolEndpoint * endpoint)
+{
+  if (endpoint->clients || endpoint->pending > 0 || endpoint->resolving)
+    return;
+
+  GST_DEBUG ("freeing pool for %s:%d", endpoint->host, endpoint->port);
+  g_resolver_free_addresses (endpoint->addresses);
+  g_free (endpoint->key);
+  g_free (endpoint->host);
+  g_free (endpoint);
+
+  pool_n_endpoints--;
+  if (pool_n_endpoints == 0)
+    pool_stop ();
+}
+
+static GSocketConnection *
+pool_take (GstRtmpClient * client)
+{
+  PoolEndpoint *endpoint;
+  PoolConnection *pc;
+  GSocketConnection *connection = NULL;
+  char *key;
+  gint64 now;
+
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&pool_lock);
+  endpoint = pool_attach (client);
+  while (!connection && (pc = g_queue_pop_head (&endpoint->idle))) {
+    if (pool_connection_is_usable (pc, now)) {
+      connection = g_object_ref (pc->connection);
+    }
+    pool_connection_free (pc);
+  }
+  if (connection) {
+    endpoint->hits++;
+  } else {
+    endpoint->misses++;
+  }
+  GST_DEBUG ("pool %s for %s:%d (%u hits, %u misses)",
+      connection ? "hit" : "miss", endpoint->host, endpoint->port,
+      endpoint->hits, endpoint->misses);
+  key = g_strdup (endpoint->key);
+  g_mutex_unlock (&pool_lock);
+
+  /* by key, the endpoint may be gone by the time this runs */
+  g_main_context_invoke_full (pool_context, G_PRIORITY_DEFAULT, pool_refill,
+      key, g_free);
+
+  return connection;
+}
+
+/* The cached address of the client's server that a pooled connect last
+ * worked with, so a pool miss at least skips DNS.  Otherwise the server
+ * is resolved again, and all its addresses are tried. */
+static GSocketConnectable *
+pool_get_address (GstRtmpClient * client)
+{
+  PoolEndpoint *endpoint;
+  GSocketConnectable *addr = NULL;
+
+  g_mutex_lock (&pool_lock);
+  endpoint = client->pool_endpoint;
+  if (endpoint && endpoint->address_ok &&
+      g_get_monotonic_time () - endpoint->addresses_time < POOL_DNS_TTL) {
+    addr = G_SOCKET_CONNECTABLE (g_inet_socket_address_new
+        (g_list_nth_data (endpoint->addresses, endpoint->address_index),
+            endpoint->port));
+  }
+  g_mutex_unlock (&pool_lock);
+
+  if (!addr) {
+    addr = g_network_address_new (client->server_address,
+        client->server_port);
+  }
+
+  return addr;
+}
+
+static gboolean
+pool_refill (gpointer user_data)
+{
+  const char *key = user_data;
+  PoolEndpoint *endpoint;
+
+  g_mutex_lock (&pool_lock);
+  endpoint = g_hash_table_lookup (pool_endpoints, key);
+  if (endpoint)
+    pool_top_up (endpoint);
+  g_mutex_unlock (&pool_lock);
+
+  return G_SOURCE_REMOVE;
+}
+
+static gboolean
+pool_maintain (gpointer user_data)
+{
+  GHashTableIter iter;
+  gpointer value;
+
+  g_mutex_lock (&pool_lock);
+  g_hash_table_iter_init (&iter, pool_endpoints);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    pool_top_up (value);
+  }
+  g_mutex_unlock (&pool_lock);
+
+  return G_SOURCE_CONTINUE;
+}
+
+/* Drops stale and surplus idle connections and starts new ones.  Called
+ * in the pool thread with the pool lock held. */
+static void
+pool_top_up (PoolEndpoint * endpoint)
+{
+  gint64 now = g_get_monotonic_time ();
+  GList *l, *next;
+
+  for (l = endpoint->idle.head; l; l = next) {
+    PoolConnection *pc = l->data;
+
+    next = l->next;
+    if (!pool_connection_is_usable (pc, now)) {
+      GST_DEBUG ("dropping idle connection to %s:%d", endpoint->host,
+          endpoint->port);
+      g_queue_delete_link (&endpoint->idle, l);
+      pool_connection_free (pc);
+    }
+  }
+
+  /* the oldest go first */
+  while (endpoint->idle.length > endpoint->size) {
+    pool_connection_free (g_queue_pop_head (&endpoint->idle));
+  }
+
+  while (endpoint->idle.length + endpoint->pending < endpoint->size) {
+    endpoint->pending++;
+    if (endpoint->addresses && now - endpoint->addresses_time < POOL_DNS_TTL) {
+      pool_connect_address (endpoint);
+    } else {
+      endpoint->waiting++;
+      if (!endpoint->resolving) {
+        GResolver *resolver = g_resolver_get_default ();
+
+        endpoint->resolving = TRUE;
+        g_resolver_lookup_by_name_async (resolver, endpoint->host, NULL,
+            pool_resolve_done, endpoint);
+        g_object_unref (resolver);
+      }
+    }
+  }
+}
+
+static void
+pool_resolve_done (GObject * source, GAsyncResult * result,
+    gpointer user_data)
+{
+  PoolEndpoint *endpoint = user_data;
+  GError *error = NULL;
+  GList *addresses;
+  guint i;
+
+  addresses = g_resolver_lookup_by_name_finish (G_RESOLVER (source), result,
+      &error);
+
+  g_mutex_lock (&pool_lock);
+  endpoint->resolving = FALSE;
+  if (!addresses || !endpoint->clients) {
+    if (!addresses) {
+      GST_WARNING ("could not resolve %s: %s", endpoint->host,
+          error->message);
+      g_error_free (error);
+    }
+    g_resolver_free_addresses (addresses);
+    endpoint->pending -= endpoint->waiting;
+    endpoint->waiting = 0;
+    pool_endpoint_maybe_free (endpoint);
+    g_mutex_unlock (&pool_lock);
+    return;
+  }
+
+  g_resolver_free_addresses (endpoint->addresses);
+  endpoint->addresses = addresses;
+  endpoint->addresses_time = g_get_monotonic_time ();
+  endpoint->address_index = 0;
+  endpoint->address_ok = FALSE;
+  for (i = 0; i < endpoint->waiting; i++) {
+    pool_connect_address (endpoint);
+  }
+  endpoint->waiting = 0;
+  g_mutex_unlock (&pool_lock);
+}
+
+/* Called with the pool lock held */
+static void
+pool_connect_address (PoolEndpoint * endpoint)
+{
+  PoolConnection *pc;
+
+  pc = g_slice_new0 (PoolConnection);
+  pc->endpoint = endpoint;
+  pc->address_index = endpoint->address_index;
+  pool_connect (pc);
+}
+
+/* Connects to address pc->address_index.  Called with the pool lock
+ * held. */
+static void
+pool_connect (PoolConnection * pc)
+{
+  PoolEndpoint *endpoint = pc->endpoint;
+  GSocketClient *socket_client;
+  GSocketAddress *addr;
+
+  /* the addresses may have been resolved again in the meantime */
+  pc->address_index %= g_list_length (endpoint->addresses);
+  addr = g_inet_socket_address_new (g_list_nth_data (endpoint->addresses,
+          pc->address_index), endpoint->port);
+  socket_client = g_socket_client_new ();
+  g_socket_client_set_timeout (socket_client, DEFAULT_TIMEOUT);
+  g_socket_client_connect_async (socket_client, G_SOCKET_CONNECTABLE (addr),
+      NULL, pool_connect_done, pc);
+  g_object_unref (addr);
+}
+
+static void
+pool_connect_done (GObject * source, GAsyncResult * result,
+    gpointer user_data)
+{
+  PoolConnection *pc = user_data;
+  PoolEndpoint *endpoint = pc->endpoint;
+  GSocketConnection *connection;
+  GError *error = NULL;
+
+  connection = g_socket_client_connect_finish (G_SOCKET_CLIENT (source),
+      result, &error);
+  g_object_unref (source);
+
+  g_mutex_lock (&pool_lock);
+  if (!connection) {
+    pc->tries++;
+    if (endpoint->clients &&
+        pc->tries < g_list_length (endpoint->addresses)) {
+      GST_DEBUG ("could not connect to %s:%d address %u, trying the next: "
+          "%s", endpoint->host, endpoint->port, pc->address_index,
+          error->message);
+      g_error_free (error);
+      pc->address_index++;
+      pool_connect (pc);
+      g_mutex_unlock (&pool_lock);
+      return;
+    }
+
+    GST_WARNING ("could not connect to %s:%d: %s", endpoint->host,
+        endpoint->port, error->message);
+    g_error_free (error);
+    endpoint->pending--;
+    /* the server may have moved */
+    endpoint->addresses_time = 0;
+    endpoint->address_ok = FALSE;
+    pool_connection_free (pc);
+    pool_endpoint_maybe_free (endpoint);
+    g_mutex_unlock (&pool_lock);
+    return;
+  }
+
+  endpoint->address_index = pc->address_index;
+  endpoint->address_ok = TRUE;
+  g_mutex_unlock (&pool_lock);
+
+  g_socket_set_keepalive (g_socket_connection_get_socket (connection), TRUE);
+
+  pc->connection = connection;
+  pc->state = POOL_WRITE_C0C1;
+  pc->data = g_malloc (HANDSHAKE_SIZE);
+  pc->data[0] = 3;
+  memset (pc->data + 1, 0, 8);
+  memset (pc->data + 9, 0xa5, 1528);
+  pool_handshake_step (pc);
+}
+
+/* The same handshake GstRtmpConnection does: C0 C1 out, S0 S1 S2 in,
+ * and the last 1536 bytes of that back out as C2.  @data holds C0 C1
+ * first, then the server's reply. */
+static void
+pool_handshake_step (PoolConnection * pc)
+{
+  GIOStream *stream = G_IO_STREAM (pc->connection);
+
+  switch (pc->state) {
+    case POOL_WRITE_C0C1:
+      g_output_stream_write_async (g_io_stream_get_output_stream (stream),
+          pc->data + pc->offset, 1 + 1536 - pc->offset, G_PRIORITY_DEFAULT,
+          NULL, pool_write_done, pc);
+      break;
+    case POOL_READ_S0S1S2:
+      g_input_stream_read_async (g_io_stream_get_input_stream (stream),
+          pc->data + pc->offset, HANDSHAKE_SIZE - pc->offset,
+          G_PRIORITY_DEFAULT, NULL, pool_read_done, pc);
+      break;
+    case POOL_WRITE_C2:
+      g_output_stream_write_async (g_io_stream_get_output_stream (stream),
+          pc->data + pc->offset, HANDSHAKE_SIZE - pc->offset,
+          G_PRIORITY_DEFAULT, NULL, pool_write_done, pc);
+      break;
+  }
+}
+
+static void
+pool_write_done (GObject * source, GAsyncResult * result, gpointer user_data)
+{
+  PoolConnection *pc = user_data;
+  PoolEndpoint *endpoint = pc->endpoint;
+  GError *error = NULL;
+  gssize ret;
+
+  ret = g_output_stream_write_finish (G_OUTPUT_STREAM (source), result,
+      &error);
+  if (ret <= 0) {
+    pool_handshake_failed (pc, error);
+    return;
+  }
+
+  pc->offset += ret;
+  if (pc->state == POOL_WRITE_C0C1 && pc->offset == 1 + 1536) {
+    pc->state = POOL_READ_S0S1S2;
+    pc->offset = 0;
+  } else if (pc->state == POOL_WRITE_C2 && pc->offset == HANDSHAKE_SIZE) {
+    g_free (pc->data);
+    pc->data = NULL;
+    pc->ready_time = g_get_monotonic_time ();
+
+    g_mutex_lock (&pool_lock);
+    endpoint->pending--;
+    if (endpoint->clients) {
+      g_queue_push_tail (&endpoint->idle, pc);
+      GST_DEBUG ("pooled connection to %s:%d ready, %u idle",
+          endpoint->host, endpoint->port, endpoint->idle.length);
+    } else {
+      pool_connection_free (pc);
+      pool_endpoint_maybe_free (endpoint);
+    }
+    g_mutex_unlock (&pool_lock);
+    return;
+  }
+
+  pool_handshake_step (pc);
+}
+
+static void
+pool_read_done (GObject * source, GAsyncResult * result, gpointer user_data)
+{
+  PoolConnection *pc = user_data;
+  GError *error = NULL;
+  gssize ret;
+
+  ret = g_input_stream_read_finish (G_INPUT_STREAM (source), result, &error);
+  if (ret <= 0) {
+    pool_handshake_failed (pc, error);
+    return;
+  }
+
+  pc->offset += ret;
+  if (pc->offset == HANDSHAKE_SIZE) {
+    pc->state = POOL_WRITE_C2;
+    pc->offset = 1 + 1536;
+  }
+
+  pool_handshake_step (pc);
+}
+
+static void
+pool_handshake_failed (PoolConnection * pc, GError * error)
+{
+  PoolEndpoint *endpoint = pc->endpoint;
+
+  GST_WARNING ("handshake with %s:%d failed: %s", endpoint->host,
+      endpoint->port, error ? error->message : "connection closed");
+  g_clear_error (&error);
+
+  g_mutex_lock (&pool_lock);
+  endpoint->pending--;
+  pool_connection_free (pc);
+  pool_endpoint_maybe_free (endpoint);
+  g_mutex_unlock (&pool_lock);
+}
+
+/* A handshaken connection should be silent until we send connect, so
+ * anything to read means the server gave up on it */
+static gboolean
+pool_connection_is_usable (PoolConnection * pc, gint64 now)
+{
+  GSocket *socket;
+
+  if (now - pc->ready_time > POOL_MAX_IDLE_TIME)
+    return FALSE;
+
+  socket = g_socket_connection_get_socket (pc->connection);
+  return g_socket_condition_check (socket,
+      G_IO_IN | G_IO_ERR | G_IO_HUP) == 0;
+}
+
+static void
+pool_connection_free (PoolConnection * pc)
+{
+  g_free (pc->data);
+  if (pc->connection)
+    g_object_unref (pc->connection);
+  g_slice_free (PoolConnection, pc);
+}
@@ -62,6 +62,7 @@ struct _GstRtmpClient
   int server_port;
   char *stream;
   int timeout;
+  guint pool_size;
 
   /* private */
   GstRtmpClientState state;
@@ -72,6 +73,8 @@ struct _GstRtmpClient
   GCancellable *cancellable;
   GSimpleAsyncResult *async;
   GSocketConnection *socket_connection;
+  /* the pool endpoint this client is attached to, under the pool lock */
+  gpointer pool_endpoint;
 
   GstRtmpConnection *connection;
 };
@@ -102,6 +105,10 @@ gboolean gst_rtmp_client_connect_finish (GstRtmpClient *client,
 
 GstRtmpConnection *gst_rtmp_client_get_connection (GstRtmpClient *client);
 
+void gst_rtmp_client_set_pool_size (GstRtmpClient *client, guint size);
+void gst_rtmp_client_get_pool_stats (GstRtmpClient *client, guint *hits,
+    guint *misses);
+
 
 G_END_DECLS
 
@@ -43,34 +43,48 @@ static void gst_rtmp_connection_finalize (GObject * object);
 static void gst_rtmp_connection_got_closed (GstRtmpConnection * connection);
 static gboolean gst_rtmp_connection_input_ready (GInputStream * is,
     gpointer user_data);
+static void gst_rtmp_connection_start_input (GstRtmpConnection * sc);
+static gboolean update_input (gpointer user_data);
+static void gst_rtmp_connection_set_input_paused (GstRtmpConnection *
+    connection, gboolean paused);
 static gboolean gst_rtmp_connection_output_ready (GOutputStream * os,
     gpointer user_data);
 static void gst_rtmp_connection_client_handshake1 (GstRtmpConnection * sc);
 static void gst_rtmp_connection_client_handshake1_done (GObject * obj,
     GAsyncResult * res, gpointer user_data);
 static void gst_rtmp_connection_client_handshake2 (GstRtmpConnection * sc);
-static void gst_rtmp_connection_client_handshake2_done (GObject * obj,
-    GAsyncResult * res, gpointer user_data);
 static void gst_rtmp_connection_server_handshake1 (GstRtmpConnection * sc);
 static void gst_rtmp_connection_server_handshake1_done (GObject * obj,
     GAsyncResult * res, gpointer user_data);
 static void gst_rtmp_connection_server_handshake2 (GstRtmpConnection * sc);
-static void gst_rtmp_connection_write_chunk_done (GObject * obj,
-    GAsyncResult * res, gpointer user_data);
 static void
 gst_rtmp_connection_set_input_callback (GstRtmpConnection * connection,
     void (*input_callback) (GstRtmpConnection * connection),
     gsize needed_bytes);
 static void gst_rtmp_connection_chunk_callback (GstRtmpConnection * sc);
 static void gst_rtmp_connection_start_output (GstRtmpConnection * sc);
+static gsize gst_rtmp_connection_output_allowance (GstRtmpConnection * sc,
+    gsize size);
+static gboolean gst_rtmp_connection_fill_output (GstRtmpConnection * sc);
+static void gst_rtmp_connection_output_written (GstRtmpConnection * sc,
+    gsize written);
+static void gst_rtmp_connection_abort_output (GstRtmpConnection * sc,
+    GstRtmpChunk * chunk, GByteArray * headers);
 static void
 gst_rtmp_connection_handle_pcm (GstRtmpConnection * connection,
     GstRtmpChunk * chunk);
 static void
 gst_rtmp_connection_handle_user_control (GstRtmpConnection * connectin,
     guint32 event_type, guint32 event_data);
+static void
+gst_rtmp_connection_set_peer_bandwidth (GstRtmpConnection * connection,
+    guint32 bandwidth, int limit_type);
 static void gst_rtmp_connection_handle_chunk (GstRtmpConnection * sc,
     GstRtmpChunk * chunk);
+static void gst_rtmp_connection_dispatch_chunk (GstRtmpConnection * sc,
+    GstRtmpChunk * chunk);
+static void gst_rtmp_connection_free_message_handlers (GstRtmpConnection *
+    sc);
 
 static void gst_rtmp_connection_send_ack (GstRtmpConnection * connection);
 static void
@@ -79,20 +93,83 @@ gst_rtmp_connection_send_ping_response (GstRtmpConnection * connection,
 static void gst_rtmp_connection_send_window_size_request (GstRtmpConnection *
     connection);
 
+/* output is serialized this many bytes at a time, so that new messages
+ * can be interleaved and stale ones aborted in between */
+#define OUTPUT_BATCH_SIZE 16384
+#define OUTPUT_MAX_SEGMENTS 256
+#define OUTPUT_MAX_VECTORS 64
+
+/* part of a chunk header or payload that is waiting to be written */
+typedef struct _OutputSegment OutputSegment;
+struct _OutputSegment
+{
+  GBytes *bytes;
+  gsize offset;
+  gsize size;
+};
+
 typedef struct _CommandCallback CommandCallback;
 struct _CommandCallback
 {
+  /* chunk stream id in the upper half, transaction id in the lower */
+  guint64 key;
   guint32 chunk_stream_id;
   int transaction_id;
+  /* message stream the command went to, for onStatus replies */
+  guint32 stream_id;
+  gint64 deadline;
+  /* in transaction_deadlines, or NULL */
+  GList *link;
   GstRtmpCommandCallback func;
   gpointer user_data;
 };
 
+#define DEFAULT_COMMAND_TIMEOUT 30000
+
+typedef struct _MessageHandler MessageHandler;
+struct _MessageHandler
+{
+  guint id;
+  guint32 type_mask;
+  /* NULL once removed during dispatch */
+  GstRtmpMessageHandler func;
+  gpointer user_data;
+  GDestroyNotify notify;
+};
+
+static int gst_rtmp_connection_allocate_transaction_id (GstRtmpConnection *
+    sc, guint32 chunk_stream_id);
+static void gst_rtmp_connection_add_transaction (GstRtmpConnection * sc,
+    guint32 chunk_stream_id, guint32 stream_id, int transaction_id,
+    GstRtmpCommandCallback func, gpointer user_data);
+static CommandCallback *gst_rtmp_connection_take_transaction (GstRtmpConnection
+    * sc, GstRtmpChunk * chunk, const char *command_name,
+    gsize command_name_length, int transaction_id);
+static void gst_rtmp_connection_remove_transaction (GstRtmpConnection * sc,
+    CommandCallback * cb);
+static void gst_rtmp_connection_schedule_timeout (GstRtmpConnection * sc);
+static gboolean gst_rtmp_connection_transaction_timeout (gpointer user_data);
+static void gst_rtmp_connection_fail_transactions (GstRtmpConnection * sc);
+static void gst_rtmp_connection_queue_command (GstRtmpConnection *
+    connection, int chunk_stream_id, int stream_id, GBytes * payload,
+    int transaction_id, GstRtmpCommandCallback response_command,
+    gpointer user_data);
+
 enum
 {
   PROP_0
 };
 
+enum
+{
+  SIGNAL_GOT_CHUNK,
+  SIGNAL_GOT_CONTROL_CHUNK,
+  SIGNAL_CLOSED,
+  N_SIGNALS
+};
+
+static guint signals[N_SIGNALS];
+
 /* class initialization */
 
 G_DEFINE_TYPE_WITH_CODE (GstRtmpConnection, gst_rtmp_connection,
@@ -110,15 +187,18 @@ gst_rtmp_connection_class_init (GstRtmpConnectionClass * klass)
   gobject_class->dispose = gst_rtmp_connection_dispose;
   gobject_class->finalize = gst_rtmp_connection_finalize;
 
-  g_signal_new ("got-chunk", G_TYPE_FROM_CLASS (klass),
+  signals[SIGNAL_GOT_CHUNK] = g_signal_new ("got-chunk",
+      G_TYPE_FROM_CLASS (klass),
       G_SIGNAL_RUN_LAST, G_STRUCT_OFFSET (GstRtmpConnectionClass,
           got_chunk), NULL, NULL, g_cclosure_marshal_generic,
       G_TYPE_NONE, 1, GST_TYPE_RTMP_CHUNK);
-  g_signal_new ("got-control-chunk", G_TYPE_FROM_CLASS (klass),
+  signals[SIGNAL_GOT_CONTROL_CHUNK] = g_signal_new ("got-control-chunk",
+      G_TYPE_FROM_CLASS (klass),
       G_SIGNAL_RUN_LAST, G_STRUCT_OFFSET (GstRtmpConnectionClass,
           got_control_chunk), NULL, NULL, g_cclosure_marshal_generic,
       G_TYPE_NONE, 1, GST_TYPE_RTMP_CHUNK);
-  g_signal_new ("closed", G_TYPE_FROM_CLASS (klass),
+  signals[SIGNAL_CLOSED] = g_signal_new ("closed",
+      G_TYPE_FROM_CLASS (klass),
       G_SIGNAL_RUN_LAST, G_STRUCT_OFFSET (GstRtmpConnectionClass, closed),
       NULL, NULL, g_cclosure_marshal_generic, G_TYPE_NONE, 0);
 }
@@ -128,11 +208,23 @@ gst_rtmp_connection_init (GstRtmpConnection * rtmpconnection)
 {
   rtmpconnection->cancellable = g_cancellable_new ();
   rtmpconnection->output_queue = g_async_queue_new ();
+  g_queue_init (&rtmpconnection->output_pending);
+  rtmpconnection->output_segments =
+      g_array_new (FALSE, FALSE, sizeof (OutputSegment));
   rtmpconnection->input_chunk_cache = gst_rtmp_chunk_cache_new ();
   rtmpconnection->output_chunk_cache = gst_rtmp_chunk_cache_new ();
+  rtmpconnection->transactions = g_hash_table_new_full (g_int64_hash,
+      g_int64_equal, NULL, g_free);
+  g_queue_init (&rtmpconnection->transaction_deadlines);
+  rtmpconnection->command_timeout = DEFAULT_COMMAND_TIMEOUT;
+  rtmpconnection->next_transaction_id = 1;
+  rtmpconnection->message_handlers =
+      g_array_new (FALSE, FALSE, sizeof (MessageHandler));
+  rtmpconnection->next_message_handler_id = 1;
 
   rtmpconnection->in_chunk_size = 128;
   rtmpconnection->out_chunk_size = 128;
+  rtmpconnection->peer_bandwidth_limit_type = -1;
 }
 
 void
@@ -173,6 +265,7 @@ gst_rtmp_connection_dispose (GObject * object)
   GST_DEBUG_OBJECT (rtmpconnection, "dispose");
 
   /* clean up as possible.  may be called multiple times */
+  gst_rtmp_connection_free_message_handlers (rtmpconnection);
 
   G_OBJECT_CLASS (gst_rtmp_connection_parent_class)->dispose (object);
 }
@@ -183,11 +276,16 @@ gst_rtmp_connection_finalize (GObject * object)
   GstRtmpConnection *rtmpconnection = GST_RTMP_CONNECTION (object);
   GSocket *sock;
   gpointer p;
+  guint i;
 
   GST_DEBUG_OBJECT (rtmpconnection, "finalize");
 
   /* clean up object here */
 
+  /* whoever sent commands that are still pending may be gone already, so
+   * unlike an explicit close this doesn't call them back */
+  g_queue_clear (&rtmpconnection->transaction_deadlines);
+  g_hash_table_remove_all (rtmpconnection->transactions);
   gst_rtmp_connection_close (rtmpconnection);
 
   g_cancellable_cancel (rtmpconnection->cancellable);
@@ -212,8 +310,29 @@ gst_rtmp_connection_finalize (GObject * object)
     p = g_async_queue_try_pop (rtmpconnection->output_queue);
   }
   g_async_queue_unref (rtmpconnection->output_queue);
+  g_list_free_full (rtmpconnection->output_chunks, g_object_unref);
+  g_list_free_full (rtmpconnection->output_finished, g_object_unref);
+  while (!g_queue_is_empty (&rtmpconnection->output_pending))
+    g_object_unref (g_queue_pop_head (&rtmpconnection->output_pending));
+  if (rtmpconnection->output_bytes)
+    g_bytes_unref (rtmpconnection->output_bytes);
+  if (rtmpconnection->handshake_bytes)
+    g_bytes_unref (rtmpconnection->handshake_bytes);
+  for (i = rtmpconnection->output_segment_index;
+      i < rtmpconnection->output_segments->len; i++) {
+    g_bytes_unref (g_array_index (rtmpconnection->output_segments,
+            OutputSegment, i).bytes);
+  }
+  g_array_free (rtmpconnection->output_segments, TRUE);
   gst_rtmp_chunk_cache_free (rtmpconnection->input_chunk_cache);
   gst_rtmp_chunk_cache_free (rtmpconnection->output_chunk_cache);
+  if (rtmpconnection->transaction_timeout_source) {
+    g_source_destroy (rtmpconnection->transaction_timeout_source);
+    g_source_unref (rtmpconnection->transaction_timeout_source);
+  }
+  g_queue_clear (&rtmpconnection->transaction_deadlines);
+  g_hash_table_unref (rtmpconnection->transactions);
+  g_array_free (rtmpconnection->message_handlers, TRUE);
 
   G_OBJECT_CLASS (gst_rtmp_connection_parent_class)->finalize (object);
 }
@@ -232,12 +351,23 @@ void
 gst_rtmp_connection_set_socket_connection (GstRtmpConnection * sc,
     GSocketConnection * connection)
 {
-  GInputStream *is;
-
   sc->thread = g_thread_self ();
   sc->main_context = g_main_context_ref_thread_default ();
   sc->connection = connection;
 
+  /* output is written with nonblocking vectored sends */
+  g_socket_set_blocking (g_socket_connection_get_socket (connection), FALSE);
+
+  if (!g_atomic_int_get (&sc->input_paused)) {
+    gst_rtmp_connection_start_input (sc);
+  }
+}
+
+static void
+gst_rtmp_connection_start_input (GstRtmpConnection * sc)
+{
+  GInputStream *is;
+
   /* refs the socket because it's creating an input stream, which holds a ref */
   is = g_io_stream_get_input_stream (G_IO_STREAM (sc->connection));
   /* refs the socket because it's creating a socket source */
@@ -249,6 +379,64 @@ gst_rtmp_connection_set_socket_connection (GstRtmpConnection * sc,
   g_source_attach (sc->input_source, sc->main_context);
 }
 
+/* Runs on the connection's thread and attaches or detaches the input
+ * source to match input_paused.  While detached, nothing is read from
+ * the socket, so TCP flow control pushes back on the peer. */
+static gboolean
+update_input (gpointer user_data)
+{
+  GstRtmpConnection *sc = GST_RTMP_CONNECTION (user_data);
+
+  if (sc->closed || !sc->connection ||
+      g_cancellable_is_cancelled (sc->cancellable))
+    return G_SOURCE_REMOVE;
+
+  if (g_atomic_int_get (&sc->input_paused)) {
+    if (sc->input_source) {
+      GST_DEBUG ("pausing input");
+      g_source_destroy (sc->input_source);
+      g_source_unref (sc->input_source);
+      sc->input_source = NULL;
+    }
+  } else if (!sc->input_source) {
+    GST_DEBUG ("resuming input");
+    gst_rtmp_connection_start_input (sc);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+gst_rtmp_connection_set_input_paused (GstRtmpConnection * connection,
+    gboolean paused)
+{
+  GSource *source;
+
+  g_atomic_int_set (&connection->input_paused, paused);
+  if (!connection->main_context)
+    return;
+
+  source = g_idle_source_new ();
+  g_source_set_callback (source, update_input, g_object_ref (connection),
+      g_object_unref);
+  g_source_attach (source, connection->main_context);
+  g_source_unref (source);
+}
+
+/* Stops reading from the socket.  Messages already read are still
+ * delivered.  May be called from any thread. */
+void
+gst_rtmp_connection_pause_input (GstRtmpConnection * connection)
+{
+  gst_rtmp_connection_set_input_paused (connection, TRUE);
+}
+
+void
+gst_rtmp_connection_resume_input (GstRtmpConnection * connection)
+{
+  gst_rtmp_connection_set_input_paused (connection, FALSE);
+}
+
 void
 gst_rtmp_connection_close (GstRtmpConnection * connection)
 {
@@ -268,7 +456,18 @@ gst_rtmp_connection_close (GstRtmpConnection * connection)
     g_source_unref (connection->output_source);
     connection->output_source = NULL;
   }
+  if (connection->pacing_source) {
+    g_source_destroy (connection->pacing_source);
+    g_source_unref (connection->pacing_source);
+    connection->pacing_source = NULL;
+  }
+  if (connection->transaction_timeout_source) {
+    g_source_destroy (connection->transaction_timeout_source);
+    g_source_unref (connection->transaction_timeout_source);
+    connection->transaction_timeout_source = NULL;
+  }
 
+  gst_rtmp_connection_fail_transactions (connection);
 }
 
 static gboolean
@@ -374,91 +573,514 @@ static gboolean
 gst_rtmp_connection_output_ready (GOutputStream * os, gpointer user_data)
 {
   GstRtmpConnection *sc = GST_RTMP_CONNECTION (user_data);
-  GstRtmpChunk *chunk;
-  const guint8 *data;
-  gsize size;
+  GOutputVector vectors[OUTPUT_MAX_VECTORS];
+  GSocket *socket;
+  GError *error = NULL;
+  gsize allowed;
+  gsize offset;
+  gssize ret;
+  guint i, n;
 
   GST_DEBUG ("output ready");
   if (sc->thread != g_thread_self ()) {
     GST_ERROR ("input_ready: Called from wrong thread");
   }
 
-  sc->output_source = NULL;
+  /* the source is removed whatever this returns, a new one is made when
+   * there is more to write */
+  if (sc->output_source) {
+    g_source_unref (sc->output_source);
+    sc->output_source = NULL;
+  }
 
-  if (sc->writing)
+  if (sc->output_remaining == 0 && !gst_rtmp_connection_fill_output (sc))
     return G_SOURCE_REMOVE;
 
-  if (sc->output_chunk) {
-    chunk = sc->output_chunk;
-  } else {
-    GstRtmpChunkCacheEntry *entry;
+  /* a partial write is handled like a short write; the remainder goes
+   * out once the pacer or the peer's window allows it.  C2 is part of
+   * the handshake, not of the RTMP stream, and always goes out. */
+  allowed = sc->output_handshake_remaining;
+  if (sc->output_remaining > allowed) {
+    allowed += gst_rtmp_connection_output_allowance (sc,
+        sc->output_remaining - allowed);
+  }
+  if (allowed == 0)
+    return G_SOURCE_REMOVE;
 
-    chunk = g_async_queue_try_pop (sc->output_queue);
-    if (!chunk) {
+  /* headers and payloads are written straight from where they are,
+   * without copying them together */
+  n = 0;
+  offset = sc->output_segment_offset;
+  for (i = sc->output_segment_index; i < sc->output_segments->len &&
+      n < OUTPUT_MAX_VECTORS && allowed > 0; i++) {
+    OutputSegment *segment;
+    const guint8 *data;
+
+    segment = &g_array_index (sc->output_segments, OutputSegment, i);
+    data = g_bytes_get_data (segment->bytes, NULL);
+    vectors[n].buffer = data + segment->offset + offset;
+    vectors[n].size = MIN (segment->size - offset, allowed);
+    allowed -= vectors[n].size;
+    offset = 0;
+    n++;
+  }
+
+  socket = g_socket_connection_get_socket (sc->connection);
+  ret = g_socket_send_message (socket, NULL, vectors, n, NULL, 0,
+      G_SOCKET_MSG_NONE, sc->cancellable, &error);
+  if (ret < 0) {
+    if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_WOULD_BLOCK)) {
+      g_error_free (error);
+      gst_rtmp_connection_start_output (sc);
       return G_SOURCE_REMOVE;
     }
-    sc->output_chunk = chunk;
+    GST_DEBUG ("write error: %s", error->message);
+    gst_rtmp_connection_got_closed (sc);
+    g_error_free (error);
+    return G_SOURCE_REMOVE;
+  }
 
-    entry =
-        gst_rtmp_chunk_cache_get (sc->output_chunk_cache,
+  gst_rtmp_connection_output_written (sc, ret);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* A partially sent video message is stale if fresher media has been
+ * queued behind it for longer than max_output_latency. */
+static gboolean
+gst_rtmp_connection_output_is_stale (GstRtmpConnection * sc,
+    GstRtmpChunk * chunk)
+{
+  GstRtmpChunkCacheEntry *entry;
+  guint32 newest;
+  gint32 delay;
+
+  if (sc->max_output_latency == 0)
+    return FALSE;
+  if (chunk->message_type_id != GST_RTMP_MESSAGE_TYPE_VIDEO)
+    return FALSE;
+
+  entry = gst_rtmp_chunk_cache_get (sc->output_chunk_cache,
+      chunk->chunk_stream_id);
+  if (entry->offset == 0)
+    return FALSE;
+
+  newest = g_atomic_int_get (&sc->output_newest_timestamp);
+  delay = (gint32) (newest - chunk->timestamp);
+
+  return delay > (gint32) sc->max_output_latency;
+}
+
+/* Abandons a message in progress at a chunk boundary.  The peer is told
+ * to discard what it has received so far, and video is skipped up to the
+ * next keyframe since the decoder would be missing a reference. */
+static void
+gst_rtmp_connection_abort_output (GstRtmpConnection * sc,
+    GstRtmpChunk * chunk, GByteArray * headers)
+{
+  GstRtmpChunkCacheEntry *entry;
+  GstRtmpChunk *abort_chunk;
+  OutputSegment segment;
+  guint8 *data;
+
+  entry = gst_rtmp_chunk_cache_get (sc->output_chunk_cache,
+      chunk->chunk_stream_id);
+
+  GST_INFO ("aborting stale message on chunk stream %d, timestamp %u, "
+      "%" G_GSIZE_FORMAT " of %" G_GSIZE_FORMAT " bytes sent",
+      chunk->chunk_stream_id, chunk->timestamp, entry->offset,
+      chunk->message_length);
+
+  entry->offset = 0;
+  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO)
+    sc->output_skip_video = TRUE;
+
+  abort_chunk = gst_rtmp_chunk_new ();
+  abort_chunk->chunk_stream_id = GST_RTMP_CHUNK_STREAM_PROTOCOL;
+  abort_chunk->timestamp = 0;
+  abort_chunk->message_type_id = GST_RTMP_MESSAGE_TYPE_ABORT;
+  abort_chunk->stream_id = 0;
+
+  data = g_malloc (4);
+  GST_WRITE_UINT32_BE (data, chunk->chunk_stream_id);
+  abort_chunk->payload = g_bytes_new_take (data, 4);
+  abort_chunk->message_length = 4;
+
+  /* small enough to copy along with the headers */
+  entry = gst_rtmp_chunk_cache_get (sc->output_chunk_cache,
+      abort_chunk->chunk_stream_id);
+  segment.bytes = NULL;
+  segment.offset = headers->len;
+  gst_rtmp_chunk_serialize_next (abort_chunk, entry, sc->out_chunk_size,
+      headers);
+  segment.size = headers->len - segment.offset;
+  g_array_append_val (sc->output_segments, segment);
+  g_object_unref (abort_chunk);
+
+  g_atomic_int_add (&sc->output_queued_bytes, -(gint) chunk->message_length);
+  g_object_unref (chunk);
+}
+
+static gboolean
+gst_rtmp_connection_skip_output (GstRtmpConnection * sc, GstRtmpChunk * chunk)
+{
+  const guint8 *data;
+  gsize size;
+
+  if (!sc->output_skip_video ||
+      chunk->message_type_id != GST_RTMP_MESSAGE_TYPE_VIDEO)
+    return FALSE;
+
+  data = g_bytes_get_data (chunk->payload, &size);
+  if (size >= 1 && (data[0] >> 4) == 1) {
+    GST_DEBUG ("keyframe at timestamp %u, resuming video", chunk->timestamp);
+    sc->output_skip_video = FALSE;
+    return FALSE;
+  }
+
+  GST_LOG ("skipping video at timestamp %u", chunk->timestamp);
+  return TRUE;
+}
+
+static gboolean
+gst_rtmp_connection_chunk_stream_busy (GstRtmpConnection * sc,
+    guint32 chunk_stream_id)
+{
+  GList *l;
+
+  for (l = sc->output_chunks; l; l = l->next) {
+    GstRtmpChunk *chunk = l->data;
+    if (chunk->chunk_stream_id == chunk_stream_id)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static void
+gst_rtmp_connection_add_payload_segments (GstRtmpConnection * sc,
+    GstRtmpChunk * chunk, gsize offset, gsize len)
+{
+  OutputSegment segment;
+  gsize size;
+
+  if (chunk->payload_prefix && len > 0) {
+    size = g_bytes_get_size (chunk->payload_prefix);
+    if (offset < size) {
+      segment.bytes = g_bytes_ref (chunk->payload_prefix);
+      segment.offset = offset;
+      segment.size = MIN (len, size - offset);
+      g_array_append_val (sc->output_segments, segment);
+      len -= segment.size;
+      offset = 0;
+    } else {
+      offset -= size;
+    }
+  }
+
+  if (len > 0) {
+    segment.bytes = g_bytes_ref (chunk->payload);
+    segment.offset = offset;
+    segment.size = len;
+    g_array_append_val (sc->output_segments, segment);
+  }
+}
+
+/* Serializes the next batch of output into output_segments.  Messages on
+ * different chunk streams are interleaved one chunk at a time, so that
+ * e.g. audio does not wait for a large video frame.  Chunk headers are
+ * collected in one buffer; payloads are referenced, not copied.  Returns
+ * FALSE if there is nothing to send. */
+static gboolean
+gst_rtmp_connection_fill_output (GstRtmpConnection * sc)
+{
+  GByteArray *headers;
+  GBytes *header_bytes;
+  GstRtmpChunk *chunk;
+  GList *l, *next;
+  gsize batch_size;
+  guint i;
+
+  while ((chunk = g_async_queue_try_pop (sc->output_queue))) {
+    g_queue_push_tail (&sc->output_pending, chunk);
+  }
+
+  headers = g_byte_array_new ();
+  batch_size = 0;
+
+  /* the client's C2 goes out in the same write as the first commands */
+  if (sc->output_bytes) {
+    OutputSegment segment;
+
+    segment.bytes = sc->output_bytes;
+    segment.offset = 0;
+    segment.size = g_bytes_get_size (sc->output_bytes);
+    g_array_append_val (sc->output_segments, segment);
+    batch_size += segment.size;
+    sc->output_handshake_remaining = segment.size;
+    sc->output_bytes = NULL;
+  }
+
+  for (l = sc->output_chunks; l; l = next) {
+    next = l->next;
+    chunk = l->data;
+    if (gst_rtmp_connection_output_is_stale (sc, chunk)) {
+      sc->output_chunks = g_list_delete_link (sc->output_chunks, l);
+      gst_rtmp_connection_abort_output (sc, chunk, headers);
+    }
+  }
+
+  for (l = sc->output_pending.head; l; l = next) {
+    next = l->next;
+    chunk = l->data;
+    if (gst_rtmp_connection_skip_output (sc, chunk)) {
+      g_queue_delete_link (&sc->output_pending, l);
+      g_atomic_int_add (&sc->output_queued_bytes,
+          -(gint) chunk->message_length);
+      g_object_unref (chunk);
+    } else if (!gst_rtmp_connection_chunk_stream_busy (sc,
+            chunk->chunk_stream_id)) {
+      g_queue_delete_link (&sc->output_pending, l);
+      sc->output_chunks = g_list_append (sc->output_chunks, chunk);
+    }
+  }
+
+  batch_size += headers->len;
+  while (sc->output_chunks && batch_size < OUTPUT_BATCH_SIZE &&
+      sc->output_segments->len + 3 <= OUTPUT_MAX_SEGMENTS) {
+    GstRtmpChunkCacheEntry *entry;
+    OutputSegment segment;
+    gsize offset;
+    gsize len;
+
+    l = sc->output_chunks;
+    chunk = l->data;
+    sc->output_chunks = g_list_remove_link (sc->output_chunks, l);
+
+    entry = gst_rtmp_chunk_cache_get (sc->output_chunk_cache,
         chunk->chunk_stream_id);
-    sc->output_bytes =
-        gst_rtmp_chunk_serialize (chunk, &entry->previous_header,
-        sc->out_chunk_size);
-    gst_rtmp_chunk_cache_update (entry, chunk);
+
+    segment.bytes = NULL;
+    segment.offset = headers->len;
+    len = gst_rtmp_chunk_serialize_next_header (chunk, entry,
+        sc->out_chunk_size, headers, &offset);
+    segment.size = headers->len - segment.offset;
+    g_array_append_val (sc->output_segments, segment);
+    gst_rtmp_connection_add_payload_segments (sc, chunk, offset, len);
+    batch_size += segment.size + len;
+
+    if (entry->offset == 0) {
+      if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_SET_CHUNK_SIZE) {
+        /* takes effect right after this message */
+        sc->out_chunk_size =
+            GST_READ_UINT32_BE (g_bytes_get_data (chunk->payload, NULL));
+        GST_INFO ("output chunk size now %" G_GSIZE_FORMAT,
+            sc->out_chunk_size);
+      }
+      sc->output_finished = g_list_concat (sc->output_finished, l);
+    } else {
+      sc->output_chunks = g_list_concat (sc->output_chunks, l);
+    }
   }
 
-  os = g_io_stream_get_output_stream (G_IO_STREAM (sc->connection));
-  data = g_bytes_get_data (sc->output_bytes, &size);
-  g_output_stream_write_async (os, data, size, G_PRIORITY_DEFAULT,
-      sc->cancellable, gst_rtmp_connection_write_chunk_done, sc);
-  sc->writing = TRUE;
+  if (sc->output_segments->len == 0) {
+    g_byte_array_unref (headers);
+    return FALSE;
+  }
 
-  return G_SOURCE_REMOVE;
+  header_bytes = g_byte_array_free_to_bytes (headers);
+  for (i = 0; i < sc->output_segments->len; i++) {
+    OutputSegment *segment;
+
+    segment = &g_array_index (sc->output_segments, OutputSegment, i);
+    if (segment->bytes == NULL)
+      segment->bytes = g_bytes_ref (header_bytes);
+  }
+  g_bytes_unref (header_bytes);
+
+  sc->output_segment_index = 0;
+  sc->output_segment_offset = 0;
+  sc->output_remaining = batch_size;
+
+  return TRUE;
 }
 
+/* Advances the output segments past @written bytes, releasing what has
+ * been written, and continues with the rest. */
 static void
-gst_rtmp_connection_got_closed (GstRtmpConnection * connection)
+gst_rtmp_connection_output_written (GstRtmpConnection * sc, gsize written)
 {
-  connection->closed = TRUE;
-  g_signal_emit_by_name (connection, "closed");
+  gsize handshake;
+
+  /* acknowledgements count the bytes after the handshake */
+  handshake = MIN (written, sc->output_handshake_remaining);
+  sc->output_handshake_remaining -= handshake;
+  sc->total_output_bytes += written - handshake;
+  if (sc->pacing) {
+    sc->pacing_tokens -= written - handshake;
+  }
+
+  if (written < sc->output_remaining) {
+    GST_DEBUG ("short write %" G_GSIZE_FORMAT " < %" G_GSIZE_FORMAT,
+        written, sc->output_remaining);
+  }
+  sc->output_remaining -= written;
+
+  while (written > 0) {
+    OutputSegment *segment;
+    gsize n;
+
+    segment = &g_array_index (sc->output_segments, OutputSegment,
+        sc->output_segment_index);
+    n = MIN (written, segment->size - sc->output_segment_offset);
+    sc->output_segment_offset += n;
+    written -= n;
+
+    if (sc->output_segment_offset == segment->size) {
+      g_bytes_unref (segment->bytes);
+      segment->bytes = NULL;
+      sc->output_segment_index++;
+      sc->output_segment_offset = 0;
+    }
+  }
+
+  if (sc->output_remaining == 0) {
+    GList *l;
+
+    g_array_set_size (sc->output_segments, 0);
+    sc->output_segment_index = 0;
+
+    for (l = sc->output_finished; l; l = l->next) {
+      GstRtmpChunk *chunk = l->data;
+      g_atomic_int_add (&sc->output_queued_bytes,
+          -(gint) chunk->message_length);
+    }
+    g_list_free_full (sc->output_finished, g_object_unref);
+    sc->output_finished = NULL;
+  }
+
+  gst_rtmp_connection_start_output (sc);
+}
+
+static gboolean
+pacing_timeout (gpointer user_data)
+{
+  GstRtmpConnection *sc = GST_RTMP_CONNECTION (user_data);
+
+  g_source_unref (sc->pacing_source);
+  sc->pacing_source = NULL;
+  start_output (sc);
+
+  return G_SOURCE_REMOVE;
 }
 
 static void
-gst_rtmp_connection_write_chunk_done (GObject * obj,
-    GAsyncResult * res, gpointer user_data)
+gst_rtmp_connection_update_enqueue_rate (GstRtmpConnection * sc, gint64 now)
 {
-  GOutputStream *os = G_OUTPUT_STREAM (obj);
-  GstRtmpConnection *connection = GST_RTMP_CONNECTION (user_data);
-  GstRtmpChunk *chunk = connection->output_chunk;
-  GError *error = NULL;
-  gssize ret;
+  guint enqueued;
+  gdouble rate;
+  gint64 elapsed;
 
-  GST_DEBUG ("gst_rtmp_connection_write_chunk_done");
+  enqueued = g_atomic_int_get (&sc->output_enqueued_bytes);
 
-  connection->writing = FALSE;
+  if (sc->enqueue_last_time == 0) {
+    sc->enqueue_last_time = now;
+    sc->enqueue_last_bytes = enqueued;
+    return;
+  }
 
-  ret = g_output_stream_write_finish (os, res, &error);
-  if (ret < 0) {
-    GST_DEBUG ("write error: %s", error->message);
-    gst_rtmp_connection_got_closed (connection);
-    g_error_free (error);
+  elapsed = now - sc->enqueue_last_time;
+  if (elapsed < 100 * 1000)
     return;
+
+  rate = (gdouble) (enqueued - sc->enqueue_last_bytes) * G_USEC_PER_SEC /
+      elapsed;
+  if (sc->enqueue_rate > 0) {
+    sc->enqueue_rate = 0.9 * sc->enqueue_rate + 0.1 * rate;
+  } else {
+    sc->enqueue_rate = rate;
   }
-  if (ret < (gssize) g_bytes_get_size (connection->output_bytes)) {
-    GST_DEBUG ("short write %" G_GSIZE_FORMAT " < %" G_GSIZE_FORMAT,
-        ret, g_bytes_get_size (connection->output_bytes));
 
-    connection->output_bytes =
-        gst_rtmp_bytes_remove (connection->output_bytes, ret);
+  sc->enqueue_last_time = now;
+  sc->enqueue_last_bytes = enqueued;
+}
+
+/* Returns how many of the next @size bytes may be written now.  If the
+ * answer is 0, arranges for output to be restarted later. */
+static gsize
+gst_rtmp_connection_output_allowance (GstRtmpConnection * sc, gsize size)
+{
+  gint64 now;
+  gdouble rate;
+  gsize burst;
+  gsize window;
+  gint32 unacked;
+
+  if (!sc->pacing)
+    return size;
+
+  /* don't let more than the peer's window be in flight, but only if
+   * the peer acknowledges at all.  The peer only acks every
+   * window-ack-size bytes (we announce peer_bandwidth back to it, and
+   * it may announce its own), so a window no larger than that stalls
+   * until each ack arrives, and a smaller one never sees an ack at all
+   * and deadlocks.  Allow twice the larger of the two. */
+  if (sc->got_ack && sc->peer_bandwidth > 0) {
+    window = 2 * MAX (sc->peer_bandwidth, sc->window_ack_size);
+    unacked = (gint32) (sc->total_output_bytes - sc->acked_output_bytes);
+    unacked = MAX (unacked, 0);
+    if ((gsize) unacked >= window) {
+      GST_DEBUG ("peer window full (%d unacknowledged bytes)", unacked);
+      return 0;
+    }
+    size = MIN (size, window - unacked);
+  }
+
+  now = g_get_monotonic_time ();
+  gst_rtmp_connection_update_enqueue_rate (sc, now);
+
+  if (sc->pacing_rate > 0) {
+    rate = sc->pacing_rate;
   } else {
-    g_bytes_unref (connection->output_bytes);
-    connection->output_bytes = NULL;
-    g_object_unref (chunk);
-    connection->output_chunk = NULL;
+    /* keep up with the input, but smooth out bursts */
+    rate = 2 * sc->enqueue_rate;
   }
+  if (rate <= 0)
+    return size;
 
-  gst_rtmp_connection_start_output (connection);
+  burst = sc->pacing_burst;
+  if (burst == 0)
+    burst = MAX (rate / 20, 4 * sc->out_chunk_size);
+
+  if (sc->pacing_last_time == 0) {
+    sc->pacing_tokens = burst;
+  } else {
+    sc->pacing_tokens += rate * (now - sc->pacing_last_time) / G_USEC_PER_SEC;
+    sc->pacing_tokens = MIN (sc->pacing_tokens, burst);
+  }
+  sc->pacing_last_time = now;
+
+  if (sc->pacing_tokens < MIN (size, sc->out_chunk_size)) {
+    gdouble wait;
+
+    if (sc->pacing_source)
+      return 0;
+
+    wait = (MIN (size, sc->out_chunk_size) - sc->pacing_tokens) / rate;
+    GST_LOG ("pacing: waiting %.1f ms", wait * 1000);
+    sc->pacing_source = g_timeout_source_new (MAX (wait * 1000, 1));
+    g_source_set_callback (sc->pacing_source, pacing_timeout, sc, NULL);
+    g_source_attach (sc->pacing_source, sc->main_context);
+    return 0;
+  }
+
+  return MIN (size, (gsize) sc->pacing_tokens);
+}
+
+static void
+gst_rtmp_connection_got_closed (GstRtmpConnection * connection)
+{
+  connection->closed = TRUE;
+  g_signal_emit (connection, signals[SIGNAL_CLOSED], 0);
 }
 
 
@@ -674,38 +1296,88 @@ gst_rtmp_connection_handle_chunk (GstRtmpConnection * sc, GstRtmpChunk * chunk)
     GST_DEBUG ("got protocol control message, type: %d",
         chunk->message_type_id);
     gst_rtmp_connection_handle_pcm (sc, chunk);
-    g_signal_emit_by_name (sc, "got-control-chunk", chunk);
+    g_signal_emit (sc, signals[SIGNAL_GOT_CONTROL_CHUNK], 0, chunk);
   } else {
     if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_COMMAND) {
-      CommandCallback *cb = NULL;
-      GList *g;
-      char *command_name;
+      GstAmfReader reader;
+      const guint8 *data;
+      gsize size;
+      const char *name;
+      gsize name_length;
       double transaction_id;
-      GstAmfNode *command_object;
-      GstAmfNode *optional_args;
-
-      gst_rtmp_chunk_parse_message (chunk, &command_name, &transaction_id,
-          &command_object, &optional_args);
-      for (g = sc->command_callbacks; g; g = g_list_next (g)) {
-        cb = g->data;
-        if (cb->chunk_stream_id == chunk->chunk_stream_id &&
-            cb->transaction_id == transaction_id) {
-          break;
-        }
+      CommandCallback *cb = NULL;
+
+      /* only decode the rest if someone is waiting for it */
+      data = g_bytes_get_data (chunk->payload, &size);
+      gst_amf_reader_init (&reader, data, size);
+      if (gst_amf_reader_read_string (&reader, &name, &name_length) &&
+          gst_amf_reader_read_number (&reader, &transaction_id)) {
+        cb = gst_rtmp_connection_take_transaction (sc, chunk, name,
+            name_length, transaction_id);
       }
       if (cb) {
-        sc->command_callbacks = g_list_remove (sc->command_callbacks, cb);
+        char *command_name;
+        GstAmfNode *command_object;
+        GstAmfNode *optional_args = NULL;
+
+        command_name = g_strndup (name, name_length);
+        command_object = gst_amf_reader_read_node (&reader);
+        if (!gst_amf_reader_at_end (&reader))
+          optional_args = gst_amf_reader_read_node (&reader);
+
         cb->func (sc, chunk, command_name, transaction_id, command_object,
             optional_args, cb->user_data);
         g_free (cb);
+        g_free (command_name);
+        if (command_object)
+          gst_amf_node_free (command_object);
+        if (optional_args)
+          gst_amf_node_free (optional_args);
       }
-      g_free (command_name);
-      gst_amf_node_free (command_object);
-      if (optional_args)
-        gst_amf_node_free (optional_args);
     }
     GST_DEBUG ("got chunk: %" G_GSIZE_FORMAT " bytes", chunk->message_length);
-    g_signal_emit_by_name (sc, "got-chunk", chunk);
+    gst_rtmp_connection_dispatch_chunk (sc, chunk);
+  }
+}
+
+/* Message handlers first, then got-chunk.  The signal is only emitted if
+ * something is connected to it, since marshalling it for every media
+ * message is not free. */
+static void
+gst_rtmp_connection_dispatch_chunk (GstRtmpConnection * sc,
+    GstRtmpChunk * chunk)
+{
+  GstRtmpConnectionClass *klass = GST_RTMP_CONNECTION_GET_CLASS (sc);
+  guint32 type_bit;
+  guint i;
+
+  type_bit = chunk->message_type_id >= 0 && chunk->message_type_id < 32 ?
+      GST_RTMP_MESSAGE_MASK (chunk->message_type_id) : 0;
+
+  sc->dispatch_depth++;
+  for (i = 0; i < sc->message_handlers->len; i++) {
+    MessageHandler *handler =
+        &g_array_index (sc->message_handlers, MessageHandler, i);
+
+    /* the array may be reallocated by the handler, don't touch it after */
+    if (handler->func && ((handler->type_mask & type_bit) ||
+            handler->type_mask == GST_RTMP_MESSAGE_MASK_ALL)) {
+      handler->func (sc, chunk, handler->user_data);
+    }
+  }
+  sc->dispatch_depth--;
+
+  if (sc->dispatch_depth == 0 && sc->message_handlers_removed) {
+    sc->message_handlers_removed = FALSE;
+    for (i = sc->message_handlers->len; i > 0; i--) {
+      if (!g_array_index (sc->message_handlers, MessageHandler, i - 1).func)
+        g_array_remove_index (sc->message_handlers, i - 1);
+    }
+  }
+
+  if (klass->got_chunk ||
+      g_signal_has_handler_pending (sc, signals[SIGNAL_GOT_CHUNK], 0, FALSE)) {
+    g_signal_emit (sc, signals[SIGNAL_GOT_CHUNK], 0, chunk);
   }
 }
 
@@ -726,12 +1398,16 @@ gst_rtmp_connection_handle_pcm (GstRtmpConnection * connection,
       break;
     case GST_RTMP_MESSAGE_TYPE_ABORT:
       moo = GST_READ_UINT32_BE (data);
-      GST_ERROR ("unimplemented: chunk abort, stream_id = %d", moo);
+      GST_INFO ("chunk abort, chunk_stream_id = %d", moo);
+      gst_rtmp_chunk_cache_abort (connection->input_chunk_cache, moo);
       break;
     case GST_RTMP_MESSAGE_TYPE_ACKNOWLEDGEMENT:
       moo = GST_READ_UINT32_BE (data);
-      /* We don't really send ack requests that we care about, so ignore */
-      GST_DEBUG ("acknowledgement %d", moo);
+      GST_DEBUG ("acknowledgement %u", moo);
+      connection->acked_output_bytes = moo;
+      connection->got_ack = TRUE;
+      /* might have been waiting for the window to open */
+      gst_rtmp_connection_start_output (connection);
       break;
     case GST_RTMP_MESSAGE_TYPE_USER_CONTROL:
       moo = GST_READ_UINT16_BE (data);
@@ -748,11 +1424,7 @@ gst_rtmp_connection_handle_pcm (GstRtmpConnection * connection,
       moo = GST_READ_UINT32_BE (data);
       moo2 = data[4];
       GST_DEBUG ("set peer bandwidth: %d, %d", moo, moo2);
-      /* FIXME this is not correct, but close enough */
-      if (connection->peer_bandwidth != moo) {
-        connection->peer_bandwidth = moo;
-        gst_rtmp_connection_send_window_size_request (connection);
-      }
+      gst_rtmp_connection_set_peer_bandwidth (connection, moo, moo2);
       break;
     default:
       GST_ERROR ("unimplemented protocol control, type %d",
@@ -761,6 +1433,46 @@ gst_rtmp_connection_handle_pcm (GstRtmpConnection * connection,
   }
 }
 
+static void
+gst_rtmp_connection_set_peer_bandwidth (GstRtmpConnection * connection,
+    guint32 bandwidth, int limit_type)
+{
+  gsize old_bandwidth = connection->peer_bandwidth;
+
+  switch (limit_type) {
+    case GST_RTMP_PEER_BANDWIDTH_HARD:
+      connection->peer_bandwidth = bandwidth;
+      break;
+    case GST_RTMP_PEER_BANDWIDTH_SOFT:
+      if (connection->peer_bandwidth == 0 ||
+          bandwidth < connection->peer_bandwidth) {
+        connection->peer_bandwidth = bandwidth;
+      }
+      break;
+    case GST_RTMP_PEER_BANDWIDTH_DYNAMIC:
+      /* only meaningful if the previous limit was hard */
+      if (connection->peer_bandwidth_limit_type !=
+          GST_RTMP_PEER_BANDWIDTH_HARD) {
+        GST_DEBUG ("ignoring dynamic peer bandwidth");
+        return;
+      }
+      connection->peer_bandwidth = bandwidth;
+      limit_type = GST_RTMP_PEER_BANDWIDTH_HARD;
+      break;
+    default:
+      GST_ERROR ("unknown peer bandwidth limit type %d", limit_type);
+      return;
+  }
+  connection->peer_bandwidth_limit_type = limit_type;
+
+  if (connection->peer_bandwidth != old_bandwidth) {
+    GST_INFO ("peer bandwidth now %" G_GSIZE_FORMAT,
+        connection->peer_bandwidth);
+    gst_rtmp_connection_send_window_size_request (connection);
+    gst_rtmp_connection_start_output (connection);
+  }
+}
+
 static void
 gst_rtmp_connection_handle_user_control (GstRtmpConnection * connection,
     guint32 event_type, guint32 event_data)
@@ -801,6 +1513,12 @@ gst_rtmp_connection_queue_chunk (GstRtmpConnection * connection,
   g_return_if_fail (GST_IS_RTMP_CONNECTION (connection));
   g_return_if_fail (GST_IS_RTMP_CHUNK (chunk));
 
+  g_atomic_int_add (&connection->output_queued_bytes, chunk->message_length);
+  g_atomic_int_add (&connection->output_enqueued_bytes, chunk->message_length);
+  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_AUDIO ||
+      chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO) {
+    g_atomic_int_set (&connection->output_newest_timestamp, chunk->timestamp);
+  }
   g_async_queue_push (connection->output_queue, chunk);
   gst_rtmp_connection_start_output (connection);
 }
@@ -846,6 +1564,22 @@ gst_rtmp_connection_start_handshake (GstRtmpConnection * connection,
   }
 }
 
+/* For a socket that has already been through the handshake, e.g. one
+ * taken from GstRtmpClient's pool.  Call after
+ * gst_rtmp_connection_set_socket_connection(). */
+void
+gst_rtmp_connection_start_handshaked (GstRtmpConnection * connection)
+{
+  if (connection->thread != g_thread_self ()) {
+    GST_ERROR ("Called from wrong thread");
+  }
+
+  connection->handshake_complete = TRUE;
+  gst_rtmp_connection_set_input_callback (connection,
+      gst_rtmp_connection_chunk_callback, 0);
+  gst_rtmp_connection_start_output (connection);
+}
+
 #if 0
 static void
 gst_rtmp_connection_handshake_async (GstRtmpConnection * connection,
@@ -884,7 +1618,7 @@ gst_rtmp_connection_client_handshake1 (GstRtmpConnection * sc)
   memset (data + 9, 0xa5, 1528);
   bytes = g_bytes_new_take (data, 1 + 1536);
 
-  sc->output_bytes = bytes;
+  sc->handshake_bytes = bytes;
   g_output_stream_write_async (os, data, 1 + 1536,
       G_PRIORITY_DEFAULT, sc->cancellable,
       gst_rtmp_connection_client_handshake1_done, sc);
@@ -909,55 +1643,27 @@ gst_rtmp_connection_client_handshake1_done (GObject * obj,
   }
   GST_DEBUG ("wrote %" G_GSSIZE_FORMAT " bytes", ret);
 
-  g_bytes_unref (sc->output_bytes);
-  sc->output_bytes = NULL;
+  g_bytes_unref (sc->handshake_bytes);
+  sc->handshake_bytes = NULL;
 
   gst_rtmp_connection_set_input_callback (sc,
       gst_rtmp_connection_client_handshake2, 1 + 1536 + 1536);
 }
 
+/* C2 is not written here but left in output_bytes, where the output
+ * code picks it up together with whatever commands were queued during
+ * the handshake, so the connect usually goes out in the same packet.
+ * It is written regardless of pacing and the peer's window, and not
+ * counted in total_output_bytes. */
 static void
 gst_rtmp_connection_client_handshake2 (GstRtmpConnection * sc)
 {
   GBytes *bytes;
-  GBytes *out_bytes;
-  GOutputStream *os;
-  const guint8 *data;
-  gsize size;
 
   bytes = gst_rtmp_connection_take_input_bytes (sc, 1 + 1536 + 1536);
-  out_bytes = g_bytes_new_from_bytes (bytes, 1 + 1536, 1536);
+  sc->output_bytes = g_bytes_new_from_bytes (bytes, 1 + 1536, 1536);
   g_bytes_unref (bytes);
 
-  sc->output_bytes = out_bytes;
-  data = g_bytes_get_data (out_bytes, &size);
-  os = g_io_stream_get_output_stream (G_IO_STREAM (sc->connection));
-  g_output_stream_write_async (os, data, size, G_PRIORITY_DEFAULT,
-      sc->cancellable, gst_rtmp_connection_client_handshake2_done, sc);
-}
-
-static void
-gst_rtmp_connection_client_handshake2_done (GObject * obj,
-    GAsyncResult * res, gpointer user_data)
-{
-  GOutputStream *os = G_OUTPUT_STREAM (obj);
-  GstRtmpConnection *sc = GST_RTMP_CONNECTION (user_data);
-  GError *error = NULL;
-  gssize ret;
-
-  GST_DEBUG ("gst_rtmp_connection_client_handshake2_done");
-
-  ret = g_output_stream_write_finish (os, res, &error);
-  if (ret < 1536) {
-    GST_ERROR ("write error: %s", error->message);
-    g_error_free (error);
-    return;
-  }
-  GST_DEBUG ("wrote %" G_GSSIZE_FORMAT " bytes", ret);
-
-  g_bytes_unref (sc->output_bytes);
-  sc->output_bytes = NULL;
-
   /* handshake finished */
   GST_INFO ("client handshake finished");
   sc->handshake_complete = TRUE;
@@ -971,7 +1677,11 @@ gst_rtmp_connection_client_handshake2_done (GObject * obj,
         gst_rtmp_connection_chunk_callback, 0);
   }
 
-  gst_rtmp_connection_start_output (sc);
+  /* the socket is writable, no need to wait for an idle source */
+  if (!sc->output_source) {
+    gst_rtmp_connection_output_ready (g_io_stream_get_output_stream
+        (G_IO_STREAM (sc->connection)), sc);
+  }
 }
 
 void
@@ -982,86 +1692,518 @@ gst_rtmp_connection_dump (GstRtmpConnection * connection)
   g_print ("  input_bytes: %" G_GSIZE_FORMAT "\n",
       connection->input_bytes ? g_bytes_get_size (connection->input_bytes) : 0);
   g_print ("  needed: %" G_GSIZE_FORMAT "\n", connection->input_needed_bytes);
+  g_print ("  queued_bytes: %" G_GSIZE_FORMAT "\n",
+      gst_rtmp_connection_get_queued_bytes (connection));
 
 }
 
+/* Number of payload bytes that have been queued for output but not
+ * written to the socket yet.  Safe to call from any thread. */
+gsize
+gst_rtmp_connection_get_queued_bytes (GstRtmpConnection * connection)
+{
+  gint queued;
+
+  queued = g_atomic_int_get (&connection->output_queued_bytes);
+
+  return MAX (queued, 0);
+}
+
+/* Spread output over time with a token bucket.  @rate is in bytes per
+ * second, 0 meaning twice the rate at which chunks are queued.  @burst
+ * is the bucket size in bytes, 0 meaning 50 ms worth of @rate (but at
+ * least four chunks).  Must be
+ * called before output starts. */
+void
+gst_rtmp_connection_set_pacing (GstRtmpConnection * connection,
+    gboolean enable, guint64 rate, gsize burst)
+{
+  g_return_if_fail (GST_IS_RTMP_CONNECTION (connection));
+
+  connection->pacing = enable;
+  connection->pacing_rate = rate;
+  connection->pacing_burst = burst;
+  connection->pacing_last_time = 0;
+}
+
+/* Partially sent video messages lagging more than @max_latency
+ * milliseconds behind the newest queued media are aborted.  0 disables
+ * this. */
+void
+gst_rtmp_connection_set_max_output_latency (GstRtmpConnection * connection,
+    guint max_latency)
+{
+  g_return_if_fail (GST_IS_RTMP_CONNECTION (connection));
+
+  connection->max_output_latency = max_latency;
+}
+
+/* Queues a SET_CHUNK_SIZE message.  Chunks serialized after it use the
+ * new size. */
+void
+gst_rtmp_connection_set_chunk_size (GstRtmpConnection * connection,
+    gsize chunk_size)
+{
+  GstRtmpChunk *chunk;
+  guint8 *data;
+
+  g_return_if_fail (GST_IS_RTMP_CONNECTION (connection));
+  g_return_if_fail (chunk_size > 0 && chunk_size <= 0x7fffffff);
+
+  chunk = gst_rtmp_chunk_new ();
+  chunk->chunk_stream_id = GST_RTMP_CHUNK_STREAM_PROTOCOL;
+  chunk->timestamp = 0;
+  chunk->message_type_id = GST_RTMP_MESSAGE_TYPE_SET_CHUNK_SIZE;
+  chunk->stream_id = 0;
+
+  data = g_malloc (4);
+  GST_WRITE_UINT32_BE (data, chunk_size);
+  chunk->payload = g_bytes_new_take (data, 4);
+  chunk->message_length = 4;
+
+  gst_rtmp_connection_queue_chunk (connection, chunk);
+}
+
 int
 gst_rtmp_connection_send_command (GstRtmpConnection * connection,
     int chunk_stream_id, const char *command_name, int transaction_id,
     GstAmfNode * command_object, GstAmfNode * optional_args,
     GstRtmpCommandCallback response_command, gpointer user_data)
+{
+  GstAmfNode *args[] = { command_object, optional_args };
+
+  return gst_rtmp_connection_send_commandv (connection, chunk_stream_id, 0,
+      command_name, transaction_id, G_N_ELEMENTS (args), args,
+      response_command, user_data);
+}
+
+int
+gst_rtmp_connection_send_command2 (GstRtmpConnection * connection,
+    int chunk_stream_id, int stream_id,
+    const char *command_name, int transaction_id, GstAmfNode * command_object,
+    GstAmfNode * optional_args, GstAmfNode * n3, GstAmfNode * n4,
+    GstRtmpCommandCallback response_command, gpointer user_data)
+{
+  GstAmfNode *args[] = { command_object, optional_args, n3, n4 };
+
+  return gst_rtmp_connection_send_commandv (connection, chunk_stream_id,
+      stream_id, command_name, transaction_id, G_N_ELEMENTS (args), args,
+      response_command, user_data);
+}
+
+static void
+gst_rtmp_connection_queue_command (GstRtmpConnection * connection,
+    int chunk_stream_id, int stream_id, GBytes * payload, int transaction_id,
+    GstRtmpCommandCallback response_command, gpointer user_data)
 {
   GstRtmpChunk *chunk;
 
-  if (connection->thread != g_thread_self ()) {
-    GST_ERROR ("Called from wrong thread");
-  }
   chunk = gst_rtmp_chunk_new ();
   chunk->chunk_stream_id = chunk_stream_id;
   chunk->timestamp = 0;         /* FIXME */
   chunk->message_type_id = GST_RTMP_MESSAGE_TYPE_COMMAND;
-  chunk->stream_id = 0;         /* FIXME */
-
-  chunk->payload = gst_amf_serialize_command (command_name, transaction_id,
-      command_object, optional_args);
-  chunk->message_length = g_bytes_get_size (chunk->payload);
+  chunk->stream_id = stream_id;
+  chunk->payload = payload;
+  chunk->message_length = g_bytes_get_size (payload);
 
   gst_rtmp_connection_queue_chunk (connection, chunk);
 
   if (response_command) {
-    CommandCallback *callback;
+    gst_rtmp_connection_add_transaction (connection, chunk_stream_id,
+        stream_id, transaction_id, response_command, user_data);
+  }
+}
 
-    callback = g_malloc0 (sizeof (CommandCallback));
-    callback->chunk_stream_id = chunk_stream_id;
-    callback->transaction_id = transaction_id;
-    callback->func = response_command;
-    callback->user_data = user_data;
+/* Sends a command with @n_args arguments after the transaction id, NULL
+ * ones are skipped.  Returns the transaction id, or 0 if the arguments
+ * can't be serialized. */
+int
+gst_rtmp_connection_send_commandv (GstRtmpConnection * connection,
+    int chunk_stream_id, int stream_id, const char *command_name,
+    int transaction_id, guint n_args, GstAmfNode ** args,
+    GstRtmpCommandCallback response_command, gpointer user_data)
+{
+  GBytes *payload;
+
+  if (connection->thread != g_thread_self ()) {
+    GST_ERROR ("Called from wrong thread");
+  }
+  if (transaction_id == 0 && response_command) {
+    transaction_id = gst_rtmp_connection_allocate_transaction_id (connection,
+        chunk_stream_id);
+  }
 
-    connection->command_callbacks =
-        g_list_append (connection->command_callbacks, callback);
+  payload = gst_amf_serialize_commandv (command_name, transaction_id, n_args,
+      args);
+  if (!payload) {
+    GST_ERROR_OBJECT (connection, "could not serialize %s command",
+        command_name);
+    return 0;
   }
 
+  gst_rtmp_connection_queue_command (connection, chunk_stream_id, stream_id,
+      payload, transaction_id, response_command, user_data);
+
   return transaction_id;
 }
 
+/* The commands every client sends only differ in their strings, so they
+ * are serialized once per process and kept for its lifetime.  The slots
+ * are the strings left NULL. */
+static GMutex command_templates_lock;
+static GstAmfTemplate *command_templates[GST_RTMP_N_COMMAND_TEMPLATES];
+
+static void
+create_command_templates (void)
+{
+  GstAmfNode *args[2];
+
+  /* app, tcUrl.  Flash also sends fpad, capabilities, audioCodecs,
+   * videoCodecs and videoFunction, servers don't need them. */
+  args[0] = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
+  gst_amf_object_set_string (args[0], "app", NULL);
+  gst_amf_object_set_string (args[0], "type", "nonprivate");
+  gst_amf_object_set_string (args[0], "tcUrl", NULL);
+  command_templates[GST_RTMP_COMMAND_TEMPLATE_CONNECT] =
+      gst_amf_template_new ("connect", 1, args);
+  gst_amf_node_free (args[0]);
+
+  args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+  command_templates[GST_RTMP_COMMAND_TEMPLATE_CREATE_STREAM] =
+      gst_amf_template_new ("createStream", 1, args);
+
+  /* stream */
+  args[1] = gst_amf_node_new (GST_AMF_TYPE_STRING);
+  command_templates[GST_RTMP_COMMAND_TEMPLATE_RELEASE_STREAM] =
+      gst_amf_template_new ("releaseStream", 2, args);
+  command_templates[GST_RTMP_COMMAND_TEMPLATE_FC_PUBLISH] =
+      gst_amf_template_new ("FCPublish", 2, args);
+
+  gst_amf_node_free (args[0]);
+  gst_amf_node_free (args[1]);
+}
+
+/* Returns the shared template for @which, created on first use */
+const GstAmfTemplate *
+gst_rtmp_connection_get_command_template (GstRtmpCommandTemplate which)
+{
+  GstAmfTemplate *tmpl;
+
+  g_return_val_if_fail (which < GST_RTMP_N_COMMAND_TEMPLATES, NULL);
+
+  g_mutex_lock (&command_templates_lock);
+  if (!command_templates[0])
+    create_command_templates ();
+  tmpl = command_templates[which];
+  g_mutex_unlock (&command_templates_lock);
+
+  return tmpl;
+}
+
+/* Like gst_rtmp_connection_send_commandv(), with the command made from
+ * @tmpl and one string per slot */
 int
-gst_rtmp_connection_send_command2 (GstRtmpConnection * connection,
-    int chunk_stream_id, int stream_id,
-    const char *command_name, int transaction_id, GstAmfNode * command_object,
-    GstAmfNode * optional_args, GstAmfNode * n3, GstAmfNode * n4,
+gst_rtmp_connection_send_template (GstRtmpConnection * connection,
+    int chunk_stream_id, int stream_id, const GstAmfTemplate * tmpl,
+    int transaction_id, const char *const *strings,
     GstRtmpCommandCallback response_command, gpointer user_data)
 {
-  GstRtmpChunk *chunk;
+  GBytes *payload;
 
   if (connection->thread != g_thread_self ()) {
     GST_ERROR ("Called from wrong thread");
   }
-  chunk = gst_rtmp_chunk_new ();
-  chunk->chunk_stream_id = chunk_stream_id;
-  chunk->timestamp = 0;         /* FIXME */
-  chunk->message_type_id = GST_RTMP_MESSAGE_TYPE_COMMAND;
-  chunk->stream_id = stream_id;
+  if (transaction_id == 0 && response_command) {
+    transaction_id = gst_rtmp_connection_allocate_transaction_id (connection,
+        chunk_stream_id);
+  }
 
-  chunk->payload = gst_amf_serialize_command2 (command_name, transaction_id,
-      command_object, optional_args, n3, n4);
-  chunk->message_length = g_bytes_get_size (chunk->payload);
+  payload = gst_amf_template_fill (tmpl, transaction_id, strings);
+  gst_rtmp_connection_queue_command (connection, chunk_stream_id, stream_id,
+      payload, transaction_id, response_command, user_data);
 
-  gst_rtmp_connection_queue_chunk (connection, chunk);
+  return transaction_id;
+}
 
-  if (response_command) {
-    CommandCallback *callback;
+/* Calls @handler for every message that isn't a protocol control
+ * message and whose type is in @type_mask, before the got-chunk signal.
+ * Much cheaper than the signal for media messages.  Must be called from
+ * the thread the connection runs on.  Returns an id for
+ * gst_rtmp_connection_remove_message_handler(). */
+guint
+gst_rtmp_connection_add_message_handler (GstRtmpConnection * connection,
+    guint32 type_mask, GstRtmpMessageHandler handler, gpointer user_data,
+    GDestroyNotify notify)
+{
+  MessageHandler h;
+
+  g_return_val_if_fail (handler != NULL, 0);
+
+  h.id = connection->next_message_handler_id++;
+  h.type_mask = type_mask;
+  h.func = handler;
+  h.user_data = user_data;
+  h.notify = notify;
+  g_array_append_val (connection->message_handlers, h);
 
-    callback = g_malloc0 (sizeof (CommandCallback));
-    callback->chunk_stream_id = chunk_stream_id;
-    callback->transaction_id = transaction_id;
-    callback->func = response_command;
-    callback->user_data = user_data;
+  return h.id;
+}
+
+void
+gst_rtmp_connection_remove_message_handler (GstRtmpConnection * connection,
+    guint handler_id)
+{
+  guint i;
 
-    connection->command_callbacks =
-        g_list_append (connection->command_callbacks, callback);
+  for (i = 0; i < connection->message_handlers->len; i++) {
+    MessageHandler *h =
+        &g_array_index (connection->message_handlers, MessageHandler, i);
+
+    if (h->id != handler_id || !h->func)
+      continue;
+
+    if (h->notify)
+      h->notify (h->user_data);
+    if (connection->dispatch_depth > 0) {
+      h->func = NULL;
+      connection->message_handlers_removed = TRUE;
+    } else {
+      g_array_remove_index (connection->message_handlers, i);
+    }
+    return;
   }
 
-  return transaction_id;
+  GST_WARNING ("no message handler with id %u", handler_id);
+}
+
+static void
+gst_rtmp_connection_free_message_handlers (GstRtmpConnection * sc)
+{
+  guint i;
+
+  for (i = 0; i < sc->message_handlers->len; i++) {
+    MessageHandler *h = &g_array_index (sc->message_handlers, MessageHandler,
+        i);
+
+    if (h->func && h->notify)
+      h->notify (h->user_data);
+  }
+  g_array_set_size (sc->message_handlers, 0);
+}
+
+/* Commands that haven't been answered after @timeout milliseconds get
+ * their callback called with a NULL chunk and "_error" as the command
+ * name.  0 means wait forever.  Applies to commands sent afterwards. */
+void
+gst_rtmp_connection_set_command_timeout (GstRtmpConnection * connection,
+    guint timeout)
+{
+  connection->command_timeout = timeout;
+}
+
+/* Transaction id 0 with a callback means "pick one" */
+static int
+gst_rtmp_connection_allocate_transaction_id (GstRtmpConnection * sc,
+    guint32 chunk_stream_id)
+{
+  guint64 key;
+  int id;
+
+  do {
+    if (sc->next_transaction_id <= 0)
+      sc->next_transaction_id = 1;
+    id = sc->next_transaction_id++;
+    key = ((guint64) chunk_stream_id << 32) | (guint32) id;
+  } while (g_hash_table_contains (sc->transactions, &key));
+
+  return id;
+}
+
+static void
+gst_rtmp_connection_add_transaction (GstRtmpConnection * sc,
+    guint32 chunk_stream_id, guint32 stream_id, int transaction_id,
+    GstRtmpCommandCallback func, gpointer user_data)
+{
+  CommandCallback *cb;
+  CommandCallback *old;
+  GList *l;
+
+  cb = g_new0 (CommandCallback, 1);
+  cb->key = ((guint64) chunk_stream_id << 32) | (guint32) transaction_id;
+  cb->chunk_stream_id = chunk_stream_id;
+  cb->transaction_id = transaction_id;
+  cb->stream_id = stream_id;
+  cb->func = func;
+  cb->user_data = user_data;
+
+  old = g_hash_table_lookup (sc->transactions, &cb->key);
+  if (old) {
+    GST_WARNING ("transaction %d on chunk stream %u reused, dropping the "
+        "old one", transaction_id, chunk_stream_id);
+    gst_rtmp_connection_remove_transaction (sc, old);
+    g_free (old);
+  }
+  g_hash_table_insert (sc->transactions, &cb->key, cb);
+
+  if (sc->command_timeout == 0)
+    return;
+
+  /* deadlines normally arrive in order, so this is an append */
+  cb->deadline = g_get_monotonic_time () +
+      (gint64) sc->command_timeout * 1000;
+  for (l = sc->transaction_deadlines.tail; l; l = l->prev) {
+    if (((CommandCallback *) l->data)->deadline <= cb->deadline)
+      break;
+  }
+  if (l) {
+    g_queue_insert_after (&sc->transaction_deadlines, l, cb);
+    cb->link = l->next;
+  } else {
+    g_queue_push_head (&sc->transaction_deadlines, cb);
+    cb->link = sc->transaction_deadlines.head;
+    gst_rtmp_connection_schedule_timeout (sc);
+  }
+}
+
+/* Finds and unlinks the transaction @chunk answers.  Replies to publish
+ * and play are onStatus with transaction id 0 on the stream the command
+ * was sent to, so those are matched by stream instead. */
+static CommandCallback *
+gst_rtmp_connection_take_transaction (GstRtmpConnection * sc,
+    GstRtmpChunk * chunk, const char *command_name,
+    gsize command_name_length, int transaction_id)
+{
+  CommandCallback *cb;
+  guint64 key;
+
+  key = ((guint64) chunk->chunk_stream_id << 32) | (guint32) transaction_id;
+  cb = g_hash_table_lookup (sc->transactions, &key);
+
+  if (!cb && transaction_id == 0 && chunk->stream_id != 0 &&
+      command_name_length == 8 &&
+      memcmp (command_name, "onStatus", 8) == 0) {
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init (&iter, sc->transactions);
+    while (g_hash_table_iter_next (&iter, NULL, &value)) {
+      CommandCallback *candidate = value;
+
+      if (candidate->stream_id == chunk->stream_id &&
+          (!cb || candidate->transaction_id < cb->transaction_id)) {
+        cb = candidate;
+      }
+    }
+  }
+
+  if (cb) {
+    gst_rtmp_connection_remove_transaction (sc, cb);
+  }
+
+  return cb;
+}
+
+/* Unlinks @cb without freeing it */
+static void
+gst_rtmp_connection_remove_transaction (GstRtmpConnection * sc,
+    CommandCallback * cb)
+{
+  g_hash_table_steal (sc->transactions, &cb->key);
+
+  if (cb->link) {
+    gboolean was_head = cb->link == sc->transaction_deadlines.head;
+
+    g_queue_delete_link (&sc->transaction_deadlines, cb->link);
+    cb->link = NULL;
+    if (was_head)
+      gst_rtmp_connection_schedule_timeout (sc);
+  }
+}
+
+/* Keeps a single timer running for the earliest deadline */
+static void
+gst_rtmp_connection_schedule_timeout (GstRtmpConnection * sc)
+{
+  CommandCallback *first;
+  gint64 delay;
+
+  if (sc->transaction_timeout_source) {
+    g_source_destroy (sc->transaction_timeout_source);
+    g_source_unref (sc->transaction_timeout_source);
+    sc->transaction_timeout_source = NULL;
+  }
+
+  first = g_queue_peek_head (&sc->transaction_deadlines);
+  if (!first || sc->closed)
+    return;
+
+  delay = first->deadline - g_get_monotonic_time ();
+  sc->transaction_timeout_source =
+      g_timeout_source_new (MAX (delay, 0) / 1000);
+  g_source_set_callback (sc->transaction_timeout_source,
+      gst_rtmp_connection_transaction_timeout, sc, NULL);
+  g_source_attach (sc->transaction_timeout_source, sc->main_context);
+}
+
+static gboolean
+gst_rtmp_connection_transaction_timeout (gpointer user_data)
+{
+  GstRtmpConnection *sc = GST_RTMP_CONNECTION (user_data);
+  gint64 now = g_get_monotonic_time ();
+  CommandCallback *cb;
+
+  g_source_unref (sc->transaction_timeout_source);
+  sc->transaction_timeout_source = NULL;
+
+  while ((cb = g_queue_peek_head (&sc->transaction_deadlines)) &&
+      cb->deadline <= now + 1000) {
+    g_queue_pop_head (&sc->transaction_deadlines);
+    cb->link = NULL;
+    g_hash_table_steal (sc->transactions, &cb->key);
+
+    GST_WARNING ("no reply to transaction %d on chunk stream %u",
+        cb->transaction_id, cb->chunk_stream_id);
+    cb->func (sc, NULL, "_error", cb->transaction_id, NULL, NULL,
+        cb->user_data);
+    g_free (cb);
+  }
+
+  gst_rtmp_connection_schedule_timeout (sc);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* No reply is coming on a closed connection.  Callers see the same
+ * NULL chunk and "_error" as on a timeout.  Commands the callbacks send
+ * meanwhile can't be answered either and are dropped. */
+static void
+gst_rtmp_connection_fail_transactions (GstRtmpConnection * sc)
+{
+  GList *pending;
+  GList *l;
+
+  pending = g_hash_table_get_values (sc->transactions);
+  g_hash_table_steal_all (sc->transactions);
+  g_queue_clear (&sc->transaction_deadlines);
+
+  for (l = pending; l; l = l->next) {
+    CommandCallback *cb = l->data;
+
+    GST_DEBUG ("failing transaction %d on chunk stream %u, connection "
+        "closed", cb->transaction_id, cb->chunk_stream_id);
+    cb->func (sc, NULL, "_error", cb->transaction_id, NULL, NULL,
+        cb->user_data);
+    g_free (cb);
+  }
+  g_list_free (pending);
+
+  g_queue_clear (&sc->transaction_deadlines);
+  g_hash_table_remove_all (sc->transactions);
+  if (sc->transaction_timeout_source) {
+    g_source_destroy (sc->transaction_timeout_source);
+    g_source_unref (sc->transaction_timeout_source);
+    sc->transaction_timeout_source = NULL;
+  }
 }
 
 static void
@@ -31,6 +31,7 @@ G_BEGIN_DECLS
 #define GST_RTMP_CONNECTION_CLASS(klass)   (G_TYPE_CHECK_CLASS_CAST((klass),GST_TYPE_RTMP_CONNECTION,GstRtmpConnectionClass))
 #define GST_IS_RTMP_CONNECTION(obj)   (G_TYPE_CHECK_INSTANCE_TYPE((obj),GST_TYPE_RTMP_CONNECTION))
 #define GST_IS_RTMP_CONNECTION_CLASS(obj)   (G_TYPE_CHECK_CLASS_TYPE((klass),GST_TYPE_RTMP_CONNECTION))
+#define GST_RTMP_CONNECTION_GET_CLASS(obj)   (G_TYPE_INSTANCE_GET_CLASS((obj),GST_TYPE_RTMP_CONNECTION,GstRtmpConnectionClass))
 
 typedef struct _GstRtmpConnection GstRtmpConnection;
 typedef struct _GstRtmpConnectionClass GstRtmpConnectionClass;
@@ -39,6 +40,22 @@ typedef void (*GstRtmpCommandCallback) (GstRtmpConnection *connection,
     GstRtmpChunk *chunk, const char *command_name, int transaction_id,
     GstAmfNode *command_object, GstAmfNode *optional_args,
     gpointer user_data);
+typedef void (*GstRtmpMessageHandler) (GstRtmpConnection *connection,
+    GstRtmpChunk *chunk, gpointer user_data);
+
+/* shared command templates, see
+ * gst_rtmp_connection_get_command_template() */
+typedef enum {
+  GST_RTMP_COMMAND_TEMPLATE_CONNECT,        /* app, tcUrl */
+  GST_RTMP_COMMAND_TEMPLATE_CREATE_STREAM,  /* no strings */
+  GST_RTMP_COMMAND_TEMPLATE_RELEASE_STREAM, /* stream */
+  GST_RTMP_COMMAND_TEMPLATE_FC_PUBLISH,     /* stream */
+  GST_RTMP_N_COMMAND_TEMPLATES
+} GstRtmpCommandTemplate;
+
+/* message type filters for gst_rtmp_connection_add_message_handler() */
+#define GST_RTMP_MESSAGE_MASK(type) (1U << (type))
+#define GST_RTMP_MESSAGE_MASK_ALL G_MAXUINT32
 
 struct _GstRtmpConnection
 {
@@ -56,7 +73,6 @@ struct _GstRtmpConnection
   GSocketClient *socket_client;
   GAsyncQueue *output_queue;
   GSimpleAsyncResult *async;
-  gboolean writing;
   GMainContext *main_context;
 
   GSource *input_source;
@@ -65,13 +81,58 @@ struct _GstRtmpConnection
   gsize input_needed_bytes;
   GstRtmpConnectionCallback input_callback;
   gboolean handshake_complete;
+  /* C0C1 while it is being written */
+  GBytes *handshake_bytes;
   GstRtmpChunkCache *input_chunk_cache;
   GstRtmpChunkCache *output_chunk_cache;
-  GList *command_callbacks;
-
-  /* chunk currently being written */
-  GstRtmpChunk *output_chunk;
+  /* outstanding commands by chunk stream and transaction id, and the
+   * ones that can time out in order of their deadline */
+  GHashTable *transactions;
+  GQueue transaction_deadlines;
+  GSource *transaction_timeout_source;
+  guint command_timeout;
+  int next_transaction_id;
+  /* MessageHandler, called before got-chunk */
+  GArray *message_handlers;
+  guint next_message_handler_id;
+  int dispatch_depth;
+  gboolean message_handlers_removed;
+
+  /* messages being written, interleaved round-robin, at most one per
+   * chunk stream */
+  GList *output_chunks;
+  /* messages waiting for their chunk stream to become free */
+  GQueue output_pending;
+  /* messages whose last chunk is in output_segments */
+  GList *output_finished;
+  /* chunk headers and payload slices that have not been written yet */
+  GArray *output_segments;
+  guint output_segment_index;
+  gsize output_segment_offset;
+  gsize output_remaining;
+  /* C2 waiting for the first output */
   GBytes *output_bytes;
+  /* how much of output_remaining is C2, which isn't paced or counted */
+  gsize output_handshake_remaining;
+  /* timestamp of the newest media message queued, atomic */
+  gint output_newest_timestamp;
+  guint max_output_latency;
+  gboolean output_skip_video;
+  /* payload bytes queued but not yet written, atomic */
+  gint output_queued_bytes;
+  /* payload bytes ever queued, atomic, wraps */
+  gint output_enqueued_bytes;
+
+  /* output pacing */
+  gboolean pacing;
+  guint64 pacing_rate;
+  gsize pacing_burst;
+  gdouble pacing_tokens;
+  gint64 pacing_last_time;
+  GSource *pacing_source;
+  gdouble enqueue_rate;
+  guint enqueue_last_bytes;
+  gint64 enqueue_last_time;
 
   /* RTMP configuration */
   gsize in_chunk_size;
@@ -80,6 +141,10 @@ struct _GstRtmpConnection
   gsize total_input_bytes;
   gsize bytes_since_ack;
   gsize peer_bandwidth;
+  int peer_bandwidth_limit_type;
+  guint32 total_output_bytes;
+  guint32 acked_output_bytes;
+  gboolean got_ack;
 };
 
 struct _GstRtmpConnectionClass
@@ -102,9 +167,27 @@ void gst_rtmp_connection_close (GstRtmpConnection *connection);
 
 void gst_rtmp_connection_start_handshake (GstRtmpConnection *connection,
     gboolean is_server);
+void gst_rtmp_connection_start_handshaked (GstRtmpConnection *connection);
 void gst_rtmp_connection_queue_chunk (GstRtmpConnection *connection,
     GstRtmpChunk *chunk);
 void gst_rtmp_connection_dump (GstRtmpConnection *connection);
+gsize gst_rtmp_connection_get_queued_bytes (GstRtmpConnection *connection);
+void gst_rtmp_connection_set_pacing (GstRtmpConnection *connection,
+    gboolean enable, guint64 rate, gsize burst);
+void gst_rtmp_connection_set_chunk_size (GstRtmpConnection *connection,
+    gsize chunk_size);
+void gst_rtmp_connection_set_max_output_latency (
+    GstRtmpConnection *connection, guint max_latency);
+void gst_rtmp_connection_set_command_timeout (GstRtmpConnection *connection,
+    guint timeout);
+void gst_rtmp_connection_pause_input (GstRtmpConnection *connection);
+void gst_rtmp_connection_resume_input (GstRtmpConnection *connection);
+
+guint gst_rtmp_connection_add_message_handler (GstRtmpConnection *connection,
+    guint32 type_mask, GstRtmpMessageHandler handler, gpointer user_data,
+    GDestroyNotify notify);
+void gst_rtmp_connection_remove_message_handler (GstRtmpConnection *connection,
+    guint handler_id);
 
 int gst_rtmp_connection_send_command (GstRtmpConnection *connection,
     int chunk_stream_id, const char *command_name, int transaction_id,
@@ -115,6 +198,16 @@ int gst_rtmp_connection_send_command2 (GstRtmpConnection *connection,
     int transaction_id, GstAmfNode *command_object, GstAmfNode *optional_args,
     GstAmfNode *n3, GstAmfNode *n4,
     GstRtmpCommandCallback response_command, gpointer user_data);
+int gst_rtmp_connection_send_commandv (GstRtmpConnection *connection,
+    int chunk_stream_id, int stream_id, const char *command_name,
+    int transaction_id, guint n_args, GstAmfNode **args,
+    GstRtmpCommandCallback response_command, gpointer user_data);
+int gst_rtmp_connection_send_template (GstRtmpConnection *connection,
+    int chunk_stream_id, int stream_id, const GstAmfTemplate *tmpl,
+    int transaction_id, const char *const *strings,
+    GstRtmpCommandCallback response_command, gpointer user_data);
+const GstAmfTemplate * gst_rtmp_connection_get_command_template (
+    GstRtmpCommandTemplate which);
 
 
 G_END_DECLS
@@ -0,0 +1,450 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2013 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+
+#include "rtmph264.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#define NAL_TYPE_IDR 5
+#define NAL_TYPE_SPS 7
+#define NAL_TYPE_PPS 8
+#define NAL_TYPE_AUD 9
+
+typedef const guint8 *(*ScanFunc) (const guint8 * data, gsize size);
+
+static const guint8 *find_start_code_scalar (const guint8 * data, gsize size);
+#ifdef SCAN_X86
+static const guint8 *find_start_code_sse2 (const guint8 * data, gsize size);
+static const guint8 *find_start_code_avx2 (const guint8 * data, gsize size);
+#endif
+
+static ScanFunc scan_func;
+
+
+/* Returns a pointer to the first 00 00 01 in @data, or NULL */
+static const guint8 *
+find_start_code_scalar (const guint8 * data, gsize size)
+{
+  const guint8 *end = data + size;
+  const guint8 *p;
+
+  if (size < 3)
+    return NULL;
+
+  /* p points at the candidate 01.  Anything other than 00 or 01 rules
+   * out the start codes ending at p, p + 1 and p + 2. */
+  p = data + 2;
+  while (p < end) {
+    if (*p > 1) {
+      p += 3;
+    } else if (*p == 0) {
+      p++;
+    } else if (p[-1] || p[-2]) {
+      p += 3;
+    } else {
+      return p - 2;
+    }
+  }
+
+  return NULL;
+}
+
+#ifdef SCAN_X86
+/* Compares 16 (or 32) candidate positions at once using three shifted
+ * loads, so start codes straddling a block are still found.  SSE2 is
+ * always there on x86-64; AVX2 is checked at runtime. */
+static const guint8 *
+find_start_code_sse2 (const guint8 * data, gsize size)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i one = _mm_set1_epi8 (1);
+  gsize i;
+
+  for (i = 0; i + 18 <= size; i += 16) {
+    __m128i a = _mm_loadu_si128 ((const __m128i *) (data + i));
+    __m128i b = _mm_loadu_si128 ((const __m128i *) (data + i + 1));
+    __m128i c = _mm_loadu_si128 ((const __m128i *) (data + i + 2));
+    __m128i m;
+    int mask;
+
+    m = _mm_and_si128 (_mm_cmpeq_epi8 (a, zero), _mm_cmpeq_epi8 (b, zero));
+    m = _mm_and_si128 (m, _mm_cmpeq_epi8 (c, one));
+    mask = _mm_movemask_epi8 (m);
+    if (mask) {
+      return data + i + __builtin_ctz (mask);
+    }
+  }
+
+  return find_start_code_scalar (data + i, size - i);
+}
+
+__attribute__ ((target ("avx2")))
+static const guint8 *
+find_start_code_avx2 (const guint8 * data, gsize size)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i one = _mm256_set1_epi8 (1);
+  gsize i;
+
+  for (i = 0; i + 34 <= size; i += 32) {
+    __m256i a = _mm256_loadu_si256 ((const __m256i *) (data + i));
+    __m256i b = _mm256_loadu_si256 ((const __m256i *) (data + i + 1));
+    __m256i c = _mm256_loadu_si256 ((const __m256i *) (data + i + 2));
+    __m256i m;
+    guint32 mask;
+
+    m = _mm256_and_si256 (_mm256_cmpeq_epi8 (a, zero),
+        _mm256_cmpeq_epi8 (b, zero));
+    m = _mm256_and_si256 (m, _mm256_cmpeq_epi8 (c, one));
+    mask = _mm256_movemask_epi8 (m);
+    if (mask) {
+      return data + i + __builtin_ctz (mask);
+    }
+  }
+
+  return find_start_code_sse2 (data + i, size - i);
+}
+#endif
+
+/* Selects the start code scanner.  Only useful for benchmarking; returns
+ * FALSE if @impl is not supported on this machine. */
+gboolean
+gst_rtmp_h264_set_scan_impl (GstRtmpH264ScanImpl impl)
+{
+  ScanFunc func = NULL;
+
+  switch (impl) {
+    case GST_RTMP_H264_SCAN_AUTO:
+#ifdef SCAN_X86
+      if (__builtin_cpu_supports ("avx2")) {
+        func = find_start_code_avx2;
+      } else {
+        func = find_start_code_sse2;
+      }
+#else
+      func = find_start_code_scalar;
+#endif
+      break;
+    case GST_RTMP_H264_SCAN_SCALAR:
+      func = find_start_code_scalar;
+      break;
+#ifdef SCAN_X86
+    case GST_RTMP_H264_SCAN_SSE2:
+      func = find_start_code_sse2;
+      break;
+    case GST_RTMP_H264_SCAN_AVX2:
+      if (__builtin_cpu_supports ("avx2")) {
+        func = find_start_code_avx2;
+      }
+      break;
+#endif
+    default:
+      break;
+  }
+
+  if (!func)
+    return FALSE;
+
+  g_atomic_pointer_set (&scan_func, func);
+  return TRUE;
+}
+
+const guint8 *
+gst_rtmp_h264_find_start_code (const guint8 * data, gsize size)
+{
+  ScanFunc func = g_atomic_pointer_get (&scan_func);
+
+  if (G_UNLIKELY (func == NULL)) {
+    gst_rtmp_h264_set_scan_impl (GST_RTMP_H264_SCAN_AUTO);
+    func = g_atomic_pointer_get (&scan_func);
+  }
+
+  return func (data, size);
+}
+
+void
+gst_rtmp_h264_access_unit_init (GstRtmpH264AccessUnit * au)
+{
+  memset (au, 0, sizeof (*au));
+  au->nals = g_array_new (FALSE, FALSE, sizeof (GstRtmpH264Nal));
+}
+
+void
+gst_rtmp_h264_access_unit_clear (GstRtmpH264AccessUnit * au)
+{
+  if (au->nals) {
+    g_array_free (au->nals, TRUE);
+    au->nals = NULL;
+  }
+  if (au->sps) {
+    g_bytes_unref (au->sps);
+    au->sps = NULL;
+  }
+  if (au->pps) {
+    g_bytes_unref (au->pps);
+    au->pps = NULL;
+  }
+}
+
+/* Splits a byte-stream (Annex B) access unit into NAL units, notes
+ * whether it contains an IDR slice and copies out SPS and PPS.  Access
+ * unit delimiters are dropped.  Returns FALSE if no start code was
+ * found. */
+gboolean
+gst_rtmp_h264_scan (GstRtmpH264AccessUnit * au, const guint8 * data,
+    gsize size)
+{
+  const guint8 *end = data + size;
+  const guint8 *sc;
+  gsize out_pos = 0;
+
+  g_array_set_size (au->nals, 0);
+  au->idr = FALSE;
+  au->in_place = TRUE;
+  if (au->sps) {
+    g_bytes_unref (au->sps);
+    au->sps = NULL;
+  }
+  if (au->pps) {
+    g_bytes_unref (au->pps);
+    au->pps = NULL;
+  }
+
+  sc = gst_rtmp_h264_find_start_code (data, size);
+  while (sc) {
+    const guint8 *nal_start = sc + 3;
+    const guint8 *nal_end;
+    GstRtmpH264Nal nal;
+
+    sc = gst_rtmp_h264_find_start_code (nal_start, end - nal_start);
+    nal_end = sc ? sc : end;
+    /* zero_byte of a 4-byte start code, or trailing_zero_8bits */
+    while (nal_end > nal_start && nal_end[-1] == 0)
+      nal_end--;
+    if (nal_end == nal_start)
+      continue;
+
+    nal.offset = nal_start - data;
+    nal.size = nal_end - nal_start;
+    nal.type = nal_start[0] & 0x1f;
+
+    if (nal.type == NAL_TYPE_AUD) {
+      continue;
+    } else if (nal.type == NAL_TYPE_IDR) {
+      au->idr = TRUE;
+    } else if (nal.type == NAL_TYPE_SPS) {
+      if (au->sps)
+        g_bytes_unref (au->sps);
+      au->sps = g_bytes_new (nal_start, nal.size);
+    } else if (nal.type == NAL_TYPE_PPS) {
+      if (au->pps)
+        g_bytes_unref (au->pps);
+      au->pps = g_bytes_new (nal_start, nal.size);
+    }
+
+    /* the length field must not overwrite input that is still unread,
+     * which holds as long as every start code is 4 bytes */
+    if (out_pos + 4 > nal.offset) {
+      au->in_place = FALSE;
+    }
+    out_pos += 4 + nal.size;
+    g_array_append_val (au->nals, nal);
+  }
+
+  au->avcc_size = out_pos;
+
+  return au->nals->len > 0;
+}
+
+/* Writes the NAL units found by gst_rtmp_h264_scan() with 4-byte length
+ * prefixes.  @out needs room for au->avcc_size bytes and may be @data if
+ * au->in_place is set.  Returns the number of bytes written. */
+gsize
+gst_rtmp_h264_to_avcc (const GstRtmpH264AccessUnit * au, const guint8 * data,
+    guint8 * out)
+{
+  gsize out_pos = 0;
+  guint i;
+
+  g_return_val_if_fail (out != data || au->in_place, 0);
+
+  for (i = 0; i < au->nals->len; i++) {
+    const GstRtmpH264Nal *nal = &g_array_index (au->nals, GstRtmpH264Nal, i);
+
+    GST_WRITE_UINT32_BE (out + out_pos, nal->size);
+    memmove (out + out_pos + 4, data + nal->offset, nal->size);
+    out_pos += 4 + nal->size;
+  }
+
+  return out_pos;
+}
+
+/* Reads bits from an RBSP, skipping emulation prevention bytes */
+typedef struct
+{
+  const guint8 *data;
+  gsize size;
+  gsize offset;
+  guint bit;
+  guint zeros;
+} BitReader;
+
+static gboolean
+bit_reader_read_bit (BitReader * br, guint * value)
+{
+  if (br->bit == 0) {
+    if (br->offset >= br->size)
+      return FALSE;
+    /* 00 00 03 */
+    if (br->zeros >= 2 && br->data[br->offset] == 3) {
+      br->offset++;
+      br->zeros = 0;
+      if (br->offset >= br->size)
+        return FALSE;
+    }
+    br->zeros = br->data[br->offset] ? 0 : br->zeros + 1;
+  }
+
+  *value = (br->data[br->offset] >> (7 - br->bit)) & 1;
+  if (++br->bit == 8) {
+    br->bit = 0;
+    br->offset++;
+  }
+
+  return TRUE;
+}
+
+/* Exp-Golomb ue(v) */
+static gboolean
+bit_reader_read_ue (BitReader * br, guint * value)
+{
+  guint leading_zeros = 0;
+  guint bit;
+  guint v = 0;
+  guint i;
+
+  for (;;) {
+    if (!bit_reader_read_bit (br, &bit))
+      return FALSE;
+    if (bit)
+      break;
+    if (++leading_zeros > 31)
+      return FALSE;
+  }
+  for (i = 0; i < leading_zeros; i++) {
+    if (!bit_reader_read_bit (br, &bit))
+      return FALSE;
+    v = (v << 1) | bit;
+  }
+  *value = (1u << leading_zeros) - 1 + v;
+
+  return TRUE;
+}
+
+/* Reads chroma_format_idc and the bit depths from the SPS of a high
+ * profile.  These come right after seq_parameter_set_id. */
+static gboolean
+parse_sps_chroma_format (const guint8 * sps_data, gsize sps_size,
+    guint * chroma_format, guint * bit_depth_luma_minus8,
+    guint * bit_depth_chroma_minus8)
+{
+  BitReader br = { sps_data, sps_size, 4, 0, 0 };
+  guint sps_id;
+  guint separate_colour_plane;
+
+  if (!bit_reader_read_ue (&br, &sps_id) ||
+      !bit_reader_read_ue (&br, chroma_format) || *chroma_format > 3)
+    return FALSE;
+  if (*chroma_format == 3 &&
+      !bit_reader_read_bit (&br, &separate_colour_plane))
+    return FALSE;
+  if (!bit_reader_read_ue (&br, bit_depth_luma_minus8) ||
+      !bit_reader_read_ue (&br, bit_depth_chroma_minus8))
+    return FALSE;
+
+  return *bit_depth_luma_minus8 <= 6 && *bit_depth_chroma_minus8 <= 6;
+}
+
+/* Builds an AVCDecoderConfigurationRecord with 4-byte NAL lengths.  For
+ * the high profiles the record ends with the chroma format and bit
+ * depths, and no SPS extensions.  Returns NULL if those can't be read
+ * from @sps. */
+GBytes *
+gst_rtmp_h264_make_avc_config (GBytes * sps, GBytes * pps)
+{
+  const guint8 *sps_data;
+  const guint8 *pps_data;
+  gsize sps_size;
+  gsize pps_size;
+  guint chroma_format = 1;
+  guint bit_depth_luma_minus8 = 0;
+  guint bit_depth_chroma_minus8 = 0;
+  gboolean high_profile;
+  guint8 *data;
+  gsize size;
+
+  sps_data = g_bytes_get_data (sps, &sps_size);
+  pps_data = g_bytes_get_data (pps, &pps_size);
+  if (sps_size < 4 || sps_size > G_MAXUINT16 || pps_size > G_MAXUINT16) {
+    return NULL;
+  }
+
+  high_profile = sps_data[1] == 100 || sps_data[1] == 110 ||
+      sps_data[1] == 122 || sps_data[1] == 144;
+  if (high_profile && !parse_sps_chroma_format (sps_data, sps_size,
+          &chroma_format, &bit_depth_luma_minus8, &bit_depth_chroma_minus8)) {
+    GST_WARNING ("could not parse chroma format from SPS");
+    return NULL;
+  }
+
+  size = 6 + 2 + sps_size + 1 + 2 + pps_size + (high_profile ? 4 : 0);
+  data = g_malloc (size);
+  data[0] = 1;                  /* configurationVersion */
+  data[1] = sps_data[1];        /* AVCProfileIndication */
+  data[2] = sps_data[2];        /* profile_compatibility */
+  data[3] = sps_data[3];        /* AVCLevelIndication */
+  data[4] = 0xff;               /* lengthSizeMinusOne = 3 */
+  data[5] = 0xe1;               /* numOfSequenceParameterSets = 1 */
+  GST_WRITE_UINT16_BE (data + 6, sps_size);
+  memcpy (data + 8, sps_data, sps_size);
+  data[8 + sps_size] = 1;       /* numOfPictureParameterSets */
+  GST_WRITE_UINT16_BE (data + 9 + sps_size, pps_size);
+  memcpy (data + 11 + sps_size, pps_data, pps_size);
+  if (high_profile) {
+    guint8 *ext = data + 11 + sps_size + pps_size;
+
+    ext[0] = 0xfc | chroma_format;
+    ext[1] = 0xf8 | bit_depth_luma_minus8;
+    ext[2] = 0xf8 | bit_depth_chroma_minus8;
+    ext[3] = 0;                 /* numOfSequenceParameterSetExt */
+  }
+
+  return g_bytes_new_take (data, size);
+}
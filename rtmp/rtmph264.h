@@ -0,0 +1,67 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2013 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_RTMP_H264_H_
+#define _GST_RTMP_H264_H_
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef enum {
+  GST_RTMP_H264_SCAN_AUTO,
+  GST_RTMP_H264_SCAN_SCALAR,
+  GST_RTMP_H264_SCAN_SSE2,
+  GST_RTMP_H264_SCAN_AVX2
+} GstRtmpH264ScanImpl;
+
+typedef struct _GstRtmpH264Nal GstRtmpH264Nal;
+struct _GstRtmpH264Nal {
+  gsize offset;                 /* of the NAL header byte */
+  gsize size;
+  guint8 type;
+};
+
+typedef struct _GstRtmpH264AccessUnit GstRtmpH264AccessUnit;
+struct _GstRtmpH264AccessUnit {
+  GArray *nals;
+  gboolean idr;
+  /* last SPS and PPS in the access unit, copied */
+  GBytes *sps;
+  GBytes *pps;
+  /* size of the AVCC output */
+  gsize avcc_size;
+  /* AVCC can be written over the input */
+  gboolean in_place;
+};
+
+gboolean gst_rtmp_h264_set_scan_impl (GstRtmpH264ScanImpl impl);
+const guint8 *gst_rtmp_h264_find_start_code (const guint8 *data, gsize size);
+
+void gst_rtmp_h264_access_unit_init (GstRtmpH264AccessUnit *au);
+void gst_rtmp_h264_access_unit_clear (GstRtmpH264AccessUnit *au);
+gboolean gst_rtmp_h264_scan (GstRtmpH264AccessUnit *au, const guint8 *data,
+    gsize size);
+gsize gst_rtmp_h264_to_avcc (const GstRtmpH264AccessUnit *au,
+    const guint8 *data, guint8 *out);
+GBytes *gst_rtmp_h264_make_avc_config (GBytes *sps, GBytes *pps);
+
+G_END_DECLS
+
+#endif
@@ -0,0 +1,220 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2014 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* Pipelined startup: connect, createStream and publish or play are sent
+ * back to back, without waiting for the replies, so the stream starts
+ * after one round trip instead of three.  The command goes to stream 1,
+ * which is what servers hand out for the first createStream.  This
+ * checks the replies as they come in, and if the server disagrees or
+ * rejects something, redoes the missing steps one at a time.
+ *
+ * The fallback uses the two transaction ids after the pipelined command,
+ * so its replies can't be mistaken for those to the pipelined commands.
+ * Unless the pipelined command only went to the wrong stream, the
+ * fallback redoes createStream first: the server answers in order, so
+ * once that reply is in, no more onStatus for the pipelined command can
+ * follow. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <string.h>
+#include "rtmpstartup.h"
+
+static GstRtmpStartupResult gst_rtmp_startup_fall_back (GstRtmpStartup *
+    startup, const char *reason, char **error);
+
+void
+gst_rtmp_startup_init (GstRtmpStartup * startup, const char *command_name,
+    int create_stream_id, int command_id, const char *const *start_codes,
+    GstRtmpStartupSendFunc send_create_stream,
+    GstRtmpStartupSendFunc send_command, gpointer user_data)
+{
+  memset (startup, 0, sizeof (*startup));
+  startup->command_name = command_name;
+  startup->create_stream_id = create_stream_id;
+  startup->command_id = command_id;
+  startup->start_codes = start_codes;
+  startup->send_create_stream = send_create_stream;
+  startup->send_command = send_command;
+  startup->user_data = user_data;
+  startup->arena = gst_amf_arena_new ();
+  gst_rtmp_startup_reset (startup);
+}
+
+void
+gst_rtmp_startup_clear (GstRtmpStartup * startup)
+{
+  if (startup->arena) {
+    gst_amf_arena_free (startup->arena);
+    startup->arena = NULL;
+  }
+}
+
+void
+gst_rtmp_startup_reset (GstRtmpStartup * startup)
+{
+  startup->active = FALSE;
+  startup->create_stream_ok = FALSE;
+  startup->fallback = FALSE;
+  startup->retry_sent = FALSE;
+  startup->stream_id = 1;
+}
+
+/* Call before sending the pipelined commands.  The command goes to
+ * startup->stream_id. */
+void
+gst_rtmp_startup_begin (GstRtmpStartup * startup)
+{
+  gst_rtmp_startup_reset (startup);
+  startup->active = TRUE;
+}
+
+static gboolean
+is_start_code (GstRtmpStartup * startup, const GstAmfValue * code)
+{
+  int i;
+
+  for (i = 0; startup->start_codes[i]; i++) {
+    if (gst_amf_value_string_equal (code, startup->start_codes[i]))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/* Checks a command message received while startup->active.  On failure,
+ * *@error is set to a description to be freed with g_free(). */
+GstRtmpStartupResult
+gst_rtmp_startup_handle_reply (GstRtmpStartup * startup, GstRtmpChunk * chunk,
+    char **error)
+{
+  const GstAmfValue *message;
+  const GstAmfValue *command_name;
+  const GstAmfValue *optional_args;
+  const GstAmfValue *code;
+  GstRtmpStartupResult result = GST_RTMP_STARTUP_PENDING;
+  double transaction_id;
+  char *s;
+
+  *error = NULL;
+  if (!startup->active)
+    return GST_RTMP_STARTUP_PENDING;
+
+  message = gst_amf_arena_parse (startup->arena, chunk->payload);
+  command_name = gst_amf_value_get_index (message, 0);
+  transaction_id =
+      gst_amf_value_get_number (gst_amf_value_get_index (message, 1));
+  optional_args = gst_amf_value_get_index (message, 3);
+
+  if (gst_amf_value_string_equal (command_name, "_result") ||
+      gst_amf_value_string_equal (command_name, "_error")) {
+    gboolean ok = gst_amf_value_string_equal (command_name, "_result");
+
+    if (transaction_id == 1) {
+      code = gst_amf_value_get_field (optional_args, "code");
+      if (!ok ||
+          !gst_amf_value_string_equal (code, "NetConnection.Connect.Success")) {
+        s = gst_amf_value_dup_string (code);
+        *error = g_strdup_printf ("code %s", GST_STR_NULL (s));
+        g_free (s);
+        startup->active = FALSE;
+        result = GST_RTMP_STARTUP_CONNECT_FAILED;
+      } else if (gst_amf_value_get_field (optional_args, "secureToken")) {
+        /* the response would have to go out before the other commands */
+        *error = g_strdup ("server requested secureToken authentication");
+        startup->active = FALSE;
+        result = GST_RTMP_STARTUP_CONNECT_FAILED;
+      } else {
+        GST_DEBUG ("connect success");
+      }
+    } else if ((transaction_id == startup->create_stream_id &&
+            !startup->fallback) ||
+        transaction_id == startup->command_id + 1) {
+      if (!ok || !optional_args) {
+        result = gst_rtmp_startup_fall_back (startup, "createStream rejected",
+            error);
+      } else {
+        startup->stream_id = gst_amf_value_get_number (optional_args);
+        startup->create_stream_ok = TRUE;
+        GST_DEBUG ("createStream success, stream_id=%u", startup->stream_id);
+        if (startup->fallback) {
+          startup->send_command (startup->stream_id, startup->command_id + 2,
+              startup->user_data);
+          startup->retry_sent = TRUE;
+        } else if (startup->stream_id != 1) {
+          result = gst_rtmp_startup_fall_back (startup,
+              "command went to the wrong stream", error);
+        }
+      }
+    } else if (((transaction_id == startup->command_id && !startup->fallback)
+            || transaction_id == startup->command_id + 2) && !ok) {
+      result = gst_rtmp_startup_fall_back (startup, "command rejected", error);
+    }
+  } else if (gst_amf_value_string_equal (command_name, "onStatus") &&
+      optional_args && chunk->stream_id == startup->stream_id &&
+      startup->fallback == startup->retry_sent) {
+    /* while falling back, the status of the pipelined command is stale */
+    code = gst_amf_value_get_field (optional_args, "code");
+
+    if (is_start_code (startup, code)) {
+      GST_DEBUG ("%s started (fallback %d)", startup->command_name,
+          startup->fallback);
+      startup->active = FALSE;
+      result = GST_RTMP_STARTUP_STARTED;
+    } else if (gst_amf_value_string_equal (gst_amf_value_get_field
+            (optional_args, "level"), "error")) {
+      s = gst_amf_value_dup_string (code);
+      result = gst_rtmp_startup_fall_back (startup, s ? s : "command failed",
+          error);
+      g_free (s);
+    }
+  }
+
+  gst_amf_arena_reset (startup->arena);
+
+  return result;
+}
+
+static GstRtmpStartupResult
+gst_rtmp_startup_fall_back (GstRtmpStartup * startup, const char *reason,
+    char **error)
+{
+  if (startup->fallback) {
+    startup->active = FALSE;
+    *error = g_strdup_printf ("%s: %s", startup->command_name, reason);
+    return GST_RTMP_STARTUP_FAILED;
+  }
+
+  GST_WARNING ("pipelined %s failed (%s), falling back to serial commands",
+      startup->command_name, reason);
+  startup->fallback = TRUE;
+
+  if (startup->create_stream_ok && startup->stream_id != 1) {
+    startup->send_command (startup->stream_id, startup->command_id + 2,
+        startup->user_data);
+    startup->retry_sent = TRUE;
+  } else {
+    startup->send_create_stream (0, startup->command_id + 1,
+        startup->user_data);
+  }
+
+  return GST_RTMP_STARTUP_PENDING;
+}
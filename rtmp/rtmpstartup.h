@@ -0,0 +1,76 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2014 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _GST_RTMP_STARTUP_H_
+#define _GST_RTMP_STARTUP_H_
+
+#include <glib.h>
+#include <rtmp/rtmpchunk.h>
+#include <rtmp/amf.h>
+
+G_BEGIN_DECLS
+
+/* Sends createStream, or the publish or play command on @stream_id */
+typedef void (*GstRtmpStartupSendFunc) (guint32 stream_id,
+    int transaction_id, gpointer user_data);
+
+typedef enum {
+  GST_RTMP_STARTUP_PENDING,
+  GST_RTMP_STARTUP_STARTED,
+  GST_RTMP_STARTUP_CONNECT_FAILED,
+  GST_RTMP_STARTUP_FAILED
+} GstRtmpStartupResult;
+
+typedef struct _GstRtmpStartup GstRtmpStartup;
+struct _GstRtmpStartup {
+  const char *command_name;
+  /* transaction ids of the pipelined createStream and publish or play,
+   * the fallback uses the two after command_id */
+  int create_stream_id;
+  int command_id;
+  /* onStatus codes that mean the stream started, NULL terminated */
+  const char *const *start_codes;
+  GstRtmpStartupSendFunc send_create_stream;
+  GstRtmpStartupSendFunc send_command;
+  gpointer user_data;
+
+  /* replies are still expected */
+  gboolean active;
+  gboolean create_stream_ok;
+  gboolean fallback;
+  /* the command of the fallback went out, its replies count from now on */
+  gboolean retry_sent;
+  guint32 stream_id;
+  /* reused for every reply */
+  GstAmfArena *arena;
+};
+
+void gst_rtmp_startup_init (GstRtmpStartup *startup,
+    const char *command_name, int create_stream_id, int command_id,
+    const char *const *start_codes, GstRtmpStartupSendFunc send_create_stream,
+    GstRtmpStartupSendFunc send_command, gpointer user_data);
+void gst_rtmp_startup_clear (GstRtmpStartup *startup);
+void gst_rtmp_startup_reset (GstRtmpStartup *startup);
+void gst_rtmp_startup_begin (GstRtmpStartup *startup);
+GstRtmpStartupResult gst_rtmp_startup_handle_reply (GstRtmpStartup *startup,
+    GstRtmpChunk *chunk, char **error);
+
+G_END_DECLS
+
+#endif
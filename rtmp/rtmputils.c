@@ -181,22 +181,80 @@ gst_rtmp_tea_decode (const gchar * key, const gchar * text)
   return (gchar *) out;
 }
 
+/* Prints values as they are read, in the format of gst_amf_node_dump() */
+static gboolean
+dump_value (GstAmfReader * reader, int indent)
+{
+  const char *s;
+  gsize length;
+  double d;
+  gboolean b;
+
+  switch (gst_amf_reader_peek_type (reader)) {
+    case GST_AMF_TYPE_NUMBER:
+      if (!gst_amf_reader_read_number (reader, &d))
+        return FALSE;
+      g_print ("%g", d);
+      break;
+    case GST_AMF_TYPE_BOOLEAN:
+      if (!gst_amf_reader_read_boolean (reader, &b))
+        return FALSE;
+      g_print ("%s", b ? "True" : "False");
+      break;
+    case GST_AMF_TYPE_STRING:
+    case GST_AMF_TYPE_LONG_STRING:
+      if (!gst_amf_reader_read_string (reader, &s, &length))
+        return FALSE;
+      g_print ("\"%.*s\"", (int) length, s);
+      break;
+    case GST_AMF_TYPE_OBJECT:
+    case GST_AMF_TYPE_ECMA_ARRAY:
+      if (indent > 128) {
+        g_print ("{...}");
+        return gst_amf_reader_skip (reader);
+      }
+      if (!gst_amf_reader_enter_object (reader))
+        return FALSE;
+      g_print ("{\n");
+      while (gst_amf_reader_next_field (reader, &s, &length)) {
+        g_print ("%*.*s  \"%.*s\": ", indent, indent, "", (int) length, s);
+        if (!dump_value (reader, indent + 2))
+          return FALSE;
+        g_print (",\n");
+      }
+      if (reader->error)
+        return FALSE;
+      g_print ("%*.*s}", indent, indent, "");
+      break;
+    case GST_AMF_TYPE_NULL:
+      gst_amf_reader_skip (reader);
+      g_print ("Null");
+      break;
+    default:
+      g_print ("<type %d>", gst_amf_reader_peek_type (reader));
+      return gst_amf_reader_skip (reader);
+  }
+
+  return TRUE;
+}
+
 static void
 dump_command (GstRtmpChunk * chunk)
 {
-  GstAmfNode *amf;
+  GstAmfReader reader;
   gsize size;
   const guint8 *data;
-  gsize n_parsed;
-  int offset;
 
-  offset = 0;
   data = g_bytes_get_data (chunk->payload, &size);
-  while (offset < (int) size) {
-    amf = gst_amf_node_new_parse (data + offset, size - offset, &n_parsed);
-    gst_amf_node_dump (amf);
-    gst_amf_node_free (amf);
-    offset += n_parsed;
+  gst_amf_reader_init (&reader, data, size);
+  while (!gst_amf_reader_at_end (&reader)) {
+    gboolean ok = dump_value (&reader, 0);
+
+    g_print ("\n");
+    if (!ok) {
+      g_print ("(malformed)\n");
+      break;
+    }
   }
 }
 
@@ -216,6 +274,8 @@ gst_rtmp_dump_chunk (GstRtmpChunk * chunk, gboolean dir, gboolean dump_message,
     }
   }
   if (dump_data) {
+    if (chunk->payload_prefix)
+      gst_rtmp_dump_data (chunk->payload_prefix);
     gst_rtmp_dump_data (gst_rtmp_chunk_get_payload (chunk));
   }
 }
@@ -0,0 +1,270 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2014 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/* Microbenchmark for AMF0 parsing.  Generates an onMetaData message
+ * shaped like what encoders send, an ECMA array of numbers, booleans and
+ * strings with some non-ASCII text and a few long strings, and times
+ * walking it with the lazy reader, validating it, and decoding it into a
+ * node tree and into an arena.  With --latin1 the non-ASCII text is
+ * Latin-1, as some servers send it, which the decoders must accept,
+ * replacing the invalid bytes. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amf.h"
+
+
+#define GETTEXT_PACKAGE NULL
+
+typedef enum
+{
+  MODE_SKIP,
+  MODE_VALIDATE,
+  MODE_NODES,
+  MODE_ARENA
+} Mode;
+
+static gint fields = 64;
+static gint long_string = 1024;
+static gint messages = 100000;
+static gint iterations = 3;
+static gboolean latin1 = FALSE;
+
+static GOptionEntry entries[] = {
+  {"fields", 'f', 0, G_OPTION_ARG_INT, &fields, "Metadata fields", "N"},
+  {"long-string", 'l', 0, G_OPTION_ARG_INT, &long_string,
+      "Length of the long string fields", "BYTES"},
+  {"messages", 'n', 0, G_OPTION_ARG_INT, &messages, "Messages per run", "N"},
+  {"iterations", 'i', 0, G_OPTION_ARG_INT, &iterations, "Runs per mode",
+      "N"},
+  {"latin1", 'L', 0, G_OPTION_ARG_NONE, &latin1,
+      "Use Latin-1 instead of UTF-8 for the non-ASCII text", NULL},
+  {NULL}
+};
+
+static GstAmfArena *arena;
+
+static void
+append_u8 (GByteArray * array, guint8 value)
+{
+  g_byte_array_append (array, &value, 1);
+}
+
+static void
+append_string (GByteArray * array, const char *s, gsize length)
+{
+  guint8 header[2];
+
+  GST_WRITE_UINT16_BE (header, length);
+  g_byte_array_append (array, header, 2);
+  g_byte_array_append (array, (const guint8 *) s, length);
+}
+
+static void
+append_number (GByteArray * array, double value)
+{
+  guint8 data[8];
+
+  GST_WRITE_DOUBLE_BE (data, value);
+  append_u8 (array, GST_AMF_TYPE_NUMBER);
+  g_byte_array_append (array, data, 8);
+}
+
+static GBytes *
+generate_message (void)
+{
+  /* "Überschrift: 東京 ライブ" */
+  static const char title[] = "\xc3\x9c" "berschrift: \xe6\x9d\xb1\xe4\xba"
+      "\xac \xe3\x83\xa9\xe3\x82\xa4\xe3\x83\x96";
+  /* "Überschrift: Café" */
+  static const char title_latin1[] = "\xdc" "berschrift: Caf\xe9";
+  const char *t = latin1 ? title_latin1 : title;
+  GByteArray *array;
+  guint8 header[4];
+  char *text;
+  int i;
+
+  text = g_malloc (long_string);
+  for (i = 0; i < long_string; i++) {
+    text[i] = 'a' + i % 26;
+  }
+
+  array = g_byte_array_new ();
+  append_u8 (array, GST_AMF_TYPE_STRING);
+  append_string (array, "onMetaData", 10);
+  append_u8 (array, GST_AMF_TYPE_ECMA_ARRAY);
+  GST_WRITE_UINT32_BE (header, fields);
+  g_byte_array_append (array, header, 4);
+
+  for (i = 0; i < fields; i++) {
+    char *name = g_strdup_printf ("field%d", i);
+
+    append_string (array, name, strlen (name));
+    g_free (name);
+    switch (i % 8) {
+      case 0:
+        append_u8 (array, GST_AMF_TYPE_STRING);
+        append_string (array, t, strlen (t));
+        break;
+      case 1:
+        append_u8 (array, GST_AMF_TYPE_BOOLEAN);
+        append_u8 (array, i & 1);
+        break;
+      case 2:
+        append_u8 (array, GST_AMF_TYPE_STRING);
+        append_string (array, "avc1", 4);
+        break;
+      case 7:
+        if (long_string > 0) {
+          GST_WRITE_UINT32_BE (header, long_string);
+          append_u8 (array, GST_AMF_TYPE_LONG_STRING);
+          g_byte_array_append (array, header, 4);
+          g_byte_array_append (array, (const guint8 *) text, long_string);
+          break;
+        }
+        /* fall through */
+      default:
+        append_number (array, i * 1000.5);
+        break;
+    }
+  }
+  append_string (array, "", 0);
+  append_u8 (array, GST_AMF_TYPE_OBJECT_END);
+
+  g_free (text);
+
+  return g_byte_array_free_to_bytes (array);
+}
+
+static gboolean
+parse_once (Mode mode, GBytes * bytes)
+{
+  const guint8 *data;
+  gsize size;
+  gsize offset = 0;
+
+  data = g_bytes_get_data (bytes, &size);
+
+  switch (mode) {
+    case MODE_SKIP:
+    case MODE_VALIDATE:{
+      GstAmfReader reader;
+
+      gst_amf_reader_init (&reader, data, size);
+      while (!gst_amf_reader_at_end (&reader)) {
+        if (mode == MODE_SKIP ? !gst_amf_reader_skip (&reader) :
+            !gst_amf_reader_validate (&reader))
+          return FALSE;
+      }
+      return TRUE;
+    }
+    case MODE_NODES:
+      while (offset < size) {
+        GstAmfNode *node;
+        gsize n_bytes;
+
+        node = gst_amf_node_new_parse (data + offset, size - offset,
+            &n_bytes);
+        if (!node)
+          return FALSE;
+        gst_amf_node_free (node);
+        offset += n_bytes;
+      }
+      return TRUE;
+    case MODE_ARENA:
+      return gst_amf_arena_parse (arena, bytes) != NULL;
+  }
+
+  return FALSE;
+}
+
+/* Returns the best time per message in nanoseconds */
+static double
+run (const char *name, Mode mode, GBytes * bytes, double validate)
+{
+  gint64 best = G_MAXINT64;
+  double per_message;
+  int it, i;
+
+  for (it = 0; it < iterations; it++) {
+    gint64 start_time = g_get_monotonic_time ();
+
+    for (i = 0; i < messages; i++) {
+      if (!parse_once (mode, bytes)) {
+        g_print ("%-10s failed to parse\n", name);
+        return 0;
+      }
+    }
+    best = MIN (best, g_get_monotonic_time () - start_time);
+  }
+
+  per_message = best * 1000.0 / messages;
+  g_print ("%-10s %8.1f MB/s  %8.0f messages/s", name,
+      (double) g_bytes_get_size (bytes) * messages / MAX (best, 1),
+      messages * (double) G_USEC_PER_SEC / MAX (best, 1));
+  if (validate > 0)
+    g_print ("  validation %4.1f%%", 100.0 * validate / per_message);
+  g_print ("\n");
+
+  return per_message;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  GBytes *bytes;
+  double validate;
+
+  context = g_option_context_new ("- benchmark AMF parsing");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s\n", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+
+  if (fields < 1 || long_string < 0 || messages < 1 || iterations < 1) {
+    g_print ("invalid parameters\n");
+    exit (1);
+  }
+
+  arena = gst_amf_arena_new ();
+  bytes = generate_message ();
+  g_print ("onMetaData with %d fields, %" G_GSIZE_FORMAT " bytes, %s, "
+      "best of %d\n", fields, g_bytes_get_size (bytes),
+      latin1 ? "Latin-1" : "UTF-8", iterations);
+
+  run ("skip", MODE_SKIP, bytes, 0);
+  validate = run ("validate", MODE_VALIDATE, bytes, 0);
+  run ("nodes", MODE_NODES, bytes, validate);
+  run ("arena", MODE_ARENA, bytes, validate);
+
+  g_bytes_unref (bytes);
+  gst_amf_arena_free (arena);
+
+  return 0;
+}
@@ -0,0 +1,209 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2014 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/* libFuzzer harness for the AMF parsers.  Built with --enable-fuzzers,
+ * which needs clang:
+ *
+ *   CC=clang ./configure --enable-fuzzers && make
+ *   tools/amf-fuzzer corpus/
+ *
+ * Every input is fed to the tree parser, the arena parser and the lazy
+ * reader, which must agree on whether it is valid, and whatever parses
+ * is dumped (to nowhere) and serialized again so all of it gets
+ * touched.  Invalid UTF-8 is only an error in field names; the strings
+ * the parsers return must always be valid. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amf.h"
+#include "rtmpchunk.h"
+
+int LLVMFuzzerTestOneInput (const guint8 * data, size_t size);
+
+static GstAmfArena *arena;
+
+static void
+discard_print (const gchar * string)
+{
+}
+
+/* Aborts if a string in @node isn't UTF-8 */
+static void
+check_strings (const GstAmfNode * node)
+{
+  int i;
+
+  if (node->type == GST_AMF_TYPE_STRING) {
+    if (!g_utf8_validate (gst_amf_node_get_string (node), -1, NULL))
+      abort ();
+  } else if (node->type == GST_AMF_TYPE_OBJECT ||
+      node->type == GST_AMF_TYPE_ECMA_ARRAY ||
+      node->type == GST_AMF_TYPE_STRICT_ARRAY) {
+    for (i = 0; i < gst_amf_node_get_object_length (node); i++) {
+      check_strings (gst_amf_node_get_object_by_index (node, i));
+    }
+  }
+}
+
+/* g_utf8_validate() stops at NUL, which AMF strings may contain */
+static gboolean
+validate_with_nuls (const char *s, gsize length)
+{
+  const char *end;
+
+  while (!g_utf8_validate (s, length, &end)) {
+    if (*end != 0)
+      return FALSE;
+    length -= end + 1 - s;
+    s = end + 1;
+  }
+  return TRUE;
+}
+
+/* Same for the names and strings in an arena value */
+static void
+check_values (const GstAmfValue * value)
+{
+  guint i;
+
+  if (value->type == GST_AMF_TYPE_STRING) {
+    if (!validate_with_nuls (value->v.string, value->length))
+      abort ();
+  } else if (value->type == GST_AMF_TYPE_OBJECT ||
+      value->type == GST_AMF_TYPE_ECMA_ARRAY ||
+      value->type == GST_AMF_TYPE_STRICT_ARRAY) {
+    for (i = 0; i < value->length; i++) {
+      const GstAmfField *field = &value->v.fields[i];
+
+      if (field->name && !validate_with_nuls (field->name,
+              field->name_length))
+        abort ();
+      check_values (&field->value);
+    }
+  }
+}
+
+static void
+fuzz_nodes (const guint8 * data, gsize size, gboolean * valid)
+{
+  gsize offset = 0;
+
+  while (offset < size) {
+    GstAmfNode *node;
+    gsize n_bytes;
+    gsize serialized_size;
+
+    node = gst_amf_node_new_parse (data + offset, size - offset, &n_bytes);
+    if (!node) {
+      *valid = FALSE;
+      return;
+    }
+    if (node->type == GST_AMF_TYPE_OBJECT)
+      gst_amf_node_get_object (node, "code");
+    gst_amf_node_dump (node);
+    check_strings (node);
+
+    /* the computed size must be exactly what gets written */
+    serialized_size = gst_amf_node_get_serialized_size (node);
+    if (serialized_size > 0) {
+      guint8 *out = g_malloc (serialized_size);
+
+      if (gst_amf_node_serialize (node, out, serialized_size) !=
+          serialized_size)
+        abort ();
+      g_free (out);
+    }
+    gst_amf_node_free (node);
+    offset += n_bytes;
+  }
+  *valid = TRUE;
+}
+
+static gboolean
+fuzz_reader (const guint8 * data, gsize size)
+{
+  GstAmfReader reader;
+
+  gst_amf_reader_init (&reader, data, size);
+  while (!gst_amf_reader_at_end (&reader)) {
+    if (!gst_amf_reader_validate (&reader))
+      return FALSE;
+  }
+  return TRUE;
+}
+
+static void
+fuzz_chunk (const guint8 * data, gsize size)
+{
+  GstRtmpChunk *chunk;
+  char *command_name;
+  double transaction_id;
+  GstAmfNode *command_object;
+  GstAmfNode *optional_args;
+
+  chunk = gst_rtmp_chunk_new ();
+  chunk->payload = g_bytes_new_static (data, size);
+  chunk->message_length = size;
+  gst_rtmp_chunk_parse_message (chunk, &command_name, &transaction_id,
+      &command_object, &optional_args);
+  g_free (command_name);
+  if (command_object)
+    gst_amf_node_free (command_object);
+  if (optional_args)
+    gst_amf_node_free (optional_args);
+  g_object_unref (chunk);
+}
+
+int
+LLVMFuzzerTestOneInput (const guint8 * data, size_t size)
+{
+  const GstAmfValue *value;
+  gboolean node_valid;
+  gboolean reader_valid;
+  GBytes *bytes;
+
+  if (!arena) {
+    gst_init (NULL, NULL);
+    g_set_print_handler (discard_print);
+    arena = gst_amf_arena_new ();
+  }
+
+  fuzz_nodes (data, size, &node_valid);
+  reader_valid = fuzz_reader (data, size);
+
+  bytes = g_bytes_new_static (data, size);
+  value = gst_amf_arena_parse (arena, bytes);
+  gst_amf_value_get_field (gst_amf_value_get_index (value, 2), "code");
+  if (value)
+    check_values (value);
+  gst_amf_arena_reset (arena);
+  g_bytes_unref (bytes);
+
+  if (node_valid != reader_valid || node_valid != (value != NULL))
+    abort ();
+
+  fuzz_chunk (data, size);
+
+  return 0;
+}
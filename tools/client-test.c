@@ -36,13 +36,26 @@ GstRtmpConnection *connection;
 
 gboolean verbose;
 gboolean dump;
+gboolean jitter;
+char *server_address;
 
 static GOptionEntry entries[] = {
   {"verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Be verbose", NULL},
   {"dump", 'd', 0, G_OPTION_ARG_NONE, &dump, "Dump packets", NULL},
+  {"jitter", 'j', 0, G_OPTION_ARG_NONE, &jitter,
+      "Measure audio delivery jitter", NULL},
+  {"server", 's', 0, G_OPTION_ARG_STRING, &server_address, "Server address",
+      "ADDRESS"},
   {NULL}
 };
 
+/* interarrival jitter of audio messages, as in RFC 3550, in ms */
+static gint64 jitter_last_arrival;
+static guint32 jitter_last_timestamp;
+static double jitter_estimate;
+static double jitter_max;
+static int jitter_count;
+
 static void connect_done (GObject * source, GAsyncResult * result,
     gpointer user_data);
 static void cmd_connect_done (GstRtmpConnection * connection,
@@ -52,6 +65,7 @@ static void cmd_connect_done (GstRtmpConnection * connection,
 static void send_connect (void);
 static void got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
     gpointer user_data);
+static void update_jitter (GstRtmpChunk * chunk);
 static void send_create_stream (void);
 static void create_stream_done (GstRtmpConnection * connection,
     GstRtmpChunk * chunk, const char *command_name, int transaction_id,
@@ -81,8 +95,8 @@ main (int argc, char *argv[])
 
 
   client = gst_rtmp_client_new ();
-  gst_rtmp_client_set_server_address (client,
-      "ec2-54-185-55-241.us-west-2.compute.amazonaws.com");
+  gst_rtmp_client_set_server_address (client, server_address ?
+      server_address : "ec2-54-185-55-241.us-west-2.compute.amazonaws.com");
   cancellable = g_cancellable_new ();
 
   main_loop = g_main_loop_new (NULL, TRUE);
@@ -118,9 +132,41 @@ static void
 got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
     gpointer user_data)
 {
+  if (jitter) {
+    if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_AUDIO)
+      update_jitter (chunk);
+    return;
+  }
   gst_rtmp_dump_chunk (chunk, FALSE, TRUE, TRUE);
 }
 
+static void
+update_jitter (GstRtmpChunk * chunk)
+{
+  gint64 arrival;
+  double d;
+
+  arrival = g_get_monotonic_time ();
+
+  if (jitter_count > 0) {
+    d = (arrival - jitter_last_arrival) / 1000.0 -
+        (gint32) (chunk->timestamp - jitter_last_timestamp);
+    if (d < 0)
+      d = -d;
+    jitter_estimate += (d - jitter_estimate) / 16;
+    if (d > jitter_max)
+      jitter_max = d;
+  }
+  jitter_last_arrival = arrival;
+  jitter_last_timestamp = chunk->timestamp;
+  jitter_count++;
+
+  if (jitter_count % 100 == 0) {
+    g_print ("audio messages: %d, jitter: %.2f ms, max deviation: %.2f ms\n",
+        jitter_count, jitter_estimate, jitter_max);
+  }
+}
+
 static void
 send_connect (void)
 {
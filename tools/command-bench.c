@@ -0,0 +1,265 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2014 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/* Microbenchmark for serializing the startup commands of a publisher and
+ * a player: connect, releaseStream, FCPublish, createStream, publish and
+ * play.  "tree" builds GstAmfNode trees and serializes them with
+ * gst_amf_serialize_command2(), like the elements used to; "template"
+ * fills in precompiled templates.  Both produce the same bytes, which is
+ * checked before timing. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amf.h"
+
+
+#define GETTEXT_PACKAGE NULL
+
+#define N_COMMANDS 6
+
+static gint sequences = 200000;
+static gint iterations = 3;
+static gchar *application = "live";
+static gchar *stream = "stream-0123456789abcdef";
+
+static GOptionEntry entries[] = {
+  {"sequences", 'n', 0, G_OPTION_ARG_INT, &sequences,
+      "Startup sequences per run", "N"},
+  {"iterations", 'i', 0, G_OPTION_ARG_INT, &iterations, "Runs per mode",
+      "N"},
+  {"application", 'a', 0, G_OPTION_ARG_STRING, &application,
+      "Application name", "NAME"},
+  {"stream", 's', 0, G_OPTION_ARG_STRING, &stream, "Stream name", "NAME"},
+  {NULL}
+};
+
+static gchar *tc_url;
+static GstAmfTemplate *templates[N_COMMANDS];
+
+static GstAmfNode *
+new_string (const char *s)
+{
+  GstAmfNode *node = gst_amf_node_new (GST_AMF_TYPE_STRING);
+
+  gst_amf_node_set_string (node, s);
+  return node;
+}
+
+static GstAmfNode *
+new_connect_object (const char *app, const char *url)
+{
+  GstAmfNode *node = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
+
+  gst_amf_object_set_string (node, "app", app);
+  gst_amf_object_set_string (node, "type", "nonprivate");
+  gst_amf_object_set_string (node, "tcUrl", url);
+  return node;
+}
+
+/* Builds the arguments of command @i, with NULL strings for a template */
+static const char *
+build_command (int i, const char *app, const char *url, const char *name,
+    GstAmfNode ** args)
+{
+  memset (args, 0, 4 * sizeof (GstAmfNode *));
+
+  switch (i) {
+    case 0:
+      args[0] = new_connect_object (app, url);
+      return "connect";
+    case 1:
+      args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+      args[1] = new_string (name);
+      return "releaseStream";
+    case 2:
+      args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+      args[1] = new_string (name);
+      return "FCPublish";
+    case 3:
+      args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+      return "createStream";
+    case 4:
+      args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+      args[1] = new_string (name);
+      args[2] = new_string (app);
+      return "publish";
+    default:
+      args[0] = gst_amf_node_new (GST_AMF_TYPE_NULL);
+      args[1] = new_string (name);
+      args[2] = gst_amf_node_new (GST_AMF_TYPE_NUMBER);
+      gst_amf_node_set_number (args[2], 0);
+      return "play";
+  }
+}
+
+static void
+free_args (GstAmfNode ** args)
+{
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    if (args[i])
+      gst_amf_node_free (args[i]);
+  }
+}
+
+static GBytes *
+serialize_tree (int i, int transaction_id)
+{
+  GstAmfNode *args[4];
+  const char *name;
+  GBytes *bytes;
+
+  name = build_command (i, application, tc_url, stream, args);
+  bytes = gst_amf_serialize_command2 (name, transaction_id, args[0], args[1],
+      args[2], args[3]);
+  free_args (args);
+
+  return bytes;
+}
+
+static GBytes *
+serialize_template (int i, int transaction_id)
+{
+  const char *strings[2];
+
+  switch (i) {
+    case 0:
+      strings[0] = application;
+      strings[1] = tc_url;
+      break;
+    case 4:
+      strings[0] = stream;
+      strings[1] = application;
+      break;
+    default:
+      strings[0] = stream;
+      break;
+  }
+
+  return gst_amf_template_fill (templates[i], transaction_id, strings);
+}
+
+static void
+create_templates (void)
+{
+  GstAmfNode *args[4];
+  const char *name;
+  int i;
+
+  for (i = 0; i < N_COMMANDS; i++) {
+    name = build_command (i, NULL, NULL, NULL, args);
+    templates[i] = gst_amf_template_new (name, 4, args);
+    free_args (args);
+  }
+}
+
+static gboolean
+check_equal (void)
+{
+  int i;
+
+  for (i = 0; i < N_COMMANDS; i++) {
+    GBytes *tree = serialize_tree (i, i + 1);
+    GBytes *tmpl = serialize_template (i, i + 1);
+    gboolean equal = g_bytes_equal (tree, tmpl);
+
+    g_bytes_unref (tree);
+    g_bytes_unref (tmpl);
+    if (!equal) {
+      g_print ("command %d differs\n", i);
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Returns the best time per sequence in nanoseconds */
+static double
+run (const char *name, GBytes * (*serialize) (int, int), double baseline)
+{
+  gint64 best = G_MAXINT64;
+  double per_sequence;
+  int it, n, i;
+
+  for (it = 0; it < iterations; it++) {
+    gint64 start_time = g_get_monotonic_time ();
+
+    for (n = 0; n < sequences; n++) {
+      for (i = 0; i < N_COMMANDS; i++) {
+        g_bytes_unref (serialize (i, i + 1));
+      }
+    }
+    best = MIN (best, g_get_monotonic_time () - start_time);
+  }
+
+  per_sequence = best * 1000.0 / sequences;
+  g_print ("%-10s %8.1f ns/sequence  %10.0f commands/s", name, per_sequence,
+      (double) sequences * N_COMMANDS * G_USEC_PER_SEC / MAX (best, 1));
+  if (baseline > 0)
+    g_print ("  %5.1fx", baseline / per_sequence);
+  g_print ("\n");
+
+  return per_sequence;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  double baseline;
+  int i;
+
+  context = g_option_context_new ("- benchmark RTMP command serialization");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s\n", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+
+  if (sequences < 1 || iterations < 1) {
+    g_print ("invalid parameters\n");
+    exit (1);
+  }
+
+  tc_url = g_strdup_printf ("rtmp://127.0.0.1/%s", application);
+  create_templates ();
+  if (!check_equal ())
+    exit (1);
+
+  g_print ("%d commands per sequence, best of %d\n", N_COMMANDS, iterations);
+  baseline = run ("tree", serialize_tree, 0);
+  run ("template", serialize_template, baseline);
+
+  for (i = 0; i < N_COMMANDS; i++) {
+    gst_amf_template_free (templates[i]);
+  }
+  g_free (tc_url);
+
+  return 0;
+}
@@ -0,0 +1,281 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2013 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/* Measures what delivering a message to the application costs, got-chunk
+ * signal against a direct message handler.  Small video messages are
+ * written into one end of a socket pair and read by a GstRtmpConnection
+ * on the other end.  Every run also has a handler for the data message
+ * that ends the stream, and the "baseline" run has nothing else, so the
+ * difference to it is the dispatch cost per message. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <gio/gio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "rtmpconnection.h"
+#include "rtmpchunk.h"
+
+
+#define GETTEXT_PACKAGE NULL
+
+typedef enum
+{
+  MODE_BASELINE,
+  MODE_SIGNAL,
+  MODE_HANDLER
+} Mode;
+
+static gint messages = 1000000;
+static gint payload_size = 32;
+static gint iterations = 3;
+
+static GOptionEntry entries[] = {
+  {"messages", 'n', 0, G_OPTION_ARG_INT, &messages, "Messages per run", "N"},
+  {"payload", 's', 0, G_OPTION_ARG_INT, &payload_size,
+      "Payload bytes per message (at most 128)", "BYTES"},
+  {"iterations", 'i', 0, G_OPTION_ARG_INT, &iterations, "Runs per mode",
+      "N"},
+  {NULL}
+};
+
+static GMainLoop *main_loop;
+static GBytes *stream;
+static guint received;
+
+static GBytes *
+serialize_message (int message_type_id, gsize size)
+{
+  GstRtmpChunk *chunk;
+  GBytes *bytes;
+
+  chunk = gst_rtmp_chunk_new ();
+  chunk->chunk_stream_id = 6;
+  chunk->message_type_id = message_type_id;
+  chunk->stream_id = 1;
+  chunk->timestamp = 0;
+  chunk->message_length = size;
+  chunk->payload = g_bytes_new_take (g_malloc0 (size), size);
+  bytes = gst_rtmp_chunk_serialize (chunk, NULL, 128);
+  g_object_unref (chunk);
+
+  return bytes;
+}
+
+static GBytes *
+generate_stream (void)
+{
+  GByteArray *array;
+  GBytes *video;
+  GBytes *end;
+  gconstpointer data;
+  gsize size;
+  int i;
+
+  video = serialize_message (GST_RTMP_MESSAGE_TYPE_VIDEO, payload_size);
+  end = serialize_message (GST_RTMP_MESSAGE_TYPE_DATA, 1);
+
+  array = g_byte_array_new ();
+  data = g_bytes_get_data (video, &size);
+  for (i = 0; i < messages; i++) {
+    g_byte_array_append (array, data, size);
+  }
+  data = g_bytes_get_data (end, &size);
+  g_byte_array_append (array, data, size);
+
+  g_bytes_unref (video);
+  g_bytes_unref (end);
+
+  return g_byte_array_free_to_bytes (array);
+}
+
+static gpointer
+writer_thread (gpointer user_data)
+{
+  GSocket *socket = user_data;
+  const gchar *data;
+  gsize size;
+  gsize offset = 0;
+
+  data = g_bytes_get_data (stream, &size);
+  while (offset < size) {
+    gssize n = g_socket_send (socket, data + offset, size - offset, NULL,
+        NULL);
+
+    if (n <= 0)
+      break;
+    offset += n;
+  }
+
+  return NULL;
+}
+
+static void
+count_signal (GstRtmpConnection * connection, GstRtmpChunk * chunk,
+    gpointer user_data)
+{
+  if (chunk->message_type_id == GST_RTMP_MESSAGE_TYPE_VIDEO)
+    received++;
+}
+
+static void
+count_handler (GstRtmpConnection * connection, GstRtmpChunk * chunk,
+    gpointer user_data)
+{
+  received++;
+}
+
+static void
+end_of_stream (GstRtmpConnection * connection, GstRtmpChunk * chunk,
+    gpointer user_data)
+{
+  g_main_loop_quit (main_loop);
+}
+
+/* Returns the time taken in microseconds, or -1 */
+static gint64
+run_once (Mode mode)
+{
+  GstRtmpConnection *connection;
+  GSocketConnection *socket_connection;
+  GSocket *reader;
+  GSocket *writer;
+  GThread *thread;
+  GError *error = NULL;
+  gint64 start_time;
+  gint64 end_time;
+  int fds[2];
+
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    g_print ("socketpair failed\n");
+    exit (1);
+  }
+  reader = g_socket_new_from_fd (fds[0], &error);
+  writer = reader ? g_socket_new_from_fd (fds[1], &error) : NULL;
+  if (!writer) {
+    g_print ("could not create sockets: %s\n", error->message);
+    exit (1);
+  }
+
+  connection = gst_rtmp_connection_new ();
+  gst_rtmp_connection_add_message_handler (connection,
+      GST_RTMP_MESSAGE_MASK (GST_RTMP_MESSAGE_TYPE_DATA), end_of_stream, NULL,
+      NULL);
+  if (mode == MODE_SIGNAL) {
+    g_signal_connect (connection, "got-chunk", G_CALLBACK (count_signal),
+        NULL);
+  } else if (mode == MODE_HANDLER) {
+    gst_rtmp_connection_add_message_handler (connection,
+        GST_RTMP_MESSAGE_MASK (GST_RTMP_MESSAGE_TYPE_VIDEO), count_handler,
+        NULL, NULL);
+  }
+
+  socket_connection = g_socket_connection_factory_create_connection (reader);
+  gst_rtmp_connection_set_socket_connection (connection, socket_connection);
+  gst_rtmp_connection_start_handshaked (connection);
+
+  received = 0;
+  start_time = g_get_monotonic_time ();
+  thread = g_thread_new ("writer", writer_thread, writer);
+  g_main_loop_run (main_loop);
+  end_time = g_get_monotonic_time ();
+  g_thread_join (thread);
+
+  gst_rtmp_connection_close (connection);
+  g_object_unref (connection);
+  g_object_unref (reader);
+  g_object_unref (writer);
+
+  if (mode != MODE_BASELINE && received != (guint) messages) {
+    g_print ("only received %u of %d messages\n", received, messages);
+    return -1;
+  }
+
+  return end_time - start_time;
+}
+
+/* Returns the best time per message in nanoseconds */
+static double
+run (const char *name, Mode mode, double baseline)
+{
+  gint64 best = G_MAXINT64;
+  double per_message;
+  int i;
+
+  for (i = 0; i < iterations; i++) {
+    gint64 t = run_once (mode);
+
+    if (t >= 0)
+      best = MIN (best, t);
+  }
+  if (best == G_MAXINT64) {
+    g_print ("%-10s failed\n", name);
+    return 0;
+  }
+
+  per_message = best * 1000.0 / messages;
+  g_print ("%-10s %8.1f ns/message  %8.0f messages/s", name, per_message,
+      messages * (double) G_USEC_PER_SEC / MAX (best, 1));
+  if (baseline > 0)
+    g_print ("  dispatch %6.1f ns", per_message - baseline);
+  g_print ("\n");
+
+  return per_message;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  double baseline;
+
+  context = g_option_context_new ("- benchmark RTMP message dispatch");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s\n", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+
+  if (messages < 1 || payload_size < 1 || payload_size > 128 ||
+      iterations < 1) {
+    g_print ("invalid parameters\n");
+    exit (1);
+  }
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+  stream = generate_stream ();
+  g_print ("%d messages of %d bytes, best of %d\n", messages, payload_size,
+      iterations);
+
+  baseline = run ("baseline", MODE_BASELINE, 0);
+  run ("signal", MODE_SIGNAL, baseline);
+  run ("handler", MODE_HANDLER, baseline);
+
+  g_bytes_unref (stream);
+  g_main_loop_unref (main_loop);
+
+  return 0;
+}
@@ -0,0 +1,221 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2013 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/* Microbenchmark for the byte-stream to AVCC conversion done by rtmp2sink.
+ * Generates a synthetic Annex B stream shaped like a 4K encode (IDR plus
+ * SPS/PPS every GOP, several slices per frame, emulation prevention so
+ * there are no false start codes) and times scanning and conversion with
+ * each start code scanner. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rtmph264.h"
+
+
+#define GETTEXT_PACKAGE NULL
+
+typedef struct
+{
+  guint8 *data;
+  gsize size;
+} Frame;
+
+static gint bitrate = 40000000;
+static gint framerate = 60;
+static gint gop = 120;
+static gint slices = 4;
+static gint seconds = 10;
+static gint iterations = 5;
+
+static GOptionEntry entries[] = {
+  {"bitrate", 'b', 0, G_OPTION_ARG_INT, &bitrate, "Bitrate in bits/s",
+      "BITS"},
+  {"framerate", 'f', 0, G_OPTION_ARG_INT, &framerate, "Frames per second",
+      "N"},
+  {"gop", 'g', 0, G_OPTION_ARG_INT, &gop, "Frames per IDR", "N"},
+  {"slices", 's', 0, G_OPTION_ARG_INT, &slices, "Slices per frame", "N"},
+  {"seconds", 't', 0, G_OPTION_ARG_INT, &seconds, "Stream duration", "S"},
+  {"iterations", 'i', 0, G_OPTION_ARG_INT, &iterations,
+      "Passes over the stream", "N"},
+  {NULL}
+};
+
+static void
+append_nal (GByteArray * array, guint8 header, gsize size, GRand * rand)
+{
+  static const guint8 start_code[] = { 0, 0, 0, 1 };
+  int zeros = 0;
+  gsize i;
+
+  g_byte_array_append (array, start_code, 4);
+  g_byte_array_append (array, &header, 1);
+  for (i = 1; i < size; i++) {
+    guint8 b;
+
+    /* encoded slices are mostly high-entropy, with the odd run of zeros */
+    b = g_rand_int_range (rand, 0, 8) == 0 ? 0 : g_rand_int (rand);
+    if (zeros == 2 && b <= 3) {
+      guint8 epb = 3;
+
+      g_byte_array_append (array, &epb, 1);
+      zeros = 0;
+    }
+    g_byte_array_append (array, &b, 1);
+    zeros = b ? 0 : zeros + 1;
+  }
+  if (zeros) {
+    guint8 b = 0x80;            /* rbsp_stop_one_bit */
+
+    g_byte_array_append (array, &b, 1);
+  }
+}
+
+static Frame *
+generate_stream (int n_frames)
+{
+  static const guint8 sps[] = { 0x67, 0x64, 0x00, 0x33, 0xac, 0xb4, 0x28 };
+  Frame *frames;
+  GRand *rand;
+  gsize frame_size;
+  int i, j;
+
+  rand = g_rand_new_with_seed (1);
+  frames = g_new0 (Frame, n_frames);
+  frame_size = bitrate / 8 / framerate;
+
+  for (i = 0; i < n_frames; i++) {
+    GByteArray *array = g_byte_array_new ();
+    gboolean idr = (i % gop) == 0;
+    gsize size = idr ? frame_size * 4 : frame_size;
+
+    append_nal (array, 0x09, 2, rand);
+    if (idr) {
+      static const guint8 start_code[] = { 0, 0, 0, 1 };
+
+      g_byte_array_append (array, start_code, 4);
+      g_byte_array_append (array, sps, sizeof (sps));
+      append_nal (array, 0x68, 4, rand);
+    }
+    for (j = 0; j < slices; j++) {
+      append_nal (array, idr ? 0x65 : 0x41, size / slices, rand);
+    }
+
+    frames[i].size = array->len;
+    frames[i].data = g_byte_array_free (array, FALSE);
+  }
+
+  g_rand_free (rand);
+
+  return frames;
+}
+
+static void
+run (const char *name, GstRtmpH264ScanImpl impl, Frame * frames,
+    int n_frames)
+{
+  GstRtmpH264AccessUnit au;
+  gint64 scan_time = 0;
+  gint64 convert_time = 0;
+  guint64 bytes = 0;
+  guint8 *out;
+  gsize max_size = 0;
+  int idrs = 0;
+  int it, i;
+
+  if (!gst_rtmp_h264_set_scan_impl (impl)) {
+    g_print ("%-8s not supported\n", name);
+    return;
+  }
+
+  for (i = 0; i < n_frames; i++) {
+    max_size = MAX (max_size, frames[i].size + frames[i].size / 2);
+  }
+  out = g_malloc (max_size);
+
+  gst_rtmp_h264_access_unit_init (&au);
+  for (it = 0; it < iterations; it++) {
+    for (i = 0; i < n_frames; i++) {
+      gint64 t0, t1, t2;
+
+      t0 = g_get_monotonic_time ();
+      gst_rtmp_h264_scan (&au, frames[i].data, frames[i].size);
+      t1 = g_get_monotonic_time ();
+      gst_rtmp_h264_to_avcc (&au, frames[i].data, out);
+      t2 = g_get_monotonic_time ();
+
+      scan_time += t1 - t0;
+      convert_time += t2 - t1;
+      bytes += frames[i].size;
+      idrs += au.idr;
+    }
+  }
+  gst_rtmp_h264_access_unit_clear (&au);
+  g_free (out);
+
+  g_print ("%-8s scan %8.1f MB/s  scan+convert %8.1f MB/s  "
+      "%8.0f frames/s  (%d idr)\n", name,
+      (double) bytes / MAX (scan_time, 1),
+      (double) bytes / MAX (scan_time + convert_time, 1),
+      (double) n_frames * iterations * G_USEC_PER_SEC /
+      MAX (scan_time + convert_time, 1), idrs / iterations);
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  Frame *frames;
+  int n_frames;
+  int i;
+
+  context = g_option_context_new ("- benchmark H.264 byte-stream conversion");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s\n", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+
+  if (framerate < 1 || gop < 1 || slices < 1 || seconds < 1) {
+    g_print ("invalid stream parameters\n");
+    exit (1);
+  }
+
+  n_frames = framerate * seconds;
+  frames = generate_stream (n_frames);
+  g_print ("%d frames, %d kbit/s at %d fps, %d slices per frame\n",
+      n_frames, bitrate / 1000, framerate, slices);
+
+  run ("scalar", GST_RTMP_H264_SCAN_SCALAR, frames, n_frames);
+  run ("sse2", GST_RTMP_H264_SCAN_SSE2, frames, n_frames);
+  run ("avx2", GST_RTMP_H264_SCAN_AVX2, frames, n_frames);
+
+  for (i = 0; i < n_frames; i++) {
+    g_free (frames[i].data);
+  }
+  g_free (frames);
+
+  return 0;
+}
@@ -102,7 +102,8 @@ add_connection (GstRtmpServer * server, GstRtmpConnection * connection,
 {
   GST_DEBUG ("new connection");
 
-  g_signal_connect (connection, "got-chunk", G_CALLBACK (got_chunk), NULL);
+  gst_rtmp_connection_add_message_handler (connection,
+      GST_RTMP_MESSAGE_MASK_ALL, got_chunk, NULL, NULL);
 
   gst_rtmp_client_connect_async (client, cancellable, connect_done, client);
 
@@ -157,8 +158,8 @@ connect_done (GObject * source, GAsyncResult * result, gpointer user_data)
   }
 
   proxy_conn = gst_rtmp_client_get_connection (client);
-  g_signal_connect (proxy_conn, "got-chunk", G_CALLBACK (got_chunk_proxy),
-      NULL);
+  gst_rtmp_connection_add_message_handler (proxy_conn,
+      GST_RTMP_MESSAGE_MASK_ALL, got_chunk_proxy, NULL, NULL);
 }
 
 static void
@@ -0,0 +1,366 @@
+/* GStreamer RTMP Library
+ * Copyright (C) 2013 David Schleef <ds@schleef.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Suite 500,
+ * Boston, MA 02110-1335, USA.
+ */
+
+/* Measures rtmp2src time-to-first-frame with and without fast-start.
+ * Runs a minimal RTMP server in-process that answers connect,
+ * createStream and play, holding every command for one artificial round
+ * trip before replying, and then sends a sequence header and a keyframe.
+ * The handshake is not delayed, so the numbers only show the command
+ * round trips.  The fallback path can be exercised with --stream-id,
+ * which makes the server hand out unexpected stream ids, counting up
+ * from the given one like real servers do, with --fail-create-stream,
+ * which rejects the first createStream on each connection, and with
+ * --error-replies, which rejects a play on an unknown stream with an
+ * _error reply as well as an error onStatus. */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <gst/gst.h>
+#include <gio/gio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "amf.h"
+#include "rtmpserver.h"
+#include "rtmpchunk.h"
+
+
+#define GETTEXT_PACKAGE NULL
+
+typedef struct
+{
+  GstRtmpConnection *connection;
+  GstRtmpChunk *chunk;
+} DelayedCommand;
+
+static gint port = 19350;
+static gint rtt = 100;
+static gint runs = 10;
+static gint stream_id = 1;
+static gboolean fail_create_stream = FALSE;
+static gboolean error_replies = FALSE;
+
+static GOptionEntry entries[] = {
+  {"port", 'p', 0, G_OPTION_ARG_INT, &port, "Server port", "PORT"},
+  {"rtt", 'r', 0, G_OPTION_ARG_INT, &rtt, "Artificial round trip time",
+      "MS"},
+  {"runs", 'n', 0, G_OPTION_ARG_INT, &runs, "Runs per mode", "N"},
+  {"stream-id", 's', 0, G_OPTION_ARG_INT, &stream_id,
+      "Stream id returned by the first createStream", "ID"},
+  {"fail-create-stream", 'f', 0, G_OPTION_ARG_NONE, &fail_create_stream,
+      "Reject the first createStream", NULL},
+  {"error-replies", 'e', 0, G_OPTION_ARG_NONE, &error_replies,
+      "Reject a play on an unknown stream with _error too", NULL},
+  {NULL}
+};
+
+static GMainLoop *main_loop;
+static gint64 first_frame_time;
+
+/* AVCDecoderConfigurationRecord and an IDR slice, contents don't matter */
+static const guint8 sequence_header[] = {
+  0x17, 0x00, 0x00, 0x00, 0x00,
+  0x01, 0x42, 0xc0, 0x1e, 0xff, 0xe1, 0x00, 0x04, 0x67, 0x42, 0xc0, 0x1e,
+  0x01, 0x00, 0x04, 0x68, 0xce, 0x3c, 0x80
+};
+
+static const guint8 keyframe[] = {
+  0x17, 0x01, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x05, 0x65, 0x88, 0x84, 0x00, 0x33
+};
+
+static void
+send_status (GstRtmpConnection * connection, guint32 id, const char *level,
+    const char *code)
+{
+  GstAmfNode *node;
+  GstAmfNode *info;
+
+  node = gst_amf_node_new (GST_AMF_TYPE_NULL);
+  info = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
+  gst_amf_object_set_string (info, "level", level);
+  gst_amf_object_set_string (info, "code", code);
+  gst_rtmp_connection_send_command2 (connection, 5, id, "onStatus", 0, node,
+      info, NULL, NULL, NULL, NULL);
+  gst_amf_node_free (node);
+  gst_amf_node_free (info);
+}
+
+static void
+send_error (GstRtmpConnection * connection, double transaction_id,
+    const char *code)
+{
+  GstAmfNode *node;
+  GstAmfNode *info;
+
+  node = gst_amf_node_new (GST_AMF_TYPE_NULL);
+  info = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
+  gst_amf_object_set_string (info, "level", "error");
+  gst_amf_object_set_string (info, "code", code);
+  gst_rtmp_connection_send_command (connection, 3, "_error", transaction_id,
+      node, info, NULL, NULL);
+  gst_amf_node_free (node);
+  gst_amf_node_free (info);
+}
+
+static void
+send_video (GstRtmpConnection * connection, guint32 id, const guint8 * data,
+    gsize size)
+{
+  GstRtmpChunk *chunk;
+
+  chunk = gst_rtmp_chunk_new ();
+  chunk->chunk_stream_id = 6;
+  chunk->message_type_id = GST_RTMP_MESSAGE_TYPE_VIDEO;
+  chunk->stream_id = id;
+  chunk->timestamp = 0;
+  chunk->message_length = size;
+  chunk->payload = g_bytes_new_static (data, size);
+  gst_rtmp_connection_queue_chunk (connection, chunk);
+}
+
+static gboolean
+handle_command (gpointer user_data)
+{
+  DelayedCommand *command = user_data;
+  GstRtmpConnection *connection = command->connection;
+  GstRtmpChunk *chunk = command->chunk;
+  char *command_name;
+  double transaction_id;
+  GstAmfNode *command_object;
+  GstAmfNode *optional_args;
+  GstAmfNode *node;
+  GstAmfNode *info;
+  /* per connection: the last stream id handed out, 0 before the first */
+  guint32 created = GPOINTER_TO_UINT (g_object_get_data (G_OBJECT
+          (connection), "stream-id"));
+
+  gst_rtmp_chunk_parse_message (chunk, &command_name, &transaction_id,
+      &command_object, &optional_args);
+
+  if (g_strcmp0 (command_name, "connect") == 0) {
+    node = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
+    gst_amf_object_set_string (node, "fmsVer", "FMS/3,0,1,123");
+    info = gst_amf_node_new (GST_AMF_TYPE_OBJECT);
+    gst_amf_object_set_string (info, "level", "status");
+    gst_amf_object_set_string (info, "code", "NetConnection.Connect.Success");
+    gst_rtmp_connection_send_command (connection, 3, "_result",
+        transaction_id, node, info, NULL, NULL);
+    gst_amf_node_free (node);
+    gst_amf_node_free (info);
+  } else if (g_strcmp0 (command_name, "createStream") == 0) {
+    if (fail_create_stream &&
+        !g_object_get_data (G_OBJECT (connection), "create-failed")) {
+      g_object_set_data (G_OBJECT (connection), "create-failed",
+          GINT_TO_POINTER (1));
+      send_error (connection, transaction_id, "NetConnection.Call.Failed");
+    } else {
+      created = created ? created + 1 : (guint32) stream_id;
+      g_object_set_data (G_OBJECT (connection), "stream-id",
+          GUINT_TO_POINTER (created));
+      node = gst_amf_node_new (GST_AMF_TYPE_NULL);
+      info = gst_amf_node_new (GST_AMF_TYPE_NUMBER);
+      gst_amf_node_set_number (info, created);
+      gst_rtmp_connection_send_command (connection, 3, "_result",
+          transaction_id, node, info, NULL, NULL);
+      gst_amf_node_free (node);
+      gst_amf_node_free (info);
+    }
+  } else if (g_strcmp0 (command_name, "play") == 0) {
+    if (created && chunk->stream_id == created) {
+      send_status (connection, created, "status", "NetStream.Play.Start");
+      send_video (connection, created, sequence_header,
+          sizeof (sequence_header));
+      send_video (connection, created, keyframe, sizeof (keyframe));
+    } else {
+      if (error_replies)
+        send_error (connection, transaction_id, "NetStream.Play.Failed");
+      send_status (connection, chunk->stream_id, "error",
+          "NetStream.Play.StreamNotFound");
+    }
+  }
+
+  g_free (command_name);
+  if (command_object)
+    gst_amf_node_free (command_object);
+  if (optional_args)
+    gst_amf_node_free (optional_args);
+  g_object_unref (chunk);
+  g_object_unref (connection);
+  g_free (command);
+
+  return G_SOURCE_REMOVE;
+}
+
+static void
+got_chunk (GstRtmpConnection * connection, GstRtmpChunk * chunk,
+    gpointer user_data)
+{
+  DelayedCommand *command;
+
+  if (chunk->message_type_id != GST_RTMP_MESSAGE_TYPE_COMMAND)
+    return;
+
+  command = g_new0 (DelayedCommand, 1);
+  command->connection = g_object_ref (connection);
+  command->chunk = g_object_ref (chunk);
+  g_timeout_add (rtt, handle_command, command);
+}
+
+static void
+add_connection (GstRtmpServer * server, GstRtmpConnection * connection,
+    gpointer user_data)
+{
+  g_signal_connect (connection, "got-chunk", G_CALLBACK (got_chunk), NULL);
+}
+
+static void
+handoff (GstElement * sink, GstBuffer * buffer, GstPad * pad,
+    gpointer user_data)
+{
+  if (GST_BUFFER_FLAG_IS_SET (buffer, GST_BUFFER_FLAG_HEADER) ||
+      first_frame_time != 0)
+    return;
+
+  first_frame_time = g_get_monotonic_time ();
+  g_main_loop_quit (main_loop);
+}
+
+static gboolean
+timeout (gpointer user_data)
+{
+  g_main_loop_quit (main_loop);
+  return G_SOURCE_REMOVE;
+}
+
+/* Returns the time to the first frame in microseconds, or -1 */
+static gint64
+run_once (gboolean fast_start)
+{
+  GstElement *pipeline;
+  GstElement *sink;
+  GError *error = NULL;
+  gchar *description;
+  gint64 start_time;
+  guint timeout_id;
+
+  description = g_strdup_printf ("rtmp2src location=rtmp://127.0.0.1:%d/"
+      "live/bench fast-start=%s ! fakesink name=sink sync=false "
+      "signal-handoffs=true", port, fast_start ? "true" : "false");
+  pipeline = gst_parse_launch (description, &error);
+  g_free (description);
+  if (!pipeline) {
+    g_print ("could not create pipeline: %s\n", error->message);
+    g_error_free (error);
+    exit (1);
+  }
+
+  sink = gst_bin_get_by_name (GST_BIN (pipeline), "sink");
+  g_signal_connect (sink, "handoff", G_CALLBACK (handoff), NULL);
+  gst_object_unref (sink);
+
+  first_frame_time = 0;
+  timeout_id = g_timeout_add (10 * rtt + 5000, timeout, NULL);
+  start_time = g_get_monotonic_time ();
+  gst_element_set_state (pipeline, GST_STATE_PLAYING);
+  g_main_loop_run (main_loop);
+  g_source_remove (timeout_id);
+
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (pipeline);
+
+  if (first_frame_time == 0)
+    return -1;
+  return first_frame_time - start_time;
+}
+
+static void
+run (const char *name, gboolean fast_start)
+{
+  gint64 min = G_MAXINT64;
+  gint64 max = 0;
+  gint64 total = 0;
+  int failed = 0;
+  int i;
+
+  for (i = 0; i < runs; i++) {
+    gint64 t = run_once (fast_start);
+
+    if (t < 0) {
+      failed++;
+      continue;
+    }
+    min = MIN (min, t);
+    max = MAX (max, t);
+    total += t;
+  }
+
+  if (failed == runs) {
+    g_print ("%-12s no frames received\n", name);
+    return;
+  }
+  g_print ("%-12s first frame after %7.1f ms avg, %7.1f min, %7.1f max "
+      "(%.1f RTTs)", name, total / 1000.0 / (runs - failed), min / 1000.0,
+      max / 1000.0, rtt ? total / 1000.0 / (runs - failed) / rtt : 0.0);
+  if (failed)
+    g_print (", %d failed", failed);
+  g_print ("\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+  GError *error = NULL;
+  GOptionContext *context;
+  GstRtmpServer *server;
+
+  context = g_option_context_new ("- benchmark rtmp2src startup latency");
+  g_option_context_add_main_entries (context, entries, GETTEXT_PACKAGE);
+  g_option_context_add_group (context, gst_init_get_option_group ());
+  if (!g_option_context_parse (context, &argc, &argv, &error)) {
+    g_print ("option parsing failed: %s\n", error->message);
+    exit (1);
+  }
+  g_option_context_free (context);
+
+  if (runs < 1 || rtt < 0) {
+    g_print ("invalid parameters\n");
+    exit (1);
+  }
+
+  server = gst_rtmp_server_new ();
+  server->port = port;
+  g_signal_connect (server, "add-connection", G_CALLBACK (add_connection),
+      NULL);
+  gst_rtmp_server_start (server);
+
+  main_loop = g_main_loop_new (NULL, FALSE);
+
+  g_print ("%d ms round trip, %d runs, server stream id %d%s%s\n", rtt, runs,
+      stream_id, fail_create_stream ? ", failing createStream" : "",
+      error_replies ? ", _error replies" : "");
+  run ("serial", FALSE);
+  run ("fast-start", TRUE);
+
+  g_main_loop_unref (main_loop);
+  g_object_unref (server);
+
+  return 0;
+}